@@ -28,22 +28,58 @@
 
 	#include "common_defs.h"
 
+	#define FLUID_DEAD		1			// flagged in Advance, removed by compaction at the end of the step
+	#define FLUID_SLEEP		2			// in a dormant grid cell: skipped by the pressure, force and advance passes
+	#define FLUID_RESTLESS	4			// moved or compressed past the dormancy thresholds in the last step
+	#define FLUID_WAIT		8			// block time-stepping: between its own steps, only drifts this step
+	#define FLUID_CONTACT	16			// collider penalty of this step is in FluidSystem::m_ColAccel
+	#define FLUID_LEVEL_SHIFT	8		// block time-stepping: dt level, 0 = SPH_TIMESTEP, each level halves it
+	#define FLUID_LEVEL_MASK	(15 << FLUID_LEVEL_SHIFT)
+
+	// Particle attributes are split into index-parallel blocks (GeomX buffers), so a
+	// pass only streams the blocks it uses. The layout is registered with GeomX::AddAttributeAt.
+	#define FLUID_HOT		0			// Fluid: read for the particle and every neighbor
+	#define FLUID_THERMAL	1			// FluidThermal: heat diffusion
+	#define FLUID_COLD		2			// FluidCold: display and unused model state
+	#define FLUID_BLOCKS	3
+
+	// Hot block, one 64-byte cache line per particle
 	struct Fluid {
 	public:
-		Vector3DF		pos;			// Basic particle (must match Particle class)
-		DWORD			clr;
+		Vector3DF		pos;			// Basic particle (pos/next must match Point class)
+		DWORD			flags;			// FLUID_DEAD etc. (in place of Point::clr)
 		int				next;
 		Vector3DF		vel;			
 		Vector3DF		vel_eval;		
-		unsigned short	age;
-
 		float			pressure;		// Smoothed Particle Hydrodynamics
 		float			density;
+		Vector3DF		sph_force;
+	};
+
+	struct FluidThermal {
+	public:
 		float			temp;
 		float			temp_eval;
+	};
+
+	struct FluidCold {
+	public:
+		DWORD			clr;
+		unsigned short	age;
 		float			viscosity;
 		Matrix3			stress_tensor;
-		Vector3DF		sph_force;
+		Vector3DF		accel;			// block time-stepping: acceleration of the last kick
+		float			step;			// block time-stepping: length of the step it opened (s)
+	};
+
+	// Quantized position for the neighbor search (USE_QPOS): 16-bit fixed-point offset
+	// within the particle's grid cell. Stored per cell, in grid chain order, so a
+	// candidate costs 12 bytes instead of a hot record. The cell is implied by the slot.
+	#define QPOS_ONE		65536.0f	// quanta per cell width
+	struct FluidQPos {
+	public:
+		unsigned short	x, y, z, pad;
+		int				idx;			// particle index
 	};
 
 #endif /*PARTICLE_H_*/
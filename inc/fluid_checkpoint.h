@@ -0,0 +1,89 @@
+/*
+  FLUIDS v.1 - SPH Fluid Simulator for CPU and GPU
+  Asynchronous checkpoints
+
+  ZLib license (see fluid_system.h)
+*/
+
+#ifndef DEF_FLUID_CHECKPOINT
+	#define DEF_FLUID_CHECKPOINT
+
+	#include <string>
+	#include <deque>
+
+	#ifdef _MSC_VER
+		#include <windows.h>
+	#else
+		#include <pthread.h>
+	#endif
+
+	class FluidSystem;
+
+	// Snapshot() copies the flat simulation state into a fixed staging arena and returns;
+	// a background thread writes queued snapshots to <prefix>_NNNNNN.chk in order.
+	// The arena is a FIFO ring, so in-flight memory never exceeds its size. When it is
+	// full, Snapshot() waits for the writer (bWait) or drops the checkpoint.
+	// The time spent inside Snapshot() is the latency added to the step loop.
+	class FluidCheckpoint {
+	public:
+		FluidCheckpoint ();
+		~FluidCheckpoint ();
+
+		bool Start ( std::string prefix, long arena_bytes, bool bWait );
+		void Stop ();										// flushes pending snapshots
+		bool Snapshot ( FluidSystem* fluid, int step );		// false if dropped
+		static bool Load ( FluidSystem* fluid, std::string fname );
+		void Report ();
+
+		double GetLastLatency ()		{ return m_LastMS; }	// msec
+		int GetPending ();
+
+	private:
+		struct Pending {
+			long	offset;			// start of snapshot in arena
+			long	bytes;			// snapshot size
+			long	charge;			// bytes reserved (includes wrap padding)
+			int		step;
+		};
+		bool Reserve ( long bytes, Pending& p );			// call with lock held
+		void Writer ();
+		void Lock ();
+		void Unlock ();
+		void Wait ( bool bDone );							// wait on done (space freed) or work
+		void Signal ( bool bDone );
+		#ifdef _MSC_VER
+			static DWORD WINAPI Entry ( LPVOID arg );
+		#else
+			static void* Entry ( void* arg );
+		#endif
+
+		std::string				m_Prefix;
+		char*					m_Arena;
+		long					m_Size;
+		long					m_Head, m_Tail, m_Used;
+		bool					m_bWait;
+		bool					m_bRunning;
+		volatile bool			m_bQuit;
+		std::deque<Pending>		m_Queue;
+
+		// stats
+		int						m_Taken, m_Dropped, m_Written;
+		double					m_LastMS, m_MaxMS, m_TotalMS;
+		double					m_WriteSec;
+		double					m_BytesWritten;
+		int						m_MemId;				// MemAccount entry for the arena
+
+		#ifdef _MSC_VER
+			HANDLE					m_Thread;
+			CRITICAL_SECTION		m_Lock;
+			CONDITION_VARIABLE		m_WorkCond;
+			CONDITION_VARIABLE		m_DoneCond;
+		#else
+			pthread_t				m_Thread;
+			pthread_mutex_t			m_Lock;
+			pthread_cond_t			m_WorkCond;
+			pthread_cond_t			m_DoneCond;
+		#endif
+	};
+
+#endif
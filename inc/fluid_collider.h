@@ -0,0 +1,107 @@
+/*
+  FLUIDS v.1 - SPH Fluid Simulator for CPU and GPU
+  Signed distance colliders
+
+  ZLib license (see fluid_system.h)
+*/
+
+#ifndef DEF_FLUID_COLLIDER
+	#define DEF_FLUID_COLLIDER
+
+	#include <vector>
+	#include "vector.h"
+
+	// Collider shapes
+	#define COLLIDE_BOX			0			// a, b = min, max corner
+	#define COLLIDE_SPHERE		1			// a = center, r
+	#define COLLIDE_CAPSULE		2			// a, b = segment end points, r
+	#define COLLIDE_PLANE		3			// b = unit normal (into the fluid), r = offset along it
+	#define COLLIDE_CYLINDER	4			// a, b = end cap centers, r
+	#define COLLIDE_VOXEL		5			// sdf = index of a baked field
+
+	// Collider flags
+	#define COLLIDE_CONTAINER	1			// fluid is kept inside the shape rather than outside
+	#define COLLIDE_SINK		2			// particles that enter are removed, not pushed back
+	#define COLLIDE_DOMAIN		4			// built from the volume and barrier settings (FluidSystem::SPH_SetupColliders)
+
+	#define COLLIDE_BATCH		64			// particles evaluated together
+
+	struct FluidCollider {
+		int				type;
+		int				flags;
+		Vector3DF		a, b;
+		float			r;
+		float			stiff;			// multiplies SPH_EXTSTIFF
+		int				sdf;
+	};
+
+	// Signed distance sampled at min + (i,j,k) * cell, x fastest
+	struct FluidSDF {
+		Vector3DF		min;
+		float			cell;
+		int				res[3];
+		std::vector<float>	dist;
+	};
+
+	// Static obstacles and containers as signed distance functions. Distances are in world
+	// units, positive on the fluid side, with the unit normal pointing into the fluid; the
+	// union of all colliders bounds the fluid. Shapes are evaluated for a batch of points
+	// at a time, one shape per loop, so the loops stay branch-free per shape.
+	//
+	// The broad phase is a table over the particle grid: for each cell, the colliders
+	// whose surface (or sink volume) is within reach of any point in the cell. It is built
+	// by Cull() and rebuilt only when the colliders, the grid or the reach change. Cells
+	// with no candidates are skipped entirely; GetCellIndex() lists the others.
+	//
+	// Bake() samples a group of colliders into one voxel field and replaces them with it,
+	// so a container made of any number of shapes costs one trilinear lookup per particle.
+	class FluidColliders {
+	public:
+		FluidColliders ();
+
+		int AddBox ( Vector3DF lo, Vector3DF hi, int flags = 0, float stiff = 1 );
+		int AddSphere ( Vector3DF c, float r, int flags = 0, float stiff = 1 );
+		int AddCapsule ( Vector3DF a, Vector3DF b, float r, int flags = 0, float stiff = 1 );
+		int AddPlane ( Vector3DF pnt, Vector3DF norm, int flags = 0, float stiff = 1 );
+		int AddCylinder ( Vector3DF a, Vector3DF b, float r, int flags = 0, float stiff = 1 );
+		int AddVoxel ( FluidSDF& sdf, int flags = 0, float stiff = 1 );		// takes the samples
+		int Bake ( int flags, Vector3DF min, Vector3DF max, float cell );	// colliders with all of flags
+		void Clear ( int flags );											// removes colliders with all of flags
+
+		int GetNum ()						{ return (int) m_List.size(); }
+		int GetVersion ()					{ return m_Version; }		// changes with every add, remove or bake
+		FluidCollider& Get ( int c )		{ return m_List[c]; }
+
+		// Signed distance and normal of collider c at n points
+		void Distance ( int c, int n, const float* x, const float* y, const float* z, float* d, float* nx, float* ny, float* nz );
+		float Distance ( int c, Vector3DF p, Vector3DF& norm );
+
+		// Broad phase
+		void Cull ( Vector3DF gmin, Vector3DF delta, Vector3DF res, float reach );
+		int GetCell ( Vector3DF p );										// -1 outside the grid
+		int GetNumCells ()					{ return (int) m_Cells.size(); }
+		int GetCellIndex ( int n )			{ return m_Cells[n]; }
+		int GetNumCandidates ( int cell )	{ return m_CellStart[cell+1] - m_CellStart[cell]; }
+		const int* GetCandidates ( int cell )	{ return &m_CellList[0] + m_CellStart[cell]; }
+
+		double GetMemory ();
+		void Report ();
+
+	private:
+		void Changed ()						{ m_Version++; }
+		void Remove ( std::vector<bool>& drop );
+
+		std::vector<FluidCollider>	m_List;
+		std::vector<FluidSDF>		m_SDF;
+		int							m_Version;
+
+		// broad phase
+		int							m_CullVersion;
+		Vector3DF					m_CullMin, m_CullDelta, m_CullRes;
+		float						m_CullReach;
+		std::vector<int>			m_CellStart;		// per grid cell, offsets into m_CellList (one extra at the end)
+		std::vector<int>			m_CellList;
+		std::vector<int>			m_Cells;			// grid cells with at least one candidate
+	};
+
+#endif
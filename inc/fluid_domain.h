@@ -0,0 +1,101 @@
+/*
+  FLUIDS v.1 - SPH Fluid Simulator for CPU and GPU
+  Multi-process domain decomposition
+
+  ZLib license (see fluid_system.h)
+*/
+
+#ifndef DEF_FLUID_DOMAIN
+	#define DEF_FLUID_DOMAIN
+
+	#include <string>
+	#include <vector>
+
+	#include "vector.h"
+
+	class FluidSystem;
+
+	// Shared memory ring buffer (single producer, single consumer).
+	// Lives at the start of a mapped segment, data follows the header.
+	struct HaloRing {
+		volatile unsigned int	magic;			// set by creator once the segment is sized
+		unsigned int			size;			// bytes of data area (power of two)
+		char					pad0[56];
+		volatile unsigned int	head;			// total bytes written (producer)
+		char					pad1[60];
+		volatile unsigned int	tail;			// total bytes read (consumer)
+		char					pad2[60];
+	};
+
+	class HaloChannel {
+	public:
+		HaloChannel ();
+
+		bool Create ( std::string name, int size );		// producer side
+		bool Open ( std::string name );					// consumer side (waits for creator, with a timeout)
+		void Close ();
+
+		int Write ( const char* src, int len );			// non-blocking, returns bytes written
+		int Read ( char* dest, int len );				// non-blocking, returns bytes read
+		bool IsOpen ()					{ return m_Ring != 0x0; }
+		int GetMapSize ()				{ return m_Ring != 0x0 ? m_MapSize : 0; }
+
+	private:
+		std::string		m_Name;
+		bool			m_bOwner;
+		HaloRing*		m_Ring;
+		char*			m_Data;
+		int				m_MapSize;
+		#ifdef _MSC_VER
+			void*		m_Handle;
+		#else
+			int			m_Handle;
+		#endif
+	};
+
+	// Splits the simulation volume into slabs along one axis, one slab per process.
+	// Each step, particles that left the slab migrate to the neighbor that now owns them,
+	// and particles within the halo width of a slab face are sent as read-only ghosts.
+	// Ghosts are appended behind the owned particles so the regular grid, density and
+	// force passes see them, but Advance only integrates owned particles.
+	// A neighbor that stops stepping (exited, crashed, or paused) for HALO_TIMEOUT seconds
+	// fails the exchange; FluidSystem then abandons that step, drops the domain and the rank
+	// carries on alone.
+	class FluidDomain {
+	public:
+		FluidDomain ();
+		~FluidDomain ();
+
+		bool Setup ( FluidSystem* fluid, std::string session, int rank, int ranks, int axis, int ring_size );
+		void Close ();
+
+		void ClipToSlab ( FluidSystem* fluid );			// remove initial particles outside our slab
+		bool Exchange ( FluidSystem* fluid );			// migrate + send/receive ghosts (before grid insert), false if a neighbor stalled or mismatched
+		void DropGhosts ( FluidSystem* fluid );			// discard ghosts (after advance)
+
+		bool InSlab ( Vector3DF& p )	{ float c = Axis(p); return c >= m_Lo && c < m_Hi; }
+		int GetRank ()					{ return m_Rank; }
+		int GetRanks ()					{ return m_Ranks; }
+		int GetNumGhost ()				{ return m_NumGhost; }
+		float GetSlabMin ()				{ return m_Lo; }
+		float GetSlabMax ()				{ return m_Hi; }
+
+	private:
+		float Axis ( Vector3DF& p )		{ return (m_Axis==0) ? p.x : (m_Axis==1) ? p.y : p.z; }
+		bool Transfer ( int sent[2] );
+		void UpdateMemory ();
+
+		int						m_Rank, m_Ranks, m_Axis;
+		float					m_Lo, m_Hi;				// owned range along axis (world units)
+		float					m_Halo;					// ghost width (world units)
+		int						m_NumGhost;
+		int						m_Step;
+
+		HaloChannel				m_Send[2];				// 0 = left neighbor, 1 = right neighbor
+		HaloChannel				m_Recv[2];
+		std::vector<char>		m_Out[2];				// staged outgoing messages
+		std::vector<char>		m_In[2];				// staged incoming messages
+		int						m_MemIO, m_MemScratch;	// MemAccount entries
+	};
+
+#endif
@@ -0,0 +1,58 @@
+/*
+  FLUIDS v.1 - SPH Fluid Simulator for CPU and GPU
+  Ensemble of independent simulations
+
+  ZLib license (see fluid_system.h)
+*/
+
+#ifndef DEF_FLUID_ENSEMBLE
+	#define DEF_FLUID_ENSEMBLE
+
+	#include <stdio.h>
+	#include <string>
+	#include <vector>
+
+	class FluidSystem;
+	class ThreadPool;
+
+	struct EnsembleMember {
+		FluidSystem*	fluid;			// headless, serial (no nested pool)
+		int				example;		// SPH_CreateExample scene
+		int				nmax;
+		int				steps;			// steps completed
+		double			sec;			// wall time spent stepping
+		FILE*			out;
+	};
+
+	// Many small, independent simulations (e.g. a parameter sweep) in one process.
+	// Each member owns its particles, grid and neighbor table sized to its own nmax.
+	// Members share one thread pool: pool threads pull the next member from a shared
+	// counter and run it to completion, so a member is only ever touched by one thread
+	// and uneven members balance themselves.
+	class FluidEnsemble {
+	public:
+		FluidEnsemble ();
+		~FluidEnsemble ();
+
+		int Add ( int example, int nmax );						// returns member index
+		void SetParam ( int n, int p, double v );				// applied over the scene defaults
+		bool Load ( std::string fname, int nmax );				// one member per line: example [name value]...
+		void Setup ( std::string out_prefix );					// build scenes, open <prefix>_NNN.txt (empty = no output)
+		void Run ( ThreadPool* pool, int steps, int out_every );
+		void Clear ();
+
+		int GetNumMembers ()					{ return (int) m_Members.size(); }
+		FluidSystem* GetMember ( int n )		{ return m_Members[n].fluid; }
+
+	private:
+		static void RunJob ( void* ctx, int t, int nt );
+		void Step ( EnsembleMember& m );
+		void Output ( EnsembleMember& m );
+
+		std::vector< EnsembleMember >	m_Members;
+		volatile long					m_Next;
+		int								m_Steps;
+		int								m_OutEvery;
+	};
+
+#endif
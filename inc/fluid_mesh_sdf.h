@@ -0,0 +1,87 @@
+/*
+  FLUIDS v.1 - SPH Fluid Simulator for CPU and GPU
+  Triangle mesh colliders
+
+  ZLib license (see fluid_system.h)
+*/
+
+#ifndef DEF_FLUID_MESH_SDF
+	#define DEF_FLUID_MESH_SDF
+
+	#include <string>
+	#include <vector>
+	#include "vector.h"
+	#include "fluid_collider.h"
+
+	class ThreadPool;
+
+	#define MESH_SDF_MAGIC		0x46534446		// 'FSDF'
+	#define MESH_SDF_VERSION	1
+	#define MESH_BVH_LEAF		4				// triangles per BVH leaf
+
+	// A triangle mesh read from a PLY file, baked into a narrow-band signed distance field
+	// for FluidColliders::AddVoxel. Samples within band of the surface get the exact
+	// distance to the closest triangle, found through a BVH; the sign comes from the
+	// angle-weighted pseudo normal of the closest feature. Samples farther out are set
+	// to +/- band, inside or out by a flood fill from the border of the field, so the
+	// mesh should be closed; an open mesh bakes as a two-sided sheet.
+	//
+	// Bake() splits the z slices over the thread pool. With a cache prefix, the field is
+	// stored in <prefix>_<mesh hash>_<cell>.sdf and loaded from there when the mesh (after
+	// scaling and placement), the cell and the band all match.
+	class FluidMeshSDF {
+	public:
+		FluidMeshSDF ();
+
+		// ascii or binary_little_endian; y and z are swapped as in Mesh::LoadPly (z up)
+		bool LoadPly ( std::string fname, float scale );
+		void AddTriangle ( Vector3DF a, Vector3DF b, Vector3DF c );
+		void Translate ( Vector3DF offset );
+
+		bool Bake ( FluidSDF& sdf, float cell, float band, ThreadPool* pool, std::string cache );
+		void BakeRange ( int z0, int z1 );					// z slices of the field being baked
+		int GetBakeSlices ()			{ return m_BakeSDF->res[2]; }
+
+		int GetNumTris ()				{ return (int) m_Tri.size() / 3; }
+		int GetNumVerts ()				{ return (int) m_Vert.size() / 3; }
+		Vector3DF GetMin ();
+		Vector3DF GetMax ();
+		unsigned long long GetHash ();						// vertices and triangles, FNV-1a
+		void Report ();
+
+	private:
+		struct Node {
+			float			min[3], max[3];
+			int				first;			// leaf: first triangle; inner: left child (right is first+1)
+			int				count;			// triangles, 0 for an inner node
+		};
+		void BuildNormals ();
+		void BuildBVH ();
+		int BuildNode ( int node, int first, int count );
+		float Closest ( const float* p, float maxd, int& tri );	// signed; |d| = maxd and tri = -1 if nothing is closer
+		bool LoadCache ( std::string fname, FluidSDF& sdf, unsigned long long hash, float band );
+		void SaveCache ( std::string fname, FluidSDF& sdf, unsigned long long hash, float band );
+		void FloodSign ( FluidSDF& sdf, std::vector<char>& known, float band );
+
+		std::vector<float>		m_Vert;			// x, y, z
+		std::vector<int>		m_Tri;			// 3 vertex indices per triangle
+
+		// built by Bake, triangles in BVH leaf order
+		std::vector<float>		m_Corner;		// 9 floats per triangle
+		std::vector<float>		m_Pseudo;		// 7 normals per triangle: face, edges ab bc ca, vertices a b c
+		std::vector<Node>		m_Node;
+		std::vector<int>		m_Order;
+		std::vector<float>		m_Cent;			// split axis centroid per triangle, during BuildBVH
+
+		// bake in progress
+		FluidSDF*				m_BakeSDF;
+		std::vector<char>*		m_BakeKnown;
+		float					m_BakeBand;
+
+		// stats
+		double					m_BakeSec;
+		bool					m_bCached;
+		int						m_Known;
+	};
+
+#endif
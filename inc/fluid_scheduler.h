@@ -0,0 +1,53 @@
+/*
+  FLUIDS v.1 - SPH Fluid Simulator for CPU and GPU
+  Sub-step scheduling
+
+  ZLib license (see fluid_system.h)
+*/
+
+#ifndef DEF_FLUID_SCHEDULER
+	#define DEF_FLUID_SCHEDULER
+
+	class FluidSystem;
+
+	// Runs as many simulation steps per displayed frame as it takes to advance a fixed
+	// amount of simulated time, so the simulation rate does not depend on the frame rate.
+	// Only the last sub-step of a frame writes render output (see FluidSystem::SetRenderOutput).
+	//
+	// Each frame owes sim_per_frame seconds plus whatever the last frame left over. Steps
+	// are taken while time is owed, at most max_sub per frame, and only while the measured
+	// step cost still fits in budget_ms. Falling behind degrades in two ways:
+	//  - up to max_skip frames in a row are simulated without rendering (IsRenderFrame),
+	//    which hands the render time to the simulation (a skipped frame gets twice the budget);
+	//  - debt beyond one frame is dropped, so the simulation runs slower than real time
+	//    instead of spiralling.
+	// With sim_per_frame = 0 every frame runs exactly one step, as before.
+	class FluidScheduler {
+	public:
+		FluidScheduler ();
+
+		void Setup ( double sim_per_frame, double budget_ms, int max_sub, int max_skip );
+		int Frame ( FluidSystem* f );						// returns the sub-steps taken
+		bool IsRenderFrame ()			{ return m_bRender; }
+		void Report ();
+
+		double GetStepMS ()				{ return m_StepMS; }		// running average cost of one step
+
+	private:
+		double			m_SimPerFrame;
+		double			m_BudgetMS;
+		int				m_MaxSub;
+		int				m_MaxSkip;
+
+		double			m_Owed;						// simulated seconds still to run
+		double			m_StepMS;
+		int				m_Skipped;					// frames skipped in a row
+		bool			m_bRender;
+
+		// stats
+		int				m_Frames, m_Steps, m_MaxSteps;
+		int				m_SkipTotal, m_OverBudget;
+		double			m_Dropped;					// simulated seconds given up
+	};
+
+#endif
@@ -0,0 +1,111 @@
+/*
+  FLUIDS v.1 - SPH Fluid Simulator for CPU and GPU
+  Render output staging
+
+  ZLib license (see fluid_system.h)
+*/
+
+#ifndef DEF_FLUID_STAGE
+	#define DEF_FLUID_STAGE
+
+	#include <GL/glew.h>
+
+	#ifdef _MSC_VER
+		#include <windows.h>
+	#else
+		#include <pthread.h>
+	#endif
+
+	#include "common_defs.h"
+
+	#define STAGE_SLOTS		3
+	#define STAGE_POS		12			// bytes per particle: float x, y, z (w = 1 by default)
+	#define STAGE_CLR		4			// bytes per particle: RGBA8, or one float scalar
+
+	// Color output requested by the consumer, and recorded per slot
+	#define STAGE_CLR_NONE		0			// colors not written
+	#define STAGE_CLR_RGBA		1			// ramp applied on the CPU
+	#define STAGE_CLR_SCALAR	2			// ramp input in [0,1], applied by the consumer
+
+	// COLORA packs 0xRRGGBBAA; RGBA8 byte order in memory is R, G, B, A
+	#define STAGE_RGBA(c)	( ((c)>>24) | (((c)>>8) & 0xFF00) | (((c)<<8) & 0xFF0000) | ((c)<<24) )
+
+	// Ring of STAGE_SLOTS output slots that Advance writes positions and colors into
+	// directly. Each slot holds up to max particles: positions, then packed colors.
+	//
+	// GL mode: all slots live in one buffer object. Acquire() waits for the fence of
+	// the slot it hands out and maps just that range unsynchronized, so the driver
+	// never orphans or copies; Publish() unmaps it, makes it current and fences the
+	// previous current slot behind every draw issued from it. Draw from GetVBO() at
+	// GetPosOffset() / GetColorOffset(). Acquire and Publish must be called on the GL thread.
+	//
+	// Memory mode (headless): slots are plain memory. Readers (capture, streaming) pin
+	// the current slot with AcquireRead() and the writer never hands out a pinned slot.
+	//
+	// Consumers say which colors they need with SetColorFormat(); a slot may still carry
+	// RGBA when scalars were asked for but the color mode has none (original colors).
+	class FluidStage {
+	public:
+		FluidStage ();
+		~FluidStage ();
+
+		bool Setup ( int max, bool bGL );
+		void Release ();
+		bool IsActive ()				{ return m_Max > 0; }
+		bool IsGL ()					{ return m_bGL; }
+
+		// Writer
+		int Acquire ( int num );							// slot for num particles, -1 if none free
+		void Publish ( int s, int num, int fmt );
+		float* GetPos ( int s )			{ return (float*) m_Ptr[s]; }
+		DWORD* GetColor ( int s )		{ return (DWORD*) ( m_Ptr[s] + (long) m_Max * STAGE_POS ); }
+		float* GetScalar ( int s )		{ return (float*) GetColor ( s ); }
+		int GetColorRequest ()			{ return m_Request; }
+
+		// Consumers: current slot
+		int GetCurrent ()				{ return m_Current; }
+		int GetNum ()					{ return m_Current < 0 ? 0 : m_Num[m_Current]; }
+		int GetFrame ()					{ return m_Frame; }
+		int GetColorFormat ()			{ return m_Current < 0 ? STAGE_CLR_NONE : m_Fmt[m_Current]; }
+		void SetColorFormat ( int fmt )	{ m_Request = fmt; }
+		GLuint GetVBO ()				{ return m_VBO; }
+		long GetPosOffset ()			{ return m_Current < 0 ? 0 : SlotOffset ( m_Current ); }
+		long GetColorOffset ()			{ return GetPosOffset() + (long) m_Max * STAGE_POS; }
+
+		// Memory mode readers: pin the current slot while reading it
+		int AcquireRead ();									// -1 if nothing published yet
+		void ReleaseRead ( int s );
+		const float* ReadPos ( int s )		{ return (const float*) m_Ptr[s]; }
+		const DWORD* ReadColor ( int s )	{ return (const DWORD*) ( m_Ptr[s] + (long) m_Max * STAGE_POS ); }
+		int ReadNum ( int s )				{ return m_Num[s]; }
+		int ReadColorFormat ( int s )		{ return m_Fmt[s]; }
+
+	private:
+		long SlotOffset ( int s )		{ return (long) s * m_Max * ( STAGE_POS + STAGE_CLR ); }
+		void WaitFence ( int s );
+		void Lock ();
+		void Unlock ();
+
+		bool			m_bGL;
+		int				m_Max;
+		GLuint			m_VBO;
+		char*			m_Mem;						// memory mode storage
+		char*			m_Ptr[STAGE_SLOTS];			// write/read pointer (GL: valid while mapped)
+		GLsync			m_Fence[STAGE_SLOTS];
+		int				m_Num[STAGE_SLOTS];
+		int				m_Age[STAGE_SLOTS];			// frame when last published
+		int				m_Pin[STAGE_SLOTS];
+		int				m_Fmt[STAGE_SLOTS];			// STAGE_CLR_ of the slot contents
+		int				m_Request;
+		int				m_Current;
+		int				m_Frame;
+		int				m_MemId;
+
+		#ifdef _MSC_VER
+			CRITICAL_SECTION	m_Lock;
+		#else
+			pthread_mutex_t		m_Lock;
+		#endif
+	};
+
+#endif
@@ -31,7 +31,11 @@
 	#include <math.h>
 
 	#include "point_set.h"
+	#include "mem_account.h"
+	#include "mprofile.h"
 	#include "fluid.h"
+	#include "fluid_stage.h"
+	#include "fluid_collider.h"
 	
 	// Scalar params
 	#define SPH_DRAWMODE		0
@@ -63,6 +67,20 @@
 	#define SPH_TEMP_MIN		24
 	#define SPH_JUMP_MAX		25
 	#define SPH_JUMP_MIN		26
+	#define SPH_CFL				27		// adaptive timestep: Courant number, 0 = fixed SPH_TIMESTEP
+	#define SPH_DT_MIN			28		// adaptive timestep bounds
+	#define SPH_DT_MAX			29
+	#define SPH_PCI_TOL			30		// PCISPH: allowed average compression, fraction of rest density
+	#define SPH_PCI_ITER		31		// PCISPH: iteration cap
+	#define SPH_PBF_ITER		32		// PBF: density constraint iterations per step
+	#define SPH_PBF_RELAX		33		// PBF: constraint relaxation, fraction of a full neighborhood's gradient sum
+	#define SPH_PBF_VORT		34		// PBF: vorticity confinement (m/s)
+	#define SPH_PBF_XSPH		35		// PBF: XSPH velocity smoothing
+	#define SPH_SLEEP_STEPS		36		// dormant cells: quiet steps before a grid cell is frozen, 0 = off
+	#define SPH_SLEEP_VEL		37		// dormant cells: max speed of a quiet particle (m/s)
+	#define SPH_SLEEP_DRHO		38		// dormant cells: max density change per step, fraction of the density
+	#define SPH_BLOCK_LEVELS	39		// block time-stepping: power-of-two dt levels below SPH_TIMESTEP, 1 = off
+	#define SPH_COLLIDE_BAKE	40		// colliders: bake the volume walls and barriers into one voxel field of this spacing (world units), 0 = off
 	
 	// Vector params
 	#define SPH_VOLMIN			7
@@ -78,13 +96,98 @@
 	#define LEVY_BARRIER		4
 	#define DRAIN_BARRIER		5
 	#define USE_CUDA			6
+	#define USE_QPOS			7		// neighbor search on quantized cell-relative positions
+	#define USE_PCISPH			8		// iterative incompressible pressure instead of the equation of state
+	#define USE_PBF				9		// position based fluids instead of force integration (wins over USE_PCISPH)
+	#define USE_BOUNDARY		10		// walls as static boundary particles in the SPH sums (not PBF or CUDA)
 	
 	#define MAX_PARAM			50
 	#define BFLUID				2
 
+	// Passes, for the per-pass block declarations and bytes-moved report
+	#define PASS_INSERT			0
+	#define PASS_PRESS			1
+	#define PASS_FORCE			2
+	#define PASS_ADV			3
+	#define PASS_COLOR			4
+	#define PASS_SOLVE			5				// PCISPH or PBF iterations, all of them
+	#define PASS_COLLIDE		6				// contacts with the colliders, grid cells near a surface only
+	#define PASS_MAX			7
+
+	// Profiled phases of Run (see mprofile.h)
+	#define PROF_STEP			0				// all of Run
+	#define PROF_PREDICT		1				// PBF predicted positions
+	#define PROF_INSERT			2
+	#define PROF_PRESS			3
+	#define PROF_FORCE			4
+	#define PROF_COLLIDE		5
+	#define PROF_SOLVE			6
+	#define PROF_ADV			7
+	#define PROF_TRANSFER		8				// CUDA copies, both ways
+	#define PROF_MAP			9				// output slot: fence wait and map (within ADV)
+	#define PROF_UPLOAD			10				// output slot: unmap and fence (within ADV)
+	#define PROF_MAX			11
+
+	// Synthetic scenes (SPH_CreateSynthetic): num particles in a cube of about num cells
+	// of the fluid lattice, so the mean neighbor count matches the examples
+	#define SYNTH_LATTICE		0				// the fluid lattice
+	#define SYNTH_RANDOM		1				// uniform random, same mean density
+	#define SYNTH_CLUSTER		2				// gaussian clumps of 1000, ~4x the lattice density at their centers
+	#define SYNTH_POOL			3				// the lattice with as much room above it; Run to settle
+	#define SYNTH_MAX			4
+
+	#define COLOR_RAMP			256				// color ramp lookup table entries
+	#define COLOR_BLOCK			256				// particles per block in the color stage
+
+	// Adaptive timestep. The limit that set each step's dt, for the history report.
+	#define DT_LIMIT_VEL		0				// Courant: h / (c + vmax)
+	#define DT_LIMIT_FORCE		1				// h / amax
+	#define DT_LIMIT_VISC		2				// h^2 / nu
+	#define DT_LIMIT_GROWTH		3				// at most DT_GROWTH times the last step
+	#define DT_LIMIT_MIN		4				// SPH_DT_MIN / SPH_DT_MAX
+	#define DT_LIMIT_MAX		5
+	#define DT_LIMITS			6
+	#define DT_GROWTH			1.2
+	#define DT_HISTORY			1024			// steps kept
+
+	#define PCI_MIN_ITER		3				// PCISPH iterations before the tolerance is checked
+	#define PCI_RELAX			0.5				// damping of the pressure update (neighbors correct too)
+
+	#define PBF_SCORR_K			0.01				// artificial pressure: -k (W(r) / W(dq h))^4
+	#define PBF_SCORR_DQ		0.2
+	#define PBF_WALL_JITTER		0.1				// spread of clamped positions, fraction of the wall margin
+
+	#define BLOCK_LEVELS_MAX	8				// block time-stepping: finest step is SPH_TIMESTEP / 128
+	#define BLOCK_CFL			0.4				// Courant number for the levels when SPH_CFL is 0
+
+	#define BARRIER_DEPTH		4.0				// thickness of the barrier boxes (world units)
+
+	struct FluidDTStep {
+		float			dt;				// step taken
+		float			vmax;			// max speed after the step (m/s)
+		float			amax;			// max acceleration in the step (m/s^2)
+		int				limit;			// DT_LIMIT_ that chose the next dt
+	};
+
+	class FluidDomain;
+	class ThreadPool;
+
+	// A pass declares the attributes it reads or writes, for the particle itself and for
+	// each neighbor it visits. The registry maps them to blocks; the pass must not touch others.
+	struct FluidPass {
+		const char*		name;
+		int				own;			// block mask (1 << FLUID_HOT ...) for the particle itself
+		int				nbr;			// block mask for each neighbor visited
+		long			records;		// particles processed in the last step
+		volatile long	visits;			// neighbors visited in the last step (summed over threads)
+		volatile long	entries;		// neighbor table entries written or read
+		double			bytes;			// estimated bytes moved in the last step
+	};
+
 	class FluidSystem : public PointSet {
 	public:
 		FluidSystem ();
+		~FluidSystem ();
 
 		// Basic Particle System
 		virtual void Initialize ( int mode, int nmax );
@@ -94,22 +197,190 @@
 		virtual int AddPoint ();		
 		virtual int AddPointReuse ();
 		virtual void AddVolume (Vector3DF min, Vector3DF max, float spacing );
-		Fluid* AddFluid ()			{ return (Fluid*) GetElem(0, AddPointReuse()); }
-		Fluid* GetFluid (int n)		{ return (Fluid*) GetElem(0, n); }
-		//VBOS
-		void UpdateVBOS(int numParticles);
-		GLuint getPositionVBO() {return m_posVBO;}
-		GLuint getColorVBO() {return m_colorVBO;}
+		virtual void Emit ( float spacing );
+		Fluid* AddFluid ()			{ return (Fluid*) GetElem(FLUID_HOT, AddPointReuse()); }
+		Fluid* GetFluid (int n)		{ return (Fluid*) GetElem(FLUID_HOT, n); }
+		FluidThermal* GetThermal (int n)	{ return (FluidThermal*) GetElem(FLUID_THERMAL, n); }
+		FluidCold* GetCold (int n)			{ return (FluidCold*) GetElem(FLUID_COLD, n); }
+
+		// Whole particles across all blocks (domain exchange)
+		int GetRecordSize ();								// bytes per particle, all blocks
+		void PackParticle ( int n, char* dest );
+		int UnpackParticle ( char* src );
+		void DeleteParticle ( int n );						// swaps the last particle into n
+		void SetNumPoints ( int n );						// truncate all blocks
+
+		// Attribute blocks. Passes declare attributes by name; see SPH_DeclarePasses.
+		int GetBlockMask ( const char** attr );
+		void SPH_DeclarePasses ();
+		void SPH_ReportLayout ();
+
+		// Memory accounting (see mem_account.h). One entry per category per instance.
+		void SPH_UpdateMemory ();
+		void SPH_SetupNeighbors ( int nmax, int width );		// Neighbor_Setup, then fault the table in
+		FluidPass* GetPass ( int p )		{ return &m_Pass[p]; }
+
+		// Phase timing. Run records each phase into the process profiler; the report adds
+		// the bytes each pass moved in the last step and the rate at the median time, and
+		// the hardware counts per phase and thread once Profiler::StartCounters has run.
+		int GetProfileId ( int phase )		{ return m_ProfId[phase]; }
+		void SPH_ReportProfile ();
+		void AddPassVisits ( int p, long visits, long entries );
+		//Render Output. Advance writes positions (3 floats) into the current stage slot,
+		//then the color stage fills the colors in the format the consumer asked for with
+		//GetStage()->SetColorFormat(). Draw GetStage()->GetNum() points from its VBO and offsets.
+		//Scalar colors are looked up in GetColorRamp() (COLOR_RAMP entries, RGBA8).
+		FluidStage* GetStage ()				{ return &m_Stage; }
+		void SetRenderOutput ( bool b )		{ m_bOutput = b; }		// false: skip the stage (sub-steps, see fluid_scheduler.h)
+		const DWORD* GetColorRamp ()		{ return m_ColorRamp; }
+		GLuint getPositionVBO()				{ return m_Stage.GetVBO(); }
+		GLuint getColorVBO()				{ return m_Stage.GetVBO(); }
+
+		// Headless instances (no GL context) have no GL output. With capture set they
+		// fill a memory ring instead, for capture and streaming. Set both before Initialize.
+		void SetHeadless ( bool b )			{ m_bHeadless = b; }
+		void SetCapture ( bool b )			{ m_bCapture = b; }
+		bool IsHeadless ()					{ return m_bHeadless; }
+		void SetTiming ( bool b )			{ m_bTiming = b; }		// layout report at Initialize; phase times are in SPH_ReportProfile
+
+		// Parameter overrides, applied by SPH_CreateExample after the scene defaults
+		void SetParamOverride ( int p, double v );
+		void ClearParamOverrides ()			{ m_Override.clear(); }
+
+		// Flat copy of the simulation state (header, parameters, particle blocks) for checkpoints
+		long GetStateSize ();
+		void SaveState ( char* dest );
+		bool LoadState ( char* src, long size );
+
+		// Multi-process slab decomposition (see fluid_domain.h)
+		void SetDomain ( FluidDomain* d )	{ m_Domain = d; }
+		FluidDomain* GetDomain ()			{ return m_Domain; }
+		int NumOwned ();
+
+		// Threaded passes (see mthread.h). Each thread owns one contiguous particle range.
+		void SetThreadPool ( ThreadPool* pool )	{ m_Pool = pool; }
+		ThreadPool* GetThreadPool ()			{ return m_Pool; }
+		void SPH_ComputePressureRange ( int start, int end );
+		void SPH_ComputePressureRangeQ ( int start, int end );
+		void SPH_ComputeForceRange ( int start, int end );
+		int AdvanceRange ( int start, int end, int t );	// returns number of particles flagged FLUID_DEAD
+		void SPH_ComputeColorRange ( int start, int end );
+		void SPH_ReportNUMA ();
+
+		// Particle removal. Advance flags particles FLUID_DEAD (drains, sinks); Compact then
+		// streams the survivors, in order, into a second buffer and remaps the grid chains.
+		void Compact ();
+		void CompactCopyRange ( int t, int nt );
+		void CompactGridRange ( int t, int nt );
+		int GetNumRemoved ()				{ return m_NumRemoved; }
+		void SetThreadDead ( int t, int n )	{ m_ThreadDead[t] = n; }
 
 		// Smoothed Particle Hydrodynamics
 		void SPH_Setup ();
 		void SPH_CreateExample ( int n, int nmax );
+		void SPH_CreateSynthetic ( int dist, int num, unsigned int seed );		// for the microbenchmarks
 		void SPH_DrawDomain ();
 		void SPH_ComputeKernels ();
 
 		void SPH_ComputePressureSlow ();			// O(n^2)
 		void SPH_ComputePressureGrid ();			// O(kn) - spatial grid
-		
+
+		// Quantized positions (USE_QPOS). Rebuilt from the grid after every insert;
+		// the full-precision pos is still used by the force pass and integration.
+		void Grid_Quantize ();
+		float GetQuantStep ()				{ return m_QStep; }		// one quantum, in world units
+		void SPH_ReportQuantError ();			// neighbor table vs. exact distances, after the pressure pass
+
+		// Adaptive timestep (SPH_CFL > 0). Advance reduces the max speed and acceleration
+		// over all particles; SPH_ComputeTimestep then sets SPH_TIMESTEP for the next step
+		// from the Courant, force and viscous limits, within [SPH_DT_MIN, SPH_DT_MAX].
+		// Disabled with a domain, since every slab would need the same dt.
+		void SPH_ComputeTimestep ();
+		void SPH_ReportTimestep ();
+		int GetNumDTSteps ()				{ return m_DTSteps < DT_HISTORY ? m_DTSteps : DT_HISTORY; }
+		FluidDTStep* GetDTStep ( int back )	{ return &m_DTHist[ ( m_DTSteps - 1 - back ) % DT_HISTORY ]; }		// 0 = latest
+		double GetTime ()					{ return m_Time; }
+
+		// Incompressible pressure (USE_PCISPH), Solenthaler & Pajarola 2009. Replaces the
+		// equation of state: the pressure pass only measures density and builds the neighbor
+		// table, the force pass adds viscosity, then SPH_ComputePressurePCI iterates pressures
+		// until the predicted compression is below SPH_PCI_TOL or SPH_PCI_ITER is reached.
+		void SPH_ComputePressurePCI ();
+		void SPH_PredictRange ( int start, int end );
+		void SPH_PredictDensityRange ( int start, int end, int t );
+		void SPH_PressureForceRange ( int start, int end );
+		void SPH_ReportSolver ();
+		int GetSolverIters ()				{ return m_SolveIters; }		// last step, PCISPH or PBF
+		float GetSolverError ()				{ return m_SolveErr; }			// last step, average compression / rest density
+
+		// Position based fluids (USE_PBF), Macklin & Mueller 2013. Replaces the force pass and
+		// the integration: positions are predicted under gravity first, so the grid and the
+		// neighbor table are built there, then SPH_PBF_ITER Jacobi iterations project them
+		// onto the density constraint. Velocities come from the position change, plus
+		// vorticity confinement and XSPH smoothing. Meant for large steps (1/60 s) in
+		// interactive previews, not accuracy; walls are projected, barriers are ignored
+		// and there is no thermal diffusion.
+		void SPH_PredictPBF ();
+		void SPH_SolvePBF ();
+		void SPH_PredictPBFRange ( int start, int end );
+		void SPH_PBFLambdaRange ( int start, int end, int t );
+		void SPH_PBFDeltaRange ( int start, int end );
+		void SPH_PBFVelocityRange ( int start, int end );
+		void SPH_PBFVorticityRange ( int start, int end );
+		void SPH_PBFConfineRange ( int start, int end );
+
+		// Dormant cells (SPH_SLEEP_STEPS > 0). A grid cell whose particles, and those of its
+		// 26 neighbor cells, stayed below SPH_SLEEP_VEL and SPH_SLEEP_DRHO for SPH_SLEEP_STEPS
+		// steps is frozen: its particles are flagged FLUID_SLEEP, lose their velocity and are
+		// skipped by the pressure, force and advance passes, while awake neighbors still see
+		// their last density and pressure. A restless particle in or next to a frozen cell,
+		// or any awake particle entering it, wakes it. Runs after every insert. Only for the
+		// equation of state; off with PCISPH, PBF or a domain.
+		void SPH_UpdateDormancy ();
+		void SPH_ReportDormancy ();
+		int GetNumAwake ()					{ return m_NumAwake; }		// particles not in dormant cells, last step
+		int GetNumActive ()					{ return m_NumActive; }		// particles the pressure and force passes processed, last step
+
+		// Block time-stepping (SPH_BLOCK_LEVELS > 1). Each particle steps with SPH_TIMESTEP / 2^level,
+		// the level chosen from its own Courant and force limits (SPH_CFL, or BLOCK_CFL). A Run()
+		// advances the finest step: every particle drifts, but only those at the start of their own
+		// step (not FLUID_WAIT) get density, forces and a kick. Levels change only on their own
+		// boundaries, coarsen one at a time and stay within one of every neighbor's; a waiting
+		// particle more than one level coarser than a fine neighbor has its step cut short
+		// (Saitoh & Makino 2009). Neighbors between their steps are read as they are: drifted
+		// positions, density and pressure from their last evaluation. Off with PCISPH, PBF or a domain.
+		void SPH_FinishBlockStep ();
+		void SPH_ReportBlockSteps ();
+		long GetBlockTick ()				{ return m_BlockTick; }
+
+		// Colliders (see fluid_collider.h). SPH_CreateExample builds the volume walls and the
+		// barrier toggles as COLLIDE_DOMAIN shapes; others may be added to GetColliders(). Each
+		// step the contact pass visits only the grid cells the broad phase kept, evaluates each
+		// candidate for the cell's particles as one batch, and leaves the wall penalty in
+		// m_ColAccel for Advance and the PCISPH prediction (FLUID_CONTACT). Sinks remove
+		// the particles inside them. PBF projects positions out of the same shapes instead.
+		void SPH_SetupColliders ();
+		void SPH_ComputeColliders ();
+		void SPH_ComputeCollideRange ( int start, int end );		// range of GetColliders()->GetCellIndex()
+		void SPH_ReportColliders ();
+		FluidColliders* GetColliders ()		{ return &m_Colliders; }
+		// PLY obstacle (fluid_mesh_sdf.h), scaled then moved by offset, baked with voxel spacing
+		// cell (world units, 0 = half the contact distance) and cached next to the file
+		int SPH_AddMeshCollider ( std::string fname, float scale, Vector3DF offset, float cell, int flags = 0 );
+
+		// Boundary particles (USE_BOUNDARY), after Akinci et al. 2012. The colliders are sampled
+		// once into static particles a smoothing radius deep on the solid side, at the fluid
+		// spacing and with the particle mass. They sit in their own grid of smoothing radius
+		// cells, built with them and kept until the colliders change, and enter the density sum
+		// and the viscosity and pressure forces (or the PCISPH iterations) with the fluid
+		// particle's own pressure mirrored along the wall normal; approaching particles are
+		// damped with SPH_EXTDAMP. The wall penalty then only acts on particles that got behind
+		// a surface.
+		void SPH_SetupBoundary ();
+		void SPH_ReportBoundary ();
+		int GetNumBoundary ()				{ return (int) m_BndPos.size(); }
+		Vector3DF* GetBoundaryPos ()		{ return m_BndPos.empty() ? 0x0 : &m_BndPos[0]; }
+
 		void SPH_ComputeForceSlow ();				// O(n^2)
 		void SPH_ComputeForceGrid ();				// O(kn) - spatial grid
 		void SPH_ComputeForceGridNC ();				// O(cn) - neighbor table
@@ -117,17 +388,131 @@
 		void SPH_ComputeXSPH (Fluid* p, int i);
 		
 	private:
+		void SPH_SetupScene ();						// colliders and grid for the volume, particles inserted
+		void ClearFluid ( int n );
+		void CountPass ( int p, long records );
+		double GetStepDT ();						// dt the next Advance will take
+		void SPH_ComputeBoundary ( Fluid* p, int i, Vector3DF& accel );
+		void SPH_ComputeContact ( Fluid* p, Vector3DF& accel );
+		double SPH_ComputePCIScale ();
+		double SPH_ComputePBFScale ();
+		void SPH_ProjectBounds ( Vector3DF& pos, int i );
+		float SPH_BoundaryDensity ( Vector3DF& pos );					// sum of psi_b * (h^2 - r^2)^3
+		void SPH_BoundaryForce ( Fluid* p, Vector3DF& force );
+		void SPH_BoundaryPressure ( Fluid* p, Vector3DF& force );		// PCISPH, into m_PciPress
+		int GetBoundaryCell ( Vector3DF& pos );							// -1 if no boundary particle is within reach
+		int GetBlockLevels ()				{ int n = (int) m_Param[SPH_BLOCK_LEVELS]; return ( n < 1 ) ? 1 : ( n > BLOCK_LEVELS_MAX ) ? BLOCK_LEVELS_MAX : n; }
 
 		// Smoothed Particle Hydrodynamics
 		double						m_R2, m_Poly6Kern, m_LapKern, m_SpikyKern;		// Kernel functions
 		
-		//VBO Memory
-		float * m_vPos;
-		float * m_vCol;
+		//Render Output (see fluid_stage.h)
+		FluidStage					m_Stage;
+		int							m_StageSlot;		// slot being written this step, -1 = none
+		float*						m_StagePos;
+		DWORD*						m_StageClr;
+		int							m_StageFmt;			// STAGE_CLR_ written this step
+		DWORD						m_ColorRamp[COLOR_RAMP];
+		bool						m_bCapture;
+		bool						m_bOutput;
+
+		bool						m_bHeadless;
+		bool						m_bTiming;
+		std::vector< std::pair<int, double> >	m_Override;
+
+		FluidDomain*				m_Domain;
+		ThreadPool*					m_Pool;
+
+		FluidPass					m_Pass[PASS_MAX];
+		int							m_ProfId[PROF_MAX];
+		int							m_MemId[MEM_CATEGORIES];		// -1 until first update
+
+		// Quantized positions, per cell: slots m_QStart[c] .. m_QStart[c+1]-1
+		std::vector<int>			m_QStart;
+		std::vector<int>			m_QFill;
+		std::vector<FluidQPos>		m_QPos;
+		float						m_QStep;
+
+		// Compaction
+		std::vector<int>			m_ThreadDead;		// per-thread dead count from Advance, then output offsets
+		std::vector<int>			m_Remap;			// old index -> new index (-1 = removed)
+		GeomBuf						m_Scratch[FLUID_BLOCKS];		// second storage per block (swapped with mBuf[b])
+		int							m_NumRemoved;
+
+		// Adaptive timestep
+		std::vector<float>			m_ThreadVMax;		// per-thread max |v|^2 and |a|^2 from Advance
+		std::vector<float>			m_ThreadAMax;
+		FluidDTStep					m_DTHist[DT_HISTORY];
+		int							m_DTSteps;
+		int							m_DTLimit[DT_LIMITS];
+		double						m_DTLo, m_DTHi, m_DTSum;
+
+		// Incompressible pressure, per particle (all points, ghosts included)
+		std::vector<Vector3DF>		m_PciPred;			// predicted position, world units
+		std::vector<Vector3DF>		m_PciPress;			// pressure acceleration, added by Advance
+		std::vector<double>			m_ThreadErr;		// per-thread sum of compression
+		bool						m_bPciValid;		// m_PciPress belongs to this step
+		double						m_PciDelta;			// pressure per unit of density error
+		float						m_PciDT;			// step being solved for
+
+		// Position based fluids, per particle (all points)
+		std::vector<Vector3DF>		m_PbfPrev;			// position at the start of the step
+		std::vector<Vector3DF>		m_PbfPos;			// positions being projected, world units
+		std::vector<Vector3DF>		m_PbfNext;			// Jacobi output, swapped with m_PbfPos; then XSPH
+		std::vector<Vector3DF>		m_PbfOmega;			// vorticity
+		std::vector<float>			m_PbfLambda;
+		double						m_PbfScale;			// sum of |grad C|^2 at rest, see SPH_ComputePBFScale
+		float						m_PbfDT;
+
+		// Solver stats (PCISPH or PBF)
+		int							m_SolveIters;
+		float						m_SolveErr;
+		int							m_SolveSteps, m_SolveIterSum, m_SolveIterMax, m_SolveCapped;
+		float						m_SolveErrMax;
+
+		// Dormant cells, per grid cell
+		std::vector<int>			m_CellQuiet;		// quiet steps so far, -1 = dormant
+		std::vector<char>			m_CellRestless;
+		bool						m_bSleep;			// dormancy on for this step
+		int							m_NumAwake;
+		int							m_SleepSteps, m_CellsUsed, m_CellsAsleep;
+		double						m_AwakeSum;			// sum of the awake fraction, for the average
+		DWORD						m_SkipMask;			// flags of particles the pressure and force passes skip this step
+		volatile long				m_NumActive;
+		volatile long				m_NeighborFull;		// particles with more neighbors than their table row holds, last search
+
+		// Block time-stepping
+		bool						m_bBlock;			// on for this step
+		long						m_BlockTick;		// finest steps taken
+		std::vector<char>			m_BlockNbr;			// per particle: finest level among its neighbors, from the force pass
+		std::vector< std::vector<int> >	m_ThreadFine;	// per thread: particles kicked at level 2 or finer
+		std::vector<int>			m_ThreadLevel;		// per thread: particles per level after the step, BLOCK_LEVELS_MAX each
+		int							m_BlockLevel[BLOCK_LEVELS_MAX];
+		long						m_BlockTicks, m_BlockCuts;
+		volatile long				m_BlockClamped;		// kicks that wanted a step below the finest
+		double						m_BlockEvals, m_BlockUpdates;	// particles evaluated, particles that a global finest step would evaluate
+
+		// Colliders
+		FluidColliders				m_Colliders;
+		std::vector<Vector3DF>		m_ColAccel;			// per particle: wall penalty of this step, valid with FLUID_CONTACT
+		float						m_ColBake;			// SPH_COLLIDE_BAKE the domain colliders were set up with
+		bool						m_bContacts;		// contact pass ran this step; otherwise contacts are evaluated per particle
+		volatile long				m_ColRecords, m_ColContacts;
 
-		//VBO Pointers
-		GLuint m_posVBO;
-		GLuint m_colorVBO;
+		// Boundary particles, sorted by static cell
+		std::vector<Vector3DF>		m_BndPos;			// world units
+		std::vector<Vector3DF>		m_BndNorm;			// collider normal, into the fluid
+		std::vector<int>			m_BndStart;			// per cell, offsets into m_BndPos (one extra at the end)
+		std::vector<char>			m_BndNear;			// per cell: boundary particles in the cell or a neighbor
+		Vector3DF					m_BndMin;
+		float						m_BndCell;			// world units, the smoothing radius
+		float						m_BndPsi;			// mass of each, SPH_PMASS
+		float						m_BndWall;			// damping weight at a flat wall, normalizes SPH_EXTDAMP
+		int							m_BndRes[3];
+		int							m_BndVersion;		// collider version sampled, -1 = none
+		bool						m_bBoundary;		// on for this step
+		double						m_BndSec;
+		volatile long				m_BndHits;			// fluid particles with boundary neighbors, last pressure pass
 	};
 
 #endif
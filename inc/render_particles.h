@@ -12,6 +12,8 @@
 #ifndef __RENDER_PARTICLES__
 #define __RENDER_PARTICLES__
 #include <glm/glm.hpp>
+#include "mem_account.h"
+#include "mprofile.h"
 
 
 namespace particle_attributes {
@@ -57,6 +59,17 @@ enum DisplayMode {
 	DISPLAY_TOTAL = 11
 };
 
+//Passes of display(), timed by the profiler as trace spans (CPU side: command submission)
+enum RenderPass {
+	RENDER_BACKGROUND = 0,
+	RENDER_DEPTH = 1,
+	RENDER_THICKNESS = 2,
+	RENDER_BLUR = 3,
+	RENDER_NORMAL = 4,
+	RENDER_COMPOSITE = 5,
+	RENDER_PASSES = 6
+};
+
 class ParticleRenderer
 {
 public:
@@ -68,9 +81,14 @@ public:
     void setPositions(float *pos, int numParticles);
 
 	//VBO's For Storing Things (A Lot Faster than Immediate Mode)
-	void setVertexBuffer(unsigned int vbo, int numParticles);
+	void setVertexBuffer(unsigned int vbo, int numParticles, long posOffset = 0, long colorOffset = 0);
     void setColorBuffer(unsigned int vbo) { m_colorVBO = vbo; }
 
+	//Particle colors: none, RGBA8, or one float mapped through the ramp texture in the shader
+	void setColorFormat(int fmt) { m_colorFormat = fmt; }
+	void setColorRamp(const unsigned int *rgba, int n);
+	bool needsParticleColor() { return m_display_type == DISPLAY_COLOR || m_display_type == DISPLAY_DIFFUSE || m_display_type == DISPLAY_DIFFUSE_SPEC; }
+
     void display();
 
     void setPointSize(float size)  { m_pointSize = size; }
@@ -103,6 +121,7 @@ protected: // methods
 	void _setTextures();
     void _drawPoints();
 	void _initQuad();
+	void _updateMemory();
 
 	//Shader Loading
 	void _initGL();
@@ -148,6 +167,10 @@ protected: // data
 
     GLuint m_vbo;
     GLuint m_colorVBO;
+	long m_posOffset;			// byte offsets of the xyz floats and RGBA8 colors
+	long m_colorOffset;
+	int m_colorFormat;			// STAGE_CLR_ (fluid_stage.h)
+	GLuint m_rampTexture;
 
 	GLuint m_depthTexture;
 	GLuint m_colorTexture;
@@ -164,6 +187,13 @@ protected: // data
 	GLuint m_thickFBO;
 
 	device_mesh2_t m_device_quad;
+
+	//Memory Accounting (texture sizes from their formats)
+	int m_memGPU, m_memHost;
+	double m_fboBytes, m_cubeBytes, m_skyBytes;
+
+	//Profiler scopes, one per RenderPass
+	int m_profId[RENDER_PASSES];
 };
 
 #endif //__ RENDER_PARTICLES__
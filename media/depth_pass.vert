@@ -6,6 +6,8 @@ uniform mat4x4 u_InvTrans;
 
 uniform float pointRadius;  // point size in world space
 uniform float pointScale;   // scale to calculate size in pixels
+uniform int u_ColorScalar;  // Color.x is a ramp coordinate in [0,1]
+uniform sampler1D u_Ramp;
 
 in vec3 Position;
 in vec3 Color;
@@ -21,6 +23,9 @@ void main(void) {
 	
 	fs_PosEye = posEye;
 	fs_Position = u_ModelView * vec4(Position.xyz, 1.0);
-	fs_Color = vec4(Color.xyz,1.0f);
+	if (u_ColorScalar != 0)
+		fs_Color = vec4(textureLod(u_Ramp, Color.x, 0.0).rgb, 1.0f);
+	else
+		fs_Color = vec4(Color.xyz,1.0f);
 	gl_Position = u_Persp * u_ModelView * vec4(Position.xyz, 1.0);
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -30,14 +30,15 @@
 GeomX::GeomX ()
 {
 	mHeap = 0x0;
+	mHugePages = false;
+	mPrefault = true;
+	mReserve = GEOM_RESERVE;
 }
 
 void GeomX::FreeBuffers ()
 {
-	for (int n=0; n < (int) mBuf.size(); n++) {
-		free ( mBuf[n].data );
-		mBuf[n].data = 0x0;
-	}
+	for (int n=0; n < (int) mBuf.size(); n++)
+		ReleaseBuffer ( mBuf[n] );
 	mBuf.clear ();
 	
 	if ( mHeap != 0x0 ) free ( mHeap );
@@ -74,18 +75,16 @@ int GeomX::CopyBuffer ( uchar bdest, uchar bsrc, GeomX& src )
 		for (int n=0; n <= bdest - GetNumBuf(); n++ )
 			AddBuffer ( 0, 0, 0 );
 	}
-	if ( mBuf[bdest].data != 0x0 ) {
-		free ( mBuf[bdest].data );
-		mBuf[bdest].data = 0x0;
-	}
+	ReleaseBuffer ( mBuf[bdest] );
 		
 	GeomBuf* buf = src.GetBuffer( bsrc );
 	mBuf[bdest].dtype = buf->dtype;
 	mBuf[bdest].max = buf->max;
-	mBuf[bdest].num = buf->num;
+	mBuf[bdest].num = 0;
 	mBuf[bdest].stride = buf->stride;
+	CommitBuffer ( mBuf[bdest], (long) mBuf[bdest].max * mBuf[bdest].stride );
+	mBuf[bdest].num = buf->num;
 	mBuf[bdest].size = buf->size;
-	mBuf[bdest].data = (char*) malloc (  mBuf[bdest].max * mBuf[bdest].stride );
 	memcpy ( mBuf[bdest].data, buf->data, mBuf[bdest].num * mBuf[bdest].stride );
 
 	return bdest;
@@ -163,22 +162,37 @@ int GeomX::AddAttribute ( uchar b, std::string name, ushort stride, bool bExtend
 	attr.stride = stride;
 	
 	if ( bExtend ) {
-		int new_stride = buf->stride + attr.stride;
-		char* new_data = (char*) malloc ( buf->max * new_stride );
+		GeomBuf ext;
+		ext.stride = buf->stride + attr.stride;
+		CommitBuffer ( ext, (long) buf->max * ext.stride );
+		char* new_data = ext.data;
 		char* old_data = buf->data;
 		for (int n=0; n < buf->num; n++) {
 			memcpy ( new_data, old_data, buf->stride );
 			old_data += buf->stride;
-			new_data += new_stride;
+			new_data += ext.stride;
 		}
-		free ( buf->data );
-		buf->data = new_data;
-		buf->stride = new_stride;
+		ReleaseBuffer ( *buf );
+		buf->mem = ext.mem;
+		buf->data = ext.data;
+		buf->stride = ext.stride;
+		buf->size = (long) buf->num * buf->stride;
 	}
 	mAttribute.push_back ( attr );
 	return (int) mAttribute.size()-1;
 }
 
+int GeomX::AddAttributeAt ( uchar b, std::string name, ushort stride, ushort offset )
+{
+	GeomAttr attr;
+	attr.buf = b;
+	attr.name = name;
+	attr.offset = offset;
+	attr.stride = stride;
+	mAttribute.push_back ( attr );
+	return (int) mAttribute.size()-1;
+}
+
 int GeomX::GetAttribute ( std::string name )
 {
 	for (int n=0; n < (int) mAttribute.size(); n++) {
@@ -197,6 +211,15 @@ int GeomX::GetAttrOffset ( std::string name )
 	return -1;
 }
 
+int GeomX::GetAttrBuf ( std::string name )
+{
+	for (int n=0; n < (int) mAttribute.size(); n++) {
+		if ( mAttribute[n].name.compare ( name ) == 0 )
+			return mAttribute[n].buf;
+	}
+	return -1;
+}
+
 int GeomX::AddBuffer ( uchar typ, ushort stride, int max )
 {
 	GeomBuf buf;
@@ -205,22 +228,60 @@ int GeomX::AddBuffer ( uchar typ, ushort stride, int max )
 	buf.max = max;
 	buf.num = 0;
 	buf.size = 0;
-	buf.data = (char*) malloc ( buf.max * buf.stride );
+	CommitBuffer ( buf, (long) buf.max * buf.stride );
 	mBuf.push_back ( buf );
 	return (int) mBuf.size()-1;
 }
-void GeomX::ResetBuffer ( uchar b, int n )
+
+// Storage is a reserved address range (see mem_arena.h). Within the reservation this
+// only commits more pages; past it, the buffer moves once to a reservation twice the
+// new size, so repeated doubling copies at most once per reservation.
+void GeomX::CommitBuffer ( GeomBuf& buf, long bytes )
 {
-	mBuf[b].max = n;		
+	if ( buf.mem.base != 0x0 && bytes <= buf.mem.reserved ) {
+		if ( !MemCommit ( buf.mem, bytes, mPrefault ) ) {
+			error.PrintF ( "geom", "Out of memory committing buffer.\n" );
+			error.Exit ();
+		}
+		return;
+	}
+	MemArena old = buf.mem;
+	buf.mem = MemArena ();
+	long reserve = ( bytes*2 > mReserve ) ? bytes*2 : mReserve;
+	if ( !MemReserve ( buf.mem, reserve, mHugePages, bytes ) || !MemCommit ( buf.mem, bytes, mPrefault ) ) {
+		error.PrintF ( "geom", "Cannot reserve buffer address space.\n" );
+		error.Exit ();
+	}
+	if ( old.base != 0x0 ) {
+		memcpy ( buf.mem.base, old.base, (long) buf.num * buf.stride );
+		MemRelease ( old );
+	}
+	buf.data = buf.mem.base;
+}
 
-	if ( mBuf[b].data != 0x0 ) free ( mBuf[b].data );
+void GeomX::ReleaseBuffer ( GeomBuf& buf )
+{
+	MemRelease ( buf.mem );
+	buf.data = 0x0;
+}
 
-	char* new_data = (char*) malloc ( mBuf[b].max * mBuf[b].stride );
-	
-	mBuf[b].data = new_data;
-	
+void GeomX::SwapBufferData ( uchar b, GeomBuf& buf )
+{
+	MemArena mem = mBuf[b].mem;
+	mBuf[b].mem = buf.mem;
+	mBuf[b].data = mBuf[b].mem.base;
+	buf.mem = mem;
+	buf.data = buf.mem.base;
+}
+
+// Keeps the existing reservation when it is large enough, so re-creating a scene
+// does not unmap and re-fault the particle buffers.
+void GeomX::ResetBuffer ( uchar b, int n )
+{
+	mBuf[b].max = n;		
 	mBuf[b].num = 0;
 	mBuf[b].size = mBuf[b].num*mBuf[b].stride;
+	CommitBuffer ( mBuf[b], (long) mBuf[b].max * mBuf[b].stride );
 }
 
 char* GeomX::AddElem ( uchar b, href& ndx )
@@ -231,10 +292,7 @@ char* GeomX::AddElem ( uchar b, href& ndx )
 			error.Exit ();
 		}
 		mBuf[b].max *= 2;		
-		char* new_data = (char*) malloc ( mBuf[b].max * mBuf[b].stride );
-		memcpy ( new_data, mBuf[b].data, mBuf[b].num*mBuf[b].stride );
-		free ( mBuf[b].data );
-		mBuf[b].data = new_data;
+		CommitBuffer ( mBuf[b], (long) mBuf[b].max * mBuf[b].stride );
 	}
 	mBuf[b].num++;
 	mBuf[b].size += mBuf[b].stride; 
@@ -252,10 +310,7 @@ int GeomX::AddElem ( uchar b, char* data )
 {
 	if ( mBuf[b].num >= mBuf[b].max ) {
 		mBuf[b].max *= 2;
-		char* new_data = (char*) malloc ( mBuf[b].max * mBuf[b].stride );
-		memcpy ( new_data, mBuf[b].data, mBuf[b].num*mBuf[b].stride );
-		free ( mBuf[b].data );
-		mBuf[b].data = new_data;
+		CommitBuffer ( mBuf[b], (long) mBuf[b].max * mBuf[b].stride );
 	}
 	memcpy ( mBuf[b].data + mBuf[b].num*mBuf[b].stride, data, mBuf[b].stride );
 	mBuf[b].num++;
@@ -440,4 +495,4 @@ hval GeomX::AddRef ( hval r, hList& list, hval delta )
 		list.cnt++;
 	}
 	return list.pos;
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -25,6 +25,8 @@
 
 	#include <vector>
 
+	#include "mem_arena.h"
+
 	#define	HEAP_MAX			2147483640	// largest heap size (range of hpos)
 
 	#define	ELEM_MAX			2147483640	// largest number of elements in a buffer (range of hval)
@@ -32,6 +34,10 @@
 
 	#define BUF_UNDEF			255
 
+	// Address space reserved per buffer (at least twice the first allocation).
+	// Buffers grow in place up to this, without copying.
+	#define GEOM_RESERVE		( sizeof(void*) == 8 ? (256L<<20) : (8L<<20) )
+
 	#define FPOS				2			// free position offsets
 	typedef unsigned char		uchar;
 	typedef unsigned short		ushort;
@@ -55,18 +61,20 @@
 
 	class GeomBuf {
 	public:
-		GeomBuf()	{ dtype = 0; num = 0; max = 0; stride = 0; data = 0x0; }		
+		GeomBuf()	{ dtype = 0; num = 0; max = 0; size = 0; stride = 0; data = 0x0; }		
 		uchar		dtype;
 		hval		num;
 		hval		max;
 		long		size;
 		ushort		stride;		
-		char*		data;
+		char*		data;			// = mem.base, MEM_ALIGN aligned
+		MemArena	mem;
 	};
 
 	class GeomX {
 	public:
 		GeomX ();
+		virtual ~GeomX ()		{}		// PointSet adds virtual methods
 	
 	//	virtual objType GetType ()			{ return 'geom'; }
 	
@@ -81,10 +89,18 @@
 		void ResetBuffer ( uchar b, int n );
 		void ResetHeap ();
 		int AddBuffer ( uchar typ, ushort stride, int max );
+		void CommitBuffer ( GeomBuf& buf, long bytes );		// grow storage to bytes, in place while within the reservation
+		void ReleaseBuffer ( GeomBuf& buf );
+		void SwapBufferData ( uchar b, GeomBuf& buf );		// exchange storage with a scratch buffer of the same layout
+		void SetHugePages ( bool b )		{ mHugePages = b; }		// for buffers allocated from now on
+		void SetPrefault ( bool b )			{ mPrefault = b; }		// fault in pages when committed
+		void SetReserve ( long bytes )		{ mReserve = bytes; }
 		int AddAttribute ( uchar b, std::string name, ushort stride );
 		int AddAttribute ( uchar b, std::string name, ushort stride, bool bExtend );
+		int AddAttributeAt ( uchar b, std::string name, ushort stride, ushort offset );	// describe an existing field
 		int GetAttribute ( std::string name );
 		int GetAttrOffset ( std::string name );
+		int GetAttrBuf ( std::string name );
 		int NumElem ( uchar b )				{ if ( b==BUF_UNDEF) return 0; else return mBuf[b].num; }
 		int MaxElem ( uchar b )				{ if ( b==BUF_UNDEF) return 0; else return mBuf[b].max; } 		
 		int GetStride ( uchar b )			{ return mBuf[b].stride; }
@@ -116,6 +132,10 @@
 		std::vector< GeomBuf >		mBuf;	
 		std::vector< GeomAttr >		mAttribute;
 
+		bool						mHugePages;
+		bool						mPrefault;
+		long						mReserve;
+
 		hpos						mHeapNum;
 		hpos						mHeapMax;
 		hpos						mHeapFree;
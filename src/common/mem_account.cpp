@@ -0,0 +1,127 @@
+
+#include <stdio.h>
+
+#include "mem_account.h"
+
+MemAccount& MemAccount::Global ()
+{
+	static MemAccount* acct = new MemAccount;
+	return *acct;
+}
+
+MemAccount::MemAccount ()
+{
+	for (int c = 0; c <= MEM_CATEGORIES; c++ )
+		m_Current[c] = m_Peak[c] = 0;
+	#ifdef _MSC_VER
+		InitializeCriticalSection ( &m_Lock );
+	#else
+		pthread_mutex_init ( &m_Lock, 0x0 );
+	#endif
+}
+
+void MemAccount::Lock ()
+{
+	#ifdef _MSC_VER
+		EnterCriticalSection ( &m_Lock );
+	#else
+		pthread_mutex_lock ( &m_Lock );
+	#endif
+}
+
+void MemAccount::Unlock ()
+{
+	#ifdef _MSC_VER
+		LeaveCriticalSection ( &m_Lock );
+	#else
+		pthread_mutex_unlock ( &m_Lock );
+	#endif
+}
+
+int MemAccount::Register ( int category, std::string name )
+{
+	Lock ();
+	int id = 0;
+	while ( id < (int) m_Entry.size() && m_Entry[id].used ) id++;
+	if ( id == (int) m_Entry.size() ) m_Entry.push_back ( Entry() );
+	Entry& e = m_Entry[id];
+	e.category = category;
+	e.name = name;
+	e.current = e.peak = 0;
+	e.used = true;
+	Unlock ();
+	return id;
+}
+
+void MemAccount::Unregister ( int id )
+{
+	if ( id < 0 ) return;
+	Set ( id, 0 );
+	Lock ();
+	m_Entry[id].used = false;
+	Unlock ();
+}
+
+void MemAccount::Set ( int id, double bytes )
+{
+	if ( id < 0 ) return;
+	Lock ();
+	Entry& e = m_Entry[id];
+	double delta = bytes - e.current;
+	e.current = bytes;
+	if ( bytes > e.peak ) e.peak = bytes;
+	int c = e.category;
+	m_Current[c] += delta;
+	if ( m_Current[c] > m_Peak[c] ) m_Peak[c] = m_Current[c];
+	m_Current[MEM_CATEGORIES] += delta;
+	if ( m_Current[MEM_CATEGORIES] > m_Peak[MEM_CATEGORIES] ) m_Peak[MEM_CATEGORIES] = m_Current[MEM_CATEGORIES];
+	Unlock ();
+}
+
+double MemAccount::GetCurrent ( int category )
+{
+	return m_Current[ category < 0 ? MEM_CATEGORIES : category ];
+}
+
+double MemAccount::GetPeak ( int category )
+{
+	return m_Peak[ category < 0 ? MEM_CATEGORIES : category ];
+}
+
+const char* MemAccount::GetName ( int category )
+{
+	static const char* names[MEM_CATEGORIES+1] = { "particles", "scratch", "neighbor", "grid", "staging", "gpu", "io", "total" };
+	return names[ category < 0 ? MEM_CATEGORIES : category ];
+}
+
+void MemAccount::Report ( int num )
+{
+	const double MB = 1024.0*1024.0;
+	Lock ();
+	printf ( "Memory:    %-12s %10s %10s %12s\n", "", "current", "peak", "bytes/part" );
+	for (int c = 0; c <= MEM_CATEGORIES; c++ ) {
+		if ( c < MEM_CATEGORIES && m_Peak[c] == 0 ) continue;
+		printf ( "Memory:    %-12s %7.2f MB %7.2f MB %12.1f\n", GetName(c), m_Current[c] / MB, m_Peak[c] / MB, num > 0 ? m_Current[c] / num : 0.0 );
+	}
+	// Entries with the same category and name (e.g. ensemble members) are summed
+	std::vector<bool> done ( m_Entry.size(), false );
+	char name[64];
+	for (int id = 0; id < (int) m_Entry.size(); id++ ) {
+		if ( done[id] || !m_Entry[id].used ) continue;
+		double cur = 0, peak = 0;
+		int cnt = 0;
+		for (int j = id; j < (int) m_Entry.size(); j++ ) {
+			Entry& e = m_Entry[j];
+			if ( done[j] || !e.used || e.category != m_Entry[id].category || e.name != m_Entry[id].name ) continue;
+			cur += e.current;
+			peak += e.peak;
+			cnt++;
+			done[j] = true;
+		}
+		if ( peak == 0 ) continue;
+		if ( cnt > 1 )	sprintf ( name, "%s x%d", m_Entry[id].name.c_str(), cnt );
+		else			sprintf ( name, "%s", m_Entry[id].name.c_str() );
+		printf ( "Memory:      %-10s %-12s %7.2f MB %7.2f MB\n", GetName(m_Entry[id].category), name, cur / MB, peak / MB );
+	}
+	Unlock ();
+}
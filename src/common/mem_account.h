@@ -0,0 +1,65 @@
+
+#ifndef INC_MEM_ACCOUNT_H
+	#define INC_MEM_ACCOUNT_H
+
+	#include <string>
+	#include <vector>
+
+	#ifdef _MSC_VER
+		#include <windows.h>
+	#else
+		#include <pthread.h>
+	#endif
+
+	// Categories
+	#define MEM_PARTICLES		0		// particle attribute blocks
+	#define MEM_SCRATCH			1		// compaction and exchange buffers
+	#define MEM_NEIGHBOR		2		// neighbor tables
+	#define MEM_GRID			3		// spatial grid, quantized slots
+	#define MEM_STAGING			4		// host-side render staging
+	#define MEM_GPU				5		// GL buffers and textures (from their formats)
+	#define MEM_IO				6		// checkpoint arenas, domain shared memory
+	#define MEM_CATEGORIES		7
+
+	// Process-wide memory accounting. Each subsystem registers one entry per thing it
+	// owns and calls Set() with its current size whenever that changes. Current and
+	// peak are kept per entry, per category and in total, so a short run shows what
+	// a job needs and how it scales with particle count.
+	class MemAccount {
+	public:
+		static MemAccount& Global ();			// never destroyed, safe from static destructors
+
+		int Register ( int category, std::string name );
+		void Unregister ( int id );				// drops current bytes, keeps the peaks
+		void Set ( int id, double bytes );
+
+		double GetCurrent ( int category );		// category -1 = total
+		double GetPeak ( int category );
+		static const char* GetName ( int category );
+
+		// Per category: current and peak MB, and bytes per particle for num particles
+		void Report ( int num );
+
+	private:
+		MemAccount ();
+		void Lock ();
+		void Unlock ();
+
+		struct Entry {
+			int			category;
+			std::string	name;
+			double		current, peak;
+			bool		used;
+		};
+		std::vector<Entry>	m_Entry;
+		double				m_Current[MEM_CATEGORIES+1];	// last = total
+		double				m_Peak[MEM_CATEGORIES+1];
+
+		#ifdef _MSC_VER
+			CRITICAL_SECTION	m_Lock;
+		#else
+			pthread_mutex_t		m_Lock;
+		#endif
+	};
+
+#endif
@@ -0,0 +1,111 @@
+
+#ifdef _MSC_VER
+	#include <windows.h>
+#else
+	#include <unistd.h>
+	#include <sys/mman.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mem_arena.h"
+
+long MemPageSize ()
+{
+	#ifdef _MSC_VER
+		SYSTEM_INFO si;
+		GetSystemInfo ( &si );
+		return (long) si.dwPageSize;
+	#else
+		return (long) sysconf ( _SC_PAGESIZE );
+	#endif
+}
+
+static long RoundUp ( long bytes, long unit )
+{
+	return ( ( bytes + unit-1 ) / unit ) * unit;
+}
+
+bool MemReserve ( MemArena& a, long bytes, bool bHuge, long commit )
+{
+	MemRelease ( a );
+	long unit = bHuge ? MEM_HUGE_PAGE : MemPageSize ();
+	bytes = RoundUp ( bytes > 0 ? bytes : 1, unit );
+
+	#ifdef _MSC_VER
+		if ( bHuge ) {
+			SIZE_T large = GetLargePageMinimum ();
+			if ( large > 0 ) {
+				// Large pages cannot be committed piecewise, so take only what is committed now
+				// rather than the whole reservation.
+				long lbytes = RoundUp ( commit > 0 && commit < bytes ? commit : bytes, (long) large );
+				a.base = (char*) VirtualAlloc ( 0x0, lbytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE );
+				if ( a.base != 0x0 ) {
+					a.reserved = a.committed = lbytes;
+					a.huge = true;
+					return true;
+				}
+			}
+		}
+		a.base = (char*) VirtualAlloc ( 0x0, bytes, MEM_RESERVE, PAGE_READWRITE );
+		if ( a.base == 0x0 ) return false;
+		a.reserved = bytes;
+	#else
+		// Over-reserve by one huge page so the base can be aligned to it, then trim.
+		long extra = bHuge ? MEM_HUGE_PAGE : 0;
+		char* p = (char*) mmap ( 0x0, bytes + extra, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+		if ( p == (char*) MAP_FAILED ) return false;
+		if ( bHuge ) {
+			char* aligned = (char*) RoundUp ( (long) (size_t) p, MEM_HUGE_PAGE );
+			if ( aligned > p ) munmap ( p, aligned - p );
+			if ( p + extra > aligned ) munmap ( aligned + bytes, (p + extra) - aligned );
+			p = aligned;
+			#ifdef MADV_HUGEPAGE
+				madvise ( p, bytes, MADV_HUGEPAGE );
+			#endif
+		}
+		a.base = p;
+		a.reserved = bytes;
+	#endif
+	a.committed = 0;
+	a.huge = bHuge;
+	return true;
+}
+
+// Commits [committed, bytes) rounded to the page size. With bPrefault every new page
+// is written once here, so the faults are taken now instead of inside a later pass.
+bool MemCommit ( MemArena& a, long bytes, bool bPrefault )
+{
+	if ( bytes <= a.committed ) return true;
+	if ( bytes > a.reserved ) return false;
+	long page = a.huge ? MEM_HUGE_PAGE : MemPageSize ();
+	long end = RoundUp ( bytes, page );
+	if ( end > a.reserved ) end = a.reserved;
+
+	#ifdef _MSC_VER
+		if ( VirtualAlloc ( a.base + a.committed, end - a.committed, MEM_COMMIT, PAGE_READWRITE ) == 0x0 ) return false;
+	#else
+		if ( mprotect ( a.base + a.committed, end - a.committed, PROT_READ | PROT_WRITE ) != 0 ) return false;
+	#endif
+	if ( bPrefault ) {
+		long step = MemPageSize ();
+		for (long n = a.committed; n < end; n += step )
+			a.base[n] = 0;
+	}
+	a.committed = end;
+	return true;
+}
+
+void MemRelease ( MemArena& a )
+{
+	if ( a.base == 0x0 ) return;
+	#ifdef _MSC_VER
+		VirtualFree ( a.base, 0, MEM_RELEASE );
+	#else
+		munmap ( a.base, a.reserved );
+	#endif
+	a.base = 0x0;
+	a.reserved = a.committed = 0;
+	a.huge = false;
+}
@@ -0,0 +1,28 @@
+
+#ifndef INC_MEM_ARENA_H
+	#define INC_MEM_ARENA_H
+
+	#define MEM_ALIGN			64				// cache line; every arena base is at least page aligned
+	#define MEM_HUGE_PAGE		(2L<<20)
+
+	// Reserved virtual address range that is committed from the front as it grows.
+	// Growing within the reservation never moves or copies the data, so pointers into
+	// the block stay valid. With bHuge the range is 2 MB aligned and marked for
+	// transparent huge pages (Linux), or taken as large pages up front (Windows,
+	// needs SeLockMemoryPrivilege; falls back to normal pages). Large pages are committed
+	// whole, so on Windows they cover only the commit size passed to MemReserve and
+	// growing past it needs a new arena.
+	struct MemArena {
+		MemArena()	{ base = 0x0; reserved = 0; committed = 0; huge = false; }
+		char*		base;
+		long		reserved;
+		long		committed;
+		bool		huge;
+	};
+
+	bool MemReserve ( MemArena& a, long bytes, bool bHuge, long commit );		// commit: bytes the caller commits right away
+	bool MemCommit ( MemArena& a, long bytes, bool bPrefault );		// commit at least bytes from base
+	void MemRelease ( MemArena& a );
+	long MemPageSize ();
+
+#endif
@@ -0,0 +1,114 @@
+
+#ifdef __linux__
+	#include <unistd.h>
+	#include <errno.h>
+	#include <sys/syscall.h>
+	#include <linux/perf_event.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mperf.h"
+
+static const char* g_PerfName[PERF_EVENTS] = { "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses" };
+
+PerfCounters::PerfCounters ()
+{
+	for (int s = 0; s < PERF_THREADS; s++ )
+		for (int e = 0; e < PERF_EVENTS; e++ )
+			m_Fd[s][e] = -1;
+}
+
+const char* PerfCounters::GetName ( int ev )
+{
+	return g_PerfName[ev];
+}
+
+#ifdef __linux__
+
+static int OpenEvent ( unsigned int type, unsigned long long config, int group )
+{
+	perf_event_attr attr;
+	memset ( &attr, 0, sizeof(attr) );
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return (int) syscall ( SYS_perf_event_open, &attr, 0, -1, group, 0 );		// this thread, any cpu
+}
+
+bool PerfCounters::Open ( int slot )
+{
+	const unsigned int type[PERF_EVENTS] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE };
+	const unsigned long long config[PERF_EVENTS] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_L1D | ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) | ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 ),
+		PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+
+	if ( slot < 0 || slot >= PERF_THREADS ) return false;
+	if ( IsOpen ( slot ) ) return true;
+	int lead = OpenEvent ( type[PERF_CYCLES], config[PERF_CYCLES], -1 );
+	if ( lead == -1 ) {
+		int err = errno;
+		if ( slot == 0 ) {							// other slots open concurrently, on pool threads
+			m_Error = strerror ( err );
+			if ( err == ENOENT || err == EOPNOTSUPP ) m_Error += ", no PMU";
+			if ( err == EACCES || err == EPERM ) m_Error += ", see /proc/sys/kernel/perf_event_paranoid";
+		}
+		return false;
+	}
+	m_Fd[slot][PERF_CYCLES] = lead;
+	for (int e = 0; e < PERF_EVENTS; e++ )
+		if ( e != PERF_CYCLES ) m_Fd[slot][e] = OpenEvent ( type[e], config[e], lead );		// -1 if the cpu lacks it
+	return true;
+}
+
+void PerfCounters::Close ()
+{
+	for (int s = 0; s < PERF_THREADS; s++ ) {
+		for (int e = PERF_EVENTS-1; e >= 0; e-- ) {			// the group leader last
+			if ( m_Fd[s][e] != -1 ) close ( m_Fd[s][e] );
+			m_Fd[s][e] = -1;
+		}
+	}
+}
+
+bool PerfCounters::Read ( int slot, PerfCount& c )
+{
+	for (int e = 0; e < PERF_EVENTS; e++ ) c.v[e] = -1;
+	if ( slot < 0 || slot >= PERF_THREADS || !IsOpen ( slot ) ) return false;
+
+	unsigned long long buf[3 + PERF_EVENTS];				// nr, time enabled, time running, values in group order
+	if ( read ( m_Fd[slot][PERF_CYCLES], buf, sizeof(buf) ) < (ssize_t) ( 3 * sizeof(buf[0]) ) ) return false;
+	double scale = ( buf[2] > 0 ) ? (double) buf[1] / buf[2] : 0;		// multiplexed: running part of the enabled time
+	int i = 3;
+	for (int e = 0; e < PERF_EVENTS; e++ ) {
+		if ( m_Fd[slot][e] == -1 ) continue;
+		if ( i - 3 >= (int) buf[0] ) break;
+		c.v[e] = (long long) ( buf[i++] * scale );
+	}
+	return true;
+}
+
+#else
+
+bool PerfCounters::Open ( int )
+{
+	m_Error = "perf_event_open is Linux only";
+	return false;
+}
+
+void PerfCounters::Close ()
+{
+}
+
+bool PerfCounters::Read ( int, PerfCount& c )
+{
+	for (int e = 0; e < PERF_EVENTS; e++ ) c.v[e] = -1;
+	return false;
+}
+
+#endif
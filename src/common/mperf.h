@@ -0,0 +1,45 @@
+
+#ifndef INC_MPERF_H
+	#define INC_MPERF_H
+
+	#include <string>
+
+	#define PERF_CYCLES			0
+	#define PERF_INSTR			1
+	#define PERF_L1D_MISS		2		// L1 data cache read misses
+	#define PERF_LLC_MISS		3		// last level cache misses
+	#define PERF_BRANCH_MISS	4
+	#define PERF_EVENTS			5
+	#define PERF_THREADS		64
+
+	// Event counts of one thread since its counters were opened
+	struct PerfCount {
+		long long		v[PERF_EVENTS];		// -1 = event not counted
+	};
+
+	// Hardware performance counters per thread, through Linux perf_event_open. A thread
+	// opens its own group of events with Open(slot); any thread may Read() the slot after
+	// that. Counters run only while their thread does, and in user mode only, which
+	// perf_event_paranoid up to 2 allows. Counts are scaled up when the kernel multiplexes
+	// the group. Events the cpu lacks are left out (-1); without cycles nothing is counted
+	// and Open() fails; GetError() tells why for slot 0. It always fails off Linux and where
+	// no PMU is exposed, as in most virtual machines.
+	class PerfCounters {
+	public:
+		PerfCounters ();
+		~PerfCounters ()					{ Close (); }
+
+		bool Open ( int slot );				// for the calling thread
+		void Close ();						// all slots
+		bool IsOpen ( int slot )			{ return m_Fd[slot][PERF_CYCLES] != -1; }
+		bool HasEvent ( int slot, int ev )	{ return m_Fd[slot][ev] != -1; }
+		bool Read ( int slot, PerfCount& c );		// false (all -1) if not open
+		const char* GetError ()				{ return m_Error.c_str(); }
+		static const char* GetName ( int ev );
+
+	private:
+		int				m_Fd[PERF_THREADS][PERF_EVENTS];		// -1 = not open; PERF_CYCLES leads the group
+		std::string		m_Error;							// why slot 0 failed to open
+	};
+
+#endif
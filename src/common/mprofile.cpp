@@ -0,0 +1,343 @@
+
+#include <stdio.h>
+#include <algorithm>
+
+#include "mprofile.h"
+#include "mthread.h"
+
+PROFILE_TLS int g_ProfileThread = 0;
+PROFILE_TLS int g_ProfileArgNum = -1;
+PROFILE_TLS float g_ProfileArgDT = 0;
+
+Profiler& Profiler::Global ()
+{
+	static Profiler* prof = new Profiler;
+	return *prof;
+}
+
+Profiler::Profiler ()
+{
+	m_Next = 0;
+	m_bEnabled = true;
+	m_NumScopes = 0;
+	Sample empty;
+	empty.start = empty.stop = 0;
+	empty.id = -1;
+	empty.thread = 0;
+	empty.num = -1;
+	empty.dt = 0;
+	m_Ring.assign ( PROFILE_RING, empty );
+	m_Threads = 0;
+	m_bTracing = false;
+	m_TraceStart = 0;
+	m_TraceFirst = 0;
+	m_PoolId = -1;
+	m_bCounters = false;
+	m_CounterThreads = 0;
+	m_Depth = 0;
+	for (int id = 0; id < PROFILE_SCOPES; id++ )
+		m_CountSamples[id] = 0;
+	#ifdef _MSC_VER
+		InitializeCriticalSection ( &m_Lock );
+	#else
+		pthread_mutex_init ( &m_Lock, 0x0 );
+	#endif
+}
+
+void Profiler::Lock ()
+{
+	#ifdef _MSC_VER
+		EnterCriticalSection ( &m_Lock );
+	#else
+		pthread_mutex_lock ( &m_Lock );
+	#endif
+}
+
+void Profiler::Unlock ()
+{
+	#ifdef _MSC_VER
+		LeaveCriticalSection ( &m_Lock );
+	#else
+		pthread_mutex_unlock ( &m_Lock );
+	#endif
+}
+
+int Profiler::Register ( std::string name, std::string cat )
+{
+	Lock ();
+	int id = 0;
+	while ( id < m_NumScopes && m_Name[id] != name ) id++;
+	if ( id == m_NumScopes ) {
+		if ( m_NumScopes < PROFILE_SCOPES ) {
+			m_Name[id] = name;
+			m_Cat[id] = cat;
+			m_NumScopes++;
+		} else {
+			printf ( "ERROR: Profiler: more than %d scopes, %s not timed.\n", PROFILE_SCOPES, name.c_str() );
+			id = -1;
+		}
+	}
+	Unlock ();
+	return id;
+}
+
+void Profiler::Clear ()
+{
+	for (int n = 0; n < PROFILE_RING; n++ )
+		m_Ring[n].id = -1;
+	m_Next = 0;
+	m_TraceFirst = 0;
+	for (int n = 0; n < (int) m_Counts.size(); n++ )
+		for (int e = 0; e < PERF_EVENTS; e++ )
+			m_Counts[n].v[e] = -1;
+	for (int id = 0; id < PROFILE_SCOPES; id++ )
+		m_CountSamples[id] = 0;
+}
+
+bool Profiler::GetStats ( int id, ProfileStats& st )
+{
+	std::vector<double> ms;
+	for (int n = 0; n < PROFILE_RING; n++ )
+		if ( m_Ring[n].id == id ) ms.push_back ( ( m_Ring[n].stop - m_Ring[n].start ) * 1.0e-6 );
+	st.count = (long) ms.size();
+	if ( ms.empty() ) {
+		st.min = st.mean = st.p50 = st.p99 = st.max = 0;
+		return false;
+	}
+	std::sort ( ms.begin(), ms.end() );
+	double sum = 0;
+	for (int n = 0; n < (int) ms.size(); n++ ) sum += ms[n];
+	int n = (int) ms.size();
+	st.min = ms[0];
+	st.max = ms[n-1];
+	st.mean = sum / n;
+	st.p50 = ms[ ( n - 1 ) / 2 ];					// nearest rank
+	st.p99 = ms[ ( n * 99 + 99 ) / 100 - 1 ];
+	return true;
+}
+
+void Profiler::Report ()
+{
+	#ifdef NOPROFILE
+		printf ( "Profile: compiled out (NOPROFILE)\n" );
+	#endif
+	ProfileStats st;
+	unsigned long recorded = (unsigned long) m_Next;
+	printf ( "Profile: last %lu of %lu samples\n", recorded < PROFILE_RING ? recorded : (unsigned long) PROFILE_RING, recorded );
+	printf ( "Profile:   %-12s %7s %9s %9s %9s %9s %9s  (ms)\n", "", "samples", "min", "mean", "p50", "p99", "max" );
+	for (int id = 0; id < m_NumScopes; id++ ) {
+		if ( !GetStats ( id, st ) ) continue;
+		printf ( "Profile:   %-12s %7ld %9.3f %9.3f %9.3f %9.3f %9.3f\n", m_Name[id].c_str(), st.count, st.min, st.mean, st.p50, st.p99, st.max );
+	}
+	int ids[PROFILE_SCOPES];
+	for (int id = 0; id < m_NumScopes; id++ ) ids[id] = id;
+	ReportCounters ( "Profile:", ids, m_NumScopes );
+}
+
+//------------------------------------------------------ Hardware counters
+
+bool Profiler::IsCounterThread ()
+{
+	#ifdef _MSC_VER
+		return GetCurrentThreadId () == m_CounterThread;
+	#else
+		return pthread_equal ( pthread_self (), m_CounterThread ) != 0;
+	#endif
+}
+
+void Profiler::OpenJob ( void* ctx, int thread, int )
+{
+	if ( thread > 0 ) ((Profiler*) ctx)->m_Perf.Open ( thread );		// 0, the caller, is open already
+}
+
+bool Profiler::StartCounters ( ThreadPool* pool )
+{
+	StopCounters ();
+	if ( !m_Perf.Open ( 0 ) ) {
+		printf ( "Profile: no hardware counters (%s), timing only.\n", m_Perf.GetError() );
+		return false;
+	}
+	int nt = ( pool != 0x0 ) ? pool->GetNumThreads() : 1;
+	if ( nt > PERF_THREADS ) nt = PERF_THREADS;				// the rest are not counted
+	if ( nt > 1 ) pool->Run ( OpenJob, this );
+
+	PerfCount none;
+	for (int e = 0; e < PERF_EVENTS; e++ ) none.v[e] = -1;
+	m_Snap.assign ( PROFILE_DEPTH * nt, none );
+	m_Counts.assign ( PROFILE_SCOPES * nt, none );
+	for (int id = 0; id < PROFILE_SCOPES; id++ )
+		m_CountSamples[id] = 0;
+	m_CounterThreads = nt;
+	m_Depth = 0;
+	#ifdef _MSC_VER
+		m_CounterThread = GetCurrentThreadId ();
+	#else
+		m_CounterThread = pthread_self ();
+	#endif
+	m_bCounters = true;
+
+	int open = 0;
+	for (int t = 0; t < nt; t++ )
+		if ( m_Perf.IsOpen ( t ) ) open++;
+	printf ( "Profile: hardware counters on %d of %d threads:", open, nt );
+	for (int e = 0; e < PERF_EVENTS; e++ )
+		printf ( " %s%s", PerfCounters::GetName ( e ), m_Perf.HasEvent ( 0, e ) ? "" : " (n/a)" );
+	printf ( "\n" );
+	return true;
+}
+
+void Profiler::StopCounters ()
+{
+	m_bCounters = false;
+	m_Perf.Close ();
+}
+
+int Profiler::Snapshot ()
+{
+	if ( m_Depth >= PROFILE_DEPTH || !IsCounterThread () ) return -1;
+	int nt = m_CounterThreads;
+	for (int t = 0; t < nt; t++ )
+		m_Perf.Read ( t, m_Snap[ m_Depth*nt + t ] );
+	return m_Depth++;
+}
+
+void Profiler::Accumulate ( int id, int snap )
+{
+	m_Depth = snap;
+	if ( !m_bEnabled || id < 0 ) return;
+	int nt = m_CounterThreads;
+	PerfCount now;
+	for (int t = 0; t < nt; t++ ) {
+		m_Perf.Read ( t, now );
+		PerfCount& from = m_Snap[ snap*nt + t ];
+		PerfCount& sum = m_Counts[ id*nt + t ];
+		for (int e = 0; e < PERF_EVENTS; e++ ) {
+			if ( now.v[e] < 0 || from.v[e] < 0 ) continue;
+			if ( sum.v[e] < 0 ) sum.v[e] = 0;
+			sum.v[e] += now.v[e] - from.v[e];
+		}
+	}
+	m_CountSamples[id]++;
+}
+
+bool Profiler::GetCounts ( int id, int thread, PerfCount& c, long& samples )
+{
+	for (int e = 0; e < PERF_EVENTS; e++ ) c.v[e] = -1;
+	samples = 0;
+	int nt = m_CounterThreads;
+	if ( m_Counts.empty() || id < 0 || id >= PROFILE_SCOPES || thread >= nt ) return false;
+	samples = m_CountSamples[id];
+	for (int t = ( thread < 0 ) ? 0 : thread; t < ( ( thread < 0 ) ? nt : thread+1 ); t++ ) {
+		PerfCount& sum = m_Counts[ id*nt + t ];
+		for (int e = 0; e < PERF_EVENTS; e++ ) {
+			if ( sum.v[e] < 0 ) continue;
+			if ( c.v[e] < 0 ) c.v[e] = 0;
+			c.v[e] += sum.v[e];
+		}
+	}
+	return samples > 0;
+}
+
+static void PrintCounts ( const char* tag, const char* name, long samples, PerfCount& c )
+{
+	double instr = (double) c.v[PERF_INSTR];
+	printf ( "%s   %-12s %7ld", tag, name, samples );
+	for (int e = PERF_CYCLES; e <= PERF_INSTR; e++ ) {
+		if ( c.v[e] < 0 ) printf ( " %10s", "n/a" ); else printf ( " %10.3f", c.v[e] * 1.0e-6 / samples );
+	}
+	if ( c.v[PERF_CYCLES] > 0 && instr >= 0 ) printf ( " %6.2f", instr / c.v[PERF_CYCLES] ); else printf ( " %6s", "n/a" );
+	for (int e = PERF_L1D_MISS; e <= PERF_BRANCH_MISS; e++ ) {
+		if ( c.v[e] < 0 || instr <= 0 ) printf ( " %8s", "n/a" ); else printf ( " %8.2f", c.v[e] * 1000.0 / instr );
+	}
+	printf ( "\n" );
+}
+
+void Profiler::ReportCounters ( const char* tag, const int* ids, int num )
+{
+	PerfCount c;
+	long samples;
+	char name[64];
+	if ( m_Counts.empty() ) return;							// never started
+	printf ( "%s   %-12s %7s %10s %10s %6s %8s %8s %8s  (M per sample, misses per 1000 instr)\n", tag, "", "samples", "cycles", "instr", "IPC", "L1D", "LLC", "branch" );
+	for (int i = 0; i < num; i++ ) {
+		if ( !GetCounts ( ids[i], -1, c, samples ) ) continue;
+		PrintCounts ( tag, m_Name[ ids[i] ].c_str(), samples, c );
+		if ( m_CounterThreads < 2 ) continue;
+		for (int t = 0; t < m_CounterThreads; t++ ) {
+			GetCounts ( ids[i], t, c, samples );
+			sprintf ( name, "  thread %d", t );
+			PrintCounts ( tag, name, samples, c );
+		}
+	}
+}
+
+//------------------------------------------------------ Trace export
+
+int Profiler::NewThread ()
+{
+	g_ProfileThread = FetchAdd ( &m_Threads, 1 ) + 1;
+	return g_ProfileThread - 1;
+}
+
+void Profiler::SetThreadName ( const char* name )
+{
+	int t = ( g_ProfileThread > 0 ) ? g_ProfileThread-1 : NewThread ();
+	if ( t >= PROFILE_THREADS ) return;
+	Lock ();
+	m_ThreadName[t] = name;
+	Unlock ();
+}
+
+void Profiler::StartTrace ()
+{
+	if ( m_PoolId == -1 ) m_PoolId = Register ( "POOL", "pool" );
+	m_TraceStart = Now ();
+	m_TraceFirst = m_Next;
+	m_bTracing = true;
+	printf ( "Trace: started, keeps the last %d spans\n", PROFILE_RING );
+}
+
+bool Profiler::StopTrace ( const char* file )
+{
+	if ( !m_bTracing ) return false;
+	m_bTracing = false;
+	long long stop = Now ();
+	bool dropped = ( (unsigned long) ( m_Next - m_TraceFirst ) > PROFILE_RING );
+
+	std::vector<Sample> spans;
+	for (int n = 0; n < PROFILE_RING; n++ )
+		if ( m_Ring[n].id >= 0 && m_Ring[n].start >= m_TraceStart ) spans.push_back ( m_Ring[n] );
+	std::sort ( spans.begin(), spans.end(), BeforeSample );
+
+	FILE* fp = fopen ( file, "wt" );
+	if ( fp == 0x0 ) {
+		printf ( "ERROR: Trace: cannot write %s\n", file );
+		return false;
+	}
+	fprintf ( fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+	fprintf ( fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"fluids\"}}" );
+	int threads = (int) m_Threads;
+	std::vector<bool> seen ( threads, false );
+	for (int n = 0; n < (int) spans.size(); n++ )
+		if ( spans[n].thread < threads ) seen[ spans[n].thread ] = true;
+	for (int t = 0; t < threads; t++ ) {
+		if ( !seen[t] ) continue;
+		if ( t < PROFILE_THREADS && !m_ThreadName[t].empty() )
+			fprintf ( fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", t, m_ThreadName[t].c_str() );
+		else
+			fprintf ( fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", t, t );
+		fprintf ( fp, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"sort_index\":%d}}", t, t );
+	}
+	for (int n = 0; n < (int) spans.size(); n++ ) {
+		Sample& s = spans[n];
+		fprintf ( fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+			m_Name[s.id].c_str(), m_Cat[s.id].c_str(), s.thread, ( s.start - m_TraceStart ) * 1.0e-3, ( s.stop - s.start ) * 1.0e-3 );
+		if ( s.num >= 0 ) fprintf ( fp, ",\"args\":{\"particles\":%d,\"dt\":%g}", s.num, s.dt );
+		fprintf ( fp, "}" );
+	}
+	fprintf ( fp, "\n]}\n" );
+	fclose ( fp );
+	printf ( "Trace: %d spans in %.3f s -> %s%s\n", (int) spans.size(), ( stop - m_TraceStart ) * 1.0e-9, file,
+		dropped ? " (ring full, the oldest were dropped)" : "" );
+	return true;
+}
@@ -0,0 +1,219 @@
+
+#ifndef INC_MPROFILE_H
+	#define INC_MPROFILE_H
+
+	#include <string>
+	#include <vector>
+
+	#ifdef _MSC_VER
+		#include <windows.h>
+	#else
+		#include <pthread.h>
+		#include <time.h>
+	#endif
+
+	#include "mperf.h"
+
+	class ThreadPool;
+
+	#define PROFILE_RING		65536		// samples kept, a power of two
+	#define PROFILE_SCOPES		64
+	#define PROFILE_DEPTH		16			// nested scopes with counter snapshots
+	#define PROFILE_THREADS		64			// named trace tracks
+
+	#ifdef _MSC_VER
+		#define PROFILE_TLS		__declspec(thread)
+	#else
+		#define PROFILE_TLS		__thread
+	#endif
+	extern PROFILE_TLS int g_ProfileThread;		// 1 + trace track of the calling thread, 0 = none yet
+	extern PROFILE_TLS int g_ProfileArgNum;		// PROFILE_ARGS of the calling thread, -1 = none
+	extern PROFILE_TLS float g_ProfileArgDT;
+
+	// Timing of one scope over the samples still in the ring, in milliseconds
+	struct ProfileStats {
+		long			count;				// samples in the ring
+		double			min, mean, p50, p99, max;
+	};
+
+	// Start of a sample
+	struct ProfileMark {
+		long long		start;
+		int				snap;				// counter snapshot, -1 = none
+	};
+
+	// Process-wide profiler with named scopes. A scope is registered once by name and
+	// timed with the PROFILE_ macros below; each sample holds its start and stop on the
+	// monotonic clock, in nanoseconds. Samples go into one ring shared by all threads:
+	// a writer claims its slot with a single atomic add, so recording never takes a lock
+	// or allocates. The ring keeps the last PROFILE_RING samples, and GetStats() and
+	// Report() sort the ones of each scope for the percentiles. They read the ring while
+	// writers may still be adding to it, so call them between steps.
+	//
+	// Each sample also keeps the thread that took it and the arguments of PROFILE_ARGS on that
+	// thread at the time, so systems stepping side by side (an ensemble) each tag their own
+	// spans; ThreadPool hands the caller's arguments to its threads for a job. StartTrace and StopTrace export the samples between them as Chrome trace-event
+	// JSON (chrome://tracing, ui.perfetto.dev), one track per thread. A trace is bounded by
+	// the ring: past PROFILE_RING samples the oldest are dropped. While tracing, ThreadPool
+	// also records every thread's share of each job as a POOL span.
+	//
+	// Build with NOPROFILE to compile out the PROFILE_ macros and ThreadPool's POOL spans,
+	// so nothing is left per sample, step or job. The class itself stays: registering,
+	// reports and traces still work and simply find no samples. With the macros in, a
+	// disabled profiler costs two clock reads and a branch per sample.
+	//
+	// Hardware counters (mperf.h) are off until StartCounters(). It opens them on the
+	// calling thread and, given a pool, on every pool thread, as counter thread t = pool
+	// thread t (the caller is 0 in both). Scopes begun and ended on the calling thread then
+	// also sum, per scope and per counter thread, the counts between their begin and end,
+	// reading every thread's counters twice. Scopes on other threads are only timed.
+	class Profiler {
+	public:
+		static Profiler& Global ();			// never destroyed, safe from static destructors
+
+		int Register ( std::string name, std::string cat = "" );	// the same name gets the same id
+		int GetNumScopes ()					{ return m_NumScopes; }
+		const char* GetName ( int id )		{ return m_Name[id].c_str(); }
+
+		void SetEnabled ( bool b )			{ m_bEnabled = b; }
+		bool IsEnabled ()					{ return m_bEnabled; }
+		void Clear ();						// drops all samples, keeps the scopes; between steps
+
+		static long long Now ()				// ns, monotonic
+		{
+			#ifdef _MSC_VER
+				static double nsPerTick = 0;
+				LARGE_INTEGER t;
+				if ( nsPerTick == 0 ) { QueryPerformanceFrequency ( &t ); nsPerTick = 1.0e9 / (double) t.QuadPart; }
+				QueryPerformanceCounter ( &t );
+				return (long long) ( t.QuadPart * nsPerTick );
+			#else
+				timespec t;
+				clock_gettime ( CLOCK_MONOTONIC, &t );
+				return (long long) t.tv_sec * 1000000000LL + t.tv_nsec;
+			#endif
+		}
+		void Add ( int id, long long start, long long stop )
+		{
+			if ( !m_bEnabled || id < 0 ) return;
+			Sample& s = m_Ring[ (unsigned long) FetchAdd ( &m_Next, 1 ) & (PROFILE_RING-1) ];
+			s.start = start;
+			s.stop = stop;
+			s.thread = ( g_ProfileThread > 0 ) ? g_ProfileThread-1 : NewThread ();
+			s.num = g_ProfileArgNum;
+			s.dt = g_ProfileArgDT;
+			s.id = id;
+		}
+		void SetArgs ( int num, float dt )	{ g_ProfileArgNum = num; g_ProfileArgDT = dt; }	// particles and step of the samples that follow on this thread
+		void GetArgs ( int& num, float& dt )	{ num = g_ProfileArgNum; dt = g_ProfileArgDT; }
+
+		bool GetStats ( int id, ProfileStats& st );		// false if the ring holds no samples of id
+		void Report ();
+
+		bool StartCounters ( ThreadPool* pool );		// false if this thread has no counters
+		void StopCounters ();							// the counts stay until the next start
+		bool HasCounters ()					{ return m_bCounters; }
+		int GetCounterThreads ()			{ return m_CounterThreads; }
+		bool GetCounts ( int id, int thread, PerfCount& c, long& samples );	// since Clear; thread -1 = sum of all
+		void ReportCounters ( const char* tag, const int* ids, int num );	// nothing if never started
+
+		void StartTrace ();
+		bool StopTrace ( const char* file );			// writes the spans since StartTrace
+		bool IsTracing ()					{ return m_bTracing; }
+		int GetPoolId ()					{ return m_PoolId; }
+		void SetThreadName ( const char* name );		// track name of the calling thread
+
+		ProfileMark Begin ()
+		{
+			ProfileMark m;
+			m.snap = m_bCounters ? Snapshot () : -1;
+			m.start = Now ();
+			return m;
+		}
+		void End ( int id, const ProfileMark& m )
+		{
+			Add ( id, m.start, Now () );
+			if ( m.snap >= 0 ) Accumulate ( id, m.snap );
+		}
+
+	private:
+		Profiler ();
+		int Snapshot ();					// pushes the counts of all threads, -1 if not counted here
+		void Accumulate ( int id, int snap );		// adds the counts since snap to id, pops it
+		bool IsCounterThread ();
+		static void OpenJob ( void* ctx, int thread, int num_threads );
+		int NewThread ();
+		void Lock ();
+		void Unlock ();
+		static long FetchAdd ( volatile long* v, long add )
+		{
+			#ifdef _MSC_VER
+				return InterlockedExchangeAdd ( v, add );
+			#else
+				return __sync_fetch_and_add ( v, add );
+			#endif
+		}
+
+		struct Sample {
+			long long		start, stop;
+			int				id;				// -1 = empty
+			int				thread;			// trace track
+			int				num;			// SetArgs, -1 = none
+			float			dt;
+		};
+		static bool BeforeSample ( const Sample& a, const Sample& b )	{ return a.start < b.start; }
+		std::vector<Sample>	m_Ring;
+		volatile long		m_Next;			// slots claimed so far, wraps
+		bool				m_bEnabled;
+
+		std::string			m_Name[PROFILE_SCOPES];
+		std::string			m_Cat[PROFILE_SCOPES];	// trace category
+		int					m_NumScopes;
+
+		volatile long		m_Threads;				// trace tracks handed out
+		std::string			m_ThreadName[PROFILE_THREADS];
+		bool				m_bTracing;
+		long long			m_TraceStart;
+		long				m_TraceFirst;			// m_Next at the start
+		int					m_PoolId;
+
+		PerfCounters		m_Perf;
+		bool				m_bCounters;
+		int					m_CounterThreads;
+		int					m_Depth;			// snapshots in use
+		std::vector<PerfCount>	m_Snap;			// PROFILE_DEPTH x counter threads
+		std::vector<PerfCount>	m_Counts;		// PROFILE_SCOPES x counter threads, -1 = not counted
+		long				m_CountSamples[PROFILE_SCOPES];
+
+		#ifdef _MSC_VER
+			CRITICAL_SECTION	m_Lock;
+			DWORD				m_CounterThread;
+		#else
+			pthread_mutex_t		m_Lock;
+			pthread_t			m_CounterThread;
+		#endif
+	};
+
+	// Times the rest of the enclosing block
+	class ProfileScope {
+	public:
+		ProfileScope ( int id ) : m_Id ( id ), m_Mark ( Profiler::Global().Begin () ) {}
+		~ProfileScope ()					{ Profiler::Global().End ( m_Id, m_Mark ); }
+	private:
+		int				m_Id;
+		ProfileMark		m_Mark;
+	};
+
+	#ifdef NOPROFILE
+		#define PROFILE_BEGIN(t)
+		#define PROFILE_END(t,id)
+		#define PROFILE_SCOPE(id)
+		#define PROFILE_ARGS(num,dt)
+	#else
+		#define PROFILE_BEGIN(t)			ProfileMark t = Profiler::Global().Begin ()
+		#define PROFILE_END(t,id)			Profiler::Global().End ( id, t )
+		#define PROFILE_SCOPE(id)			ProfileScope profileScope ( id )
+		#define PROFILE_ARGS(num,dt)		Profiler::Global().SetArgs ( num, dt )
+	#endif
+
+#endif
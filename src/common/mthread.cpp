@@ -0,0 +1,370 @@
+
+#ifdef _MSC_VER
+	#include <windows.h>
+#else
+	#include <unistd.h>
+	#include <sched.h>
+	#include <sys/syscall.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "mthread.h"
+#include "mprofile.h"
+
+#ifndef MPOL_MF_MOVE
+	#define MPOL_MF_MOVE	(1<<1)
+#endif
+
+struct ThreadArg {
+	ThreadPool*		pool;
+	int				t;
+};
+
+ThreadPool::ThreadPool ()
+{
+	m_NumThreads = 1;
+	m_NumNodes = 1;
+	m_bPin = false;
+	m_Job = 0x0;
+	m_Ctx = 0x0;
+	m_Generation = 0;
+	m_Pending = 0;
+	m_bQuit = false;
+	m_ArgNum = -1;
+	m_ArgDT = 0;
+	m_ThreadCpu.push_back ( -1 );
+	m_ThreadNode.push_back ( 0 );
+	#ifdef _MSC_VER
+		InitializeCriticalSection ( &m_Lock );
+		InitializeConditionVariable ( &m_WakeCond );
+		InitializeConditionVariable ( &m_DoneCond );
+	#else
+		pthread_mutex_init ( &m_Lock, 0x0 );
+		pthread_cond_init ( &m_WakeCond, 0x0 );
+		pthread_cond_init ( &m_DoneCond, 0x0 );
+	#endif
+}
+
+ThreadPool::~ThreadPool ()
+{
+	Stop ();
+	#ifdef _MSC_VER
+		DeleteCriticalSection ( &m_Lock );
+	#else
+		pthread_mutex_destroy ( &m_Lock );
+		pthread_cond_destroy ( &m_WakeCond );
+		pthread_cond_destroy ( &m_DoneCond );
+	#endif
+}
+
+int ThreadPool::GetPageSize ()
+{
+	#ifdef _MSC_VER
+		SYSTEM_INFO si;
+		GetSystemInfo ( &si );
+		return (int) si.dwPageSize;
+	#else
+		return (int) sysconf ( _SC_PAGESIZE );
+	#endif
+}
+
+// Builds the list of usable cpus ordered by NUMA node.
+void ThreadPool::DetectTopology ()
+{
+	m_Cpus.clear ();
+	m_CpuNode.clear ();
+	m_NumNodes = 0;
+
+	#ifdef _MSC_VER
+		ULONG hi = 0;
+		DWORD_PTR proc_mask, sys_mask;
+		GetProcessAffinityMask ( GetCurrentProcess(), &proc_mask, &sys_mask );
+		if ( !GetNumaHighestNodeNumber ( &hi ) ) hi = 0;
+		for ( ULONG node = 0; node <= hi; node++ ) {
+			ULONGLONG mask = 0;
+			if ( !GetNumaNodeProcessorMask ( (UCHAR) node, &mask ) ) continue;
+			mask &= proc_mask;
+			if ( mask == 0 ) continue;
+			for (int c = 0; c < (int) sizeof(DWORD_PTR)*8; c++ ) {
+				if ( mask & ((ULONGLONG) 1 << c) ) { m_Cpus.push_back ( c ); m_CpuNode.push_back ( m_NumNodes ); }
+			}
+			m_NumNodes++;
+		}
+	#else
+		cpu_set_t avail;
+		CPU_ZERO ( &avail );
+		sched_getaffinity ( 0, sizeof(avail), &avail );
+		std::vector<bool> seen ( CPU_SETSIZE, false );
+		char path[256], line[4096];
+		for (int node = 0; node < 256; node++ ) {
+			sprintf ( path, "/sys/devices/system/node/node%d/cpulist", node );
+			FILE* fp = fopen ( path, "rt" );
+			if ( fp == 0x0 ) { if ( node > 0 ) break; else continue; }
+			if ( fgets ( line, 4096, fp ) == 0x0 ) line[0] = '\0';
+			fclose ( fp );
+			bool used = false;
+			for ( char* tok = strtok ( line, ",\n" ); tok != 0x0; tok = strtok ( 0x0, ",\n" ) ) {
+				int a, b;
+				if ( sscanf ( tok, "%d-%d", &a, &b ) != 2 ) { if ( sscanf ( tok, "%d", &a ) != 1 ) continue; b = a; }
+				for (int c = a; c <= b && c < CPU_SETSIZE; c++ ) {
+					if ( !CPU_ISSET ( c, &avail ) || seen[c] ) continue;
+					seen[c] = true; used = true;
+					m_Cpus.push_back ( c );
+					m_CpuNode.push_back ( node );
+				}
+			}
+			if ( used ) m_NumNodes = node+1;
+		}
+		// No sysfs node info (container, non-NUMA kernel): treat as one node
+		for (int c = 0; c < CPU_SETSIZE; c++ ) {
+			if ( CPU_ISSET ( c, &avail ) && !seen[c] ) { m_Cpus.push_back ( c ); m_CpuNode.push_back ( 0 ); }
+		}
+	#endif
+	if ( m_NumNodes == 0 ) m_NumNodes = 1;
+	if ( m_Cpus.size() == 0 ) { m_Cpus.push_back ( -1 ); m_CpuNode.push_back ( 0 ); }
+}
+
+void ThreadPool::Pin ( int t )
+{
+	int cpu = m_ThreadCpu[t];
+	if ( !m_bPin || cpu < 0 ) return;
+	#ifdef _MSC_VER
+		SetThreadAffinityMask ( GetCurrentThread(), (DWORD_PTR) 1 << cpu );
+	#else
+		cpu_set_t set;
+		CPU_ZERO ( &set );
+		CPU_SET ( cpu, &set );
+		sched_setaffinity ( 0, sizeof(set), &set );
+	#endif
+}
+
+void ThreadPool::Start ( int num, bool bPin )
+{
+	Stop ();
+	DetectTopology ();
+
+	int ncpu = (int) m_Cpus.size();
+	m_NumThreads = ( num <= 0 ) ? ncpu : num;
+	m_bPin = bPin;
+	m_bQuit = false;
+	m_Generation = 0;
+
+	// Spread threads evenly over the node-sorted cpu list, keeping order.
+	m_ThreadCpu.resize ( m_NumThreads );
+	m_ThreadNode.resize ( m_NumThreads );
+	for (int t = 0; t < m_NumThreads; t++ ) {
+		int c = int( (long long) t * ncpu / m_NumThreads );
+		m_ThreadCpu[t] = m_Cpus[c];
+		m_ThreadNode[t] = m_CpuNode[c];
+	}
+	Pin ( 0 );
+
+	for (int t = 1; t < m_NumThreads; t++ ) {
+		ThreadArg* arg = new ThreadArg;
+		arg->pool = this;
+		arg->t = t;
+		#ifdef _MSC_VER
+			m_Threads.push_back ( CreateThread ( 0x0, 0, Entry, arg, 0, 0x0 ) );
+		#else
+			pthread_t th;
+			pthread_create ( &th, 0x0, Entry, arg );
+			m_Threads.push_back ( th );
+		#endif
+	}
+	printf ( "ThreadPool: %d threads on %d NUMA node(s)%s\n", m_NumThreads, m_NumNodes, m_bPin ? ", pinned" : "" );
+}
+
+void ThreadPool::Stop ()
+{
+	if ( m_Threads.size() == 0 ) return;
+	#ifdef _MSC_VER
+		EnterCriticalSection ( &m_Lock );
+		m_bQuit = true;
+		m_Generation++;
+		WakeAllConditionVariable ( &m_WakeCond );
+		LeaveCriticalSection ( &m_Lock );
+		for (int n = 0; n < (int) m_Threads.size(); n++ ) {
+			WaitForSingleObject ( m_Threads[n], INFINITE );
+			CloseHandle ( m_Threads[n] );
+		}
+	#else
+		pthread_mutex_lock ( &m_Lock );
+		m_bQuit = true;
+		m_Generation++;
+		pthread_cond_broadcast ( &m_WakeCond );
+		pthread_mutex_unlock ( &m_Lock );
+		for (int n = 0; n < (int) m_Threads.size(); n++ )
+			pthread_join ( m_Threads[n], 0x0 );
+	#endif
+	m_Threads.clear ();
+	m_NumThreads = 1;
+}
+
+#ifdef _MSC_VER
+	DWORD WINAPI ThreadPool::Entry ( LPVOID arg )
+#else
+	void* ThreadPool::Entry ( void* arg )
+#endif
+{
+	ThreadArg* a = (ThreadArg*) arg;
+	ThreadPool* pool = a->pool;
+	int t = a->t;
+	delete a;
+	pool->Worker ( t );
+	return 0;
+}
+
+// While tracing, each thread's share of a job is a span on its own track
+static void RunJob ( ThreadJob job, void* ctx, int t, int nt )
+{
+	#ifndef NOPROFILE
+		Profiler& prof = Profiler::Global ();
+		if ( prof.IsTracing () ) {
+			PROFILE_BEGIN ( span );
+			job ( ctx, t, nt );
+			PROFILE_END ( span, prof.GetPoolId () );
+			return;
+		}
+	#endif
+	job ( ctx, t, nt );
+}
+
+void ThreadPool::Worker ( int t )
+{
+	int gen = 0;
+	char name[32];
+	Pin ( t );
+	sprintf ( name, "pool %d", t );
+	Profiler::Global().SetThreadName ( name );
+	for (;;) {
+		#ifdef _MSC_VER
+			EnterCriticalSection ( &m_Lock );
+			while ( m_Generation == gen ) SleepConditionVariableCS ( &m_WakeCond, &m_Lock, INFINITE );
+			LeaveCriticalSection ( &m_Lock );
+		#else
+			pthread_mutex_lock ( &m_Lock );
+			while ( m_Generation == gen ) pthread_cond_wait ( &m_WakeCond, &m_Lock );
+			pthread_mutex_unlock ( &m_Lock );
+		#endif
+		gen = m_Generation;
+		if ( m_bQuit ) return;
+
+		#ifndef NOPROFILE
+			Profiler::Global().SetArgs ( m_ArgNum, m_ArgDT );
+		#endif
+		RunJob ( m_Job, m_Ctx, t, m_NumThreads );
+
+		#ifdef _MSC_VER
+			EnterCriticalSection ( &m_Lock );
+			if ( --m_Pending == 0 ) WakeAllConditionVariable ( &m_DoneCond );
+			LeaveCriticalSection ( &m_Lock );
+		#else
+			pthread_mutex_lock ( &m_Lock );
+			if ( --m_Pending == 0 ) pthread_cond_broadcast ( &m_DoneCond );
+			pthread_mutex_unlock ( &m_Lock );
+		#endif
+	}
+}
+
+void ThreadPool::Run ( ThreadJob job, void* ctx )
+{
+	if ( m_NumThreads <= 1 ) { job ( ctx, 0, 1 ); return; }
+	#ifndef NOPROFILE
+		Profiler::Global().GetArgs ( m_ArgNum, m_ArgDT );	// published to the workers with m_Generation
+	#endif
+
+	#ifdef _MSC_VER
+		EnterCriticalSection ( &m_Lock );
+		m_Job = job; m_Ctx = ctx;
+		m_Pending = m_NumThreads-1;
+		m_Generation++;
+		WakeAllConditionVariable ( &m_WakeCond );
+		LeaveCriticalSection ( &m_Lock );
+	#else
+		pthread_mutex_lock ( &m_Lock );
+		m_Job = job; m_Ctx = ctx;
+		m_Pending = m_NumThreads-1;
+		m_Generation++;
+		pthread_cond_broadcast ( &m_WakeCond );
+		pthread_mutex_unlock ( &m_Lock );
+	#endif
+
+	RunJob ( job, ctx, 0, m_NumThreads );
+
+	#ifdef _MSC_VER
+		EnterCriticalSection ( &m_Lock );
+		while ( m_Pending > 0 ) SleepConditionVariableCS ( &m_DoneCond, &m_Lock, INFINITE );
+		LeaveCriticalSection ( &m_Lock );
+	#else
+		pthread_mutex_lock ( &m_Lock );
+		while ( m_Pending > 0 ) pthread_cond_wait ( &m_DoneCond, &m_Lock );
+		pthread_mutex_unlock ( &m_Lock );
+	#endif
+}
+
+//------------------------------------------------------ NUMA placement
+
+struct TouchJob {
+	char*	data;
+	long	bytes;
+};
+
+static void TouchSlice ( void* ctx, int t, int nt )
+{
+	TouchJob* job = (TouchJob*) ctx;
+	long start = long( (long long) job->bytes * t / nt );
+	long end = long( (long long) job->bytes * (t+1) / nt );
+	if ( end > start ) memset ( job->data + start, 0, end - start );
+}
+
+void ThreadPool::Touch ( char* data, long bytes )
+{
+	if ( data == 0x0 || bytes <= 0 ) return;
+	TouchJob job;
+	job.data = data;
+	job.bytes = bytes;
+	Run ( TouchSlice, &job );
+}
+
+void ThreadPool::Place ( char* data, long bytes )
+{
+	#if !defined(_MSC_VER) && defined(__NR_move_pages)
+		if ( data == 0x0 || bytes <= 0 || m_NumNodes < 2 ) return;
+		long page = GetPageSize ();
+		char* first = (char*) ( (size_t) data & ~(size_t)(page-1) );
+		long cnt = long( ( data + bytes - first + page-1 ) / page );
+		std::vector<void*> pages ( cnt );
+		std::vector<int> nodes ( cnt );
+		std::vector<int> status ( cnt );
+		for (long n = 0; n < cnt; n++ ) {
+			pages[n] = first + n*page;
+			long off = n*page + page/2 - long(data - first);		// owner of the page middle
+			if ( off < 0 ) off = 0;
+			if ( off >= bytes ) off = bytes-1;
+			int t = int( (long long) off * m_NumThreads / bytes );
+			nodes[n] = m_ThreadNode[t];
+		}
+		syscall ( __NR_move_pages, 0, cnt, &pages[0], &nodes[0], &status[0], MPOL_MF_MOVE );
+	#endif
+}
+
+bool ThreadPool::QueryNodes ( char* data, long bytes, std::vector<int>& nodes )
+{
+	long page = GetPageSize ();
+	char* first = (char*) ( (size_t) data & ~(size_t)(page-1) );
+	long cnt = ( data == 0x0 || bytes <= 0 ) ? 0 : long( ( data + bytes - first + page-1 ) / page );
+	nodes.assign ( cnt, -1 );
+	#if !defined(_MSC_VER) && defined(__NR_move_pages)
+		if ( cnt == 0 ) return false;
+		std::vector<void*> pages ( cnt );
+		for (long n = 0; n < cnt; n++ ) pages[n] = first + n*page;
+		if ( syscall ( __NR_move_pages, 0, cnt, &pages[0], 0x0, &nodes[0], 0 ) != 0 ) return false;
+		for (long n = 0; n < cnt; n++ ) if ( nodes[n] < 0 ) nodes[n] = -1;		// -ENOENT: page never touched
+		return true;
+	#else
+		return false;
+	#endif
+}
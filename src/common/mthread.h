@@ -0,0 +1,91 @@
+
+#ifndef INC_MINT_THREAD_H
+	#define INC_MINT_THREAD_H
+
+	#include <vector>
+
+	#ifdef _MSC_VER
+		#include <windows.h>
+	#else
+		#include <pthread.h>
+	#endif
+
+	// Work function run on every pool thread. thread = 0..num_threads-1 (0 is the caller).
+	typedef void (*ThreadJob) ( void* ctx, int thread, int num_threads );
+
+	// Fixed-size worker pool with a static thread-to-partition mapping.
+	//
+	// Threads are pinned in order to CPUs sorted by NUMA node, so consecutive
+	// thread ids (and therefore consecutive particle partitions) share a node.
+	// Touch() first-touches a freshly allocated block so each page lands on the node
+	// of the thread that owns that slice. Place() migrates pages of an existing
+	// block the same way (Linux only). QueryNodes() reports where pages live.
+	class ThreadPool {
+	public:
+		ThreadPool ();
+		~ThreadPool ();
+
+		void Start ( int num, bool bPin );			// num <= 0: one thread per available cpu
+		void Stop ();
+		void Run ( ThreadJob job, void* ctx );		// blocks until all threads finish; caller is thread 0
+
+		int GetNumThreads ()			{ return m_NumThreads; }
+		int GetNumNodes ()				{ return m_NumNodes; }
+		int GetThreadNode ( int t )		{ return m_ThreadNode[t]; }
+		int GetThreadCpu ( int t )		{ return m_ThreadCpu[t]; }
+
+		void Touch ( char* data, long bytes );
+		void Place ( char* data, long bytes );
+		bool QueryNodes ( char* data, long bytes, std::vector<int>& nodes );	// node per page, -1 if unknown
+		static int GetPageSize ();
+
+		// Contiguous partition of n items for thread t
+		static void GetRange ( int n, int t, int nt, int& start, int& end )		{ start = int( (long long) n * t / nt ); end = int( (long long) n * (t+1) / nt ); }
+
+		// Atomic add, returns the previous value (dynamic work queues)
+		#ifdef _MSC_VER
+			static long FetchAdd ( volatile long* v, long add )		{ return InterlockedExchangeAdd ( v, add ); }
+		#else
+			static long FetchAdd ( volatile long* v, long add )		{ return __sync_fetch_and_add ( v, add ); }
+		#endif
+
+	private:
+		void DetectTopology ();
+		void Pin ( int t );
+		void Worker ( int t );
+		#ifdef _MSC_VER
+			static DWORD WINAPI Entry ( LPVOID arg );
+		#else
+			static void* Entry ( void* arg );
+		#endif
+
+		int						m_NumThreads;
+		int						m_NumNodes;
+		bool					m_bPin;
+		std::vector<int>		m_Cpus;				// available cpus, sorted by node
+		std::vector<int>		m_CpuNode;			// node of each entry in m_Cpus
+		std::vector<int>		m_ThreadCpu;
+		std::vector<int>		m_ThreadNode;
+
+		ThreadJob				m_Job;
+		void*					m_Ctx;
+		int						m_ArgNum;			// the caller's PROFILE_ARGS, for the job's POOL spans
+		float					m_ArgDT;
+		volatile int			m_Generation;
+		volatile int			m_Pending;
+		volatile bool			m_bQuit;
+
+		#ifdef _MSC_VER
+			std::vector<HANDLE>		m_Threads;
+			CRITICAL_SECTION		m_Lock;
+			CONDITION_VARIABLE		m_WakeCond;
+			CONDITION_VARIABLE		m_DoneCond;
+		#else
+			std::vector<pthread_t>	m_Threads;
+			pthread_mutex_t			m_Lock;
+			pthread_cond_t			m_WakeCond;
+			pthread_cond_t			m_DoneCond;
+		#endif
+	};
+
+#endif
@@ -63,7 +63,10 @@ void Time::SetSystemTime ( int accuracy )
 			QueryPerformanceCounter ( &currCount );
 			m_CurrTime = m_BaseTime + sjtime( (double(currCount.QuadPart-m_BaseCount.QuadPart) / m_BaseFreq.QuadPart) * SEC_SCALAR);
 		#else
-			debug.Printf ( "mtime", "ERROR: ACC_NSEC NOT IMPLEMENTED for Time::SetSystemTime\n" );
+			struct timespec ts;
+			clock_gettime ( CLOCK_REALTIME, &ts );
+			sjtime t = ((sjtime) ts.tv_sec * 1000000000LL) + (sjtime) ts.tv_nsec;
+			m_CurrTime = m_BaseTime + ( t - m_BaseTicks * 1000LL );		// m_BaseTicks is in microseconds
 		#endif
 		} break;	
 	}
@@ -30,9 +30,19 @@ PointSet::PointSet ()
 {	
 	m_GridRes.Set ( 0, 0, 0 );
 	m_pcurr = -1;
+	m_NeighborMax = 0;
+	m_NeighborWidth = 0;
+	m_NC = 0x0;
+	m_Neighbor = 0x0;
+	m_NDist = 0x0;
 	Reset ();
 }
 
+PointSet::~PointSet ()
+{
+	Neighbor_Setup ( 0 );
+}
+
 int PointSet::GetGridCell ( int x, int y, int z )
 {
 	return (int) ( (z*m_GridRes.y + y)*m_GridRes.x + x);
@@ -57,11 +67,36 @@ Point* PointSet::nextGridParticle ( int& p )
 	return pnt;
 }
 
-unsigned short* PointSet::getNeighborTable ( int n, int& cnt )
+int* PointSet::getNeighborTable ( int n, int& cnt )
 {
 	cnt = m_NC[n];
 	if ( cnt == 0 ) return 0x0;
-	return &m_Neighbor[n][0];
+	return GetNeighbors ( n );
+}
+
+// One row per particle of the buffer, with int indices so any particle count can be
+// tabled. A row costs width * 8 bytes, so rows start narrow (NEIGHBOR_WIDTH) and the
+// caller widens them, up to MAX_NEIGHBOR, when a search finds more neighbors than fit.
+void PointSet::Neighbor_Setup ( int nmax, int width )
+{
+	if ( width > MAX_NEIGHBOR ) width = MAX_NEIGHBOR;
+	if ( nmax == m_NeighborMax && width == m_NeighborWidth ) return;
+
+	free ( m_NC );
+	free ( m_Neighbor );
+	free ( m_NDist );
+	m_NC = 0x0; m_Neighbor = 0x0; m_NDist = 0x0;
+	m_NeighborMax = nmax;
+	m_NeighborWidth = width;
+	if ( nmax == 0 ) return;
+
+	m_NC = (unsigned short*) calloc ( nmax, sizeof(unsigned short) );
+	m_Neighbor = (int*) malloc ( (size_t) nmax * width * sizeof(int) );
+	m_NDist = (float*) malloc ( (size_t) nmax * width * sizeof(float) );
+	if ( m_NC == 0x0 || m_Neighbor == 0x0 || m_NDist == 0x0 ) {
+		printf ( "Out of memory allocating neighbor table (%d particles, %d neighbors each).\n", nmax, width );
+		exit ( -1 );
+	}
 }
 
 float PointSet::GetValue ( float x, float y, float z )
@@ -506,6 +541,11 @@ int PointSet::Grid_FindCell ( Vector3DF p )
 }
 
 void PointSet::Grid_FindCells ( Vector3DF p, float radius )
+{
+	Grid_FindCells ( p, radius, m_GridCell );
+}
+
+void PointSet::Grid_FindCells ( Vector3DF p, float radius, int* cells )
 {
 	Vector3DI sph_min;
 
@@ -516,24 +556,27 @@ void PointSet::Grid_FindCells ( Vector3DF p, float radius )
 	if ( sph_min.x < 0 ) sph_min.x = 0;
 	if ( sph_min.y < 0 ) sph_min.y = 0;
 	if ( sph_min.z < 0 ) sph_min.z = 0;
+	if ( sph_min.x > m_GridRes.x-1 ) sph_min.x = (int) m_GridRes.x-1;		// escaped particles search the edge cells
+	if ( sph_min.y > m_GridRes.y-1 ) sph_min.y = (int) m_GridRes.y-1;
+	if ( sph_min.z > m_GridRes.z-1 ) sph_min.z = (int) m_GridRes.z-1;
 
-	m_GridCell[0] = (int)((sph_min.z * m_GridRes.y + sph_min.y) * m_GridRes.x + sph_min.x);
-	m_GridCell[1] = m_GridCell[0] + 1;
-	m_GridCell[2] = (int)(m_GridCell[0] + m_GridRes.x);
-	m_GridCell[3] = m_GridCell[2] + 1;
+	cells[0] = (int)((sph_min.z * m_GridRes.y + sph_min.y) * m_GridRes.x + sph_min.x);
+	cells[1] = cells[0] + 1;
+	cells[2] = (int)(cells[0] + m_GridRes.x);
+	cells[3] = cells[2] + 1;
 
 	if ( sph_min.z+1 < m_GridRes.z ) {
-		m_GridCell[4] = (int)(m_GridCell[0] + m_GridRes.y*m_GridRes.x);
-		m_GridCell[5] = m_GridCell[4] + 1;
-		m_GridCell[6] = (int)(m_GridCell[4] + m_GridRes.x);
-		m_GridCell[7] = m_GridCell[6] + 1;
+		cells[4] = (int)(cells[0] + m_GridRes.y*m_GridRes.x);
+		cells[5] = cells[4] + 1;
+		cells[6] = (int)(cells[4] + m_GridRes.x);
+		cells[7] = cells[6] + 1;
 	}
 	if ( sph_min.x+1 >= m_GridRes.x ) {
-		m_GridCell[1] = -1;		m_GridCell[3] = -1;		
-		m_GridCell[5] = -1;		m_GridCell[7] = -1;
+		cells[1] = -1;		cells[3] = -1;		
+		cells[5] = -1;		cells[7] = -1;
 	}
 	if ( sph_min.y+1 >= m_GridRes.y ) {
-		m_GridCell[2] = -1;		m_GridCell[3] = -1;
-		m_GridCell[6] = -1;		m_GridCell[7] = -1;
+		cells[2] = -1;		cells[3] = -1;
+		cells[6] = -1;		cells[7] = -1;
 	}
 }
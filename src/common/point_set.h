@@ -35,7 +35,8 @@
 
 	typedef signed int		xref;
 	
-	#define MAX_NEIGHBOR		500
+	#define MAX_NEIGHBOR		500			// most neighbors one particle can table
+	#define NEIGHBOR_WIDTH		64			// first row width, doubled up to MAX_NEIGHBOR as rows fill
 	
 	#define MAX_PARAM			50
 
@@ -78,6 +79,7 @@
 	class PointSet : public GeomX {
 	public:
 		PointSet ();
+		~PointSet ();
 
 		// Point Sets
 		
@@ -120,6 +122,7 @@
 		void Grid_InsertParticles ();	
 		void Grid_Draw ( float* view_mat );		
 		void Grid_FindCells ( Vector3DF p, float radius );
+		void Grid_FindCells ( Vector3DF p, float radius, int* cells );		// thread-safe, fills cells[0..7]
 		int Grid_FindCell ( Vector3DF p );
 		Vector3DF GetGridRes ()		{ return m_GridRes; }
 		Vector3DF GetGridMin ()		{ return m_GridMin; }
@@ -128,7 +131,10 @@
 		int GetGridCell ( int x, int y, int z );
 		Point* firstGridParticle ( int gc, int& p );
 		Point* nextGridParticle ( int& p );
-		unsigned short* getNeighborTable ( int n, int& cnt );
+		int* getNeighborTable ( int n, int& cnt );
+		void Neighbor_Setup ( int nmax, int width = NEIGHBOR_WIDTH );	// (re)allocate the neighbor table, nmax rows of width entries
+		int* GetNeighbors ( int n )		{ return m_Neighbor + (long) n * m_NeighborWidth; }
+		float* GetNDist ( int n )		{ return m_NDist + (long) n * m_NeighborWidth; }
 
 	protected:
 		int							m_Frame;		
@@ -154,10 +160,12 @@
 		float						m_GridCellsize;
 		int							m_GridCell[27];
 
-		// Neighbor Table
-		unsigned short				m_NC[65536];			// neighbor table (600k)
-		unsigned short				m_Neighbor[65536][MAX_NEIGHBOR];	
-		float						m_NDist[65536][MAX_NEIGHBOR];
+		// Neighbor Table (heap, sized to the particle buffer by Neighbor_Setup)
+		int							m_NeighborMax;			// rows
+		int							m_NeighborWidth;		// entries per row
+		unsigned short*				m_NC;
+		int*						m_Neighbor;				// row n at n * m_NeighborWidth
+		float*						m_NDist;
 
 		static int m_pcurr;
 	};
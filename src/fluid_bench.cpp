@@ -0,0 +1,433 @@
+/*
+  FLUIDS v.1 - SPH Fluid Simulator for CPU and GPU
+  Headless benchmark
+
+  ZLib license (see fluid_system.h)
+*/
+
+// Runs one SPH_CreateExample scene for a number of steps without a window or a GL
+// context (the FluidSystem is headless, so Initialize never touches GL) and writes
+// the throughput and the per-phase times as JSON:
+//
+//   fluid_bench [-example N] [-particles N] [-steps N] [-warmup N] [-threads N] [-nopin]
+//               [-qpos] [-pcisph] [-pbf] [-boundary] [-dt T] [-cfl C] [-counters] [-trace file]
+//               [-json file]
+//
+// The step is the app's: -dt defaults to BENCH_DT, or one step per frame with -pbf.
+// Warm-up steps are run first and left out of all numbers. Without -json the JSON
+// goes to fluid_bench.json; a one-line summary is always printed. -counters adds the
+// hardware counts of every phase, summed over the steps, for each pool thread (see
+// Profiler::StartCounters); where the counters cannot be opened the run is timed only.
+// -trace writes the spans of the timed steps, per thread, as a Chrome trace (see
+// Profiler::StopTrace); only the last PROFILE_RING spans are kept.
+//
+// With -micro it runs the microbenchmarks instead: the grid build, the density pass,
+// the force pass and the integration, each timed alone on synthetic scenes
+// (SPH_CreateSynthetic) or a saved state, for every distribution and particle count:
+//
+//   fluid_bench -micro [-dist lattice,random,cluster,pool] [-counts 10000,100000,1000000,2000000]
+//               [-reps N] [-warmup N] [-settle N] [-seed N] [-snapshot file.chk]
+//               [-threads N] [-nopin] [-qpos] [-dt T] [-json file]
+//
+// Each phase runs warmup + reps times on the same particles; the integration restores
+// the scene and rebuilds the grid and forces (untimed) before every run, so every
+// repetition starts from the same state. The pool is settled with -settle full steps
+// first. A count that is not a positive number, an unknown distribution or a case that
+// fails makes the run return an error; the cases that did run are still written.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+
+#include "fluid_system.h"
+#include "fluid_checkpoint.h"
+#include "mthread.h"
+#include "mprofile.h"
+#include "mem_account.h"
+
+#define BENCH_DT		0.001f			// default SPH_TIMESTEP, as in main.cpp
+
+static void WriteJSON ( FILE* fp, FluidSystem& fluid, ThreadPool* pool, int example, int steps, int warmup, float dt, double sec, double updates )
+{
+	fprintf ( fp, "{\n" );
+	fprintf ( fp, "  \"example\": %d,\n", example );
+	fprintf ( fp, "  \"particles\": %d,\n", fluid.NumPoints() );
+	fprintf ( fp, "  \"threads\": %d,\n", pool ? pool->GetNumThreads() : 1 );
+	fprintf ( fp, "  \"numa_nodes\": %d,\n", pool ? pool->GetNumNodes() : 1 );
+	fprintf ( fp, "  \"solver\": \"%s\",\n", fluid.GetToggle(USE_PBF) ? "pbf" : ( fluid.GetToggle(USE_PCISPH) ? "pcisph" : "wcsph" ) );
+	fprintf ( fp, "  \"qpos\": %s,\n", fluid.GetToggle(USE_QPOS) ? "true" : "false" );
+	fprintf ( fp, "  \"boundary\": %s,\n", fluid.GetToggle(USE_BOUNDARY) ? "true" : "false" );
+	fprintf ( fp, "  \"dt\": %g,\n", dt );
+	fprintf ( fp, "  \"warmup\": %d,\n", warmup );
+	fprintf ( fp, "  \"steps\": %d,\n", steps );
+	fprintf ( fp, "  \"seconds\": %.6f,\n", sec );
+	fprintf ( fp, "  \"steps_per_sec\": %.3f,\n", sec > 0 ? steps / sec : 0.0 );
+	fprintf ( fp, "  \"particle_updates_per_sec\": %.6g,\n", sec > 0 ? updates / sec : 0.0 );
+	fprintf ( fp, "  \"peak_mb\": %.3f,\n", MemAccount::Global().GetPeak(-1) / (1024.0*1024.0) );
+	fprintf ( fp, "  \"phases_ms\": {" );
+	ProfileStats st;
+	bool first = true;
+	for (int p = 0; p < PROF_MAX; p++ ) {
+		if ( !Profiler::Global().GetStats ( fluid.GetProfileId(p), st ) ) continue;
+		fprintf ( fp, "%s\n    \"%s\": { \"samples\": %ld, \"min\": %.4f, \"mean\": %.4f, \"p50\": %.4f, \"p99\": %.4f, \"max\": %.4f }",
+			first ? "" : ",", Profiler::Global().GetName ( fluid.GetProfileId(p) ), st.count, st.min, st.mean, st.p50, st.p99, st.max );
+		first = false;
+	}
+	fprintf ( fp, "\n  }" );
+
+	Profiler& prof = Profiler::Global ();
+	PerfCount c;
+	long samples;
+	if ( prof.HasCounters () ) {
+		fprintf ( fp, ",\n  \"counters\": {" );
+		first = true;
+		for (int p = 0; p < PROF_MAX; p++ ) {
+			if ( !prof.GetCounts ( fluid.GetProfileId(p), -1, c, samples ) ) continue;
+			fprintf ( fp, "%s\n    \"%s\": { \"samples\": %ld, \"threads\": [", first ? "" : ",", prof.GetName ( fluid.GetProfileId(p) ), samples );
+			for (int t = 0; t < prof.GetCounterThreads(); t++ ) {
+				prof.GetCounts ( fluid.GetProfileId(p), t, c, samples );
+				fprintf ( fp, "%s\n      {", t ? "," : "" );
+				for (int e = 0; e < PERF_EVENTS; e++ ) {
+					if ( c.v[e] < 0 )	fprintf ( fp, "%s \"%s\": null", e ? "," : "", PerfCounters::GetName ( e ) );
+					else				fprintf ( fp, "%s \"%s\": %lld", e ? "," : "", PerfCounters::GetName ( e ), c.v[e] );
+				}
+				fprintf ( fp, " }" );
+			}
+			fprintf ( fp, " ] }" );
+			first = false;
+		}
+		fprintf ( fp, "\n  }" );
+	}
+	fprintf ( fp, "\n}\n" );
+}
+
+//-------------------------------------------------------- Microbenchmarks
+
+#define MICRO_INSERT			0
+#define MICRO_PRESS				1
+#define MICRO_FORCE				2
+#define MICRO_ADV				3
+#define MICRO_PHASES			4
+
+static const char* g_MicroPhase[MICRO_PHASES] = { "INSERT", "PRESS", "FORCE", "ADV" };
+static const char* g_MicroDist[SYNTH_MAX] = { "lattice", "random", "cluster", "pool" };
+
+struct MicroStats {
+	double			min, p50, mean, sd, max;		// ms
+};
+
+struct MicroCase {
+	std::string		dist;
+	int				particles;
+	double			neighbors;						// per particle, from the density pass
+	MicroStats		phase[MICRO_PHASES];
+};
+
+static MicroStats GetMicroStats ( std::vector<double>& ms )
+{
+	MicroStats st;
+	std::sort ( ms.begin(), ms.end() );
+	int n = (int) ms.size();
+	double sum = 0, sq = 0;
+	for (int i = 0; i < n; i++ ) sum += ms[i];
+	st.mean = sum / n;
+	for (int i = 0; i < n; i++ ) sq += ( ms[i] - st.mean ) * ( ms[i] - st.mean );
+	st.sd = ( n > 1 ) ? sqrt ( sq / (n-1) ) : 0;
+	st.min = ms[0];
+	st.max = ms[n-1];
+	st.p50 = ( n % 2 ) ? ms[n/2] : 0.5 * ( ms[n/2-1] + ms[n/2] );
+	return st;
+}
+
+// Grid build as in Run: linked cells, plus the quantized slots when they are on
+static void MicroInsert ( FluidSystem* fluid )
+{
+	fluid->Grid_InsertParticles ();
+	if ( fluid->GetToggle ( USE_QPOS ) ) fluid->Grid_Quantize ();
+}
+
+static void MicroPrepare ( FluidSystem* fluid )
+{
+	MicroInsert ( fluid );
+	fluid->SPH_ComputePressureGrid ();
+	fluid->SPH_ComputeForceGridNC ();
+}
+
+static bool MicroRun ( MicroCase& mc, FluidSystem* fluid, int reps, int warmup )
+{
+	std::vector<char> state ( fluid->GetStateSize () );
+	fluid->SPH_DeclarePasses ();
+	MicroPrepare ( fluid );
+	mc.particles = fluid->NumPoints ();
+	mc.neighbors = mc.particles > 0 ? fluid->GetPass(PASS_PRESS)->entries / (double) mc.particles : 0;
+	fluid->SaveState ( &state[0] );
+
+	std::vector<double> ms;
+	long long start;
+	for (int p = 0; p < MICRO_PHASES; p++ ) {
+		ms.clear ();
+		for (int r = -warmup; r < reps; r++ ) {
+			if ( p == MICRO_ADV ) {
+				if ( !fluid->LoadState ( &state[0], (long) state.size() ) ) return false;
+				MicroPrepare ( fluid );
+			}
+			start = Profiler::Now ();
+			switch ( p ) {
+			case MICRO_INSERT:	MicroInsert ( fluid );					break;
+			case MICRO_PRESS:	fluid->SPH_ComputePressureGrid ();		break;
+			case MICRO_FORCE:	fluid->SPH_ComputeForceGridNC ();		break;
+			case MICRO_ADV:		fluid->Advance ();						break;
+			}
+			if ( r >= 0 ) ms.push_back ( ( Profiler::Now () - start ) * 1.0e-6 );
+		}
+		mc.phase[p] = GetMicroStats ( ms );
+	}
+	return true;
+}
+
+static void ParseList ( const char* arg, std::vector<std::string>& list )
+{
+	std::string s = arg;
+	size_t a = 0, b;
+	list.clear ();
+	while ( a <= s.size() ) {
+		b = s.find ( ',', a );
+		if ( b == std::string::npos ) b = s.size();
+		if ( b > a ) list.push_back ( s.substr ( a, b - a ) );
+		a = b + 1;
+	}
+}
+
+static int MicroBench ( int argc, char** argv )
+{
+	std::vector<std::string> dists, counts;
+	ParseList ( "lattice,random,cluster,pool", dists );
+	ParseList ( "10000,100000,1000000,2000000", counts );
+	int reps = 20;
+	int warmup = 3;
+	int settle = 200;
+	int seed = 1;
+	int threads = 1;
+	bool pin = true;
+	bool qpos = false;
+	float dt = BENCH_DT;
+	std::string snapshot = "";
+	std::string json = "fluid_microbench.json";
+
+	for (int i = 1; i < argc; i++ ) {
+		if ( strcmp ( argv[i], "-micro" ) == 0 )			continue;
+		else if ( strcmp ( argv[i], "-nopin" ) == 0 )		pin = false;
+		else if ( strcmp ( argv[i], "-qpos" ) == 0 )		qpos = true;
+		else if ( i+1 >= argc )								{ printf ( "fluid_bench: %s needs a value\n", argv[i] ); return -1; }
+		else if ( strcmp ( argv[i], "-dist" ) == 0 )		ParseList ( argv[++i], dists );
+		else if ( strcmp ( argv[i], "-counts" ) == 0 )		ParseList ( argv[++i], counts );
+		else if ( strcmp ( argv[i], "-reps" ) == 0 )		reps = atoi ( argv[++i] );
+		else if ( strcmp ( argv[i], "-warmup" ) == 0 )		warmup = atoi ( argv[++i] );
+		else if ( strcmp ( argv[i], "-settle" ) == 0 )		settle = atoi ( argv[++i] );
+		else if ( strcmp ( argv[i], "-seed" ) == 0 )		seed = atoi ( argv[++i] );
+		else if ( strcmp ( argv[i], "-dt" ) == 0 )			dt = atof ( argv[++i] );
+		else if ( strcmp ( argv[i], "-snapshot" ) == 0 )	snapshot = argv[++i];
+		else if ( strcmp ( argv[i], "-threads" ) == 0 )		threads = atoi ( argv[++i] );
+		else if ( strcmp ( argv[i], "-json" ) == 0 )		json = argv[++i];
+		else { printf ( "fluid_bench: unknown option %s\n", argv[i] ); return -1; }
+	}
+	if ( reps <= 0 || warmup < 0 ) {
+		printf ( "fluid_bench: reps must be positive\n" );
+		return -1;
+	}
+	if ( !snapshot.empty() ) {				// the saved state is the only scene
+		dists.assign ( 1, "snapshot" );
+		counts.assign ( 1, "0" );
+	}
+	for (int c = 0; c < (int) counts.size() && snapshot.empty(); c++ ) {
+		if ( atoi ( counts[c].c_str() ) <= 0 ) {
+			printf ( "fluid_bench: bad particle count %s\n", counts[c].c_str() );
+			return -1;
+		}
+	}
+
+	ThreadPool* pool = 0x0;
+	if ( threads != 1 ) {
+		pool = new ThreadPool;
+		pool->Start ( threads, pin );
+	}
+
+	std::vector<MicroCase> cases;
+	int failed = 0;
+	for (int d = 0; d < (int) dists.size(); d++ ) {
+		int dist = 0;
+		while ( dist < SYNTH_MAX && dists[d] != g_MicroDist[dist] ) dist++;
+		if ( dist == SYNTH_MAX && snapshot.empty() ) {
+			printf ( "fluid_bench: unknown distribution %s\n", dists[d].c_str() );
+			failed++;
+			continue;
+		}
+		for (int c = 0; c < (int) counts.size(); c++ ) {
+			int num = atoi ( counts[c].c_str() );
+			FluidSystem fluid;							// a fresh system per case
+			fluid.SetHeadless ( true );
+			fluid.SetTiming ( false );
+			fluid.SetThreadPool ( pool );
+			MicroCase mc;
+			mc.dist = dists[d];
+			bool ok = true;
+			if ( !snapshot.empty() ) {
+				fluid.Initialize ( BFLUID, 1 );
+				ok = FluidCheckpoint::Load ( &fluid, snapshot );
+			} else {
+				fluid.Initialize ( BFLUID, num );
+				if ( qpos ) fluid.Toggle ( USE_QPOS );
+				fluid.SPH_CreateSynthetic ( dist, num, seed );
+				fluid.SetParam ( SPH_TIMESTEP, dt );		// a snapshot keeps its own
+				if ( dist == SYNTH_POOL )
+					for (int s = 0; s < settle; s++ ) fluid.Run ();
+			}
+			if ( ok ) ok = MicroRun ( mc, &fluid, reps, warmup );
+			if ( !ok ) {
+				printf ( "fluid_bench: %s %s failed\n", mc.dist.c_str(), snapshot.empty() ? counts[c].c_str() : snapshot.c_str() );
+				failed++;
+				continue;
+			}
+			for (int p = 0; p < MICRO_PHASES; p++ ) {
+				MicroStats& st = mc.phase[p];
+				printf ( "Micro: %-8s %7d %6.1f nbrs  %-6s  min %8.3f  p50 %8.3f  mean %8.3f  sd %7.3f  max %8.3f ms  %7.1f ns/particle\n",
+					mc.dist.c_str(), mc.particles, mc.neighbors, g_MicroPhase[p], st.min, st.p50, st.mean, st.sd, st.max, st.p50 * 1.0e6 / mc.particles );
+			}
+			cases.push_back ( mc );
+		}
+	}
+	if ( pool != 0x0 ) {
+		pool->Stop ();
+		delete pool;
+	}
+
+	FILE* fp = fopen ( json.c_str(), "wt" );
+	if ( fp == 0x0 ) {
+		printf ( "fluid_bench: cannot write %s\n", json.c_str() );
+		return -1;
+	}
+	fprintf ( fp, "{\n  \"threads\": %d,\n  \"qpos\": %s,\n  \"dt\": %g,\n  \"reps\": %d,\n  \"warmup\": %d,\n  \"seed\": %d,\n  \"cases\": [", threads, qpos ? "true" : "false", dt, reps, warmup, seed );
+	for (int c = 0; c < (int) cases.size(); c++ ) {
+		MicroCase& mc = cases[c];
+		fprintf ( fp, "%s\n    { \"dist\": \"%s\", \"particles\": %d, \"neighbors\": %.2f, \"phases_ms\": {", c ? "," : "", mc.dist.c_str(), mc.particles, mc.neighbors );
+		for (int p = 0; p < MICRO_PHASES; p++ ) {
+			MicroStats& st = mc.phase[p];
+			fprintf ( fp, "%s\n      \"%s\": { \"min\": %.4f, \"p50\": %.4f, \"mean\": %.4f, \"sd\": %.4f, \"max\": %.4f }",
+				p ? "," : "", g_MicroPhase[p], st.min, st.p50, st.mean, st.sd, st.max );
+		}
+		fprintf ( fp, " } }" );
+	}
+	fprintf ( fp, "\n  ]\n}\n" );
+	fclose ( fp );
+	printf ( "fluid_bench: %d cases -> %s\n", (int) cases.size(), json.c_str() );
+	if ( failed > 0 ) {
+		printf ( "fluid_bench: %d cases failed\n", failed );
+		return -1;
+	}
+	return 0;
+}
+
+int main ( int argc, char** argv )
+{
+	for (int i = 1; i < argc; i++ )
+		if ( strcmp ( argv[i], "-micro" ) == 0 ) return MicroBench ( argc, argv );
+
+	int example = 0;
+	int particles = 20000;
+	int steps = 500;
+	int warmup = 20;
+	int threads = 1;
+	bool pin = true;
+	bool qpos = false, pcisph = false, pbf = false, boundary = false, counters = false;
+	float dt = 0, cfl = 0;
+	std::string json = "fluid_bench.json";
+	std::string trace;
+
+	for (int i = 1; i < argc; i++ ) {
+		if ( strcmp ( argv[i], "-nopin" ) == 0 )			pin = false;
+		else if ( strcmp ( argv[i], "-qpos" ) == 0 )		qpos = true;
+		else if ( strcmp ( argv[i], "-pcisph" ) == 0 )		pcisph = true;
+		else if ( strcmp ( argv[i], "-pbf" ) == 0 )			pbf = true;
+		else if ( strcmp ( argv[i], "-boundary" ) == 0 )	boundary = true;
+		else if ( strcmp ( argv[i], "-counters" ) == 0 )	counters = true;
+		else if ( i+1 >= argc )								{ printf ( "fluid_bench: %s needs a value\n", argv[i] ); return -1; }
+		else if ( strcmp ( argv[i], "-example" ) == 0 )		example = atoi ( argv[++i] );
+		else if ( strcmp ( argv[i], "-particles" ) == 0 )	particles = atoi ( argv[++i] );
+		else if ( strcmp ( argv[i], "-steps" ) == 0 )		steps = atoi ( argv[++i] );
+		else if ( strcmp ( argv[i], "-warmup" ) == 0 )		warmup = atoi ( argv[++i] );
+		else if ( strcmp ( argv[i], "-threads" ) == 0 )		threads = atoi ( argv[++i] );
+		else if ( strcmp ( argv[i], "-dt" ) == 0 )			dt = atof ( argv[++i] );
+		else if ( strcmp ( argv[i], "-cfl" ) == 0 )			cfl = atof ( argv[++i] );
+		else if ( strcmp ( argv[i], "-json" ) == 0 )		json = argv[++i];
+		else if ( strcmp ( argv[i], "-trace" ) == 0 )		trace = argv[++i];
+		else { printf ( "fluid_bench: unknown option %s\n", argv[i] ); return -1; }
+	}
+	if ( particles <= 0 || steps <= 0 || warmup < 0 ) {
+		printf ( "fluid_bench: particles and steps must be positive\n" );
+		return -1;
+	}
+
+	Profiler::Global().SetThreadName ( "main" );
+	FluidSystem fluid;
+	fluid.SetHeadless ( true );
+	fluid.SetTiming ( false );
+	fluid.Initialize ( BFLUID, particles );
+	if ( qpos ) fluid.Toggle ( USE_QPOS );
+	if ( pcisph ) fluid.Toggle ( USE_PCISPH );
+	if ( pbf ) fluid.Toggle ( USE_PBF );
+	if ( boundary ) fluid.Toggle ( USE_BOUNDARY );
+	ThreadPool* pool = 0x0;
+	if ( threads != 1 ) {
+		pool = new ThreadPool;
+		pool->Start ( threads, pin );
+		fluid.SetThreadPool ( pool );
+	}
+	if ( counters ) Profiler::Global().StartCounters ( pool );
+	fluid.SPH_CreateExample ( example, particles );
+	if ( dt <= 0 ) dt = pbf ? 1.0f / 60 : BENCH_DT;		// PBF: one solver step per displayed frame
+	fluid.SetParam ( SPH_TIMESTEP, dt );
+	fluid.SetParam ( SPH_CFL, cfl );
+
+	for (int s = 0; s < warmup; s++ )
+		fluid.Run ();
+	Profiler::Global().Clear ();
+	if ( !trace.empty() ) Profiler::Global().StartTrace ();
+
+	double updates = 0;
+	long long start = Profiler::Now ();
+	for (int s = 0; s < steps; s++ ) {
+		updates += fluid.NumPoints ();
+		fluid.Run ();
+	}
+	double sec = ( Profiler::Now () - start ) * 1.0e-9;
+	if ( !trace.empty() ) Profiler::Global().StopTrace ( trace.c_str() );
+
+	FILE* fp = fopen ( json.c_str(), "wt" );
+	bool ok = ( fp != 0x0 );
+	if ( ok ) {
+		WriteJSON ( fp, fluid, pool, example, steps, warmup, dt, sec, updates );
+		fclose ( fp );
+	} else {
+		printf ( "fluid_bench: cannot write %s\n", json.c_str() );
+	}
+	printf ( "fluid_bench: example %d, %d particles, %d threads: %d steps in %.3f s, %.2f steps/s, %.4g particle-updates/s -> %s\n",
+		example, fluid.NumPoints(), pool ? pool->GetNumThreads() : 1, steps, sec, sec > 0 ? steps / sec : 0.0, sec > 0 ? updates / sec : 0.0, json.c_str() );
+	if ( counters ) {
+		int ids[PROF_MAX];
+		for (int p = 0; p < PROF_MAX; p++ ) ids[p] = fluid.GetProfileId ( p );
+		Profiler::Global().ReportCounters ( "fluid_bench:", ids, PROF_MAX );
+		Profiler::Global().StopCounters ();
+	}
+
+	if ( pool != 0x0 ) {
+		fluid.SetThreadPool ( 0x0 );
+		pool->Stop ();
+		delete pool;
+	}
+	return ok ? 0 : -1;
+}
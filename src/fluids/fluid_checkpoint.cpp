@@ -0,0 +1,283 @@
+/*
+  FLUIDS v.1 - SPH Fluid Simulator for CPU and GPU
+  Asynchronous checkpoints
+
+  ZLib license (see fluid_system.h)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fluid_system.h"
+#include "fluid_checkpoint.h"
+#include "mtime.h"
+#include "mem_account.h"
+
+FluidCheckpoint::FluidCheckpoint ()
+{
+	m_Arena = 0x0;
+	m_Size = 0;
+	m_Head = m_Tail = m_Used = 0;
+	m_bWait = true;
+	m_bRunning = false;
+	m_bQuit = false;
+	m_Taken = m_Dropped = m_Written = 0;
+	m_LastMS = m_MaxMS = m_TotalMS = 0;
+	m_WriteSec = 0;
+	m_BytesWritten = 0;
+	m_MemId = MemAccount::Global().Register ( MEM_IO, "checkpoint" );
+	#ifdef _MSC_VER
+		m_Thread = 0x0;
+		InitializeCriticalSection ( &m_Lock );
+		InitializeConditionVariable ( &m_WorkCond );
+		InitializeConditionVariable ( &m_DoneCond );
+	#else
+		pthread_mutex_init ( &m_Lock, 0x0 );
+		pthread_cond_init ( &m_WorkCond, 0x0 );
+		pthread_cond_init ( &m_DoneCond, 0x0 );
+	#endif
+}
+
+FluidCheckpoint::~FluidCheckpoint ()
+{
+	Stop ();
+	#ifdef _MSC_VER
+		DeleteCriticalSection ( &m_Lock );
+	#else
+		pthread_mutex_destroy ( &m_Lock );
+		pthread_cond_destroy ( &m_WorkCond );
+		pthread_cond_destroy ( &m_DoneCond );
+	#endif
+	MemAccount::Global().Unregister ( m_MemId );
+}
+
+void FluidCheckpoint::Lock ()
+{
+	#ifdef _MSC_VER
+		EnterCriticalSection ( &m_Lock );
+	#else
+		pthread_mutex_lock ( &m_Lock );
+	#endif
+}
+
+void FluidCheckpoint::Unlock ()
+{
+	#ifdef _MSC_VER
+		LeaveCriticalSection ( &m_Lock );
+	#else
+		pthread_mutex_unlock ( &m_Lock );
+	#endif
+}
+
+void FluidCheckpoint::Wait ( bool bDone )
+{
+	#ifdef _MSC_VER
+		SleepConditionVariableCS ( bDone ? &m_DoneCond : &m_WorkCond, &m_Lock, INFINITE );
+	#else
+		pthread_cond_wait ( bDone ? &m_DoneCond : &m_WorkCond, &m_Lock );
+	#endif
+}
+
+void FluidCheckpoint::Signal ( bool bDone )
+{
+	#ifdef _MSC_VER
+		WakeAllConditionVariable ( bDone ? &m_DoneCond : &m_WorkCond );
+	#else
+		pthread_cond_broadcast ( bDone ? &m_DoneCond : &m_WorkCond );
+	#endif
+}
+
+#ifdef _MSC_VER
+	DWORD WINAPI FluidCheckpoint::Entry ( LPVOID arg )
+	{
+		((FluidCheckpoint*) arg)->Writer ();
+		return 0;
+	}
+#else
+	void* FluidCheckpoint::Entry ( void* arg )
+	{
+		((FluidCheckpoint*) arg)->Writer ();
+		return 0x0;
+	}
+#endif
+
+bool FluidCheckpoint::Start ( std::string prefix, long arena_bytes, bool bWait )
+{
+	Stop ();
+	m_Arena = (char*) malloc ( arena_bytes );
+	if ( m_Arena == 0x0 ) {
+		printf ( "Checkpoint: cannot allocate %ld byte arena.\n", arena_bytes );
+		return false;
+	}
+	m_Prefix = prefix;
+	m_Size = arena_bytes;
+	MemAccount::Global().Set ( m_MemId, (double) arena_bytes );
+	m_Head = m_Tail = m_Used = 0;
+	m_bWait = bWait;
+	m_bQuit = false;
+	m_bRunning = true;
+	#ifdef _MSC_VER
+		m_Thread = CreateThread ( 0x0, 0, Entry, this, 0, 0x0 );
+	#else
+		pthread_create ( &m_Thread, 0x0, Entry, this );
+	#endif
+	printf ( "Checkpoint: %s_NNNNNN.chk, %.1f MB staging, %s when full\n", prefix.c_str(), arena_bytes / (1024.0*1024.0), bWait ? "wait" : "drop" );
+	return true;
+}
+
+void FluidCheckpoint::Stop ()
+{
+	if ( !m_bRunning ) return;
+	Lock ();
+	m_bQuit = true;
+	Signal ( false );
+	Unlock ();
+	#ifdef _MSC_VER
+		WaitForSingleObject ( m_Thread, INFINITE );
+		CloseHandle ( m_Thread );
+		m_Thread = 0x0;
+	#else
+		pthread_join ( m_Thread, 0x0 );
+	#endif
+	m_bRunning = false;
+	free ( m_Arena );
+	m_Arena = 0x0;
+	MemAccount::Global().Set ( m_MemId, 0 );
+	Report ();
+}
+
+int FluidCheckpoint::GetPending ()
+{
+	Lock ();
+	int n = (int) m_Queue.size();
+	Unlock ();
+	return n;
+}
+
+// FIFO ring allocation: space is freed in the order it was reserved, so the free
+// region is always [head, tail) with a possible wrap. Padding skipped at the end of
+// the arena is charged to the snapshot that wrapped.
+bool FluidCheckpoint::Reserve ( long bytes, Pending& p )
+{
+	if ( m_Used == 0 ) m_Head = m_Tail = 0;
+	if ( m_Used == 0 || m_Head > m_Tail ) {
+		if ( m_Size - m_Head >= bytes ) { p.offset = m_Head; p.charge = bytes; }
+		else if ( m_Tail >= bytes ) { p.offset = 0; p.charge = ( m_Size - m_Head ) + bytes; }
+		else return false;
+	} else {
+		if ( m_Tail - m_Head >= bytes ) { p.offset = m_Head; p.charge = bytes; }
+		else return false;
+	}
+	p.bytes = bytes;
+	m_Head = p.offset + bytes;
+	if ( m_Head == m_Size ) m_Head = 0;
+	m_Used += p.charge;
+	return true;
+}
+
+bool FluidCheckpoint::Snapshot ( FluidSystem* fluid, int step )
+{
+	if ( !m_bRunning ) return false;
+
+	mint::Time start, stop;
+	start.SetSystemTime ( ACC_NSEC );
+
+	Pending p;
+	long bytes = fluid->GetStateSize ();
+	bool ok = ( bytes <= m_Size );
+	if ( !ok ) printf ( "Checkpoint: state (%ld bytes) larger than staging arena.\n", bytes );
+
+	Lock ();
+	while ( ok && !Reserve ( bytes, p ) ) {
+		if ( !m_bWait ) { ok = false; break; }
+		Wait ( true );
+	}
+	Unlock ();
+
+	if ( ok ) {
+		fluid->SaveState ( m_Arena + p.offset );			// copy outside the lock, region is ours
+		p.step = step;
+		Lock ();
+		m_Queue.push_back ( p );
+		Signal ( false );
+		Unlock ();
+		m_Taken++;
+	} else {
+		m_Dropped++;
+	}
+
+	stop.SetSystemTime ( ACC_NSEC );
+	stop = stop - start;
+	m_LastMS = stop.GetSec() * 1000.0;
+	m_TotalMS += m_LastMS;
+	if ( m_LastMS > m_MaxMS ) m_MaxMS = m_LastMS;
+	return ok;
+}
+
+void FluidCheckpoint::Writer ()
+{
+	char step[32];
+	std::string fn, tmp;									// the prefix is a path of any length
+	Lock ();
+	for (;;) {
+		while ( m_Queue.empty() && !m_bQuit ) Wait ( false );
+		if ( m_Queue.empty() ) break;						// quit once drained
+		Pending p = m_Queue.front ();
+		Unlock ();
+
+		mint::Time start, stop;
+		start.SetSystemTime ( ACC_NSEC );
+		sprintf ( step, "_%06d.chk", p.step );
+		fn = m_Prefix + step;
+		tmp = fn + ".tmp";
+		FILE* fp = fopen ( tmp.c_str(), "wb" );
+		bool ok = ( fp != 0x0 ) && fwrite ( m_Arena + p.offset, 1, p.bytes, fp ) == (size_t) p.bytes;
+		if ( fp != 0x0 ) ok = ( fclose ( fp ) == 0 ) && ok;
+		if ( ok ) {
+			remove ( fn.c_str() );							// rename does not replace on Windows
+			ok = ( rename ( tmp.c_str(), fn.c_str() ) == 0 );
+		}
+		if ( !ok ) printf ( "Checkpoint: failed to write %s\n", fn.c_str() );
+		stop.SetSystemTime ( ACC_NSEC );
+		stop = stop - start;
+
+		Lock ();
+		m_Queue.pop_front ();
+		m_Used -= p.charge;
+		m_Tail = p.offset + p.bytes;
+		if ( m_Tail == m_Size ) m_Tail = 0;
+		if ( ok ) { m_Written++; m_BytesWritten += p.bytes; }
+		m_WriteSec += stop.GetSec ();
+		Signal ( true );
+	}
+	Unlock ();
+}
+
+bool FluidCheckpoint::Load ( FluidSystem* fluid, std::string fname )
+{
+	FILE* fp = fopen ( fname.c_str(), "rb" );
+	if ( fp == 0x0 ) {
+		printf ( "Checkpoint: cannot open %s\n", fname.c_str() );
+		return false;
+	}
+	fseek ( fp, 0, SEEK_END );
+	long size = ftell ( fp );
+	fseek ( fp, 0, SEEK_SET );
+	char* buf = (char*) malloc ( size );
+	bool ok = ( buf != 0x0 ) && fread ( buf, 1, size, fp ) == (size_t) size;
+	fclose ( fp );
+	if ( ok ) ok = fluid->LoadState ( buf, size );
+	free ( buf );
+	printf ( "Checkpoint: %s %s\n", ok ? "restored" : "failed to restore", fname.c_str() );
+	return ok;
+}
+
+void FluidCheckpoint::Report ()
+{
+	printf ( "Checkpoint: %d taken, %d dropped, %d written (%.1f MB", m_Taken, m_Dropped, m_Written, m_BytesWritten / (1024.0*1024.0) );
+	if ( m_WriteSec > 0 ) printf ( ", %.1f MB/s", m_BytesWritten / (1024.0*1024.0) / m_WriteSec );
+	printf ( ")\n" );
+	if ( m_Taken + m_Dropped > 0 )
+		printf ( "Checkpoint: step latency last %.3f ms, avg %.3f ms, max %.3f ms\n", m_LastMS, m_TotalMS / (m_Taken + m_Dropped), m_MaxMS );
+}
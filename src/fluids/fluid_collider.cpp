@@ -0,0 +1,415 @@
+/*
+  FLUIDS v.1 - SPH Fluid Simulator for CPU and GPU
+  Signed distance colliders
+
+  ZLib license (see fluid_system.h)
+*/
+
+#include <math.h>
+#include <stdio.h>
+
+#include "fluid_collider.h"
+
+FluidColliders::FluidColliders ()
+{
+	m_Version = 0;
+	m_CullVersion = -1;
+	m_CullReach = 0;
+}
+
+int FluidColliders::AddBox ( Vector3DF lo, Vector3DF hi, int flags, float stiff )
+{
+	FluidCollider c;
+	c.type = COLLIDE_BOX;
+	c.flags = flags;
+	c.a = lo;
+	c.b = hi;
+	c.r = 0;
+	c.stiff = stiff;
+	c.sdf = -1;
+	m_List.push_back ( c );
+	Changed ();
+	return (int) m_List.size() - 1;
+}
+
+int FluidColliders::AddSphere ( Vector3DF ctr, float r, int flags, float stiff )
+{
+	FluidCollider c;
+	c.type = COLLIDE_SPHERE;
+	c.flags = flags;
+	c.a = ctr;
+	c.b = ctr;
+	c.r = r;
+	c.stiff = stiff;
+	c.sdf = -1;
+	m_List.push_back ( c );
+	Changed ();
+	return (int) m_List.size() - 1;
+}
+
+int FluidColliders::AddCapsule ( Vector3DF a, Vector3DF b, float r, int flags, float stiff )
+{
+	FluidCollider c;
+	c.type = COLLIDE_CAPSULE;
+	c.flags = flags;
+	c.a = a;
+	c.b = b;
+	c.r = r;
+	c.stiff = stiff;
+	c.sdf = -1;
+	m_List.push_back ( c );
+	Changed ();
+	return (int) m_List.size() - 1;
+}
+
+int FluidColliders::AddPlane ( Vector3DF pnt, Vector3DF norm, int flags, float stiff )
+{
+	FluidCollider c;
+	norm.Normalize ();
+	c.type = COLLIDE_PLANE;
+	c.flags = flags;
+	c.a = pnt;
+	c.b = norm;
+	c.r = norm.x*pnt.x + norm.y*pnt.y + norm.z*pnt.z;
+	c.stiff = stiff;
+	c.sdf = -1;
+	m_List.push_back ( c );
+	Changed ();
+	return (int) m_List.size() - 1;
+}
+
+int FluidColliders::AddCylinder ( Vector3DF a, Vector3DF b, float r, int flags, float stiff )
+{
+	FluidCollider c;
+	c.type = COLLIDE_CYLINDER;
+	c.flags = flags;
+	c.a = a;
+	c.b = b;
+	c.r = r;
+	c.stiff = stiff;
+	c.sdf = -1;
+	m_List.push_back ( c );
+	Changed ();
+	return (int) m_List.size() - 1;
+}
+
+int FluidColliders::AddVoxel ( FluidSDF& sdf, int flags, float stiff )
+{
+	FluidCollider c;
+	if ( sdf.res[0] < 2 || sdf.res[1] < 2 || sdf.res[2] < 2 || sdf.cell <= 0 || (int) sdf.dist.size() != sdf.res[0]*sdf.res[1]*sdf.res[2] ) {
+		printf ( "ERROR: Colliders: voxel field %dx%dx%d with %d samples, cell %f.\n", sdf.res[0], sdf.res[1], sdf.res[2], (int) sdf.dist.size(), sdf.cell );
+		return -1;
+	}
+	c.type = COLLIDE_VOXEL;
+	c.flags = flags;
+	c.a = sdf.min;
+	c.b.Set ( sdf.min.x + (sdf.res[0]-1)*sdf.cell, sdf.min.y + (sdf.res[1]-1)*sdf.cell, sdf.min.z + (sdf.res[2]-1)*sdf.cell );
+	c.r = sdf.cell;
+	c.stiff = stiff;
+	c.sdf = (int) m_SDF.size();
+	m_SDF.push_back ( FluidSDF() );
+	FluidSDF& dst = m_SDF.back ();
+	dst.min = sdf.min;
+	dst.cell = sdf.cell;
+	for (int k = 0; k < 3; k++ ) dst.res[k] = sdf.res[k];
+	dst.dist.swap ( sdf.dist );
+	m_List.push_back ( c );
+	Changed ();
+	return (int) m_List.size() - 1;
+}
+
+// The union of the group's solids is the smallest fluid-side distance of its members.
+// Sinks are not baked; they stay separate shapes.
+int FluidColliders::Bake ( int flags, Vector3DF min, Vector3DF max, float cell )
+{
+	std::vector<int> group;
+	for (int c = 0; c < (int) m_List.size(); c++ )
+		if ( ( m_List[c].flags & flags ) == flags && !( m_List[c].flags & COLLIDE_SINK ) ) group.push_back ( c );
+	if ( group.size() == 0 || cell <= 0 ) return -1;
+
+	FluidSDF sdf;
+	sdf.min = min;
+	sdf.cell = cell;
+	sdf.res[0] = (int) ceil ( (max.x - min.x) / cell ) + 1;
+	sdf.res[1] = (int) ceil ( (max.y - min.y) / cell ) + 1;
+	sdf.res[2] = (int) ceil ( (max.z - min.z) / cell ) + 1;
+	for (int k = 0; k < 3; k++ ) if ( sdf.res[k] < 2 ) sdf.res[k] = 2;
+	sdf.dist.resize ( sdf.res[0] * sdf.res[1] * sdf.res[2] );
+
+	// One row of samples at a time, each member over the whole row
+	int nx = sdf.res[0];
+	std::vector<float> px ( nx ), py ( nx ), pz ( nx ), d ( nx ), gx ( nx ), gy ( nx ), gz ( nx );
+	for (int x = 0; x < nx; x++ ) px[x] = min.x + x * cell;
+	float* row;
+	for (int z = 0; z < sdf.res[2]; z++ ) {
+		for (int y = 0; y < sdf.res[1]; y++ ) {
+			for (int x = 0; x < nx; x++ ) { py[x] = min.y + y * cell; pz[x] = min.z + z * cell; }
+			row = &sdf.dist[ (z * sdf.res[1] + y) * nx ];
+			for (int x = 0; x < nx; x++ ) row[x] = 1e30f;
+			for (int g = 0; g < (int) group.size(); g++ ) {
+				Distance ( group[g], nx, &px[0], &py[0], &pz[0], &d[0], &gx[0], &gy[0], &gz[0] );
+				for (int x = 0; x < nx; x++ ) row[x] = ( d[x] < row[x] ) ? d[x] : row[x];
+			}
+		}
+	}
+	std::vector<bool> drop ( m_List.size(), false );
+	for (int g = 0; g < (int) group.size(); g++ ) drop[ group[g] ] = true;
+	Remove ( drop );
+	return AddVoxel ( sdf, flags, 1 );
+}
+
+void FluidColliders::Clear ( int flags )
+{
+	std::vector<bool> drop ( m_List.size(), false );
+	for (int c = 0; c < (int) m_List.size(); c++ ) drop[c] = ( m_List[c].flags & flags ) == flags;
+	Remove ( drop );
+}
+
+// Drops colliders and the voxel fields only they used
+void FluidColliders::Remove ( std::vector<bool>& drop )
+{
+	std::vector<FluidCollider> keep;
+	std::vector<FluidSDF> sdf;
+	for (int c = 0; c < (int) m_List.size(); c++ ) {
+		if ( drop[c] ) continue;
+		keep.push_back ( m_List[c] );
+		if ( m_List[c].type == COLLIDE_VOXEL ) {
+			sdf.push_back ( FluidSDF() );
+			sdf.back().min = m_SDF[ m_List[c].sdf ].min;
+			sdf.back().cell = m_SDF[ m_List[c].sdf ].cell;
+			for (int k = 0; k < 3; k++ ) sdf.back().res[k] = m_SDF[ m_List[c].sdf ].res[k];
+			sdf.back().dist.swap ( m_SDF[ m_List[c].sdf ].dist );
+			keep.back().sdf = (int) sdf.size() - 1;
+		}
+	}
+	m_List.swap ( keep );
+	m_SDF.swap ( sdf );
+	Changed ();
+}
+
+// Signed distance of one collider for a batch of points. Each shape is one loop with no
+// branches the compiler cannot turn into selects.
+void FluidColliders::Distance ( int c, int n, const float* x, const float* y, const float* z, float* d, float* nx, float* ny, float* nz )
+{
+	FluidCollider& col = m_List[c];
+	float ax = col.a.x, ay = col.a.y, az = col.a.z;
+	float r = col.r;
+
+	switch ( col.type ) {
+	case COLLIDE_PLANE: {
+		float ux = col.b.x, uy = col.b.y, uz = col.b.z;
+		for (int k = 0; k < n; k++ ) {
+			d[k] = ux*x[k] + uy*y[k] + uz*z[k] - r;
+			nx[k] = ux; ny[k] = uy; nz[k] = uz;
+		}
+		} break;
+	case COLLIDE_SPHERE: {
+		float dx, dy, dz, len, inv;
+		for (int k = 0; k < n; k++ ) {
+			dx = x[k] - ax; dy = y[k] - ay; dz = z[k] - az;
+			len = sqrtf ( dx*dx + dy*dy + dz*dz );
+			inv = ( len > 0 ) ? 1.0f / len : 0.0f;
+			d[k] = len - r;
+			nx[k] = dx * inv; ny[k] = dy * inv; nz[k] = ( len > 0 ) ? dz * inv : 1.0f;
+		}
+		} break;
+	case COLLIDE_CAPSULE: {
+		float bx = col.b.x - ax, by = col.b.y - ay, bz = col.b.z - az;
+		float bb = bx*bx + by*by + bz*bz;
+		float ibb = ( bb > 0 ) ? 1.0f / bb : 0.0f;
+		float dx, dy, dz, t, len, inv;
+		for (int k = 0; k < n; k++ ) {
+			dx = x[k] - ax; dy = y[k] - ay; dz = z[k] - az;
+			t = ( dx*bx + dy*by + dz*bz ) * ibb;
+			t = ( t < 0 ) ? 0 : ( t > 1 ) ? 1 : t;
+			dx -= bx * t; dy -= by * t; dz -= bz * t;
+			len = sqrtf ( dx*dx + dy*dy + dz*dz );
+			inv = ( len > 0 ) ? 1.0f / len : 0.0f;
+			d[k] = len - r;
+			nx[k] = dx * inv; ny[k] = dy * inv; nz[k] = ( len > 0 ) ? dz * inv : 1.0f;
+		}
+		} break;
+	case COLLIDE_BOX: {
+		float cx = 0.5f * ( col.a.x + col.b.x ), cy = 0.5f * ( col.a.y + col.b.y ), cz = 0.5f * ( col.a.z + col.b.z );
+		float ex = 0.5f * ( col.b.x - col.a.x ), ey = 0.5f * ( col.b.y - col.a.y ), ez = 0.5f * ( col.b.z - col.a.z );
+		float dx, dy, dz, sx, sy, sz, qx, qy, qz, ox, oy, oz, out, in, inv;
+		for (int k = 0; k < n; k++ ) {
+			dx = x[k] - cx; dy = y[k] - cy; dz = z[k] - cz;
+			sx = ( dx < 0 ) ? -1.0f : 1.0f; sy = ( dy < 0 ) ? -1.0f : 1.0f; sz = ( dz < 0 ) ? -1.0f : 1.0f;
+			qx = dx * sx - ex; qy = dy * sy - ey; qz = dz * sz - ez;
+			ox = ( qx > 0 ) ? qx : 0; oy = ( qy > 0 ) ? qy : 0; oz = ( qz > 0 ) ? qz : 0;
+			out = sqrtf ( ox*ox + oy*oy + oz*oz );
+			in = ( qx > qy ) ? qx : qy;
+			in = ( qz > in ) ? qz : in;
+			in = ( in < 0 ) ? in : 0;
+			d[k] = out + in;
+			if ( out > 0 ) {				// outside: toward the nearest point on the surface
+				inv = 1.0f / out;
+				nx[k] = ox * sx * inv; ny[k] = oy * sy * inv; nz[k] = oz * sz * inv;
+			} else {						// inside: out through the nearest face
+				nx[k] = ( qx >= qy && qx >= qz ) ? sx : 0;
+				ny[k] = ( qy > qx && qy >= qz ) ? sy : 0;
+				nz[k] = ( qz > qx && qz > qy ) ? sz : 0;
+			}
+		}
+		} break;
+	case COLLIDE_CYLINDER: {
+		float ux = col.b.x - ax, uy = col.b.y - ay, uz = col.b.z - az;
+		float h = sqrtf ( ux*ux + uy*uy + uz*uz );
+		if ( h > 0 ) { ux /= h; uy /= h; uz /= h; } else { ux = 0; uy = 0; uz = 1; }
+		float dx, dy, dz, t, s, rr, inv, dr, dh, or_, oh, out, in;
+		for (int k = 0; k < n; k++ ) {
+			dx = x[k] - ax; dy = y[k] - ay; dz = z[k] - az;
+			t = dx*ux + dy*uy + dz*uz;
+			dx -= ux * t; dy -= uy * t; dz -= uz * t;		// radial part
+			rr = sqrtf ( dx*dx + dy*dy + dz*dz );
+			inv = ( rr > 0 ) ? 1.0f / rr : 0.0f;
+			dx *= inv; dy *= inv; dz *= inv;
+			s = ( t < 0.5f * h ) ? -1.0f : 1.0f;			// nearer cap
+			dr = rr - r;
+			dh = ( t - 0.5f * h ) * s - 0.5f * h;
+			or_ = ( dr > 0 ) ? dr : 0; oh = ( dh > 0 ) ? dh : 0;
+			out = sqrtf ( or_*or_ + oh*oh );
+			in = ( dr > dh ) ? dr : dh;
+			in = ( in < 0 ) ? in : 0;
+			d[k] = out + in;
+			if ( out > 0 ) {
+				inv = 1.0f / out;
+				nx[k] = ( dx * or_ + ux * s * oh ) * inv; ny[k] = ( dy * or_ + uy * s * oh ) * inv; nz[k] = ( dz * or_ + uz * s * oh ) * inv;
+			} else if ( dr > dh ) {
+				nx[k] = dx; ny[k] = dy; nz[k] = dz;
+			} else {
+				nx[k] = ux * s; ny[k] = uy * s; nz[k] = uz * s;
+			}
+		}
+		} break;
+	case COLLIDE_VOXEL: {
+		// Trilinear in the samples and their gradient. Outside the field the distance to
+		// it is added on the side the boundary sample is on.
+		FluidSDF& f = m_SDF[col.sdf];
+		int rx = f.res[0], ry = f.res[1], rz = f.res[2];
+		int sy = rx, sz = rx * ry;
+		float ic = 1.0f / f.cell;
+		float fx, fy, fz, cx, cy, cz, tx, ty, tz, ex, ey, ez, e, len;
+		float c00, c10, c01, c11, c0, c1;
+		int ix, iy, iz;
+		const float* s;
+		for (int k = 0; k < n; k++ ) {
+			fx = ( x[k] - ax ) * ic; fy = ( y[k] - ay ) * ic; fz = ( z[k] - az ) * ic;
+			cx = ( fx > 0 ) ? ( fx < rx-1 ) ? fx : rx-1 : 0;		// written so a NaN position clamps to 0
+			cy = ( fy > 0 ) ? ( fy < ry-1 ) ? fy : ry-1 : 0;
+			cz = ( fz > 0 ) ? ( fz < rz-1 ) ? fz : rz-1 : 0;
+			ex = ( fx - cx ) * f.cell; ey = ( fy - cy ) * f.cell; ez = ( fz - cz ) * f.cell;
+			ix = (int) cx; iy = (int) cy; iz = (int) cz;
+			if ( ix > rx-2 ) ix = rx-2;
+			if ( iy > ry-2 ) iy = ry-2;
+			if ( iz > rz-2 ) iz = rz-2;
+			tx = cx - ix; ty = cy - iy; tz = cz - iz;
+			s = &f.dist[ iz*sz + iy*sy + ix ];
+
+			c00 = s[0] + ( s[1] - s[0] ) * tx;
+			c10 = s[sy] + ( s[sy+1] - s[sy] ) * tx;
+			c01 = s[sz] + ( s[sz+1] - s[sz] ) * tx;
+			c11 = s[sz+sy] + ( s[sz+sy+1] - s[sz+sy] ) * tx;
+			c0 = c00 + ( c10 - c00 ) * ty;
+			c1 = c01 + ( c11 - c01 ) * ty;
+			d[k] = c0 + ( c1 - c0 ) * tz;
+
+			nx[k] = ( ( s[1] - s[0] ) * (1-ty) + ( s[sy+1] - s[sy] ) * ty ) * (1-tz) + ( ( s[sz+1] - s[sz] ) * (1-ty) + ( s[sz+sy+1] - s[sz+sy] ) * ty ) * tz;
+			ny[k] = ( c10 - c00 ) * (1-tz) + ( c11 - c01 ) * tz;
+			nz[k] = c1 - c0;
+			len = sqrtf ( nx[k]*nx[k] + ny[k]*ny[k] + nz[k]*nz[k] );
+			len = ( len > 0 ) ? 1.0f / len : 0.0f;
+			nx[k] *= len; ny[k] *= len; nz[k] *= len;
+
+			e = sqrtf ( ex*ex + ey*ey + ez*ez );
+			d[k] += ( d[k] < 0 ) ? -e : e;
+		}
+		} break;
+	}
+	if ( col.flags & COLLIDE_CONTAINER ) {
+		for (int k = 0; k < n; k++ ) {
+			d[k] = -d[k]; nx[k] = -nx[k]; ny[k] = -ny[k]; nz[k] = -nz[k];
+		}
+	}
+}
+
+float FluidColliders::Distance ( int c, Vector3DF p, Vector3DF& norm )
+{
+	float d;
+	Distance ( c, 1, &p.x, &p.y, &p.z, &d, &norm.x, &norm.y, &norm.z );
+	return d;
+}
+
+// A collider is a candidate for a cell if some point of the cell may be within reach of
+// its surface: distance at the center minus half the cell diagonal (and, for a voxel
+// field, one sample spacing, since trilinear distances are not exact). Sinks count only
+// if part of the cell may be inside them.
+void FluidColliders::Cull ( Vector3DF gmin, Vector3DF delta, Vector3DF res, float reach )
+{
+	if ( m_CullVersion == m_Version && m_CullReach == reach &&
+		 m_CullMin.x == gmin.x && m_CullMin.y == gmin.y && m_CullMin.z == gmin.z &&
+		 m_CullDelta.x == delta.x && m_CullDelta.y == delta.y && m_CullDelta.z == delta.z &&
+		 m_CullRes.x == res.x && m_CullRes.y == res.y && m_CullRes.z == res.z ) return;
+
+	m_CullVersion = m_Version;
+	m_CullMin = gmin;
+	m_CullDelta = delta;
+	m_CullRes = res;
+	m_CullReach = reach;
+
+	int rx = (int) res.x, ry = (int) res.y, rz = (int) res.z;
+	float sx = 1.0f / delta.x, sy = 1.0f / delta.y, sz = 1.0f / delta.z;
+	float half = 0.5f * sqrtf ( sx*sx + sy*sy + sz*sz );
+	float d, slack;
+	Vector3DF ctr, norm;
+
+	m_CellStart.assign ( rx*ry*rz + 1, 0 );
+	m_CellList.clear ();
+	m_Cells.clear ();
+	int cell = 0;
+	for (int z = 0; z < rz; z++ )
+		for (int y = 0; y < ry; y++ )
+			for (int x = 0; x < rx; x++, cell++ ) {
+				ctr.Set ( gmin.x + (x + 0.5f) * sx, gmin.y + (y + 0.5f) * sy, gmin.z + (z + 0.5f) * sz );
+				m_CellStart[cell] = (int) m_CellList.size();
+				for (int c = 0; c < (int) m_List.size(); c++ ) {
+					d = Distance ( c, ctr, norm );
+					slack = half + ( ( m_List[c].type == COLLIDE_VOXEL ) ? m_List[c].r : 0 );
+					if ( d - slack <= ( ( m_List[c].flags & COLLIDE_SINK ) ? 0 : reach ) ) m_CellList.push_back ( c );
+				}
+				if ( (int) m_CellList.size() > m_CellStart[cell] ) m_Cells.push_back ( cell );
+			}
+	m_CellStart[cell] = (int) m_CellList.size();
+}
+
+int FluidColliders::GetCell ( Vector3DF p )
+{
+	if ( m_CellStart.size() == 0 || !( p.x >= m_CullMin.x && p.y >= m_CullMin.y && p.z >= m_CullMin.z ) ) return -1;	// also NaN
+	int gx = (int) ( (p.x - m_CullMin.x) * m_CullDelta.x );
+	int gy = (int) ( (p.y - m_CullMin.y) * m_CullDelta.y );
+	int gz = (int) ( (p.z - m_CullMin.z) * m_CullDelta.z );
+	if ( gx >= (int) m_CullRes.x || gy >= (int) m_CullRes.y || gz >= (int) m_CullRes.z ) return -1;
+	return (int) ( (gz*m_CullRes.y + gy)*m_CullRes.x + gx );
+}
+
+double FluidColliders::GetMemory ()
+{
+	double bytes = m_List.capacity() * sizeof(FluidCollider);
+	for (int s = 0; s < (int) m_SDF.size(); s++ ) bytes += m_SDF[s].dist.capacity() * sizeof(float);
+	bytes += ( m_CellStart.capacity() + m_CellList.capacity() + m_Cells.capacity() ) * sizeof(int);
+	return bytes;
+}
+
+void FluidColliders::Report ()
+{
+	const char* names[] = { "box", "sphere", "capsule", "plane", "cylinder", "voxel" };
+	int cnt[6] = { 0, 0, 0, 0, 0, 0 };
+	for (int c = 0; c < (int) m_List.size(); c++ ) cnt[ m_List[c].type ]++;
+	printf ( "Colliders: %d shapes:", (int) m_List.size() );
+	for (int t = 0; t < 6; t++ ) if ( cnt[t] > 0 ) printf ( " %d %s", cnt[t], names[t] );
+	printf ( "\n" );
+	if ( m_CellStart.size() > 1 )
+		printf ( "Colliders: %d of %d grid cells within reach, %.2f candidates per such cell, %.2f MB\n", (int) m_Cells.size(), (int) m_CellStart.size()-1,
+			m_Cells.size() > 0 ? double(m_CellList.size()) / m_Cells.size() : 0.0, GetMemory() / (1024.0*1024.0) );
+}
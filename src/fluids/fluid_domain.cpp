@@ -0,0 +1,468 @@
+/*
+  FLUIDS v.1 - SPH Fluid Simulator for CPU and GPU
+  Multi-process domain decomposition
+
+  ZLib license (see fluid_system.h)
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+	#include <windows.h>
+	#define HALO_BARRIER()		MemoryBarrier()
+	#define HALO_YIELD()		Sleep(0)
+#else
+	#include <sched.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#define HALO_BARRIER()		__sync_synchronize()
+	#define HALO_YIELD()		sched_yield()
+#endif
+
+#include "fluid_system.h"
+#include "fluid_domain.h"
+#include "mtime.h"
+
+#define HALO_MAGIC			0x48414C4F		// 'HALO'
+#define HALO_HEADER			4				// ints per message header: step, migrants, ghosts, stride
+#define HALO_TIMEOUT		10.0			// seconds a neighbor may make no progress before we give up
+
+// Seconds since start
+static double HaloWaited ( mint::Time& start )
+{
+	mint::Time now;
+	now.SetSystemTime ( ACC_NSEC );
+	now = now - start;
+	return now.GetSec ();
+}
+
+//------------------------------------------------------ Halo channel
+
+HaloChannel::HaloChannel ()
+{
+	m_bOwner = false;
+	m_Ring = 0x0;
+	m_Data = 0x0;
+	m_MapSize = 0;
+	#ifdef _MSC_VER
+		m_Handle = 0x0;
+	#else
+		m_Handle = -1;
+	#endif
+}
+
+bool HaloChannel::Create ( std::string name, int size )
+{
+	int sz = 1;
+	while ( sz < size ) sz <<= 1;						// ring arithmetic needs a power of two
+	m_Name = name;
+	m_bOwner = true;
+	m_MapSize = sizeof(HaloRing) + sz;
+
+	#ifdef _MSC_VER
+		m_Handle = CreateFileMappingA ( INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, m_MapSize, name.c_str() );
+		if ( m_Handle == 0x0 ) { printf ( "ERROR: Cannot create halo segment %s.\n", name.c_str() ); return false; }
+		m_Ring = (HaloRing*) MapViewOfFile ( m_Handle, FILE_MAP_ALL_ACCESS, 0, 0, m_MapSize );
+	#else
+		shm_unlink ( name.c_str() );					// remove stale segment from an aborted run
+		m_Handle = shm_open ( name.c_str(), O_CREAT | O_RDWR, 0600 );
+		if ( m_Handle < 0 ) { printf ( "ERROR: Cannot create halo segment %s.\n", name.c_str() ); return false; }
+		if ( ftruncate ( m_Handle, m_MapSize ) != 0 ) { printf ( "ERROR: Cannot size halo segment %s.\n", name.c_str() ); return false; }
+		m_Ring = (HaloRing*) mmap ( 0x0, m_MapSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_Handle, 0 );
+		if ( m_Ring == MAP_FAILED ) m_Ring = 0x0;
+	#endif
+	if ( m_Ring == 0x0 ) { printf ( "ERROR: Cannot map halo segment %s.\n", name.c_str() ); return false; }
+
+	m_Data = (char*) m_Ring + sizeof(HaloRing);
+	m_Ring->size = sz;
+	m_Ring->head = 0;
+	m_Ring->tail = 0;
+	HALO_BARRIER ();
+	m_Ring->magic = HALO_MAGIC;
+	return true;
+}
+
+bool HaloChannel::Open ( std::string name )
+{
+	m_Name = name;
+	m_bOwner = false;
+
+	// The neighbor process may not have created its side yet. Wait for it, but not forever.
+	mint::Time start;
+	start.SetSystemTime ( ACC_NSEC );
+	for (;;) {
+		#ifdef _MSC_VER
+			m_Handle = OpenFileMappingA ( FILE_MAP_ALL_ACCESS, FALSE, name.c_str() );
+			if ( m_Handle != 0x0 ) break;
+		#else
+			m_Handle = shm_open ( name.c_str(), O_RDWR, 0600 );
+			if ( m_Handle >= 0 ) {
+				struct stat st;
+				if ( fstat ( m_Handle, &st ) == 0 && st.st_size > (off_t) sizeof(HaloRing) ) break;
+				close ( m_Handle );
+				m_Handle = -1;
+			}
+		#endif
+		if ( HaloWaited ( start ) > HALO_TIMEOUT ) {
+			printf ( "ERROR: Halo segment %s did not appear within %g s. Is the neighbor rank running?\n", name.c_str(), HALO_TIMEOUT );
+			return false;
+		}
+		HALO_YIELD ();
+	}
+
+	#ifdef _MSC_VER
+		m_Ring = (HaloRing*) MapViewOfFile ( m_Handle, FILE_MAP_ALL_ACCESS, 0, 0, 0 );
+	#else
+		struct stat st;
+		fstat ( m_Handle, &st );
+		m_MapSize = (int) st.st_size;
+		m_Ring = (HaloRing*) mmap ( 0x0, m_MapSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_Handle, 0 );
+		if ( m_Ring == MAP_FAILED ) m_Ring = 0x0;
+	#endif
+	if ( m_Ring == 0x0 ) { printf ( "ERROR: Cannot map halo segment %s.\n", name.c_str() ); return false; }
+
+	while ( m_Ring->magic != HALO_MAGIC ) {
+		if ( HaloWaited ( start ) > HALO_TIMEOUT ) {
+			printf ( "ERROR: Halo segment %s was never initialized by its creator.\n", name.c_str() );
+			Close ();
+			return false;
+		}
+		HALO_YIELD ();
+	}
+	HALO_BARRIER ();
+	m_Data = (char*) m_Ring + sizeof(HaloRing);
+	m_MapSize = sizeof(HaloRing) + m_Ring->size;
+	return true;
+}
+
+void HaloChannel::Close ()
+{
+	if ( m_Ring == 0x0 ) return;
+	#ifdef _MSC_VER
+		UnmapViewOfFile ( m_Ring );
+		CloseHandle ( m_Handle );
+		m_Handle = 0x0;
+	#else
+		munmap ( m_Ring, m_MapSize );
+		close ( m_Handle );
+		if ( m_bOwner ) shm_unlink ( m_Name.c_str() );
+		m_Handle = -1;
+	#endif
+	m_Ring = 0x0;
+	m_Data = 0x0;
+}
+
+int HaloChannel::Write ( const char* src, int len )
+{
+	unsigned int size = m_Ring->size;
+	unsigned int head = m_Ring->head;
+	unsigned int room = size - ( head - m_Ring->tail );
+	if ( (unsigned int) len > room ) len = (int) room;
+	if ( len <= 0 ) return 0;
+
+	unsigned int pos = head & (size-1);
+	unsigned int first = size - pos;
+	if ( first > (unsigned int) len ) first = len;
+	memcpy ( m_Data + pos, src, first );
+	memcpy ( m_Data, src + first, len - first );
+	HALO_BARRIER ();								// data visible before head moves
+	m_Ring->head = head + len;
+	return len;
+}
+
+int HaloChannel::Read ( char* dest, int len )
+{
+	unsigned int size = m_Ring->size;
+	unsigned int tail = m_Ring->tail;
+	unsigned int avail = m_Ring->head - tail;
+	HALO_BARRIER ();								// head read before data
+	if ( (unsigned int) len > avail ) len = (int) avail;
+	if ( len <= 0 ) return 0;
+
+	unsigned int pos = tail & (size-1);
+	unsigned int first = size - pos;
+	if ( first > (unsigned int) len ) first = len;
+	memcpy ( dest, m_Data + pos, first );
+	memcpy ( dest + first, m_Data, len - first );
+	HALO_BARRIER ();
+	m_Ring->tail = tail + len;
+	return len;
+}
+
+//------------------------------------------------------ Domain decomposition
+
+FluidDomain::FluidDomain ()
+{
+	m_Rank = 0;
+	m_Ranks = 1;
+	m_Axis = 0;
+	m_Lo = -1e30f;
+	m_Hi = 1e30f;
+	m_Halo = 0;
+	m_NumGhost = 0;
+	m_Step = 0;
+	m_MemIO = MemAccount::Global().Register ( MEM_IO, "domain" );
+	m_MemScratch = MemAccount::Global().Register ( MEM_SCRATCH, "domain" );
+}
+
+FluidDomain::~FluidDomain ()
+{
+	Close ();
+	MemAccount::Global().Unregister ( m_MemIO );
+	MemAccount::Global().Unregister ( m_MemScratch );
+}
+
+// Shared ring mappings (both directions, both sides) and the staged messages
+void FluidDomain::UpdateMemory ()
+{
+	double rings = 0, staged = 0;
+	for (int side = 0; side < 2; side++) {
+		rings += m_Send[side].GetMapSize() + m_Recv[side].GetMapSize();
+		staged += m_Out[side].capacity() + m_In[side].capacity();
+	}
+	MemAccount::Global().Set ( m_MemIO, rings );
+	MemAccount::Global().Set ( m_MemScratch, staged );
+}
+
+bool FluidDomain::Setup ( FluidSystem* fluid, std::string session, int rank, int ranks, int axis, int ring_size )
+{
+	char name[256];
+	Vector3DF vmin = fluid->GetVec ( SPH_VOLMIN );
+	Vector3DF vmax = fluid->GetVec ( SPH_VOLMAX );
+
+	m_Rank = rank;
+	m_Ranks = ranks;
+	m_Axis = axis;
+	m_NumGhost = 0;
+	m_Step = 0;
+
+	// Even slabs along the axis. The outer faces are open so nothing is ever lost off the ends.
+	float lo = Axis ( vmin );
+	float w = ( Axis ( vmax ) - lo ) / ranks;
+	m_Lo = ( rank == 0 ) ? -1e30f : lo + w * rank;
+	m_Hi = ( rank == ranks-1 ) ? 1e30f : lo + w * (rank+1);
+
+	// Ghosts need correct density to contribute pressure force, so the halo covers
+	// two smoothing radii: one for the ghost itself, one for the ghost's own neighbors.
+	m_Halo = 2.0f * fluid->GetParam ( SPH_SMOOTHRADIUS ) / fluid->GetParam ( SPH_SIMSCALE );
+
+	// Create outgoing rings first, then open incoming ones (created by the neighbors).
+	for (int side = 0; side < 2; side++) {
+		int nbr = ( side == 0 ) ? rank-1 : rank+1;
+		if ( nbr < 0 || nbr >= ranks ) continue;
+		#ifdef _MSC_VER
+			sprintf ( name, "Local\\fluids_%s_%d_%d", session.c_str(), rank, nbr );
+		#else
+			sprintf ( name, "/fluids_%s_%d_%d", session.c_str(), rank, nbr );
+		#endif
+		if ( !m_Send[side].Create ( name, ring_size ) ) return false;
+	}
+	for (int side = 0; side < 2; side++) {
+		int nbr = ( side == 0 ) ? rank-1 : rank+1;
+		if ( nbr < 0 || nbr >= ranks ) continue;
+		#ifdef _MSC_VER
+			sprintf ( name, "Local\\fluids_%s_%d_%d", session.c_str(), nbr, rank );
+		#else
+			sprintf ( name, "/fluids_%s_%d_%d", session.c_str(), nbr, rank );
+		#endif
+		if ( !m_Recv[side].Open ( name ) ) return false;
+	}
+	printf ( "Domain: rank %d/%d, axis %d, slab [%f, %f), halo %f\n", rank, ranks, axis, m_Lo, m_Hi, m_Halo );
+	UpdateMemory ();
+	return true;
+}
+
+void FluidDomain::Close ()
+{
+	for (int side = 0; side < 2; side++) {
+		m_Send[side].Close ();
+		m_Recv[side].Close ();
+	}
+	UpdateMemory ();
+}
+
+void FluidDomain::ClipToSlab ( FluidSystem* fluid )
+{
+	Fluid* p;
+	for (int n = fluid->NumPoints()-1; n >= 0; n-- ) {
+		p = fluid->GetFluid ( n );
+		if ( !InSlab ( p->pos ) ) fluid->DeleteParticle ( n );
+	}
+}
+
+// Pushes staged outgoing messages and pulls incoming ones on both sides at once.
+// Both directions progress in the same loop so two neighbors with full rings can never deadlock.
+// Fails if neither direction moves for HALO_TIMEOUT seconds (a neighbor exited or hangs);
+// sent[] then tells how much of each outgoing message made it into the ring.
+bool FluidDomain::Transfer ( int sent[2] )
+{
+	int recv[2] = { 0, 0 };
+	int need[2] = { 0, 0 };
+	int len;
+	bool done, moved;
+	mint::Time start;
+	start.SetSystemTime ( ACC_NSEC );
+
+	for (int side = 0; side < 2; side++) {
+		sent[side] = 0;
+		m_In[side].resize ( HALO_HEADER * sizeof(int) );
+		need[side] = m_Recv[side].IsOpen() ? HALO_HEADER * sizeof(int) : 0;
+	}
+	for (;;) {
+		done = true;
+		moved = false;
+		for (int side = 0; side < 2; side++) {
+			if ( m_Send[side].IsOpen() && sent[side] < (int) m_Out[side].size() ) {
+				len = m_Send[side].Write ( &m_Out[side][0] + sent[side], (int) m_Out[side].size() - sent[side] );
+				sent[side] += len;
+				moved |= ( len > 0 );
+				if ( sent[side] < (int) m_Out[side].size() ) done = false;
+			}
+			if ( recv[side] < need[side] ) {
+				len = m_Recv[side].Read ( &m_In[side][0] + recv[side], need[side] - recv[side] );
+				recv[side] += len;
+				moved |= ( len > 0 );
+				if ( recv[side] == HALO_HEADER * (int) sizeof(int) && need[side] == recv[side] ) {
+					int* hdr = (int*) &m_In[side][0];		// header complete, now we know the body size
+					need[side] += ( hdr[1] + hdr[2] ) * hdr[3];
+					m_In[side].resize ( need[side] );
+				}
+				if ( recv[side] < need[side] ) done = false;
+			}
+		}
+		if ( done ) break;
+		if ( moved ) {
+			start.SetSystemTime ( ACC_NSEC );				// the timeout counts from the last progress
+		} else if ( HaloWaited ( start ) > HALO_TIMEOUT ) {
+			for (int side = 0; side < 2; side++) {
+				bool out = m_Send[side].IsOpen() && sent[side] < (int) m_Out[side].size();
+				if ( out || recv[side] < need[side] )
+					printf ( "ERROR: Halo exchange with rank %d stalled at step %d (sent %d/%d, received %d/%d bytes).\n",
+						side==0 ? m_Rank-1 : m_Rank+1, m_Step, sent[side], m_Send[side].IsOpen() ? (int) m_Out[side].size() : 0, recv[side], need[side] );
+			}
+			return false;
+		}
+		HALO_YIELD ();
+	}
+	return true;
+}
+
+bool FluidDomain::Exchange ( FluidSystem* fluid )
+{
+	int stride = fluid->GetRecordSize ();			// a particle travels with all of its attribute blocks
+	std::vector<char> ghost[2];
+	std::vector<char> stay;							// emigrants still within our halo, kept as ghosts
+	int nmig[2] = { 0, 0 };
+	int nghost[2] = { 0, 0 };
+	int sent[2];
+	bool match = true;
+	Fluid* p;
+	float c;
+
+	m_Halo = 2.0f * fluid->GetParam ( SPH_SMOOTHRADIUS ) / fluid->GetParam ( SPH_SIMSCALE );
+
+	for (int side = 0; side < 2; side++) {
+		m_Out[side].clear ();
+		m_Out[side].resize ( HALO_HEADER * sizeof(int) );
+	}
+
+	// Migration. Walk backwards so the element DelElem swaps into the hole was already visited.
+	// The neighbor picks its ghosts before our migrants arrive, so an emigrant still within
+	// the halo would be missing from our side of the face; we keep it as a ghost ourselves.
+	for (int n = fluid->NumPoints()-1; n >= 0; n-- ) {
+		p = fluid->GetFluid ( n );
+		c = Axis ( p->pos );
+		if ( c >= m_Lo && c < m_Hi ) continue;
+		int side = ( c < m_Lo ) ? 0 : 1;
+		m_Out[side].resize ( m_Out[side].size() + stride );
+		fluid->PackParticle ( n, &m_Out[side][0] + m_Out[side].size() - stride );
+		nmig[side]++;
+		if ( c >= m_Lo - m_Halo && c < m_Hi + m_Halo ) {
+			stay.resize ( stay.size() + stride );
+			fluid->PackParticle ( n, &stay[0] + stay.size() - stride );
+		}
+		fluid->DeleteParticle ( n );
+	}
+
+	// Ghosts: owned particles within the halo of an interior face.
+	for (int n = 0; n < fluid->NumPoints(); n++ ) {
+		p = fluid->GetFluid ( n );
+		c = Axis ( p->pos );
+		if ( m_Rank > 0 && c < m_Lo + m_Halo ) {
+			ghost[0].resize ( ghost[0].size() + stride );
+			fluid->PackParticle ( n, &ghost[0][0] + ghost[0].size() - stride );
+			nghost[0]++;
+		}
+		if ( m_Rank < m_Ranks-1 && c >= m_Hi - m_Halo ) {
+			ghost[1].resize ( ghost[1].size() + stride );
+			fluid->PackParticle ( n, &ghost[1][0] + ghost[1].size() - stride );
+			nghost[1]++;
+		}
+	}
+
+	for (int side = 0; side < 2; side++) {
+		int* hdr = (int*) &m_Out[side][0];
+		hdr[0] = m_Step;
+		hdr[1] = nmig[side];
+		hdr[2] = nghost[side];
+		hdr[3] = stride;
+		m_Out[side].insert ( m_Out[side].end(), ghost[side].begin(), ghost[side].end() );
+	}
+
+	if ( !Transfer ( sent ) ) {
+		// The step is abandoned. A message that reached the ring whole is the neighbor's to
+		// unpack, so only migrants whose message never went out completely are taken back.
+		for (int side = 0; side < 2; side++) {
+			if ( m_Send[side].IsOpen() && sent[side] == (int) m_Out[side].size() ) continue;
+			char* dat = &m_Out[side][0] + HALO_HEADER * sizeof(int);
+			for (int n = 0; n < nmig[side]; n++, dat += stride )
+				fluid->UnpackParticle ( dat );
+		}
+		m_NumGhost = 0;
+		UpdateMemory ();
+		return false;
+	}
+
+	// Migrants become owned, appended first. Ghosts follow so they sit behind all owned particles.
+	// A message from another step or build cannot be trusted, so it fails the exchange.
+	for (int side = 0; side < 2; side++) {
+		if ( !m_Recv[side].IsOpen() ) continue;
+		int* hdr = (int*) &m_In[side][0];
+		if ( hdr[0] != m_Step || hdr[3] != stride ) {
+			printf ( "ERROR: Halo mismatch from rank %d (step %d/%d, stride %d/%d).\n", side==0 ? m_Rank-1 : m_Rank+1, hdr[0], m_Step, hdr[3], stride );
+			match = false;
+			continue;
+		}
+		char* dat = &m_In[side][0] + HALO_HEADER * sizeof(int);
+		for (int n = 0; n < hdr[1]; n++, dat += stride )
+			fluid->UnpackParticle ( dat );
+	}
+	if ( !match ) {
+		m_NumGhost = 0;
+		UpdateMemory ();
+		return false;
+	}
+	int owned = fluid->NumPoints ();
+	for (int side = 0; side < 2; side++) {
+		if ( !m_Recv[side].IsOpen() ) continue;
+		int* hdr = (int*) &m_In[side][0];
+		char* dat = &m_In[side][0] + HALO_HEADER * sizeof(int) + hdr[1] * stride;
+		for (int n = 0; n < hdr[2]; n++, dat += stride )
+			fluid->UnpackParticle ( dat );
+	}
+	for (int n = 0; n < (int) stay.size(); n += stride )
+		fluid->UnpackParticle ( &stay[n] );
+	m_NumGhost = fluid->NumPoints() - owned;
+	m_Step++;
+	UpdateMemory ();
+	return true;
+}
+
+void FluidDomain::DropGhosts ( FluidSystem* fluid )
+{
+	fluid->SetNumPoints ( fluid->NumPoints() - m_NumGhost );
+	m_NumGhost = 0;
+}
@@ -0,0 +1,236 @@
+/*
+  FLUIDS v.1 - SPH Fluid Simulator for CPU and GPU
+  Ensemble of independent simulations
+
+  ZLib license (see fluid_system.h)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "fluid_system.h"
+#include "fluid_ensemble.h"
+#include "mthread.h"
+#include "mtime.h"
+
+#define ENSEMBLE_TIMESTEP	0.001			// same default as the interactive viewer
+
+struct EnsembleParamName {
+	const char*		name;
+	int				id;
+};
+static EnsembleParamName g_EnsembleParams[] = {
+	{ "visc",			SPH_VISC },
+	{ "intstiff",		SPH_INTSTIFF },
+	{ "restdensity",	SPH_RESTDENSITY },
+	{ "extstiff",		SPH_EXTSTIFF },
+	{ "extdamp",		SPH_EXTDAMP },
+	{ "pmass",			SPH_PMASS },
+	{ "smoothradius",	SPH_SMOOTHRADIUS },
+	{ "timestep",		SPH_TIMESTEP },
+	{ "cfl",			SPH_CFL },
+	{ "dt_min",			SPH_DT_MIN },
+	{ "dt_max",			SPH_DT_MAX },
+	{ "pci_tol",		SPH_PCI_TOL },
+	{ "pci_iter",		SPH_PCI_ITER },
+	{ "pbf_iter",		SPH_PBF_ITER },
+	{ "pbf_relax",		SPH_PBF_RELAX },
+	{ "pbf_vort",		SPH_PBF_VORT },
+	{ "pbf_xsph",		SPH_PBF_XSPH },
+	{ "sleep_steps",	SPH_SLEEP_STEPS },
+	{ "sleep_vel",		SPH_SLEEP_VEL },
+	{ "sleep_drho",		SPH_SLEEP_DRHO },
+	{ "block_levels",	SPH_BLOCK_LEVELS },
+	{ "collide_bake",	SPH_COLLIDE_BAKE },
+	{ 0x0,				-1 }
+};
+
+FluidEnsemble::FluidEnsemble ()
+{
+	m_Next = 0;
+	m_Steps = 0;
+	m_OutEvery = 0;
+}
+
+FluidEnsemble::~FluidEnsemble ()
+{
+	Clear ();
+}
+
+void FluidEnsemble::Clear ()
+{
+	for (int n = 0; n < (int) m_Members.size(); n++ ) {
+		if ( m_Members[n].out != 0x0 ) fclose ( m_Members[n].out );
+		delete m_Members[n].fluid;
+	}
+	m_Members.clear ();
+}
+
+int FluidEnsemble::Add ( int example, int nmax )
+{
+	EnsembleMember m;
+	m.fluid = new FluidSystem;
+	m.fluid->SetHeadless ( true );
+	m.fluid->SetTiming ( false );
+	m.example = example;
+	m.nmax = nmax;
+	m.steps = 0;
+	m.sec = 0;
+	m.out = 0x0;
+	m_Members.push_back ( m );
+	return (int) m_Members.size() - 1;
+}
+
+void FluidEnsemble::SetParam ( int n, int p, double v )
+{
+	m_Members[n].fluid->SetParamOverride ( p, v );
+}
+
+// Config format, one member per line ('#' starts a comment):
+//   <example> [particles <n>] [pcisph 0|1] [pbf 0|1] [boundary 0|1] [visc <v>] [intstiff <v>] [restdensity <v>] ...
+bool FluidEnsemble::Load ( std::string fname, int nmax )
+{
+	FILE* fp = fopen ( fname.c_str(), "rt" );
+	if ( fp == 0x0 ) {
+		printf ( "Ensemble: cannot open %s\n", fname.c_str() );
+		return false;
+	}
+	char line[1024];
+	int lnum = 0;
+	while ( fgets ( line, 1024, fp ) != 0x0 ) {
+		lnum++;
+		char* hash = strchr ( line, '#' );
+		if ( hash != 0x0 ) *hash = '\0';
+		char* tok = strtok ( line, " \t\r\n" );
+		if ( tok == 0x0 ) continue;
+
+		int n = Add ( atoi ( tok ), nmax );
+		while ( (tok = strtok ( 0x0, " \t\r\n" )) != 0x0 ) {
+			char* val = strtok ( 0x0, " \t\r\n" );
+			if ( val == 0x0 ) {
+				printf ( "Ensemble: %s:%d: missing value for '%s'\n", fname.c_str(), lnum, tok );
+				break;
+			}
+			if ( strcmp ( tok, "particles" ) == 0 ) {
+				m_Members[n].nmax = atoi ( val );
+				continue;
+			}
+			if ( strcmp ( tok, "pcisph" ) == 0 ) {				// toggles survive Reset
+				if ( ( atoi ( val ) != 0 ) != m_Members[n].fluid->GetToggle ( USE_PCISPH ) ) m_Members[n].fluid->Toggle ( USE_PCISPH );
+				continue;
+			}
+			if ( strcmp ( tok, "pbf" ) == 0 ) {
+				if ( ( atoi ( val ) != 0 ) != m_Members[n].fluid->GetToggle ( USE_PBF ) ) m_Members[n].fluid->Toggle ( USE_PBF );
+				continue;
+			}
+			if ( strcmp ( tok, "boundary" ) == 0 ) {
+				if ( ( atoi ( val ) != 0 ) != m_Members[n].fluid->GetToggle ( USE_BOUNDARY ) ) m_Members[n].fluid->Toggle ( USE_BOUNDARY );
+				continue;
+			}
+			int p = 0;
+			while ( g_EnsembleParams[p].name != 0x0 && strcmp ( g_EnsembleParams[p].name, tok ) != 0 ) p++;
+			if ( g_EnsembleParams[p].name == 0x0 )
+				printf ( "Ensemble: %s:%d: unknown parameter '%s'\n", fname.c_str(), lnum, tok );
+			else
+				SetParam ( n, g_EnsembleParams[p].id, atof ( val ) );
+		}
+	}
+	fclose ( fp );
+	printf ( "Ensemble: %d members from %s\n", (int) m_Members.size(), fname.c_str() );
+	return m_Members.size() > 0;
+}
+
+void FluidEnsemble::Setup ( std::string out_prefix )
+{
+	char fn[512];
+	for (int n = 0; n < (int) m_Members.size(); n++ ) {
+		EnsembleMember& m = m_Members[n];
+		m.fluid->Initialize ( BFLUID, m.nmax );
+		m.fluid->SetParam ( SPH_TIMESTEP, (float) ENSEMBLE_TIMESTEP );
+		m.fluid->SPH_CreateExample ( m.example, m.nmax );
+		m.steps = 0;
+		m.sec = 0;
+
+		if ( out_prefix.empty() ) continue;
+		sprintf ( fn, "%s_%03d.txt", out_prefix.c_str(), n );
+		m.out = fopen ( fn, "wt" );
+		if ( m.out == 0x0 ) { printf ( "Ensemble: cannot write %s\n", fn ); continue; }
+		fprintf ( m.out, "# member %d  example %d  particles %d\n", n, m.example, m.fluid->NumPoints() );
+		fprintf ( m.out, "# visc %g  intstiff %g  restdensity %g  timestep %g\n", m.fluid->GetParam(SPH_VISC), m.fluid->GetParam(SPH_INTSTIFF), m.fluid->GetParam(SPH_RESTDENSITY), m.fluid->GetParam(SPH_TIMESTEP) );
+		fprintf ( m.out, "# step time particles invalid avg_density max_speed kinetic_energy\n" );
+	}
+}
+
+void FluidEnsemble::Output ( EnsembleMember& m )
+{
+	FluidSystem* f = m.fluid;
+	double dsum = 0, ke = 0, vmax = 0;
+	int num = f->NumPoints(), good = 0;
+	for (int i = 0; i < num; i++ ) {
+		Fluid* p = f->GetFluid ( i );
+		double v2 = p->vel.Dot ( p->vel );
+		double rho = 1.0 / p->density;						// pressure pass stores 1/density
+		if ( !( v2 < 1e30 ) || !( rho > 0 && rho < 1e30 ) ) continue;	// isolated or blown-up particle
+		dsum += rho;
+		ke += v2;
+		if ( v2 > vmax ) vmax = v2;
+		good++;
+	}
+	ke *= 0.5 * f->GetParam ( SPH_PMASS );
+	fprintf ( m.out, "%d %f %d %d %f %f %g\n", m.steps, f->GetTime(), num, num - good, good > 0 ? dsum / good : 0.0, sqrt ( vmax ), ke );
+}
+
+void FluidEnsemble::Step ( EnsembleMember& m )
+{
+	mint::Time start, stop;
+	start.SetSystemTime ( ACC_NSEC );
+	for (int s = 0; s < m_Steps; s++ ) {
+		m.fluid->Run ();
+		m.steps++;
+		if ( m.out != 0x0 && m_OutEvery > 0 && m.steps % m_OutEvery == 0 ) Output ( m );
+	}
+	stop.SetSystemTime ( ACC_NSEC );
+	stop = stop - start;
+	m.sec += stop.GetSec ();
+	if ( m.out != 0x0 ) fflush ( m.out );
+}
+
+void FluidEnsemble::RunJob ( void* ctx, int, int )
+{
+	FluidEnsemble* e = (FluidEnsemble*) ctx;
+	long n;
+	while ( (n = ThreadPool::FetchAdd ( &e->m_Next, 1 )) < (long) e->m_Members.size() )
+		e->Step ( e->m_Members[n] );
+}
+
+void FluidEnsemble::Run ( ThreadPool* pool, int steps, int out_every )
+{
+	mint::Time start, stop;
+	m_Steps = steps;
+	m_OutEvery = out_every;
+	m_Next = 0;
+
+	start.SetSystemTime ( ACC_NSEC );
+	if ( pool != 0x0 )
+		pool->Run ( RunJob, this );
+	else
+		RunJob ( this, 0, 1 );
+	stop.SetSystemTime ( ACC_NSEC );
+	stop = stop - start;
+
+	double psteps = 0, busy = 0;
+	int num = 0;
+	for (int n = 0; n < (int) m_Members.size(); n++ ) {
+		psteps += (double) m_Members[n].fluid->NumPoints() * steps;
+		busy += m_Members[n].sec;
+		num += m_Members[n].fluid->NumPoints();
+	}
+	double wall = stop.GetSec ();
+	printf ( "Ensemble: %d members x %d steps on %d threads in %.3f sec\n", (int) m_Members.size(), steps, pool ? pool->GetNumThreads() : 1, wall );
+	printf ( "Ensemble: %.3g particle-steps/s aggregate, %.1f%% busy\n", wall > 0 ? psteps / wall : 0.0,
+		wall > 0 ? 100.0 * busy / ( wall * (pool ? pool->GetNumThreads() : 1) ) : 0.0 );
+	MemAccount::Global().Report ( num );
+	Profiler::Global().Report ();				// phases of all members together
+}
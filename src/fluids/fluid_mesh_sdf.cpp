@@ -0,0 +1,624 @@
+/*
+  FLUIDS v.1 - SPH Fluid Simulator for CPU and GPU
+  Triangle mesh colliders
+
+  ZLib license (see fluid_system.h)
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+
+#include "fluid_mesh_sdf.h"
+#include "mthread.h"
+#include "mtime.h"
+
+struct MeshSDFHeader {
+	int					magic;
+	int					version;
+	unsigned long long	hash;
+	float				cell, band;
+	float				min[3];
+	int					res[3];
+};
+
+static void BakeJob ( void* ctx, int t, int nt )
+{
+	FluidMeshSDF* m = (FluidMeshSDF*) ctx;
+	int start, end;
+	ThreadPool::GetRange ( m->GetBakeSlices(), t, nt, start, end );
+	m->BakeRange ( start, end );
+}
+
+// Orders triangles by centroid along the split axis
+struct CentroidLess {
+	const float*	cent;
+	bool operator() ( int a, int b ) const		{ return cent[a] < cent[b]; }
+};
+
+FluidMeshSDF::FluidMeshSDF ()
+{
+	m_BakeSDF = 0x0;
+	m_BakeKnown = 0x0;
+	m_BakeBand = 0;
+	m_BakeSec = 0;
+	m_bCached = false;
+	m_Known = 0;
+}
+
+//------------------------------------------------------ PLY
+
+struct PlyProp {
+	std::string			type;
+	std::string			count;			// type of the count, lists only
+	std::string			name;
+};
+struct PlyElem {
+	std::string			name;
+	int					num;
+	std::vector<PlyProp>	prop;
+};
+
+static int PlySize ( const char* type )
+{
+	if ( !strcmp(type, "char") || !strcmp(type, "uchar") || !strcmp(type, "int8") || !strcmp(type, "uint8") ) return 1;
+	if ( !strcmp(type, "short") || !strcmp(type, "ushort") || !strcmp(type, "int16") || !strcmp(type, "uint16") ) return 2;
+	if ( !strcmp(type, "double") || !strcmp(type, "float64") ) return 8;
+	return 4;
+}
+
+static bool PlyRead ( FILE* fp, bool bAscii, const std::string& type, double& v )
+{
+	if ( bAscii ) return fscanf ( fp, "%lf", &v ) == 1;
+	unsigned char b[8];
+	int size = PlySize ( type.c_str() );
+	if ( fread ( b, 1, size, fp ) != (size_t) size ) return false;		// little endian host
+	const char* t = type.c_str();
+	if ( !strcmp(t, "char") || !strcmp(t, "int8") )				v = *(signed char*) b;
+	else if ( !strcmp(t, "uchar") || !strcmp(t, "uint8") )		v = *(unsigned char*) b;
+	else if ( !strcmp(t, "short") || !strcmp(t, "int16") )		v = *(short*) b;
+	else if ( !strcmp(t, "ushort") || !strcmp(t, "uint16") )	v = *(unsigned short*) b;
+	else if ( !strcmp(t, "int") || !strcmp(t, "int32") )		v = *(int*) b;
+	else if ( !strcmp(t, "uint") || !strcmp(t, "uint32") )		v = *(unsigned int*) b;
+	else if ( size == 8 )										v = *(double*) b;
+	else														v = *(float*) b;
+	return true;
+}
+
+bool FluidMeshSDF::LoadPly ( std::string fname, float scale )
+{
+	std::vector<PlyElem> elem;
+	char line[1024], w0[256], w1[256], w2[256], w3[256], w4[256];
+	bool bAscii = true, ok = true;
+
+	FILE* fp = fopen ( fname.c_str(), "rb" );
+	if ( fp == 0x0 ) {
+		printf ( "ERROR: Mesh SDF: cannot open %s\n", fname.c_str() );
+		return false;
+	}
+	if ( fgets ( line, 1024, fp ) == 0x0 || strncmp ( line, "ply", 3 ) != 0 ) {
+		printf ( "ERROR: Mesh SDF: not a ply file. %s\n", fname.c_str() );
+		fclose ( fp );
+		return false;
+	}
+	while ( fgets ( line, 1024, fp ) != 0x0 ) {
+		int n = sscanf ( line, "%255s %255s %255s %255s %255s", w0, w1, w2, w3, w4 );
+		if ( n < 1 || !strcmp(w0, "comment") || !strcmp(w0, "obj_info") ) continue;
+		if ( !strcmp(w0, "end_header") ) break;
+		if ( !strcmp(w0, "format") && n >= 2 ) {
+			bAscii = !strcmp(w1, "ascii");
+			if ( !bAscii && strcmp(w1, "binary_little_endian") ) {
+				printf ( "ERROR: Mesh SDF: %s format not supported. %s\n", w1, fname.c_str() );
+				fclose ( fp );
+				return false;
+			}
+		} else if ( !strcmp(w0, "element") && n >= 3 ) {
+			elem.push_back ( PlyElem() );
+			elem.back().name = w1;
+			elem.back().num = atoi ( w2 );
+		} else if ( !strcmp(w0, "property") && elem.size() > 0 ) {
+			PlyProp p;
+			if ( !strcmp(w1, "list") && n >= 5 ) { p.count = w2; p.type = w3; p.name = w4; }
+			else if ( n >= 3 ) { p.type = w1; p.name = w2; }
+			elem.back().prop.push_back ( p );
+		}
+	}
+
+	// Read data
+	std::vector<double> val;
+	std::vector<int> poly;
+	double v, cnt;
+	int base = GetNumVerts ();
+	for (int e = 0; e < (int) elem.size() && ok; e++ ) {
+		PlyElem& el = elem[e];
+		int xi = -1, yi = -1, zi = -1, fi = -1;
+		for (int j = 0; j < (int) el.prop.size(); j++ ) {
+			if ( el.prop[j].name == "x" ) xi = j;
+			if ( el.prop[j].name == "y" ) yi = j;
+			if ( el.prop[j].name == "z" ) zi = j;
+			if ( el.prop[j].name == "vertex_indices" || el.prop[j].name == "vertex_index" ) fi = j;
+		}
+		if ( el.name == "vertex" && ( xi == -1 || yi == -1 || zi == -1 ) ) {
+			printf ( "ERROR: Mesh SDF: vertex data not found. %s\n", fname.c_str() );
+			ok = false;
+			break;
+		}
+		val.resize ( el.prop.size() );
+		for (int i = 0; i < el.num && ok; i++ ) {
+			for (int j = 0; j < (int) el.prop.size() && ok; j++ ) {
+				if ( el.prop[j].count.empty() ) {
+					ok = PlyRead ( fp, bAscii, el.prop[j].type, val[j] );
+					continue;
+				}
+				ok = PlyRead ( fp, bAscii, el.prop[j].count, cnt );
+				poly.clear ();
+				for (int k = 0; k < (int) cnt && ok; k++ ) {
+					ok = PlyRead ( fp, bAscii, el.prop[j].type, v );
+					poly.push_back ( base + (int) v );
+				}
+				if ( j != fi || el.name != "face" ) continue;
+				for (int k = 2; k < (int) poly.size(); k++ ) {		// fan
+					m_Tri.push_back ( poly[0] );
+					m_Tri.push_back ( poly[k-1] );
+					m_Tri.push_back ( poly[k] );
+				}
+			}
+			if ( ok && el.name == "vertex" ) {
+				m_Vert.push_back ( float(val[xi] * scale) );
+				m_Vert.push_back ( float(val[zi] * scale) );
+				m_Vert.push_back ( float(val[yi] * scale) );
+			}
+		}
+	}
+	fclose ( fp );
+	if ( !ok ) {
+		printf ( "ERROR: Mesh SDF: unexpected end of data. %s\n", fname.c_str() );
+		return false;
+	}
+	for (int t = 0; t < (int) m_Tri.size(); t++ ) {
+		if ( m_Tri[t] < 0 || m_Tri[t] >= GetNumVerts() ) {
+			printf ( "ERROR: Mesh SDF: face refers to vertex %d of %d. %s\n", m_Tri[t], GetNumVerts(), fname.c_str() );
+			return false;
+		}
+	}
+	printf ( "Mesh SDF: %s, %d verts, %d triangles\n", fname.c_str(), GetNumVerts(), GetNumTris() );
+	return true;
+}
+
+void FluidMeshSDF::AddTriangle ( Vector3DF a, Vector3DF b, Vector3DF c )
+{
+	int base = GetNumVerts ();
+	Vector3DF* v[3] = { &a, &b, &c };
+	for (int k = 0; k < 3; k++ ) {
+		m_Vert.push_back ( v[k]->x );
+		m_Vert.push_back ( v[k]->y );
+		m_Vert.push_back ( v[k]->z );
+		m_Tri.push_back ( base + k );
+	}
+}
+
+void FluidMeshSDF::Translate ( Vector3DF offset )
+{
+	for (int i = 0; i < (int) m_Vert.size(); i += 3 ) {
+		m_Vert[i] += offset.x;
+		m_Vert[i+1] += offset.y;
+		m_Vert[i+2] += offset.z;
+	}
+}
+
+Vector3DF FluidMeshSDF::GetMin ()
+{
+	Vector3DF m ( 1e30f, 1e30f, 1e30f );
+	for (int i = 0; i < (int) m_Vert.size(); i += 3 ) {
+		if ( m_Vert[i] < m.x ) m.x = m_Vert[i];
+		if ( m_Vert[i+1] < m.y ) m.y = m_Vert[i+1];
+		if ( m_Vert[i+2] < m.z ) m.z = m_Vert[i+2];
+	}
+	return m;
+}
+
+Vector3DF FluidMeshSDF::GetMax ()
+{
+	Vector3DF m ( -1e30f, -1e30f, -1e30f );
+	for (int i = 0; i < (int) m_Vert.size(); i += 3 ) {
+		if ( m_Vert[i] > m.x ) m.x = m_Vert[i];
+		if ( m_Vert[i+1] > m.y ) m.y = m_Vert[i+1];
+		if ( m_Vert[i+2] > m.z ) m.z = m_Vert[i+2];
+	}
+	return m;
+}
+
+unsigned long long FluidMeshSDF::GetHash ()
+{
+	unsigned long long h = 14695981039346656037ULL;
+	const unsigned char* b = m_Vert.size() ? (const unsigned char*) &m_Vert[0] : 0x0;
+	for (size_t i = 0; i < m_Vert.size() * sizeof(float); i++ ) { h ^= b[i]; h *= 1099511628211ULL; }
+	b = m_Tri.size() ? (const unsigned char*) &m_Tri[0] : 0x0;
+	for (size_t i = 0; i < m_Tri.size() * sizeof(int); i++ ) { h ^= b[i]; h *= 1099511628211ULL; }
+	return h;
+}
+
+//------------------------------------------------------ Closest triangle
+
+static inline void Sub ( const float* a, const float* b, float* r )		{ r[0] = a[0]-b[0]; r[1] = a[1]-b[1]; r[2] = a[2]-b[2]; }
+static inline float Dot ( const float* a, const float* b )				{ return a[0]*b[0] + a[1]*b[1] + a[2]*b[2]; }
+static inline void Cross ( const float* a, const float* b, float* r )	{ r[0] = a[1]*b[2]-a[2]*b[1]; r[1] = a[2]*b[0]-a[0]*b[2]; r[2] = a[0]*b[1]-a[1]*b[0]; }
+static inline void Normalize ( float* a )
+{
+	float len = sqrtf ( Dot ( a, a ) );
+	if ( len > 0 ) { a[0] /= len; a[1] /= len; a[2] /= len; }
+}
+
+// Closest point q on triangle abc and the feature it lies on: 0 face, 1-3 edges ab bc ca,
+// 4-6 vertices a b c (Ericson, Real-Time Collision Detection 5.1.5)
+static int ClosestOnTri ( const float* p, const float* a, const float* b, const float* c, float* q )
+{
+	float ab[3], ac[3], ap[3], bp[3], cp[3];
+	Sub ( b, a, ab ); Sub ( c, a, ac ); Sub ( p, a, ap );
+	float d1 = Dot ( ab, ap ), d2 = Dot ( ac, ap );
+	if ( d1 <= 0 && d2 <= 0 ) { memcpy ( q, a, 3*sizeof(float) ); return 4; }
+	Sub ( p, b, bp );
+	float d3 = Dot ( ab, bp ), d4 = Dot ( ac, bp );
+	if ( d3 >= 0 && d4 <= d3 ) { memcpy ( q, b, 3*sizeof(float) ); return 5; }
+	float vc = d1*d4 - d3*d2;
+	if ( vc <= 0 && d1 >= 0 && d3 <= 0 ) {
+		float v = d1 / ( d1 - d3 );
+		for (int k = 0; k < 3; k++ ) q[k] = a[k] + v * ab[k];
+		return 1;
+	}
+	Sub ( p, c, cp );
+	float d5 = Dot ( ab, cp ), d6 = Dot ( ac, cp );
+	if ( d6 >= 0 && d5 <= d6 ) { memcpy ( q, c, 3*sizeof(float) ); return 6; }
+	float vb = d5*d2 - d1*d6;
+	if ( vb <= 0 && d2 >= 0 && d6 <= 0 ) {
+		float w = d2 / ( d2 - d6 );
+		for (int k = 0; k < 3; k++ ) q[k] = a[k] + w * ac[k];
+		return 3;
+	}
+	float va = d3*d6 - d5*d4;
+	if ( va <= 0 && ( d4 - d3 ) >= 0 && ( d5 - d6 ) >= 0 ) {
+		float w = ( d4 - d3 ) / ( ( d4 - d3 ) + ( d5 - d6 ) );
+		for (int k = 0; k < 3; k++ ) q[k] = b[k] + w * ( c[k] - b[k] );
+		return 2;
+	}
+	float sum = va + vb + vc;
+	if ( sum <= 0 ) { memcpy ( q, a, 3*sizeof(float) ); return 4; }		// degenerate
+	float v = vb / sum, w = vc / sum;
+	for (int k = 0; k < 3; k++ ) q[k] = a[k] + v * ab[k] + w * ac[k];
+	return 0;
+}
+
+// Face normals, and the angle-weighted pseudo normals of the edges and vertices
+// (Baerentzen and Aanaes), stored with each triangle in m_Pseudo. The winding is
+// flipped if needed so the normals point out of the enclosed volume.
+void FluidMeshSDF::BuildNormals ()
+{
+	int nt = GetNumTris ();
+	float e1[3], e2[3], n[3], vol = 0;
+	for (int t = 0; t < nt; t++ ) {
+		Cross ( &m_Vert[ m_Tri[t*3+1]*3 ], &m_Vert[ m_Tri[t*3+2]*3 ], n );
+		vol += Dot ( &m_Vert[ m_Tri[t*3]*3 ], n );
+	}
+	if ( vol < 0 )
+		for (int t = 0; t < nt; t++ ) std::swap ( m_Tri[t*3+1], m_Tri[t*3+2] );
+
+	std::vector<float> face ( nt*3 ), vert ( m_Vert.size(), 0.0f ), edge;
+	std::map<unsigned long long, int> edges;
+	std::vector<int> tedge ( nt*3 );
+	for (int t = 0; t < nt; t++ ) {
+		const int* v = &m_Tri[t*3];
+		Sub ( &m_Vert[v[1]*3], &m_Vert[v[0]*3], e1 );
+		Sub ( &m_Vert[v[2]*3], &m_Vert[v[0]*3], e2 );
+		Cross ( e1, e2, &face[t*3] );
+		Normalize ( &face[t*3] );
+		for (int k = 0; k < 3; k++ ) {
+			// angle at corner k
+			Sub ( &m_Vert[ v[(k+1)%3]*3 ], &m_Vert[ v[k]*3 ], e1 );
+			Sub ( &m_Vert[ v[(k+2)%3]*3 ], &m_Vert[ v[k]*3 ], e2 );
+			Normalize ( e1 ); Normalize ( e2 );
+			float c = Dot ( e1, e2 );
+			float ang = acosf ( c < -1 ? -1 : c > 1 ? 1 : c );
+			for (int j = 0; j < 3; j++ ) vert[ v[k]*3+j ] += ang * face[t*3+j];
+			// edge k runs from corner k to k+1
+			int a = v[k], b = v[(k+1)%3];
+			unsigned long long key = ( (unsigned long long) std::min(a, b) << 32 ) | (unsigned int) std::max(a, b);
+			std::map<unsigned long long, int>::iterator it = edges.find ( key );
+			if ( it == edges.end() ) {
+				it = edges.insert ( std::make_pair ( key, (int) edge.size() / 3 ) ).first;
+				edge.push_back ( 0 ); edge.push_back ( 0 ); edge.push_back ( 0 );
+			}
+			tedge[t*3+k] = it->second;
+			for (int j = 0; j < 3; j++ ) edge[ it->second*3+j ] += face[t*3+j];
+		}
+	}
+
+	m_Pseudo.resize ( nt * 21 );
+	for (int t = 0; t < nt; t++ ) {
+		float* ps = &m_Pseudo[t*21];
+		memcpy ( ps, &face[t*3], 3*sizeof(float) );
+		for (int k = 0; k < 3; k++ ) {
+			memcpy ( ps + 3 + k*3, &edge[ tedge[t*3+k]*3 ], 3*sizeof(float) );
+			memcpy ( ps + 12 + k*3, &vert[ m_Tri[t*3+k]*3 ], 3*sizeof(float) );
+		}
+	}
+}
+
+void FluidMeshSDF::BuildBVH ()
+{
+	int nt = GetNumTris ();
+	m_Order.resize ( nt );
+	for (int t = 0; t < nt; t++ ) m_Order[t] = t;
+	m_Node.clear ();
+	m_Node.reserve ( 2 * ( nt / MESH_BVH_LEAF + 1 ) );
+	m_Node.push_back ( Node() );
+	m_Cent.resize ( nt );
+	BuildNode ( 0, 0, nt );
+	m_Cent.clear ();
+
+	// corners and pseudo normals in leaf order, so a leaf reads contiguous memory
+	std::vector<float> pseudo ( m_Pseudo.size() );
+	m_Corner.resize ( nt * 9 );
+	for (int i = 0; i < nt; i++ ) {
+		int t = m_Order[i];
+		for (int k = 0; k < 3; k++ )
+			memcpy ( &m_Corner[i*9 + k*3], &m_Vert[ m_Tri[t*3+k]*3 ], 3*sizeof(float) );
+		memcpy ( &pseudo[i*21], &m_Pseudo[t*21], 21*sizeof(float) );
+	}
+	m_Pseudo.swap ( pseudo );
+}
+
+// Fills node with the bounds of triangles m_Order[first, first+count); inner nodes
+// split at the median centroid of their longest centroid axis.
+int FluidMeshSDF::BuildNode ( int node, int first, int count )
+{
+	float cmin[3] = { 1e30f, 1e30f, 1e30f }, cmax[3] = { -1e30f, -1e30f, -1e30f };
+	Node n;
+	for (int k = 0; k < 3; k++ ) { n.min[k] = 1e30f; n.max[k] = -1e30f; }
+	for (int i = first; i < first + count; i++ ) {
+		const int* v = &m_Tri[ m_Order[i]*3 ];
+		for (int k = 0; k < 3; k++ ) {
+			float lo = std::min ( m_Vert[v[0]*3+k], std::min ( m_Vert[v[1]*3+k], m_Vert[v[2]*3+k] ) );
+			float hi = std::max ( m_Vert[v[0]*3+k], std::max ( m_Vert[v[1]*3+k], m_Vert[v[2]*3+k] ) );
+			if ( lo < n.min[k] ) n.min[k] = lo;
+			if ( hi > n.max[k] ) n.max[k] = hi;
+			if ( lo + hi < cmin[k] ) cmin[k] = lo + hi;
+			if ( lo + hi > cmax[k] ) cmax[k] = lo + hi;
+		}
+	}
+	if ( count <= MESH_BVH_LEAF ) {
+		n.first = first;
+		n.count = count;
+		m_Node[node] = n;
+		return node;
+	}
+	int axis = 0;
+	for (int k = 1; k < 3; k++ ) if ( cmax[k] - cmin[k] > cmax[axis] - cmin[axis] ) axis = k;
+	for (int i = first; i < first + count; i++ ) {
+		const int* v = &m_Tri[ m_Order[i]*3 ];
+		m_Cent[ m_Order[i] ] = m_Vert[v[0]*3+axis] + m_Vert[v[1]*3+axis] + m_Vert[v[2]*3+axis];
+	}
+	CentroidLess less;
+	less.cent = &m_Cent[0];
+	int half = count / 2;
+	std::nth_element ( m_Order.begin() + first, m_Order.begin() + first + half, m_Order.begin() + first + count, less );
+
+	n.first = (int) m_Node.size ();
+	n.count = 0;
+	m_Node[node] = n;
+	m_Node.push_back ( Node() );
+	m_Node.push_back ( Node() );
+	BuildNode ( n.first, first, half );
+	BuildNode ( n.first + 1, first + half, count - half );
+	return node;
+}
+
+static inline float BoxDist2 ( const float* p, const float* lo, const float* hi )
+{
+	float d2 = 0, e;
+	for (int k = 0; k < 3; k++ ) {
+		e = ( p[k] < lo[k] ) ? lo[k] - p[k] : ( p[k] > hi[k] ) ? p[k] - hi[k] : 0;
+		d2 += e * e;
+	}
+	return d2;
+}
+
+float FluidMeshSDF::Closest ( const float* p, float maxd, int& tri )
+{
+	int stack[64], sp = 0;
+	float best2 = maxd * maxd, d2, q[3], bq[3] = { 0, 0, 0 }, diff[3];
+	int region, bregion = 0;
+	tri = -1;
+	stack[sp++] = 0;
+	while ( sp > 0 ) {
+		const Node& n = m_Node[ stack[--sp] ];
+		if ( BoxDist2 ( p, n.min, n.max ) >= best2 ) continue;
+		if ( n.count > 0 ) {
+			for (int i = n.first; i < n.first + n.count; i++ ) {
+				const float* c = &m_Corner[i*9];
+				region = ClosestOnTri ( p, c, c+3, c+6, q );
+				Sub ( p, q, diff );
+				d2 = Dot ( diff, diff );
+				if ( d2 < best2 ) { best2 = d2; tri = i; bregion = region; memcpy ( bq, q, 3*sizeof(float) ); }
+			}
+		} else {
+			const Node& l = m_Node[n.first];
+			const Node& r = m_Node[n.first+1];
+			bool bLeft = BoxDist2 ( p, l.min, l.max ) < BoxDist2 ( p, r.min, r.max );
+			stack[sp++] = bLeft ? n.first + 1 : n.first;		// nearer child on top
+			stack[sp++] = bLeft ? n.first : n.first + 1;
+		}
+	}
+	if ( tri < 0 ) return maxd;
+	Sub ( p, bq, diff );
+	float d = sqrtf ( best2 );
+	return ( Dot ( diff, &m_Pseudo[ tri*21 + bregion*3 ] ) < 0 ) ? -d : d;
+}
+
+//------------------------------------------------------ Bake
+
+bool FluidMeshSDF::Bake ( FluidSDF& sdf, float cell, float band, ThreadPool* pool, std::string cache )
+{
+	mint::Time start, stop;
+	start.SetSystemTime ( ACC_NSEC );
+	m_bCached = false;
+	if ( GetNumTris() == 0 || cell <= 0 ) {
+		printf ( "ERROR: Mesh SDF: nothing to bake (%d triangles, cell %f).\n", GetNumTris(), cell );
+		return false;
+	}
+	if ( band < 2 * cell ) band = 2 * cell;				// a surface between two samples is in band of both
+
+	// Field over the bounds plus the band and a border of samples that are never in band,
+	// where the flood fill starts
+	Vector3DF lo = GetMin (), hi = GetMax ();
+	float pad = band + 2 * cell;
+	sdf.min.Set ( lo.x - pad, lo.y - pad, lo.z - pad );
+	sdf.cell = cell;
+	sdf.res[0] = (int) ceil ( ( hi.x - lo.x + 2*pad ) / cell ) + 1;
+	sdf.res[1] = (int) ceil ( ( hi.y - lo.y + 2*pad ) / cell ) + 1;
+	sdf.res[2] = (int) ceil ( ( hi.z - lo.z + 2*pad ) / cell ) + 1;
+
+	unsigned long long hash = GetHash ();
+	char key[64];
+	std::string fname;										// the cache prefix is a path of any length
+	if ( !cache.empty() ) {
+		sprintf ( key, "_%016llx_%g.sdf", hash, cell );
+		fname = cache + key;
+		if ( LoadCache ( fname, sdf, hash, band ) ) {
+			m_bCached = true;
+			stop.SetSystemTime ( ACC_NSEC );
+			stop = stop - start;
+			m_BakeSec = stop.GetSec ();
+			return true;
+		}
+	}
+
+	BuildNormals ();
+	BuildBVH ();
+	std::vector<char> known;
+	sdf.dist.resize ( (long) sdf.res[0] * sdf.res[1] * sdf.res[2] );
+	known.assign ( sdf.dist.size(), 0 );
+	m_BakeSDF = &sdf;
+	m_BakeKnown = &known;
+	m_BakeBand = band;
+	if ( pool != 0x0 )
+		pool->Run ( BakeJob, this );
+	else
+		BakeRange ( 0, sdf.res[2] );
+	FloodSign ( sdf, known, band );
+	m_BakeSDF = 0x0;
+	m_BakeKnown = 0x0;
+
+	if ( !cache.empty() ) SaveCache ( fname, sdf, hash, band );
+	stop.SetSystemTime ( ACC_NSEC );
+	stop = stop - start;
+	m_BakeSec = stop.GetSec ();
+	return true;
+}
+
+void FluidMeshSDF::BakeRange ( int z0, int z1 )
+{
+	FluidSDF& sdf = *m_BakeSDF;
+	int rx = sdf.res[0], ry = sdf.res[1];
+	float band = m_BakeBand;
+	float p[3];
+	int tri;
+	long i;
+	for (int z = z0; z < z1; z++ )
+		for (int y = 0; y < ry; y++ ) {
+			i = ( (long) z * ry + y ) * rx;
+			for (int x = 0; x < rx; x++, i++ ) {
+				p[0] = sdf.min.x + x * sdf.cell;
+				p[1] = sdf.min.y + y * sdf.cell;
+				p[2] = sdf.min.z + z * sdf.cell;
+				sdf.dist[i] = Closest ( p, band, tri );
+				(*m_BakeKnown)[i] = ( tri >= 0 ) ? 1 : 0;
+			}
+		}
+}
+
+// Samples outside the band that connect to the border of the field are outside (+band),
+// the rest are enclosed by the surface (-band)
+void FluidMeshSDF::FloodSign ( FluidSDF& sdf, std::vector<char>& known, float band )
+{
+	int rx = sdf.res[0], ry = sdf.res[1], rz = sdf.res[2];
+	long sy = rx, sz = (long) rx * ry;
+	std::vector<long> stack;
+	long i, j;
+	int x, y, z;
+	m_Known = 0;
+	for (i = 0; i < (long) known.size(); i++ ) {
+		if ( known[i] == 1 ) { m_Known++; continue; }
+		x = int( i % rx ); y = int( ( i / sy ) % ry ); z = int( i / sz );
+		if ( x == 0 || y == 0 || z == 0 || x == rx-1 || y == ry-1 || z == rz-1 ) { known[i] = 2; stack.push_back ( i ); }
+	}
+	while ( stack.size() > 0 ) {
+		i = stack.back ();
+		stack.pop_back ();
+		x = int( i % rx ); y = int( ( i / sy ) % ry ); z = int( i / sz );
+		long nbr[6] = { x > 0 ? i-1 : -1, x < rx-1 ? i+1 : -1, y > 0 ? i-sy : -1, y < ry-1 ? i+sy : -1, z > 0 ? i-sz : -1, z < rz-1 ? i+sz : -1 };
+		for (int k = 0; k < 6; k++ ) {
+			j = nbr[k];
+			if ( j >= 0 && known[j] == 0 ) { known[j] = 2; stack.push_back ( j ); }
+		}
+	}
+	for (i = 0; i < (long) known.size(); i++ )
+		if ( known[i] == 0 ) sdf.dist[i] = -band;
+}
+
+bool FluidMeshSDF::LoadCache ( std::string fname, FluidSDF& sdf, unsigned long long hash, float band )
+{
+	MeshSDFHeader hdr;
+	FILE* fp = fopen ( fname.c_str(), "rb" );
+	if ( fp == 0x0 ) return false;
+	bool ok = fread ( &hdr, sizeof(hdr), 1, fp ) == 1;
+	ok = ok && hdr.magic == MESH_SDF_MAGIC && hdr.version == MESH_SDF_VERSION && hdr.hash == hash;
+	ok = ok && hdr.cell == sdf.cell && hdr.band == band;
+	ok = ok && hdr.min[0] == sdf.min.x && hdr.min[1] == sdf.min.y && hdr.min[2] == sdf.min.z;
+	ok = ok && hdr.res[0] == sdf.res[0] && hdr.res[1] == sdf.res[1] && hdr.res[2] == sdf.res[2];
+	if ( ok ) {
+		sdf.dist.resize ( (long) sdf.res[0] * sdf.res[1] * sdf.res[2] );
+		ok = fread ( &sdf.dist[0], sizeof(float), sdf.dist.size(), fp ) == sdf.dist.size();
+	}
+	fclose ( fp );
+	if ( ok )
+		printf ( "Mesh SDF: loaded %s\n", fname.c_str() );
+	else
+		printf ( "Mesh SDF: %s does not match, baking again\n", fname.c_str() );
+	return ok;
+}
+
+void FluidMeshSDF::SaveCache ( std::string fname, FluidSDF& sdf, unsigned long long hash, float band )
+{
+	MeshSDFHeader hdr;
+	memset ( &hdr, 0, sizeof(hdr) );
+	hdr.magic = MESH_SDF_MAGIC;
+	hdr.version = MESH_SDF_VERSION;
+	hdr.hash = hash;
+	hdr.cell = sdf.cell;
+	hdr.band = band;
+	hdr.min[0] = sdf.min.x; hdr.min[1] = sdf.min.y; hdr.min[2] = sdf.min.z;
+	for (int k = 0; k < 3; k++ ) hdr.res[k] = sdf.res[k];
+
+	std::string tmp = fname + ".tmp";
+	FILE* fp = fopen ( tmp.c_str(), "wb" );
+	bool ok = ( fp != 0x0 ) && fwrite ( &hdr, sizeof(hdr), 1, fp ) == 1;
+	ok = ok && fwrite ( &sdf.dist[0], sizeof(float), sdf.dist.size(), fp ) == sdf.dist.size();
+	if ( fp != 0x0 ) ok = ( fclose ( fp ) == 0 ) && ok;
+	if ( ok ) {
+		remove ( fname.c_str() );							// rename does not replace on Windows
+		ok = ( rename ( tmp.c_str(), fname.c_str() ) == 0 );
+	}
+	if ( !ok ) printf ( "Mesh SDF: failed to write %s\n", fname.c_str() );
+}
+
+void FluidMeshSDF::Report ()
+{
+	if ( m_bCached ) {
+		printf ( "Mesh SDF: %d triangles, field from cache in %.3f s\n", GetNumTris(), m_BakeSec );
+		return;
+	}
+	printf ( "Mesh SDF: %d triangles, %d BVH nodes, %d samples in band, baked in %.3f s\n", GetNumTris(), (int) m_Node.size(), m_Known, m_BakeSec );
+}
@@ -0,0 +1,108 @@
+/*
+  FLUIDS v.1 - SPH Fluid Simulator for CPU and GPU
+  Sub-step scheduling
+
+  ZLib license (see fluid_system.h)
+*/
+
+#include <stdio.h>
+
+#include "fluid_system.h"
+#include "fluid_scheduler.h"
+#include "mtime.h"
+
+#define SCHED_AVG		0.2				// weight of the newest step in the running cost average
+
+FluidScheduler::FluidScheduler ()
+{
+	Setup ( 0, 0, 1, 0 );
+}
+
+void FluidScheduler::Setup ( double sim_per_frame, double budget_ms, int max_sub, int max_skip )
+{
+	m_SimPerFrame = sim_per_frame;
+	m_BudgetMS = budget_ms;
+	m_MaxSub = ( max_sub < 1 ) ? 1 : max_sub;
+	m_MaxSkip = max_skip;
+	m_Owed = 0;
+	m_StepMS = 0;
+	m_Skipped = 0;
+	m_bRender = true;
+	m_Frames = m_Steps = m_MaxSteps = 0;
+	m_SkipTotal = m_OverBudget = 0;
+	m_Dropped = 0;
+}
+
+// Before every step the number still to go is estimated from the owed time, the steps
+// left under max_sub and the steps that fit in the remaining budget. The step that is
+// expected to be the last one writes the render output and ends the frame, so the
+// frame never shows an older slot than the state it stopped at.
+int FluidScheduler::Frame ( FluidSystem* f )
+{
+	mint::Time start, stop;
+	start.SetSystemTime ( ACC_NSEC );
+
+	if ( m_SimPerFrame <= 0 ) {
+		f->SetRenderOutput ( true );
+		f->Run ();
+		m_bRender = true;
+		m_Frames++;
+		m_Steps++;
+		if ( m_MaxSteps < 1 ) m_MaxSteps = 1;
+		return 1;
+	}
+
+	// Behind by more than half a frame: simulate only, up to max_skip frames in a row
+	m_bRender = !( m_Owed > 0.5 * m_SimPerFrame && m_Skipped < m_MaxSkip );
+	m_Skipped = m_bRender ? 0 : m_Skipped + 1;
+	if ( !m_bRender ) m_SkipTotal++;
+	m_Owed += m_SimPerFrame;
+	double budget = m_bRender ? m_BudgetMS : 2 * m_BudgetMS;	// a skipped frame also gets the render time
+
+	int n = 0;
+	bool last = false, over = false;
+	while ( !last ) {
+		double dt = f->GetParam ( SPH_TIMESTEP );			// next step, fixed or adaptive
+		int need = ( dt > 0 ) ? (int) ( m_Owed / dt + 0.5 ) : 1;
+		int left = m_MaxSub - n;
+		if ( need < left ) left = need;
+		if ( budget > 0 && m_StepMS > 0 ) {
+			stop.SetSystemTime ( ACC_NSEC );
+			stop = stop - start;
+			int fit = (int) ( ( budget - stop.GetSec() * 1000.0 ) / m_StepMS );
+			if ( fit < left ) { left = fit; over = true; }
+		}
+		last = ( left <= 1 );								// the first step of a frame always runs
+
+		mint::Time s0, s1;
+		s0.SetSystemTime ( ACC_NSEC );
+		f->SetRenderOutput ( last && m_bRender );
+		double t0 = f->GetTime ();
+		f->Run ();
+		m_Owed -= f->GetTime () - t0;
+		s1.SetSystemTime ( ACC_NSEC );
+		s1 = s1 - s0;
+		m_StepMS = ( m_StepMS == 0 ) ? s1.GetSec() * 1000.0 : m_StepMS + SCHED_AVG * ( s1.GetSec() * 1000.0 - m_StepMS );
+		n++;
+	}
+	f->SetRenderOutput ( true );
+	if ( over ) m_OverBudget++;
+
+	// Carry at most one frame of debt
+	if ( m_Owed > m_SimPerFrame ) {
+		m_Dropped += m_Owed - m_SimPerFrame;
+		m_Owed = m_SimPerFrame;
+	}
+	m_Frames++;
+	m_Steps += n;
+	if ( n > m_MaxSteps ) m_MaxSteps = n;
+	return n;
+}
+
+void FluidScheduler::Report ()
+{
+	if ( m_Frames == 0 ) return;
+	printf ( "Scheduler: %d frames, %d steps (%.2f avg, %d max per frame), %.3f ms per step\n", m_Frames, m_Steps, double(m_Steps) / m_Frames, m_MaxSteps, m_StepMS );
+	if ( m_SimPerFrame > 0 )
+		printf ( "Scheduler: %.4f s per frame target, %d frames over budget, %d skipped, %.4f s dropped\n", m_SimPerFrame, m_OverBudget, m_SkipTotal, m_Dropped );
+}
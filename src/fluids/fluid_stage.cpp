@@ -0,0 +1,195 @@
+/*
+  FLUIDS v.1 - SPH Fluid Simulator for CPU and GPU
+  Render output staging
+
+  ZLib license (see fluid_system.h)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fluid_stage.h"
+#include "mem_account.h"
+
+FluidStage::FluidStage ()
+{
+	m_bGL = false;
+	m_Max = 0;
+	m_VBO = 0;
+	m_Mem = 0x0;
+	for (int s = 0; s < STAGE_SLOTS; s++ ) {
+		m_Ptr[s] = 0x0;
+		m_Fence[s] = 0;
+		m_Num[s] = 0;
+		m_Age[s] = -1;
+		m_Pin[s] = 0;
+		m_Fmt[s] = STAGE_CLR_NONE;
+	}
+	m_Current = -1;
+	m_Frame = 0;
+	m_Request = STAGE_CLR_RGBA;
+	m_MemId = -1;
+	#ifdef _MSC_VER
+		InitializeCriticalSection ( &m_Lock );
+	#else
+		pthread_mutex_init ( &m_Lock, 0x0 );
+	#endif
+}
+
+FluidStage::~FluidStage ()
+{
+	if ( !m_bGL ) Release ();			// no GL context may be left at exit
+	MemAccount::Global().Unregister ( m_MemId );
+	#ifdef _MSC_VER
+		DeleteCriticalSection ( &m_Lock );
+	#else
+		pthread_mutex_destroy ( &m_Lock );
+	#endif
+}
+
+void FluidStage::Lock ()
+{
+	#ifdef _MSC_VER
+		EnterCriticalSection ( &m_Lock );
+	#else
+		pthread_mutex_lock ( &m_Lock );
+	#endif
+}
+
+void FluidStage::Unlock ()
+{
+	#ifdef _MSC_VER
+		LeaveCriticalSection ( &m_Lock );
+	#else
+		pthread_mutex_unlock ( &m_Lock );
+	#endif
+}
+
+bool FluidStage::Setup ( int max, bool bGL )
+{
+	Release ();
+	if ( max <= 0 ) return false;
+	m_bGL = bGL;
+	m_Max = max;
+	long bytes = SlotOffset ( STAGE_SLOTS );
+	if ( m_bGL ) {
+		glGenBuffers ( 1, &m_VBO );
+		glBindBuffer ( GL_ARRAY_BUFFER, m_VBO );
+		glBufferData ( GL_ARRAY_BUFFER, bytes, 0, GL_STREAM_DRAW );		// allocated once, never re-specified
+		glBindBuffer ( GL_ARRAY_BUFFER, 0 );
+	} else {
+		m_Mem = (char*) malloc ( bytes );
+		if ( m_Mem == 0x0 ) {
+			printf ( "Stage: cannot allocate %ld bytes.\n", bytes );
+			m_Max = 0;
+			return false;
+		}
+		for (int s = 0; s < STAGE_SLOTS; s++ )
+			m_Ptr[s] = m_Mem + SlotOffset ( s );
+	}
+	if ( m_MemId == -1 ) m_MemId = MemAccount::Global().Register ( m_bGL ? MEM_GPU : MEM_STAGING, "stage" );
+	MemAccount::Global().Set ( m_MemId, (double) bytes );
+	return true;
+}
+
+void FluidStage::Release ()
+{
+	if ( m_bGL && m_VBO != 0 ) {
+		for (int s = 0; s < STAGE_SLOTS; s++ ) {
+			if ( m_Fence[s] != 0 ) glDeleteSync ( m_Fence[s] );
+			m_Fence[s] = 0;
+		}
+		glDeleteBuffers ( 1, &m_VBO );
+		m_VBO = 0;
+	}
+	free ( m_Mem );
+	m_Mem = 0x0;
+	for (int s = 0; s < STAGE_SLOTS; s++ ) {
+		m_Ptr[s] = 0x0;
+		m_Num[s] = 0;
+		m_Age[s] = -1;
+		m_Pin[s] = 0;
+		m_Fmt[s] = STAGE_CLR_NONE;
+	}
+	m_Current = -1;
+	m_Max = 0;
+	MemAccount::Global().Set ( m_MemId, 0 );
+}
+
+void FluidStage::WaitFence ( int s )
+{
+	if ( m_Fence[s] == 0 ) return;
+	while ( glClientWaitSync ( m_Fence[s], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000 ) == GL_TIMEOUT_EXPIRED )
+		;
+	glDeleteSync ( m_Fence[s] );
+	m_Fence[s] = 0;
+}
+
+// Hands out the least recently published slot that is neither current nor pinned.
+// Grows the ring (contents are dropped) when num exceeds its capacity.
+int FluidStage::Acquire ( int num )
+{
+	if ( m_Max == 0 ) return -1;
+	if ( num > m_Max ) {
+		Lock ();
+		bool pinned = false;
+		for (int s = 0; s < STAGE_SLOTS; s++ ) pinned |= ( m_Pin[s] > 0 );
+		Unlock ();
+		if ( pinned ) return -1;								// a reader still holds the old storage
+		if ( !Setup ( num*2, m_bGL ) ) return -1;
+	}
+	Lock ();
+	int best = -1;
+	for (int s = 0; s < STAGE_SLOTS; s++ ) {
+		if ( s == m_Current || m_Pin[s] > 0 ) continue;
+		if ( best == -1 || m_Age[s] < m_Age[best] ) best = s;
+	}
+	Unlock ();
+	if ( best == -1 || !m_bGL ) return best;
+
+	WaitFence ( best );
+	glBindBuffer ( GL_ARRAY_BUFFER, m_VBO );
+	m_Ptr[best] = (char*) glMapBufferRange ( GL_ARRAY_BUFFER, SlotOffset ( best ), SlotOffset ( 1 ),
+						GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT );
+	glBindBuffer ( GL_ARRAY_BUFFER, 0 );
+	if ( m_Ptr[best] == 0x0 ) {
+		printf ( "Stage: cannot map slot %d.\n", best );
+		return -1;
+	}
+	return best;
+}
+
+void FluidStage::Publish ( int s, int num, int fmt )
+{
+	if ( s < 0 ) return;
+	if ( m_bGL ) {
+		glBindBuffer ( GL_ARRAY_BUFFER, m_VBO );
+		glUnmapBuffer ( GL_ARRAY_BUFFER );
+		glBindBuffer ( GL_ARRAY_BUFFER, 0 );
+		m_Ptr[s] = 0x0;
+		if ( m_Current >= 0 ) m_Fence[m_Current] = glFenceSync ( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+	}
+	Lock ();
+	m_Num[s] = num;
+	m_Fmt[s] = fmt;
+	m_Age[s] = m_Frame++;
+	m_Current = s;
+	Unlock ();
+}
+
+int FluidStage::AcquireRead ()
+{
+	Lock ();
+	int s = m_Current;
+	if ( s >= 0 ) m_Pin[s]++;
+	Unlock ();
+	return s;
+}
+
+void FluidStage::ReleaseRead ( int s )
+{
+	if ( s < 0 ) return;
+	Lock ();
+	m_Pin[s]--;
+	Unlock ();
+}
@@ -34,8 +34,10 @@
 
 #include "common_defs.h"
 #include "mtime.h"
+#include "mthread.h"
 #include "fluid_system.h"
-#include "render_particles.h"
+#include "fluid_domain.h"
+#include "fluid_mesh_sdf.h"
 
 #ifdef BUILD_CUDA
 	#include "fluid_system_host.cuh"
@@ -45,101 +47,260 @@
 
 
 
-DWORD getColorRampTemp(float v, float vmin, float vmax)
+// Blue-cyan-green-yellow-red ramp over v in [0,1], the same for every color mode
+static DWORD ColorRamp ( float v )
 {
 	float red = 1.0f;
 	float green = 1.0f;
 	float blue = 1.0f;
 	float alpha = 1.0f;
-	float dv;
 
-	if (v < vmin)
-	  v = vmin;
-	if (v > vmax)
-	  v = vmax;
-	dv = vmax - vmin;
-
-	if (v < (vmin + 0.25 * dv)) {
+	if (v < 0.25f) {
 	  red = 0.0;
-	  green = 4 * (v - vmin) / dv;
-	} else if (v < (vmin + 0.5 * dv)) {
+	  green = 4.0f * v;
+	} else if (v < 0.5f) {
 	  red = 0.0;
-	  blue = 1.0 + 4.0 * (vmin + 0.25 * dv - v) / dv;
-	} else if (v < (vmin + 0.75 * dv)) {
-	  red = 4.0 * (v - vmin - 0.5 * dv) / dv;
+	  blue = 1.0f + 4.0f * (0.25f - v);
+	} else if (v < 0.75f) {
+	  red = 4.0f * (v - 0.5f);
 	  blue = 0.0;
 	} else {
-	  green = 1.0 + 4.0 * (vmin + 0.75 * dv - v) / dv;
+	  green = 1.0f + 4.0f * (0.75f - v);
 	  blue = 0.0;
 	}
+	return STAGE_RGBA ( COLORA(red,green,blue,alpha) );
+}
 
-	return COLORA(red,green,blue,alpha);
+// Attributes used by each pass, for the particle itself and per neighbor visited.
+// Thermal and color attributes are only declared when the current parameters need them.
+static const char* g_InsertOwn[]	= { "pos", "next", 0x0 };
+static const char* g_PressOwn[]		= { "pos", "flags", "next", "pressure", "density", 0x0 };
+static const char* g_PressNbr[]		= { "pos", "next", 0x0 };
+static const char* g_ForceOwn[]		= { "pos", "flags", "vel_eval", "pressure", "density", "sph_force", 0x0 };
+static const char* g_ForceNbr[]		= { "pos", "vel_eval", "pressure", "density", 0x0 };
+static const char* g_ThermalOwn[]	= { "temp", "temp_eval", 0x0 };
+static const char* g_ThermalNbr[]	= { "temp_eval", 0x0 };
+static const char* g_AdvOwn[]		= { "pos", "flags", "vel", "vel_eval", "pressure", "density", "sph_force", 0x0 };
+static const char* g_AdvTemp[]		= { "temp", "temp_eval", 0x0 };
+static const char* g_ColorVel[]		= { "vel", 0x0 };
+static const char* g_ColorPress[]	= { "pressure", 0x0 };
+static const char* g_ColorTemp[]	= { "temp", 0x0 };
+static const char* g_ColorOrig[]	= { "color", 0x0 };
+static const char* g_SolveOwn[]		= { "pos", "vel", "density", "sph_force", "pressure", 0x0 };
+static const char* g_SolveNbr[]		= { "pos", "pressure", 0x0 };
+static const char* g_PbfOwn[]		= { "pos", "vel", "vel_eval", "density", 0x0 };
+static const char* g_PbfNbr[]		= { "vel", "density", 0x0 };
+static const char* g_BlockAdv[]		= { "accel", "step", 0x0 };
+static const char* g_CollideOwn[]	= { "pos", "flags", "next", "vel_eval", 0x0 };
+
+// Pool jobs: each thread takes one contiguous particle partition.
+// The partition for thread t is fixed, so pages first-touched by t stay local to it.
+static void PressureJob ( void* ctx, int t, int nt )
+{
+	FluidSystem* f = (FluidSystem*) ctx;
+	int start, end;
+	ThreadPool::GetRange ( f->NumPoints(), t, nt, start, end );
+	f->SPH_ComputePressureRange ( start, end );
 }
 
-DWORD getColorRampVel(float v, float vmin, float vmax)
+static void ForceJob ( void* ctx, int t, int nt )
 {
-	float red = 1.0f;
-	float green = 1.0f;
-	float blue = 1.0f;
-	float alpha = 1.0f;
-	float dv;
+	FluidSystem* f = (FluidSystem*) ctx;
+	int start, end;
+	ThreadPool::GetRange ( f->NumPoints(), t, nt, start, end );
+	f->SPH_ComputeForceRange ( start, end );
+}
 
-	if (v < vmin)
-	  v = vmin;
-	if (v > vmax)
-	  v = vmax;
-	dv = vmax - vmin;
+static void AdvanceJob ( void* ctx, int t, int nt )
+{
+	FluidSystem* f = (FluidSystem*) ctx;
+	int start, end;
+	ThreadPool::GetRange ( f->NumOwned(), t, nt, start, end );
+	f->SetThreadDead ( t, f->AdvanceRange ( start, end, t ) );
+}
 
-	if (v < (vmin + 0.25 * dv)) {
-	  red = 0.0;
-	  green = 4 * (v - vmin) / dv;
-	} else if (v < (vmin + 0.5 * dv)) {
-	  red = 0.0;
-	  blue = 1.0 + 4.0 * (vmin + 0.25 * dv - v) / dv;
-	} else if (v < (vmin + 0.75 * dv)) {
-	  red = 4.0 * (v - vmin - 0.5 * dv) / dv;
-	  blue = 0.0;
-	} else {
-	  green = 1.0 + 4.0 * (vmin + 0.75 * dv - v) / dv;
-	  blue = 0.0;
-	}
+static void CollideJob ( void* ctx, int t, int nt )
+{
+	FluidSystem* f = (FluidSystem*) ctx;
+	int start, end;
+	ThreadPool::GetRange ( f->GetColliders()->GetNumCells(), t, nt, start, end );
+	f->SPH_ComputeCollideRange ( start, end );
+}
 
-	return COLORA(red,green,blue,alpha);
+static void ColorJob ( void* ctx, int t, int nt )
+{
+	FluidSystem* f = (FluidSystem*) ctx;
+	int start, end;
+	ThreadPool::GetRange ( f->NumOwned(), t, nt, start, end );
+	f->SPH_ComputeColorRange ( start, end );
 }
 
-DWORD getColorRampPressure(float v, float vmin, float vmax)
+static void PredictJob ( void* ctx, int t, int nt )
 {
-	float red = 1.0f;
-	float green = 1.0f;
-	float blue = 1.0f;
-	float alpha = 1.0f;
-	float dv;
+	FluidSystem* f = (FluidSystem*) ctx;
+	int start, end;
+	ThreadPool::GetRange ( f->NumPoints(), t, nt, start, end );
+	f->SPH_PredictRange ( start, end );
+}
 
-	if (v < vmin)
-	  v = vmin;
-	if (v > vmax)
-	  v = vmax;
-	dv = vmax - vmin;
+static void PredictDensityJob ( void* ctx, int t, int nt )
+{
+	FluidSystem* f = (FluidSystem*) ctx;
+	int start, end;
+	ThreadPool::GetRange ( f->NumPoints(), t, nt, start, end );
+	f->SPH_PredictDensityRange ( start, end, t );
+}
 
-	if (v < (vmin + 0.25 * dv)) {
-	  red = 0.0;
-	  green = 4 * (v - vmin) / dv;
-	} else if (v < (vmin + 0.5 * dv)) {
-	  red = 0.0;
-	  blue = 1.0 + 4.0 * (vmin + 0.25 * dv - v) / dv;
-	} else if (v < (vmin + 0.75 * dv)) {
-	  red = 4.0 * (v - vmin - 0.5 * dv) / dv;
-	  blue = 0.0;
-	} else {
-	  green = 1.0 + 4.0 * (vmin + 0.75 * dv - v) / dv;
-	  blue = 0.0;
-	}
+static void PressureForceJob ( void* ctx, int t, int nt )
+{
+	FluidSystem* f = (FluidSystem*) ctx;
+	int start, end;
+	ThreadPool::GetRange ( f->NumPoints(), t, nt, start, end );
+	f->SPH_PressureForceRange ( start, end );
+}
+
+static void PBFPredictJob ( void* ctx, int t, int nt )
+{
+	FluidSystem* f = (FluidSystem*) ctx;
+	int start, end;
+	ThreadPool::GetRange ( f->NumPoints(), t, nt, start, end );
+	f->SPH_PredictPBFRange ( start, end );
+}
+
+static void PBFLambdaJob ( void* ctx, int t, int nt )
+{
+	FluidSystem* f = (FluidSystem*) ctx;
+	int start, end;
+	ThreadPool::GetRange ( f->NumPoints(), t, nt, start, end );
+	f->SPH_PBFLambdaRange ( start, end, t );
+}
+
+static void PBFDeltaJob ( void* ctx, int t, int nt )
+{
+	FluidSystem* f = (FluidSystem*) ctx;
+	int start, end;
+	ThreadPool::GetRange ( f->NumPoints(), t, nt, start, end );
+	f->SPH_PBFDeltaRange ( start, end );
+}
+
+static void PBFVelocityJob ( void* ctx, int t, int nt )
+{
+	FluidSystem* f = (FluidSystem*) ctx;
+	int start, end;
+	ThreadPool::GetRange ( f->NumPoints(), t, nt, start, end );
+	f->SPH_PBFVelocityRange ( start, end );
+}
 
-	return COLORA(red,green,blue,alpha);
+static void PBFVorticityJob ( void* ctx, int t, int nt )
+{
+	FluidSystem* f = (FluidSystem*) ctx;
+	int start, end;
+	ThreadPool::GetRange ( f->NumPoints(), t, nt, start, end );
+	f->SPH_PBFVorticityRange ( start, end );
+}
+
+static void PBFConfineJob ( void* ctx, int t, int nt )
+{
+	FluidSystem* f = (FluidSystem*) ctx;
+	int start, end;
+	ThreadPool::GetRange ( f->NumPoints(), t, nt, start, end );
+	f->SPH_PBFConfineRange ( start, end );
+}
+
+static void CompactCopyJob ( void* ctx, int t, int nt )
+{
+	((FluidSystem*) ctx)->CompactCopyRange ( t, nt );
+}
+
+static void CompactGridJob ( void* ctx, int t, int nt )
+{
+	((FluidSystem*) ctx)->CompactGridRange ( t, nt );
 }
 
 FluidSystem::FluidSystem ()
 {
+	m_bHeadless = false;
+	m_bCapture = false;
+	m_bOutput = true;
+	m_StageSlot = -1;
+	m_StagePos = 0x0;
+	m_StageClr = 0x0;
+	m_bTiming = true;
+	memset ( m_Toggle, 0, sizeof(m_Toggle) );		// USE_CUDA is never set by Reset
+	m_Domain = 0x0;
+	m_Pool = 0x0;
+	const char* names[PASS_MAX] = { "INSERT", "PRESS", "FORCE", "ADV", "COLOR", "SOLVE", "COLLIDE" };
+	for (int p = 0; p < PASS_MAX; p++ ) {
+		m_Pass[p].name = names[p];
+		m_Pass[p].own = m_Pass[p].nbr = 0;
+		m_Pass[p].records = m_Pass[p].visits = m_Pass[p].entries = 0;
+		m_Pass[p].bytes = 0;
+	}
+	const char* phases[PROF_MAX] = { "STEP", "PREDICT", "INSERT", "PRESS", "FORCE", "COLLIDE", "SOLVE", "ADV", "TRANSFER", "MAP", "UPLOAD" };
+	for (int p = 0; p < PROF_MAX; p++ )
+		m_ProfId[p] = Profiler::Global().Register ( phases[p], "sim" );
+	m_NumRemoved = 0;
+	m_QStep = 0;
+	m_StageFmt = STAGE_CLR_NONE;
+	m_DTSteps = 0;
+	memset ( m_DTLimit, 0, sizeof(m_DTLimit) );
+	m_DTLo = m_DTHi = m_DTSum = 0;
+	m_bPciValid = false;
+	m_PciDelta = 0;
+	m_PbfScale = 0;
+	m_PbfDT = 0;
+	m_SolveIters = 0;
+	m_SolveErr = m_SolveErrMax = 0;
+	m_SolveSteps = m_SolveIterSum = m_SolveIterMax = m_SolveCapped = 0;
+	m_bSleep = false;
+	m_NumAwake = 0;
+	m_SleepSteps = m_CellsUsed = m_CellsAsleep = 0;
+	m_AwakeSum = 0;
+	m_SkipMask = 0;
+	m_NumActive = 0;
+	m_NeighborFull = 0;
+	m_bBlock = false;
+	m_BlockTick = 0;
+	m_BlockTicks = m_BlockCuts = m_BlockClamped = 0;
+	m_BlockEvals = m_BlockUpdates = 0;
+	memset ( m_BlockLevel, 0, sizeof(m_BlockLevel) );
+	m_bContacts = false;
+	m_ColBake = 0;
+	m_ColRecords = m_ColContacts = 0;
+	m_BndCell = 0;
+	m_BndPsi = 0;
+	m_BndWall = 1;
+	m_BndRes[0] = m_BndRes[1] = m_BndRes[2] = 0;
+	m_BndVersion = -1;
+	m_bBoundary = false;
+	m_BndSec = 0;
+	m_BndHits = 0;
+	for (int n = 0; n < COLOR_RAMP; n++ )
+		m_ColorRamp[n] = ColorRamp ( float(n) / (COLOR_RAMP-1) );
+	for (int c = 0; c < MEM_CATEGORIES; c++ )
+		m_MemId[c] = -1;
+}
+
+FluidSystem::~FluidSystem ()
+{
+	FreeBuffers ();
+	for (int b = 0; b < FLUID_BLOCKS; b++ )
+		ReleaseBuffer ( m_Scratch[b] );
+	for (int c = 0; c < MEM_CATEGORIES; c++ )
+		MemAccount::Global().Unregister ( m_MemId[c] );
+}
+
+void FluidSystem::SetParamOverride ( int p, double v )
+{
+	for (int n = 0; n < (int) m_Override.size(); n++ )
+		if ( m_Override[n].first == p ) { m_Override[n].second = v; return; }
+	m_Override.push_back ( std::pair<int, double> ( p, v ) );
+}
+
+int FluidSystem::NumOwned ()
+{
+	if ( m_Domain == 0x0 ) return NumPoints();
+	return NumPoints() - m_Domain->GetNumGhost();
 }
 
 void FluidSystem::Initialize ( int mode, int total )
@@ -150,75 +311,81 @@ void FluidSystem::Initialize ( int mode, int total )
 	PointSet::Initialize ( mode, total );
 	
 	FreeBuffers ();
-	AddBuffer ( BFLUID, sizeof ( Fluid ), total );
-	AddAttribute ( 0, "pos", sizeof ( Vector3DF ), false );	
-	AddAttribute ( 0, "color", sizeof ( DWORD ), false );
-	AddAttribute ( 0, "vel", sizeof ( Vector3DF ), false );
-	AddAttribute ( 0, "ndx", sizeof ( unsigned short ), false );
-	AddAttribute ( 0, "age", sizeof ( unsigned short ), false );
-
-	AddAttribute ( 0, "pressure", sizeof ( double ), false );
-	AddAttribute ( 0, "density", sizeof ( double ), false );
-	AddAttribute ( 0, "temp", sizeof ( double ), false );
-	AddAttribute ( 0, "temp_eval", sizeof ( double ), false );
-	AddAttribute ( 0, "viscosity", sizeof ( double ), false );
-	AddAttribute ( 0, "sph_force", sizeof ( Vector3DF ), false );
-	AddAttribute ( 0, "stress_tensor", sizeof ( Matrix3 ), false );
-	AddAttribute ( 0, "next", sizeof ( Fluid* ), false );
-	AddAttribute ( 0, "tag", sizeof ( bool ), false );		
-
-	//Create Pos and Color VBOs
-	unsigned int size = sizeof(float) * 4 * total;
-	
-	m_vPos = new float[4*total];
-	m_vCol = new float[4*total];
-	
-	//for(int i=0; i < 4*total; i+=4){
-	//	m_vPos[i]= 1.0f;
-	//	m_vPos[i+1]= 1.0f;
-	//	m_vPos[i+2]= 1.0f;
-	//	m_vPos[i+3]= 1.0f;
-	//	m_vCol[i]= 1.0f;
-	//	m_vCol[i+1]= 1.0f;
-	//	m_vCol[i+2]= 1.0f;
-	//	m_vCol[i+3]= 1.0f;
-	//}
-
-	glGenBuffers(1, &m_posVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, m_posVBO);
-	glBufferData(GL_ARRAY_BUFFER, size, 0, GL_DYNAMIC_DRAW);
-	glVertexAttribPointer(particle_attributes::POSITION, 4, GL_FLOAT, GL_FALSE,0,0);
-	glEnableVertexAttribArray(particle_attributes::POSITION);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-		
-
-	glGenBuffers(1, &m_colorVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, m_colorVBO);
-	glBufferData(GL_ARRAY_BUFFER, size, 0, GL_DYNAMIC_DRAW);
-	glVertexAttribPointer(particle_attributes::COLOR, 4, GL_FLOAT, GL_FALSE,0,0);
-	glEnableVertexAttribArray(particle_attributes::COLOR);
-
-	UpdateVBOS(total);
+	ClearAttributes ();
+	AddBuffer ( BFLUID, sizeof ( Fluid ), total );				// FLUID_HOT
+	AddBuffer ( BFLUID, sizeof ( FluidThermal ), total );		// FLUID_THERMAL
+	AddBuffer ( BFLUID, sizeof ( FluidCold ), total );			// FLUID_COLD
+
+	Fluid f;
+	FluidThermal t;
+	FluidCold c;
+	#define FLUID_ATTR(b,rec,field,name)	AddAttributeAt ( b, name, sizeof(rec.field), (ushort) ((char*) &rec.field - (char*) &rec) )
+	FLUID_ATTR ( FLUID_HOT, f, pos, "pos" );
+	FLUID_ATTR ( FLUID_HOT, f, flags, "flags" );
+	FLUID_ATTR ( FLUID_HOT, f, next, "next" );
+	FLUID_ATTR ( FLUID_HOT, f, vel, "vel" );
+	FLUID_ATTR ( FLUID_HOT, f, vel_eval, "vel_eval" );
+	FLUID_ATTR ( FLUID_HOT, f, pressure, "pressure" );
+	FLUID_ATTR ( FLUID_HOT, f, density, "density" );
+	FLUID_ATTR ( FLUID_HOT, f, sph_force, "sph_force" );
+	FLUID_ATTR ( FLUID_THERMAL, t, temp, "temp" );
+	FLUID_ATTR ( FLUID_THERMAL, t, temp_eval, "temp_eval" );
+	FLUID_ATTR ( FLUID_COLD, c, clr, "color" );
+	FLUID_ATTR ( FLUID_COLD, c, age, "age" );
+	FLUID_ATTR ( FLUID_COLD, c, viscosity, "viscosity" );
+	FLUID_ATTR ( FLUID_COLD, c, stress_tensor, "stress_tensor" );
+	FLUID_ATTR ( FLUID_COLD, c, accel, "accel" );
+	FLUID_ATTR ( FLUID_COLD, c, step, "step" );
+	#undef FLUID_ATTR
+	if ( m_bTiming ) SPH_ReportLayout ();
+
+	//Render output: mapped GL ring, or a memory ring for headless capture
+	if ( !m_bHeadless || m_bCapture )
+		m_Stage.Setup ( total, !m_bHeadless );
+	else
+		m_Stage.Release ();
 
 	SPH_Setup ();
 	Reset ( total );	
 }
 
-void FluidSystem::UpdateVBOS(int numParticles)
+// The table is faulted in now, not in the first pressure pass, and with a pool on the
+// nodes of the threads that fill it
+void FluidSystem::SPH_SetupNeighbors ( int nmax, int width )
 {
-	unsigned int size = sizeof(float) * 4 * numParticles;
-	//printf("%d", numParticles);
-	glBindBufferARB(GL_ARRAY_BUFFER, m_posVBO);
-	glBufferDataARB(GL_ARRAY_BUFFER_ARB, size, m_vPos, GL_DYNAMIC_DRAW_ARB);
-
-	glBindBufferARB(GL_ARRAY_BUFFER, m_colorVBO);
-	glBufferDataARB(GL_ARRAY_BUFFER_ARB, size, m_vCol, GL_DYNAMIC_DRAW_ARB);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	Neighbor_Setup ( nmax, width );
+	long nbytes = (long) m_NeighborMax * m_NeighborWidth * sizeof(int);
+	if ( m_Pool != 0x0 ) {
+		m_Pool->Touch ( (char*) m_Neighbor, nbytes );
+		m_Pool->Touch ( (char*) m_NDist, nbytes );
+	} else if ( m_NeighborMax > 0 ) {
+		memset ( m_Neighbor, 0, nbytes );
+		memset ( m_NDist, 0, nbytes );
+	}
 }
 
 void FluidSystem::Reset ( int nmax )
 {
-	ResetBuffer ( 0, nmax );
+	SetPrefault ( m_Pool == 0x0 );				// with a pool, pages are placed by first-touch below instead
+	for (int b = 0; b < FLUID_BLOCKS; b++ ) {
+		ResetBuffer ( b, nmax );
+		if ( m_Pool != 0x0 )
+			m_Pool->Touch ( mBuf[b].data, (long) mBuf[b].max * mBuf[b].stride );	// first-touch: partition pages land on their thread's node
+	}
+	SPH_SetupNeighbors ( nmax, NEIGHBOR_WIDTH );
+	m_NumRemoved = 0;
+	m_DTSteps = 0;
+	m_DTSum = 0;
+	memset ( m_DTLimit, 0, sizeof(m_DTLimit) );
+	m_SolveSteps = m_SolveIterSum = m_SolveIterMax = m_SolveCapped = 0;
+	m_SolveErrMax = 0;
+	m_CellQuiet.clear ();						// a new scene starts awake
+	m_SleepSteps = m_CellsUsed = m_CellsAsleep = 0;
+	m_AwakeSum = 0;
+	m_BlockTick = 0;
+	m_BlockTicks = m_BlockCuts = m_BlockClamped = 0;
+	m_BlockEvals = m_BlockUpdates = 0;
+	memset ( m_BlockLevel, 0, sizeof(m_BlockLevel) );
 
 	printf("%f \n",m_DT);
 
@@ -244,6 +411,20 @@ void FluidSystem::Reset ( int nmax )
 	m_Param [ SPH_INTSTIFF ] = 1.0;
 	m_Param [ SPH_EXTSTIFF ] = 5000.0;
 	m_Param [ SPH_SMOOTHRADIUS ] = 0.01;
+	m_Param [ SPH_CFL ] = 0.0;
+	m_Param [ SPH_DT_MIN ] = 0.00001;
+	m_Param [ SPH_DT_MAX ] = 0.005;
+	m_Param [ SPH_PCI_TOL ] = 0.01;
+	m_Param [ SPH_PCI_ITER ] = 50;
+	m_Param [ SPH_PBF_ITER ] = 4;
+	m_Param [ SPH_PBF_RELAX ] = 0.3;
+	m_Param [ SPH_PBF_VORT ] = 0.001;
+	m_Param [ SPH_PBF_XSPH ] = 0.01;
+	m_Param [ SPH_SLEEP_STEPS ] = 0;
+	m_Param [ SPH_SLEEP_VEL ] = 0.02;
+	m_Param [ SPH_SLEEP_DRHO ] = 0.001;
+	m_Param [ SPH_BLOCK_LEVELS ] = 1;
+	m_Param [ SPH_COLLIDE_BAKE ] = 0;
 	
 	m_Vec [ POINT_GRAV_POS ].Set ( 0, 50, 0 );
 	m_Vec [ PLANE_GRAV_DIR ].Set ( 0, -9.8, 0.0 );
@@ -253,48 +434,94 @@ void FluidSystem::Reset ( int nmax )
 	m_Vec [ EMIT_DANG ].Set ( 0, 0, 0 );
 }
 
-int FluidSystem::AddPoint ()
+void FluidSystem::ClearFluid ( int n )
 {
-	xref ndx;	
-	Fluid* f = (Fluid*) AddElem ( 0, ndx );	
+	Fluid* f = GetFluid ( n );
 	f->sph_force.Set(0,0,0);
 	f->vel.Set(0,0,0);
 	f->vel_eval.Set(0,0,0);
 	f->next = 0x0;
+	f->flags = 0;
 	f->pressure = 0;
-	f->temp = 0;
-	f->temp_eval = 0;
 	f->density = 0;
-	f->stress_tensor = Matrix3::ZERO;
+	FluidThermal* t = GetThermal ( n );
+	t->temp = 0;
+	t->temp_eval = 0;
+	FluidCold* c = GetCold ( n );
+	c->clr = 0;
+	c->age = 0;
+	c->viscosity = 0;
+	c->stress_tensor = Matrix3::ZERO;
+	c->accel.Set(0,0,0);
+	c->step = 0;
+}
+
+int FluidSystem::AddPoint ()
+{
+	xref ndx;	
+	for (int b = 0; b < FLUID_BLOCKS; b++ )
+		AddElem ( b, ndx );						// blocks grow together, same index in each
+	ClearFluid ( ndx );
 	return ndx;
 }
 
 int FluidSystem::AddPointReuse ()
 {
 	xref ndx;	
-	Fluid* f;
-	if ( NumPoints() <= mBuf[0].max-2 )
-		f = (Fluid*) AddElem ( 0, ndx );
-	else
-		f = (Fluid*) RandomElem ( 0, ndx );
-
-	f->sph_force.Set(0,0,0);
-	f->vel.Set(0,0,0);
-	f->vel_eval.Set(0,0,0);
-	f->next = 0x0;
-	f->pressure = 0;
-	f->temp = 0;
-	f->temp_eval = 0;
-	f->density = 0;
-	f->viscosity = 0;
-	f->stress_tensor = Matrix3::ZERO;
+	if ( NumPoints() <= mBuf[FLUID_HOT].max-2 ) {
+		for (int b = 0; b < FLUID_BLOCKS; b++ )
+			AddElem ( b, ndx );
+	} else
+		RandomElem ( FLUID_HOT, ndx );
+	ClearFluid ( ndx );
 	return ndx;
 }
 
+int FluidSystem::GetRecordSize ()
+{
+	int size = 0;
+	for (int b = 0; b < FLUID_BLOCKS; b++ ) size += mBuf[b].stride;
+	return size;
+}
+
+void FluidSystem::PackParticle ( int n, char* dest )
+{
+	for (int b = 0; b < FLUID_BLOCKS; b++ ) {
+		memcpy ( dest, GetElem ( b, n ), mBuf[b].stride );
+		dest += mBuf[b].stride;
+	}
+}
+
+int FluidSystem::UnpackParticle ( char* src )
+{
+	int n = 0;
+	for (int b = 0; b < FLUID_BLOCKS; b++ ) {
+		n = AddElem ( b, src );
+		src += mBuf[b].stride;
+	}
+	return n;
+}
+
+void FluidSystem::DeleteParticle ( int n )
+{
+	for (int b = 0; b < FLUID_BLOCKS; b++ )
+		DelElem ( b, n );
+}
+
+void FluidSystem::SetNumPoints ( int n )
+{
+	for (int b = 0; b < FLUID_BLOCKS; b++ ) {
+		mBuf[b].num = n;
+		mBuf[b].size = mBuf[b].num * mBuf[b].stride;
+	}
+}
+
 void FluidSystem::AddVolume ( Vector3DF min, Vector3DF max, float spacing )
 {
 	Vector3DF pos;
 	Fluid* p;	
+	FluidThermal* t;
+	int n;
 	float dx, dy, dz;
 	dx = max.x-min.x;
 	dy = max.y-min.y;
@@ -302,36 +529,79 @@ void FluidSystem::AddVolume ( Vector3DF min, Vector3DF max, float spacing )
 	for (float y = max.y; y >= min.y; y -= spacing ) {	
 		for (float x = min.x; x <= max.x; x += spacing ) {
 			for (float z = min.z; z <= max.z; z += spacing ) {
-				p = (Fluid *) GetPoint ( AddPointReuse () );
+				n = AddPointReuse ();
+				p = GetFluid ( n );
 				pos.Set ( x, y, z);
 				//pos.x += -0.05 + float( rand() * 0.1 ) / RAND_MAX;
 				//pos.y += -0.05 + float( rand() * 0.1 ) / RAND_MAX;
 				//pos.z += -0.05 + float( rand() * 0.1 ) / RAND_MAX;
 				p->pos = pos;
+				t = GetThermal ( n );
 				if(y>-10)
-					p->temp = 1.0f;
+					t->temp = 1.0f;
 				else
-					p->temp = 0.0f;
-				//p->temp = (y-min.y)/dy;
-				p->temp_eval = p->temp;
-				p->clr = COLORA( (x-min.x)/dx, (y-min.y)/dy, (z-min.z)/dz, 1);
+					t->temp = 0.0f;
+				//t->temp = (y-min.y)/dy;
+				t->temp_eval = t->temp;
+				GetCold ( n )->clr = COLORA( (x-min.x)/dx, (y-min.y)/dy, (z-min.z)/dz, 1);
 			}
 		}
 	}	
 }
 
-void FluidSystem::Run ()
+// Same as PointSet::Emit, which writes through the Particle layout
+void FluidSystem::Emit ( float spacing )
 {
-	bool bTiming = true;
+	Fluid* p;
+	Vector3DF dir;
+	Vector3DF pos;
+	float ang_rand, tilt_rand;
+	int x = (int) sqrt(m_Vec[EMIT_RATE].y);
+
+	for ( int n = 0; n < m_Vec[EMIT_RATE].y; n++ ) {
+		ang_rand = (float(rand()*2.0/RAND_MAX) - 1.0) * m_Vec[EMIT_SPREAD].x;
+		tilt_rand = (float(rand()*2.0/RAND_MAX) - 1.0) * m_Vec[EMIT_SPREAD].y;
+		dir.x = cos ( ( m_Vec[EMIT_ANG].x + ang_rand) * DEGtoRAD ) * sin( ( m_Vec[EMIT_ANG].y + tilt_rand) * DEGtoRAD ) * m_Vec[EMIT_ANG].z;
+		dir.y = sin ( ( m_Vec[EMIT_ANG].x + ang_rand) * DEGtoRAD ) * sin( ( m_Vec[EMIT_ANG].y + tilt_rand) * DEGtoRAD ) * m_Vec[EMIT_ANG].z;
+		dir.z = cos ( ( m_Vec[EMIT_ANG].y + tilt_rand) * DEGtoRAD ) * m_Vec[EMIT_ANG].z;
+		pos = m_Vec[EMIT_POS];
+		pos.x += spacing * (n/x);
+		pos.y += spacing * (n%x);
+		
+		int ndx = AddPointReuse ();
+		p = GetFluid ( ndx );
+		p->pos = pos;
+		p->vel = dir;
+		p->vel_eval = dir;
+		FluidCold* c = GetCold ( ndx );
+		c->age = 0;	
+		c->clr = COLORA ( m_Time/10.0, m_Time/5.0, m_Time /4.0, 1 );
+	}
+}
 
-	mint::Time start, stop;
+void FluidSystem::Run ()
+{
+	PROFILE_ARGS ( NumPoints(), (float) m_Param[SPH_TIMESTEP] );		// trace span arguments
+	PROFILE_BEGIN ( step );
 	
 	float ss = m_Param [ SPH_PDIST ] / m_Param[ SPH_SIMSCALE ];		// simulation scale (not Schutzstaffel)
 
 	if ( m_Vec[EMIT_RATE].x > 0 && (++m_Frame) % (int) m_Vec[EMIT_RATE].x == 0 ) {
 		//m_Frame = 0;
-		Emit ( ss ); 
+		if ( m_Domain == 0x0 || m_Domain->InSlab ( m_Vec[EMIT_POS] ) )		// only the slab owning the emitter
+			Emit ( ss ); 
 	}
+
+	// Slab decomposition: migrate particles and pull in ghosts before the grid is built
+	if ( m_Domain != 0x0 && !m_Domain->Exchange ( this ) ) {
+		printf ( "ERROR: Domain exchange failed, rank %d drops this step and continues alone.\n", m_Domain->GetRank() );
+		m_Domain = 0x0;											// the owner still closes and deletes it
+		SPH_UpdateMemory ();
+		PROFILE_END ( step, m_ProfId[PROF_STEP] );
+		return;
+	}
+	m_bContacts = false;										// until the contact pass runs
+	m_bBoundary = false;
 	
 	#ifdef NOGRID
 		// Slow method - O(n^2)
@@ -343,62 +613,98 @@ void FluidSystem::Run ()
 			
 			#ifdef BUILD_CUDA
 				// -- GPU --
-				start.SetSystemTime ( ACC_NSEC );		
+				PROFILE_BEGIN ( to );
 				TransferToCUDA ( mBuf[0].data, (int*) &m_Grid[0], NumPoints() );
-				if ( bTiming) { stop.SetSystemTime ( ACC_NSEC ); stop = stop - start; printf ( "TO: %s\n", stop.GetReadableTime().c_str() ); }
+				PROFILE_END ( to, m_ProfId[PROF_TRANSFER] );
 			
-				start.SetSystemTime ( ACC_NSEC );		
+				PROFILE_BEGIN ( insert );
 				Grid_InsertParticlesCUDA ();
-				if ( bTiming) { stop.SetSystemTime ( ACC_NSEC ); stop = stop - start; printf ( "INSERT (CUDA): %s\n", stop.GetReadableTime().c_str() ); }
+				PROFILE_END ( insert, m_ProfId[PROF_INSERT] );
 
-				start.SetSystemTime ( ACC_NSEC );
+				PROFILE_BEGIN ( press );
 				SPH_ComputePressureCUDA ();
-				if ( bTiming) { stop.SetSystemTime ( ACC_NSEC ); stop = stop - start; printf ( "PRESS (CUDA): %s\n", stop.GetReadableTime().c_str() ); }
+				PROFILE_END ( press, m_ProfId[PROF_PRESS] );
 
-				start.SetSystemTime ( ACC_NSEC );
+				PROFILE_BEGIN ( force );
 				SPH_ComputeForceCUDA (); 
-				if ( bTiming) { stop.SetSystemTime ( ACC_NSEC ); stop = stop - start; printf ( "FORCE (CUDA): %s\n", stop.GetReadableTime().c_str() ); }
+				PROFILE_END ( force, m_ProfId[PROF_FORCE] );
 
 				//** CUDA integrator is incomplete..
 				// Once integrator is done, we can remove TransferTo/From steps
-				/*start.SetSystemTime ( ACC_NSEC );
-				SPH_AdvanceCUDA( m_DT, m_DT/m_Param[SPH_SIMSCALE] );
-				if ( bTiming) { stop.SetSystemTime ( ACC_NSEC ); stop = stop - start; printf ( "ADV (CUDA): %s\n", stop.GetReadableTime().c_str() ); }*/
+				//SPH_AdvanceCUDA( m_DT, m_DT/m_Param[SPH_SIMSCALE] );
 
-				start.SetSystemTime ( ACC_NSEC );		
+				PROFILE_BEGIN ( from );
 				TransferFromCUDA ( mBuf[0].data, (int*) &m_Grid[0], NumPoints() );
-				if ( bTiming) { stop.SetSystemTime ( ACC_NSEC ); stop = stop - start; printf ( "FROM: %s\n", stop.GetReadableTime().c_str() ); }
+				PROFILE_END ( from, m_ProfId[PROF_TRANSFER] );
 
 				// .. Do advance on CPU 
+				SPH_DeclarePasses ();
+				PROFILE_BEGIN ( adv );
 				Advance();
+				PROFILE_END ( adv, m_ProfId[PROF_ADV] );
 
 			#endif
 			
 		} else {
 			// -- CPU only --
+			m_bBlock = GetBlockLevels() > 1 && !m_Toggle[USE_PCISPH] && !m_Toggle[USE_PBF] && m_Domain == 0x0;
+			m_bBoundary = m_Toggle[USE_BOUNDARY] && !m_Toggle[USE_PBF];
+			if ( m_bBoundary ) {
+				if ( m_Param[SPH_COLLIDE_BAKE] != m_ColBake ) SPH_SetupColliders ();		// sample the baked field, not the shapes it replaces
+				if ( m_BndVersion != m_Colliders.GetVersion() || m_BndCell != m_Param[SPH_SMOOTHRADIUS] / m_Param[SPH_SIMSCALE] ) SPH_SetupBoundary ();
+				m_BndHits = 0;
+			}
+			SPH_DeclarePasses ();
 
-			start.SetSystemTime ( ACC_NSEC );
+			if ( m_Toggle[USE_PBF] ) {
+				PROFILE_BEGIN ( predict );
+				SPH_PredictPBF ();				// the grid and neighbor table are built at the predicted positions
+				PROFILE_END ( predict, m_ProfId[PROF_PREDICT] );
+			}
+
+			PROFILE_BEGIN ( insert );
 			Grid_InsertParticles ();
-			if ( bTiming) { stop.SetSystemTime ( ACC_NSEC ); stop = stop - start; printf ( "INSERT: %s\n", stop.GetReadableTime().c_str() ); }
+			if ( m_Toggle[USE_QPOS] ) Grid_Quantize ();
+			SPH_UpdateDormancy ();
+			m_SkipMask = ( m_bSleep ? FLUID_SLEEP : 0 ) | ( m_bBlock ? FLUID_WAIT : 0 );
+			CountPass ( PASS_INSERT, NumPoints() );
+			PROFILE_END ( insert, m_ProfId[PROF_INSERT] );
 		
-			start.SetSystemTime ( ACC_NSEC );
+			PROFILE_BEGIN ( press );
 			SPH_ComputePressureGrid ();
-			if ( bTiming) { stop.SetSystemTime ( ACC_NSEC ); stop = stop - start; printf ( "PRESS: %s\n", stop.GetReadableTime().c_str() ); }
+			PROFILE_END ( press, m_ProfId[PROF_PRESS] );
 
-			//start.SetSystemTime ( ACC_NSEC );
 			//SPH_ComputeStressTensorGridNC ();		
-			//if ( bTiming) { stop.SetSystemTime ( ACC_NSEC ); stop = stop - start; printf ( "STRESS: %s\n", stop.GetReadableTime().c_str() ); }
 
-			start.SetSystemTime ( ACC_NSEC );
-			SPH_ComputeForceGridNC ();		
-			if ( bTiming) { stop.SetSystemTime ( ACC_NSEC ); stop = stop - start; printf ( "FORCE: %s\n", stop.GetReadableTime().c_str() ); }
+			if ( !m_Toggle[USE_PBF] ) {
+				PROFILE_BEGIN ( force );
+				SPH_ComputeForceGridNC ();		
+				PROFILE_END ( force, m_ProfId[PROF_FORCE] );
+			}
+
+			PROFILE_BEGIN ( collide );
+			SPH_ComputeColliders ();
+			PROFILE_END ( collide, m_ProfId[PROF_COLLIDE] );
 
-			start.SetSystemTime ( ACC_NSEC );
+			if ( m_Toggle[USE_PCISPH] || m_Toggle[USE_PBF] ) {
+				PROFILE_BEGIN ( solve );
+				if ( m_Toggle[USE_PBF] )
+					SPH_SolvePBF ();
+				else
+					SPH_ComputePressurePCI ();
+				PROFILE_END ( solve, m_ProfId[PROF_SOLVE] );
+			}
+
+			PROFILE_BEGIN ( adv );
 			Advance();
-			if ( bTiming) { stop.SetSystemTime ( ACC_NSEC ); stop = stop - start; printf ( "ADV: %s\n", stop.GetReadableTime().c_str() ); }
+			PROFILE_END ( adv, m_ProfId[PROF_ADV] );
 		}		
 		
 	#endif
+
+	if ( m_Domain != 0x0 ) m_Domain->DropGhosts ( this );
+	SPH_UpdateMemory ();
+	PROFILE_END ( step, m_ProfId[PROF_STEP] );
 }
 
 
@@ -469,192 +775,352 @@ void FluidSystem::SPH_DrawDomain ()
 	glEnd ();
 }
 
+double FluidSystem::GetStepDT ()
+{
+	double dt = m_Param[SPH_TIMESTEP];
+	if ( m_bBlock ) return dt / ( 1 << ( GetBlockLevels() - 1 ) );		// the finest level; SPH_CFL sets the levels instead
+	if ( m_Param[SPH_CFL] > 0 && m_Domain == 0x0 ) {			// the first adaptive step starts from SPH_TIMESTEP
+		if ( dt > m_Param[SPH_DT_MAX] ) dt = m_Param[SPH_DT_MAX];
+		if ( dt < m_Param[SPH_DT_MIN] ) dt = m_Param[SPH_DT_MIN];
+	}
+	return dt;
+}
+
 void FluidSystem::Advance ()
 {
+	m_DT = GetStepDT ();
+
+	int nt = ( m_Pool != 0x0 ) ? m_Pool->GetNumThreads() : 1;
+	m_ThreadDead.assign ( nt, 0 );
+	m_ThreadVMax.assign ( nt, 0 );
+	m_ThreadAMax.assign ( nt, 0 );
+	if ( m_bBlock ) {
+		m_ThreadFine.resize ( nt );
+		m_ThreadLevel.assign ( nt * BLOCK_LEVELS_MAX, 0 );
+	}
+
+	// Positions and colors are written straight into the next output slot
+	m_StageSlot = -1;
+	if ( m_bOutput ) {
+		PROFILE_BEGIN ( map );
+		m_StageSlot = m_Stage.Acquire ( NumOwned() );
+		PROFILE_END ( map, m_ProfId[PROF_MAP] );
+	}
+	m_StagePos = ( m_StageSlot >= 0 ) ? m_Stage.GetPos ( m_StageSlot ) : 0x0;
+	m_StageClr = ( m_StageSlot >= 0 ) ? m_Stage.GetColor ( m_StageSlot ) : 0x0;
+
+	if ( m_Pool != 0x0 )
+		m_Pool->Run ( AdvanceJob, this );
+	else
+		m_ThreadDead[0] = AdvanceRange ( 0, NumOwned(), 0 );	// ghosts (if any) are not integrated
+	if ( m_bBlock ) SPH_FinishBlockStep ();						// before compaction, while the neighbor table is valid
+	CountPass ( PASS_ADV, NumOwned() );
+
+	// Remove particles flagged dead before the slot is published
+	int dead = 0;
+	for (int t = 0; t < nt; t++ ) dead += m_ThreadDead[t];
+	if ( dead > 0 ) Compact ();
+
+	// Colors are a separate pass over the final order, run only if someone reads them
+	if ( m_StageSlot >= 0 && m_StageFmt != STAGE_CLR_NONE ) {
+		if ( m_Pool != 0x0 )
+			m_Pool->Run ( ColorJob, this );
+		else
+			SPH_ComputeColorRange ( 0, NumOwned() );
+	}
+	CountPass ( PASS_COLOR, ( m_StageSlot >= 0 && m_StageFmt != STAGE_CLR_NONE ) ? NumOwned() : 0 );
+
+	if ( m_StageSlot >= 0 ) {
+		PROFILE_BEGIN ( upload );
+		m_Stage.Publish ( m_StageSlot, NumOwned(), m_StageFmt );
+		PROFILE_END ( upload, m_ProfId[PROF_UPLOAD] );
+	}
+	m_StageSlot = -1;
+	m_StagePos = 0x0;
+	m_StageClr = 0x0;
+	
+	m_bPciValid = false;
+	m_Time += m_DT;
+	SPH_ComputeTimestep ();
+}
+
+// Limits for a weakly compressible fluid with pressure = stiffness * (density - rest):
+// the speed of sound is c = sqrt(stiffness). Monaghan's constraints, in simulation units:
+//   dt <= cfl * h / (c + vmax),   dt <= cfl * sqrt(h / amax),   dt <= 0.125 h^2 / nu
+// Growth is limited so a calm step after a violent one does not overshoot. The PCISPH
+// and PBF solvers have no sound speed to resolve, so c = 0 there.
+void FluidSystem::SPH_ComputeTimestep ()
+{
+	float vmax = 0, amax = 0;
+	for (int t = 0; t < (int) m_ThreadVMax.size(); t++ ) {
+		if ( m_ThreadVMax[t] > vmax ) vmax = m_ThreadVMax[t];
+		if ( m_ThreadAMax[t] > amax ) amax = m_ThreadAMax[t];
+	}
+	vmax = sqrt ( vmax );
+	amax = sqrt ( amax );
+
+	double cfl = m_Param[SPH_CFL];
+	double h = m_Param[SPH_SMOOTHRADIUS];
+	double c = ( m_Toggle[USE_PCISPH] || m_Toggle[USE_PBF] ) ? 0 : sqrt ( m_Param[SPH_INTSTIFF] );
+	double nu = m_Param[SPH_VISC] / m_Param[SPH_RESTDENSITY];		// kinematic viscosity
+
+	int limit = DT_LIMIT_MAX;
+	double dt = m_Param[SPH_DT_MAX];
+	if ( cfl > 0 && m_Domain == 0x0 && !m_bBlock ) {
+		double dv = cfl * h / ( c + vmax );
+		double da = ( amax > 0 ) ? cfl * sqrt ( h / amax ) : dt;
+		double dn = ( nu > 0 ) ? 0.125 * h * h / nu : dt;
+		if ( dv < dt ) { dt = dv; limit = DT_LIMIT_VEL; }
+		if ( da < dt ) { dt = da; limit = DT_LIMIT_FORCE; }
+		if ( dn < dt ) { dt = dn; limit = DT_LIMIT_VISC; }
+		if ( dt > m_DT * DT_GROWTH ) { dt = m_DT * DT_GROWTH; limit = DT_LIMIT_GROWTH; }
+		if ( dt < m_Param[SPH_DT_MIN] || !( dt == dt ) ) { dt = m_Param[SPH_DT_MIN]; limit = DT_LIMIT_MIN; }
+		m_Param[SPH_TIMESTEP] = dt;
+	}
+
+	FluidDTStep& s = m_DTHist[ m_DTSteps % DT_HISTORY ];
+	s.dt = (float) m_DT;
+	s.vmax = vmax;
+	s.amax = amax;
+	s.limit = ( cfl > 0 && m_Domain == 0x0 && !m_bBlock ) ? limit : -1;
+	if ( m_DTSteps == 0 || m_DT < m_DTLo ) m_DTLo = m_DT;
+	if ( m_DTSteps == 0 || m_DT > m_DTHi ) m_DTHi = m_DT;
+	if ( s.limit >= 0 ) m_DTLimit[s.limit]++;
+	m_DTSum += m_DT;
+	m_DTSteps++;
+}
+
+void FluidSystem::SPH_ReportTimestep ()
+{
+	if ( m_DTSteps == 0 ) return;
+	const char* names[DT_LIMITS] = { "courant", "force", "viscous", "growth", "min", "max" };
+	printf ( "Timestep: %d steps, %.4f s simulated, dt %.6f avg (%.6f - %.6f)\n", m_DTSteps, m_DTSum, m_DTSum / m_DTSteps, m_DTLo, m_DTHi );
+	if ( m_Param[SPH_CFL] <= 0 || m_Domain != 0x0 || m_bBlock ) return;
+	printf ( "Timestep: limited by" );
+	for (int l = 0; l < DT_LIMITS; l++ )
+		if ( m_DTLimit[l] > 0 ) printf ( " %s %d", names[l], m_DTLimit[l] );
+	printf ( "\n" );
+
+	// History, oldest first, at most 16 rows of evenly spaced steps
+	int n = GetNumDTSteps ();
+	int every = ( n + 15 ) / 16;
+	for (int back = n-1; back >= 0; back -= every ) {
+		FluidDTStep* s = GetDTStep ( back );
+		printf ( "  step %6d  dt %.6f  vmax %8.4f  amax %10.2f  %s\n", m_DTSteps - 1 - back, s->dt, s->vmax, s->amax, s->limit >= 0 ? names[s->limit] : "-" );
+	}
+}
+
+// Color stage. The ramp input of each particle is gathered into a short local block
+// first, then normalized and mapped through the lookup table in a plain loop over
+// that block (or stored as is for a shader-side ramp). The mode is resolved once per
+// range, not per particle.
+void FluidSystem::SPH_ComputeColorRange ( int start, int end )
+{
+	float v[COLOR_BLOCK];
+	int mode = (int) m_Param[CLR_MODE];
+	float scale = ( mode == 1 ) ? 1.0f/1.5f : ( mode == 2 ) ? 1.0f/1500.0f : 1.0f;
+	DWORD* clr = m_StageClr;
+	float* scalar = (float*) m_StageClr;
+	int stride = mBuf[FLUID_HOT].stride;
+
+	for (int b = start; b < end; b += COLOR_BLOCK ) {
+		int n = ( end - b < COLOR_BLOCK ) ? end - b : COLOR_BLOCK;
+		char* dat = mBuf[FLUID_HOT].data + (long) b * stride;
+		switch ( mode ) {
+		case 1:	for (int i = 0; i < n; i++, dat += stride ) {					// velocity
+					Fluid* p = (Fluid*) dat;
+					v[i] = fabs(p->vel.x) + fabs(p->vel.y) + fabs(p->vel.z);
+				}
+				break;
+		case 2:	for (int i = 0; i < n; i++, dat += stride )					// pressure
+					v[i] = ((Fluid*) dat)->pressure;
+				break;
+		case 3:	for (int i = 0; i < n; i++ )									// temperature
+					v[i] = GetThermal ( b+i )->temp;
+				break;
+		default:
+				for (int i = 0; i < n; i++ )									// original color
+					clr[b+i] = STAGE_RGBA ( GetCold ( b+i )->clr );
+				continue;
+		}
+		for (int i = 0; i < n; i++ ) {
+			float x = v[i] * scale;
+			v[i] = ( x > 0.0f ) ? ( x < 1.0f ? x : 1.0f ) : 0.0f;		// NaN maps to 0
+		}
+		if ( m_StageFmt == STAGE_CLR_SCALAR ) {
+			for (int i = 0; i < n; i++ ) scalar[b+i] = v[i];
+		} else {
+			for (int i = 0; i < n; i++ ) clr[b+i] = m_ColorRamp[ (int) ( v[i] * (COLOR_RAMP-1) + 0.5f ) ];
+		}
+	}
+}
+
+// Collider penalties and point gravity, added to accel. Shared by Advance and the
+// PCISPH prediction, so both see the same boundary response. The contact pass has
+// the penalties ready for particles near a collider; a particle outside the grid is
+// in no cell chain, so it (or every particle, if the pass did not run) is tested here.
+void FluidSystem::SPH_ComputeBoundary ( Fluid* p, int i, Vector3DF& accel )
+{
+	Vector3DF norm;
+
+	if ( !m_bContacts )
+		SPH_ComputeContact ( p, accel );
+	else if ( p->flags & FLUID_CONTACT )
+		accel += m_ColAccel[i];
+	else if ( m_Colliders.GetCell ( p->pos ) < 0 )
+		SPH_ComputeContact ( p, accel );
+
+	// Point gravity
+	if ( m_Param[POINT_GRAV] > 0 ) {
+		norm.x = ( p->pos.x - m_Vec[POINT_GRAV_POS].x );
+		norm.y = ( p->pos.y - m_Vec[POINT_GRAV_POS].y );
+		norm.z = ( p->pos.z - m_Vec[POINT_GRAV_POS].z );
+		norm.Normalize ();
+		norm *= m_Param[POINT_GRAV];
+		accel -= norm;
+	}
+}
+
+int FluidSystem::AdvanceRange ( int start, int end, int t )
+{
+	int dead = 0;
+	float vmax = 0, amax = 0;			// squared, reduced over threads for the adaptive timestep
 	char *dat1, *dat1_end;
 	Fluid* p;
-	Vector3DF norm, z;
-	Vector3DF dir, accel;
+	bool bThermal = ( m_Pass[PASS_ADV].own & (1 << FLUID_THERMAL) ) != 0;
+	float* spos = m_StagePos;
+	Vector3DF* pacc = m_bPciValid ? &m_PciPress[0] : 0x0;		// PCISPH pressure, kept apart from sph_force
+	bool bPBF = m_Toggle[USE_PBF];								// positions and velocities are final already
+	bool bSleep = m_bSleep;
+	float sleepv2 = m_Param[SPH_SLEEP_VEL] * m_Param[SPH_SLEEP_VEL];
+	bool bBlock = m_bBlock;
+	int nlev = GetBlockLevels ();
+	int lev, lold, lalign = 0, lnext = 0, clamped = 0;
+	int* levels = 0x0;
+	std::vector<int>* fine = 0x0;
+	FluidCold* cold;
+	double dtc = m_Param[SPH_TIMESTEP];						// coarsest level
+	double dtlim = dtc, dti, step, vs;
+	double h = m_Param[SPH_SMOOTHRADIUS];						// block levels: Courant and force limits
+	double cs = sqrt ( m_Param[SPH_INTSTIFF] );
+	double cfl = ( m_Param[SPH_CFL] > 0 ) ? m_Param[SPH_CFL] : BLOCK_CFL;
+	Vector3DF accel;
 	Vector3DF vnext;
-	Vector3DF min, max;
-	double adj;
-	float SL, SL2, ss, radius;
-	float stiff, damp, speed, diff;
-	m_DT = m_Param[SPH_TIMESTEP];
+	float SL, SL2, ss;
+	float speed, diff;
 	SL = m_Param[SPH_LIMIT];
 	SL2 = SL*SL;
 	
-	stiff = m_Param[SPH_EXTSTIFF];
-	damp = m_Param[SPH_EXTDAMP];
-	radius = m_Param[SPH_PRADIUS];
-	min = m_Vec[SPH_VOLMIN];
-	max = m_Vec[SPH_VOLMAX];
 	ss = m_Param[SPH_SIMSCALE];
 
-	//Position VBO Mapping
-	unsigned int pCount = 0;
+	if ( bBlock ) {
+		while ( lalign < nlev-1 && m_BlockTick % ( 1 << (nlev-1-lalign) ) != 0 ) lalign++;		// coarsest level with a step starting now
+		while ( lnext < nlev-1 && ( m_BlockTick+1 ) % ( 1 << (nlev-1-lnext) ) != 0 ) lnext++;	// ... and at the next step
+		if ( m_Param[SPH_VISC] > 0 && 0.125 * h * h * m_Param[SPH_RESTDENSITY] / m_Param[SPH_VISC] < dtlim )
+			dtlim = 0.125 * h * h * m_Param[SPH_RESTDENSITY] / m_Param[SPH_VISC];		// viscous limit, the same for all
+		levels = &m_ThreadLevel[t * BLOCK_LEVELS_MAX];
+		fine = &m_ThreadFine[t];
+		fine->clear ();
+	}
+
+	unsigned int pCount = start;
 
-	dat1_end = mBuf[0].data + NumPoints()*mBuf[0].stride;
-	for ( dat1 = mBuf[0].data; dat1 < dat1_end; dat1 += mBuf[0].stride ) {
+	dat1_end = mBuf[0].data + end*mBuf[0].stride;
+	for ( dat1 = mBuf[0].data + start*mBuf[0].stride; dat1 < dat1_end; dat1 += mBuf[0].stride ) {
 		p = (Fluid*) dat1;		
 
-		// Compute Acceleration		
-		accel = p->sph_force;
-		accel *= p->density;
+		if ( bSleep && ( p->flags & FLUID_SLEEP ) ) {
+			// frozen in place, at rest
+		} else if ( bPBF ) {
+			speed = p->vel.x*p->vel.x + p->vel.y*p->vel.y + p->vel.z*p->vel.z;
+			if ( speed > vmax ) vmax = speed;
+		} else if ( bBlock && ( p->flags & FLUID_WAIT ) ) {
+			vnext = p->vel;							// between its own steps: drift only
+			speed = vnext.x*vnext.x + vnext.y*vnext.y + vnext.z*vnext.z;
+			if ( speed > vmax ) vmax = speed;
+			if ( bSleep && speed > sleepv2 ) p->flags |= FLUID_RESTLESS;
+			vnext *= m_DT/ss;
+			p->pos += vnext;
+		} else {
+			// Compute Acceleration		
+			accel = p->sph_force;
+			accel *= p->density;
+			if ( pacc != 0x0 ) accel += pacc[pCount];
 		
-		if ( m_Param[PLANE_GRAV] > 0) 
-			accel += m_Vec[PLANE_GRAV_DIR];
-
-		// Velocity limiting 
-		speed = accel.x*accel.x + accel.y*accel.y + accel.z*accel.z;
-		if ( speed > SL2 ) {
-			accel *= SL / sqrt(speed);
-		}		
+			if ( m_Param[PLANE_GRAV] > 0) 
+				accel += m_Vec[PLANE_GRAV_DIR];
+
+			// Velocity limiting 
+			speed = accel.x*accel.x + accel.y*accel.y + accel.z*accel.z;
+			if ( speed > SL2 ) {
+				accel *= SL / sqrt(speed);
+			}		
 	
-		// Boundary Conditions
-
-		// Z-axis walls
-		diff = 2 * radius - ( p->pos.z - min.z - (p->pos.x - m_Vec[SPH_VOLMIN].x) * m_Param[BOUND_ZMIN_SLOPE] )*ss;
-		if (diff > EPSILON ) {			
-			norm.Set ( -m_Param[BOUND_ZMIN_SLOPE], 0, 1.0 - m_Param[BOUND_ZMIN_SLOPE] );
-			adj = stiff * diff - damp * norm.Dot ( p->vel_eval );
-			accel.x += adj * norm.x; accel.y += adj * norm.y; accel.z += adj * norm.z;
-		}		
-
-		diff = 2 * radius - ( max.z - p->pos.z )*ss;
-		if (diff > EPSILON) {
-			norm.Set ( 0, 0, -1 );
-			adj = stiff * diff - damp * norm.Dot ( p->vel_eval );
-			accel.x += adj * norm.x; accel.y += adj * norm.y; accel.z += adj * norm.z;
-		}
+			// Boundary Conditions
+			SPH_ComputeBoundary ( p, pCount, accel );
+
+			speed = accel.x*accel.x + accel.y*accel.y + accel.z*accel.z;
+			if ( speed > amax ) amax = speed;
+
+			// Leapfrog Integration ----------------------------
+			vnext = accel;							
+			if ( bBlock ) {
+				// Level of the step it starts now: own Courant and force limits, at most one
+				// coarser than before and than any neighbor, and aligned with this step
+				cold = GetCold ( pCount );
+				lold = ( p->flags & FLUID_LEVEL_MASK ) >> FLUID_LEVEL_SHIFT;
+				vs = sqrt ( p->vel.x*p->vel.x + p->vel.y*p->vel.y + p->vel.z*p->vel.z );
+				dti = dtlim;
+				if ( cfl * h / ( cs + vs ) < dti ) dti = cfl * h / ( cs + vs );
+				if ( speed > 0 && cfl * sqrt ( h / sqrt(speed) ) < dti ) dti = cfl * sqrt ( h / sqrt(speed) );
+				for ( lev = 0; lev < nlev-1 && dtc / (1 << lev) > dti; lev++ );
+				if ( dtc / (1 << lev) > dti ) clamped++;
+				if ( lev < lold - 1 ) lev = lold - 1;
+				if ( lev < m_BlockNbr[pCount] - 1 ) lev = m_BlockNbr[pCount] - 1;
+				if ( lev < lalign ) lev = lalign;
+				step = dtc / (1 << lev);
+				vnext *= ( cold->step > 0 ) ? 0.5 * ( cold->step + step ) : step;		// v(t+1/2) = v(t-1/2) + a(t) (dt_old + dt_new)/2
+				cold->accel = accel;
+				cold->step = (float) step;
+				p->flags = ( p->flags & ~FLUID_LEVEL_MASK ) | ( lev << FLUID_LEVEL_SHIFT );
+				if ( lev >= 2 ) fine->push_back ( pCount );
+			} else
+				vnext *= m_DT;
+			vnext += p->vel;						// v(t+1/2) = v(t-1/2) + a(t) dt
+			p->vel = vnext;
+			speed = vnext.x*vnext.x + vnext.y*vnext.y + vnext.z*vnext.z;
+			if ( speed > vmax ) vmax = speed;
+			if ( bSleep && speed > sleepv2 ) p->flags |= FLUID_RESTLESS;
+			//XSPH Correction
+			//SPH_ComputeXSPH(p,pCount);
+			//vnext = p->vel;
+			p->vel_eval = p->vel;
+			p->vel_eval += vnext;
+			p->vel_eval *= 0.5;					// v(t+1) = [v(t-1/2) + v(t+1/2)] * 0.5		used to compute forces later
 		
-		// X-axis walls
-		if ( !m_Toggle[WRAP_X] ) {
-			diff = 2 * radius - ( p->pos.x - min.x /*+ (sin(m_Time*10.0)-1+(p->pos.y*0.025)*0.25) * m_Param[FORCE_XMIN_SIN]*/ )*ss;	
-			//diff = 2 * radius - ( p->pos.x - min.x + (sin(m_Time*10.0)-1) * m_Param[FORCE_XMIN_SIN] )*ss;	
-			if (diff > EPSILON ) {
-				norm.Set ( 1.0, 0, 0 );
-				adj = (m_Param[ FORCE_XMIN_SIN ] + 1) * stiff * diff - damp * norm.Dot ( p->vel_eval ) ;
-				accel.x += adj * norm.x; accel.y += adj * norm.y; accel.z += adj * norm.z;					
-			}
-
-			diff = 2 * radius - ( max.x - p->pos.x /*+ (sin(m_Time*10.0)-1) * m_Param[FORCE_XMAX_SIN]*/ )*ss;	
-			if (diff > EPSILON) {
-				norm.Set ( -1, 0, 0 );
-				adj = (m_Param[ FORCE_XMAX_SIN ]+1) * stiff * diff - damp * norm.Dot ( p->vel_eval );
-				accel.x += adj * norm.x; accel.y += adj * norm.y; accel.z += adj * norm.z;
-			}
-		}
-
-		// Y-axis walls
-		diff = 2 * radius - ( p->pos.y - min.y )*ss;			
-		if (diff > EPSILON) {
-			norm.Set ( 0, 1, 0 );
-			adj = stiff * diff - damp * norm.Dot ( p->vel_eval );
-			accel.x += adj * norm.x; accel.y += adj * norm.y; accel.z += adj * norm.z;
+			vnext *= m_DT/ss;
+			p->pos += vnext;						// p(t+1) = p(t) + v(t+1/2) dt
 		}
-		diff = 2 * radius - ( max.y - p->pos.y )*ss;
-		if (diff > EPSILON) {
-			norm.Set ( 0, -1, 0 );
-			adj = stiff * diff - damp * norm.Dot ( p->vel_eval );
-			accel.x += adj * norm.x; accel.y += adj * norm.y; accel.z += adj * norm.z;
-		}
-
-		// Wall barrier
-		if ( m_Toggle[WALL_BARRIER] ) {
-			diff = 2 * radius - ( p->pos.x - 0 )*ss;					
-			if (diff < 2*radius && diff > EPSILON && fabs(p->pos.y) < 3 && p->pos.z < 10) {
-				norm.Set ( 1.0, 0, 0 );
-				adj = 2*stiff * diff - damp * norm.Dot ( p->vel_eval ) ;	
-				accel.x += adj * norm.x; accel.y += adj * norm.y; accel.z += adj * norm.z;					
-			}
-		}
-		
-		// Levy barrier
-		if ( m_Toggle[LEVY_BARRIER] ) {
-			diff = 2 * radius - ( p->pos.x - 0 )*ss;					
-			if (diff < 2*radius && diff > EPSILON && fabs(p->pos.y) > 5 && p->pos.z < 10) {
-				norm.Set ( 1.0, 0, 0 );
-				adj = 2*stiff * diff - damp * norm.Dot ( p->vel_eval ) ;	
-				accel.x += adj * norm.x; accel.y += adj * norm.y; accel.z += adj * norm.z;					
-			}
-		}
-		// Drain barrier
-		if ( m_Toggle[DRAIN_BARRIER] ) {
-			diff = 2 * radius - ( p->pos.z - min.z-15 )*ss;
-			if (diff < 2*radius && diff > EPSILON && (fabs(p->pos.x)>3 || fabs(p->pos.y)>3) ) {
-				norm.Set ( 0, 0, 1);
-				adj = stiff * diff - damp * norm.Dot ( p->vel_eval );
-				accel.x += adj * norm.x; accel.y += adj * norm.y; accel.z += adj * norm.z;
-			}
-		}
-
-		// Point gravity
-		if ( m_Param[POINT_GRAV] > 0 ) {
-			norm.x = ( p->pos.x - m_Vec[POINT_GRAV_POS].x );
-			norm.y = ( p->pos.y - m_Vec[POINT_GRAV_POS].y );
-			norm.z = ( p->pos.z - m_Vec[POINT_GRAV_POS].z );
-			norm.Normalize ();
-			norm *= m_Param[POINT_GRAV];
-			accel -= norm;
+		if ( p->flags & FLUID_DEAD ) dead++;		// in a sink (see SPH_ComputeCollideRange)
+		p->flags &= ~FLUID_CONTACT;
+		if ( bBlock ) {							// due next step if its level has a step starting then
+			lev = ( p->flags & FLUID_LEVEL_MASK ) >> FLUID_LEVEL_SHIFT;
+			levels[lev]++;
+			if ( lev >= lnext ) p->flags &= ~FLUID_WAIT; else p->flags |= FLUID_WAIT;
 		}
-
-		// Leapfrog Integration ----------------------------
-		vnext = accel;							
-		vnext *= m_DT;
-		vnext += p->vel;						// v(t+1/2) = v(t-1/2) + a(t) dt
-		p->vel = vnext;
-		//XSPH Correction
-		//SPH_ComputeXSPH(p,pCount);
-		//vnext = p->vel;
-		p->vel_eval = p->vel;
-		p->vel_eval += vnext;
-		p->vel_eval *= 0.5;					// v(t+1) = [v(t-1/2) + v(t+1/2)] * 0.5		used to compute forces later
-		
-		vnext *= m_DT/ss;
-		p->pos += vnext;						// p(t+1) = p(t) + v(t+1/2) dt
 		
 		//Temperature							
-		p->temp_eval = p->temp;
-		
-		//Update Position VBO
-		m_vPos[4*pCount] =   p->pos.x;
-		m_vPos[4*pCount+1] = p->pos.y;
-		m_vPos[4*pCount+2] = p->pos.z;
-		m_vPos[4*pCount+3] = 1.0f;
-		
-
-		//Colors
-		DWORD color;
-		//Velocity
-		if ( m_Param[CLR_MODE] == 1.0 ) {
-			adj = fabs(p->vel.x)+fabs(p->vel.y)+fabs(p->vel.z);
-			//adj = (adj > 1.0) ? 1.0 : adj;
-			//color = COLORA( adj, 1-adj, adj, 1 );
-			color = getColorRampVel(adj,0.0, 1.5);
-		}
-
-		//Pressure
-		else if ( m_Param[CLR_MODE]==2.0 ) {
-			float v = 0.0 + ( p->pressure / 1500.0); 
-			//if ( v < 0.1 ) v = 0.1;
-			//if ( v > 1.0 ) v = 1.0;
-			//color = COLORA ( v, 0, 1-v, 1 );
-			color = getColorRampPressure(v,0.0, 1.0);
+		if ( bThermal ) {
+			FluidThermal* t = GetThermal ( pCount );
+			t->temp_eval = t->temp;
 		}
-		//Temperature
-		else if ( m_Param[CLR_MODE]==3.0 ) {
-			float v = p->temp;
-			color = getColorRampTemp(v,0.0, 1.0);
+		
+		//Render output (write-only, may be uncached GL memory)
+		if ( spos != 0x0 ) {
+			spos[3*pCount] =   p->pos.x;
+			spos[3*pCount+1] = p->pos.y;
+			spos[3*pCount+2] = p->pos.z;
 		}
-		else
-			color = p->clr;
-
-		//Update Color VBO
-		m_vCol[4*pCount] =   RED(color);
-		m_vCol[4*pCount+1] = GRN(color);
-		m_vCol[4*pCount+2] = BLUE(color);
-		m_vCol[4*pCount+3] = ALPH(color);
 		
 		pCount++;
 
@@ -675,11 +1141,397 @@ void FluidSystem::Advance ()
 			}
 		}	
 	}
+	m_ThreadVMax[t] = vmax;
+	m_ThreadAMax[t] = amax;
+	if ( clamped > 0 ) ThreadPool::FetchAdd ( &m_BlockClamped, clamped );
+	return dead;
+}
 
-	//Update VBO's
-	UpdateVBOS(NumPoints());
-	
-	m_Time += m_DT;
+// Stream compaction. Thread t owns the same particle partition it advanced, so its
+// survivor count is known without another pass; prefix sums give each thread its
+// output offset. Ghosts (never dead) ride along at the end of the last partition.
+void FluidSystem::Compact ()
+{
+	int nt = (int) m_ThreadDead.size();
+	for (int b = 0; b < FLUID_BLOCKS; b++ ) {
+		long bytes = (long) mBuf[b].max * mBuf[b].stride;
+		GeomBuf& scr = m_Scratch[b];
+		if ( scr.stride != mBuf[b].stride || scr.mem.committed < bytes ) {
+			long from = ( scr.stride == mBuf[b].stride ) ? scr.mem.committed : 0;
+			scr.num = 0;
+			scr.stride = mBuf[b].stride;
+			CommitBuffer ( scr, bytes );
+			if ( scr.mem.committed < from ) from = 0;
+			if ( m_Pool != 0x0 ) m_Pool->Touch ( scr.data + from, scr.mem.committed - from );
+		}
+	}
+	m_Remap.resize ( NumPoints() );
+
+	// survivors per partition -> output offsets
+	int offset = 0, dead = 0;
+	for (int t = 0; t < nt; t++ ) {
+		int start, end;
+		ThreadPool::GetRange ( NumOwned(), t, nt, start, end );
+		if ( t == nt-1 ) end = NumPoints();
+		int alive = ( end - start ) - m_ThreadDead[t];
+		dead += m_ThreadDead[t];
+		m_ThreadDead[t] = offset;
+		offset += alive;
+	}
+
+	if ( m_Pool != 0x0 ) {
+		m_Pool->Run ( CompactCopyJob, this );
+		m_Pool->Run ( CompactGridJob, this );		// needs every survivor copied first
+	} else {
+		CompactCopyRange ( 0, 1 );
+		CompactGridRange ( 0, 1 );
+	}
+
+	for (int b = 0; b < FLUID_BLOCKS; b++ ) {
+		SwapBufferData ( b, m_Scratch[b] );
+	}
+	SetNumPoints ( offset );
+	memset ( m_NC, 0, m_NeighborMax * sizeof(unsigned short) );		// stale indices, rebuilt by the next pressure pass
+	m_NumRemoved += dead;
+}
+
+void FluidSystem::CompactCopyRange ( int t, int nt )
+{
+	int start, end, owned = NumOwned();
+	int stride = mBuf[FLUID_HOT].stride;
+	ThreadPool::GetRange ( owned, t, nt, start, end );
+	if ( t == nt-1 ) end = NumPoints();
+
+	int k = m_ThreadDead[t];
+	char* src = mBuf[FLUID_HOT].data + (long) start * stride;
+	for (int i = start; i < end; i++, src += stride ) {
+		if ( ((Fluid*) src)->flags & FLUID_DEAD ) { m_Remap[i] = -1; continue; }
+		for (int b = 0; b < FLUID_BLOCKS; b++ )
+			memcpy ( m_Scratch[b].data + (long) k * mBuf[b].stride, mBuf[b].data + (long) i * mBuf[b].stride, mBuf[b].stride );
+		if ( i < owned && m_StagePos != 0x0 ) {
+			// Rewrite the output position at the new index from the record (the slot is never
+			// read back). Output ranges of the threads are disjoint, so this is race free.
+			// Colors are written after compaction.
+			Fluid* p = (Fluid*) src;
+			m_StagePos[3*k] = p->pos.x;		m_StagePos[3*k+1] = p->pos.y;		m_StagePos[3*k+2] = p->pos.z;
+		}
+		m_Remap[i] = k++;
+	}
+}
+
+// Grid chains are disjoint, so cells can be split across threads. Old links are
+// read from the old buffer, new links written into the compacted one.
+void FluidSystem::CompactGridRange ( int t, int nt )
+{
+	int start, end;
+	int stride = mBuf[FLUID_HOT].stride;
+	char* dest = m_Scratch[FLUID_HOT].data;
+	ThreadPool::GetRange ( m_GridTotal, t, nt, start, end );
+	for (int c = start; c < end; c++ ) {
+		int prev = -1, cnt = 0;
+		for (int j = m_Grid[c]; j != -1; j = ((Fluid*) (mBuf[FLUID_HOT].data + (long) j * stride))->next ) {
+			if ( m_Remap[j] < 0 ) continue;
+			if ( prev == -1 )	m_Grid[c] = m_Remap[j];
+			else				((Fluid*) (dest + (long) prev * stride))->next = m_Remap[j];
+			prev = m_Remap[j];
+			cnt++;
+		}
+		if ( prev == -1 )	m_Grid[c] = -1;
+		else				((Fluid*) (dest + (long) prev * stride))->next = -1;
+		m_GridCnt[c] = cnt;
+	}
+}
+
+// NUMA report. Estimates local vs remote particle accesses per phase from the current
+// page placement and the fixed thread-to-partition mapping. Neighbor reads are taken from
+// the neighbor table built by the last pressure pass (the grid walk visits a superset).
+void FluidSystem::SPH_ReportNUMA ()
+{
+	enum { PH_INSERT, PH_PRESS, PH_FORCE, PH_ADV, PH_MAX };
+	const char* names[PH_MAX] = { "INSERT", "PRESS", "FORCE", "ADV" };
+	long cnt[PH_MAX][3];				// local, remote, unplaced
+	std::vector<int> pnode, gnode;
+	int num = NumPoints();
+	int stride = mBuf[0].stride;
+	long page = ThreadPool::GetPageSize ();
+
+	if ( m_Pool == 0x0 || num == 0 ) { printf ( "NUMA: no thread pool.\n" ); return; }
+	if ( !m_Pool->QueryNodes ( mBuf[0].data, (long) num * stride, pnode ) ) {
+		printf ( "NUMA: page placement not available on this platform.\n" );
+		return;
+	}
+	if ( m_GridTotal > 0 ) m_Pool->QueryNodes ( (char*) &m_Grid[0], m_GridTotal * sizeof(int), gnode );
+	char* pfirst = (char*) ( (size_t) mBuf[0].data & ~(size_t)(page-1) );
+	char* gfirst = ( m_GridTotal > 0 ) ? (char*) ( (size_t) &m_Grid[0] & ~(size_t)(page-1) ) : 0x0;
+	memset ( cnt, 0, sizeof(cnt) );
+
+	#define NUMA_COUNT(ph,node,mine)	cnt[ph][ (node) < 0 ? 2 : ((node)==(mine) ? 0 : 1) ]++
+	#define PAGE_OF(i)					pnode[ ( mBuf[0].data + (long)(i)*stride - pfirst ) / page ]
+
+	// Insert is serial on the calling thread: one record write plus one grid head write per particle.
+	int node0 = m_Pool->GetThreadNode ( 0 );
+	for (int i = 0; i < num; i++ ) {
+		Fluid* p = GetFluid ( i );
+		NUMA_COUNT ( PH_INSERT, PAGE_OF(i), node0 );
+		int gx = (int)( (p->pos.x - m_GridMin.x) * m_GridDelta.x);
+		int gy = (int)( (p->pos.y - m_GridMin.y) * m_GridDelta.y);
+		int gz = (int)( (p->pos.z - m_GridMin.z) * m_GridDelta.z);
+		int gs = (int)( (gz*m_GridRes.y + gy)*m_GridRes.x + gx);
+		if ( gs >= 0 && gs < m_GridTotal && gnode.size() > 0 )
+			NUMA_COUNT ( PH_INSERT, gnode[ ( (char*) &m_Grid[gs] - gfirst ) / page ], node0 );
+	}
+	// Partitioned passes: own record plus every neighbor record.
+	for (int t = 0; t < m_Pool->GetNumThreads(); t++ ) {
+		int start, end, node = m_Pool->GetThreadNode ( t );
+		ThreadPool::GetRange ( num, t, m_Pool->GetNumThreads(), start, end );
+		for (int i = start; i < end; i++ ) {
+			NUMA_COUNT ( PH_PRESS, PAGE_OF(i), node );
+			NUMA_COUNT ( PH_FORCE, PAGE_OF(i), node );
+			if ( i < NumOwned() ) NUMA_COUNT ( PH_ADV, PAGE_OF(i), node );
+			int* nbr = GetNeighbors ( i );
+			for (int j = 0; j < m_NC[i]; j++ ) {
+				NUMA_COUNT ( PH_PRESS, PAGE_OF(nbr[j]), node );
+				NUMA_COUNT ( PH_FORCE, PAGE_OF(nbr[j]), node );
+			}
+		}
+	}
+	#undef NUMA_COUNT
+	#undef PAGE_OF
+
+	printf ( "NUMA: %d threads, %d node(s), %d particles\n", m_Pool->GetNumThreads(), m_Pool->GetNumNodes(), num );
+	printf ( "  %-8s %12s %12s %12s %8s\n", "phase", "local", "remote", "unplaced", "remote%" );
+	for (int ph = 0; ph < PH_MAX; ph++ ) {
+		long total = cnt[ph][0] + cnt[ph][1];
+		printf ( "  %-8s %12ld %12ld %12ld %7.1f%%\n", names[ph], cnt[ph][0], cnt[ph][1], cnt[ph][2], total > 0 ? 100.0 * cnt[ph][1] / total : 0.0 );
+	}
+}
+
+//------------------------------------------------------ Attribute Blocks
+
+int FluidSystem::GetBlockMask ( const char** attr )
+{
+	int mask = 0;
+	for ( ; *attr != 0x0; attr++ ) {
+		int b = GetAttrBuf ( *attr );
+		if ( b < 0 )
+			printf ( "ERROR: Pass uses unregistered attribute '%s'.\n", *attr );
+		else
+			mask |= 1 << b;
+	}
+	return mask;
+}
+
+// Blocks each pass may touch this step. Thermal diffusion and the particle colors
+// are optional, so the thermal and cold blocks are only streamed when in use.
+void FluidSystem::SPH_DeclarePasses ()
+{
+	bool bThermal = ( m_Param[SPH_THERMAL_DIFF] != 0 );
+	int clr = (int) m_Param[CLR_MODE];
+
+	m_Pass[PASS_INSERT].own = GetBlockMask ( g_InsertOwn );
+	m_Pass[PASS_INSERT].nbr = 0;
+	m_Pass[PASS_PRESS].own = GetBlockMask ( g_PressOwn );
+	m_Pass[PASS_PRESS].nbr = GetBlockMask ( g_PressNbr );
+	m_Pass[PASS_FORCE].own = GetBlockMask ( g_ForceOwn );
+	m_Pass[PASS_FORCE].nbr = GetBlockMask ( g_ForceNbr );
+	if ( bThermal ) {
+		m_Pass[PASS_FORCE].own |= GetBlockMask ( g_ThermalOwn );
+		m_Pass[PASS_FORCE].nbr |= GetBlockMask ( g_ThermalNbr );
+	}
+	m_Pass[PASS_ADV].own = GetBlockMask ( g_AdvOwn );
+	m_Pass[PASS_ADV].nbr = 0;
+	if ( bThermal )
+		m_Pass[PASS_ADV].own |= GetBlockMask ( g_AdvTemp );
+	if ( m_bBlock )
+		m_Pass[PASS_ADV].own |= GetBlockMask ( g_BlockAdv );
+	m_Pass[PASS_COLLIDE].own = GetBlockMask ( g_CollideOwn );
+	m_Pass[PASS_COLLIDE].nbr = 0;
+	m_Pass[PASS_SOLVE].own = m_Toggle[USE_PCISPH] ? GetBlockMask ( g_SolveOwn ) : 0;
+	m_Pass[PASS_SOLVE].nbr = m_Toggle[USE_PCISPH] ? GetBlockMask ( g_SolveNbr ) : 0;
+	if ( m_Toggle[USE_PBF] ) {								// no force pass; iterations work on side arrays
+		m_Pass[PASS_FORCE].own = m_Pass[PASS_FORCE].nbr = 0;
+		m_Pass[PASS_SOLVE].own = GetBlockMask ( g_PbfOwn );
+		m_Pass[PASS_SOLVE].nbr = GetBlockMask ( g_PbfNbr );
+	}
+	for (int p = 0; p < PASS_MAX; p++ ) {
+		if ( m_Pass[p].own != 0 || p == PASS_COLOR ) continue;		// not run this step
+		m_Pass[p].records = m_Pass[p].visits = m_Pass[p].entries = 0;
+		m_Pass[p].bytes = 0;
+	}
+
+	// Color output as requested by the consumer; scalars need a ramp input
+	m_StageFmt = ( m_Stage.IsActive() && m_bOutput ) ? m_Stage.GetColorRequest() : STAGE_CLR_NONE;
+	if ( m_StageFmt == STAGE_CLR_SCALAR && ( clr < 1 || clr > 3 ) ) m_StageFmt = STAGE_CLR_RGBA;
+	m_Pass[PASS_COLOR].own = 0;
+	m_Pass[PASS_COLOR].nbr = 0;
+	if ( m_StageFmt != STAGE_CLR_NONE )
+		m_Pass[PASS_COLOR].own = GetBlockMask ( clr == 1 ? g_ColorVel : clr == 2 ? g_ColorPress : clr == 3 ? g_ColorTemp : g_ColorOrig );
+}
+
+void FluidSystem::AddPassVisits ( int p, long visits, long entries )
+{
+	ThreadPool::FetchAdd ( &m_Pass[p].visits, visits );
+	ThreadPool::FetchAdd ( &m_Pass[p].entries, entries );
+}
+
+// Bytes moved: whole records of each declared block for the particles processed,
+// plus the declared neighbor blocks and one neighbor table entry per neighbor.
+void FluidSystem::CountPass ( int p, long records )
+{
+	FluidPass& pass = m_Pass[p];
+	double own = 0, nbr = 0;
+	for (int b = 0; b < FLUID_BLOCKS; b++ ) {
+		if ( pass.own & (1 << b) ) own += mBuf[b].stride;
+		if ( pass.nbr & (1 << b) ) nbr += mBuf[b].stride;
+	}
+	if ( p == PASS_INSERT || p == PASS_ADV || p == PASS_COLOR || p == PASS_COLLIDE ) pass.visits = pass.entries = 0;
+	if ( m_Toggle[USE_QPOS] ) {
+		if ( p == PASS_INSERT ) own += sizeof(FluidQPos);		// slots written
+		if ( p == PASS_PRESS ) nbr = sizeof(FluidQPos);			// candidates read from slots, not records
+	}
+	pass.records = records;
+	pass.bytes = records * own + (double) pass.visits * nbr + (double) pass.entries * ( sizeof(int) + sizeof(float) );
+}
+
+void FluidSystem::SPH_ReportLayout ()
+{
+	const char* names[FLUID_BLOCKS] = { "hot", "thermal", "cold" };
+	int total = 0;
+	for (int b = 0; b < FLUID_BLOCKS; b++ ) {
+		printf ( "Fluid %-8s %3d bytes:", names[b], mBuf[b].stride );
+		for (int n = 0; n < GetNumAttr(); n++ ) {
+			GeomAttr* a = GetAttribute ( n );
+			if ( a->buf == b ) printf ( " %s@%d", a->name.c_str(), a->offset );
+		}
+		printf ( "\n" );
+		total += mBuf[b].stride;
+	}
+	printf ( "Fluid record    %3d bytes total\n", total );
+}
+
+void FluidSystem::SPH_ReportProfile ()
+{
+	const int pass[PROF_MAX] = { -1, -1, PASS_INSERT, PASS_PRESS, PASS_FORCE, PASS_COLLIDE, PASS_SOLVE, PASS_ADV, -1, -1, -1 };
+	ProfileStats st;
+	printf ( "Phase:     %-10s %7s %9s %9s %9s %9s %9s  (ms) %9s %8s\n", "", "steps", "min", "mean", "p50", "p99", "max", "MB", "GB/s" );
+	for (int p = 0; p < PROF_MAX; p++ ) {
+		if ( !Profiler::Global().GetStats ( m_ProfId[p], st ) ) continue;
+		printf ( "Phase:     %-10s %7ld %9.3f %9.3f %9.3f %9.3f %9.3f", Profiler::Global().GetName ( m_ProfId[p] ), st.count, st.min, st.mean, st.p50, st.p99, st.max );
+		if ( pass[p] >= 0 && st.p50 > 0 )
+			printf ( "      %9.2f %8.2f", m_Pass[pass[p]].bytes / (1024.0*1024.0), m_Pass[pass[p]].bytes / ( st.p50 * 1.0e6 ) );
+		printf ( "\n" );
+	}
+	Profiler::Global().ReportCounters ( "Phase:  ", m_ProfId, PROF_MAX );
+}
+
+// Resident sizes: committed pages of the arena-backed blocks, capacities of the vectors.
+// The output ring accounts for itself (see fluid_stage.h).
+void FluidSystem::SPH_UpdateMemory ()
+{
+	MemAccount& acct = MemAccount::Global ();
+	if ( m_MemId[0] == -1 ) {
+		for (int c = 0; c < MEM_CATEGORIES; c++ )
+			m_MemId[c] = acct.Register ( c, "fluid" );
+	}
+	double part = 0, scratch = 0, grid;
+	for (int b = 0; b < FLUID_BLOCKS; b++ ) {
+		part += mBuf[b].mem.committed;
+		scratch += m_Scratch[b].mem.committed;
+	}
+	scratch += ( m_Remap.capacity() + m_ThreadDead.capacity() ) * sizeof(int);
+	scratch += ( m_PciPred.capacity() + m_PciPress.capacity() ) * sizeof(Vector3DF);
+	scratch += ( m_PbfPrev.capacity() + m_PbfPos.capacity() + m_PbfNext.capacity() + m_PbfOmega.capacity() ) * sizeof(Vector3DF);
+	scratch += m_PbfLambda.capacity() * sizeof(float);
+	grid = ( m_Grid.capacity() + m_GridCnt.capacity() + m_QStart.capacity() + m_QFill.capacity() ) * sizeof(int);
+	grid += m_QPos.capacity() * sizeof(FluidQPos);
+	grid += m_CellQuiet.capacity() * sizeof(int) + m_CellRestless.capacity();
+	scratch += m_BlockNbr.capacity() + m_ThreadLevel.capacity() * sizeof(int);
+	scratch += m_ColAccel.capacity() * sizeof(Vector3DF);
+	grid += m_Colliders.GetMemory ();
+	grid += ( m_BndPos.capacity() + m_BndNorm.capacity() ) * sizeof(Vector3DF) + m_BndStart.capacity() * sizeof(int) + m_BndNear.capacity();
+
+	acct.Set ( m_MemId[MEM_PARTICLES], part );
+	acct.Set ( m_MemId[MEM_SCRATCH], scratch );
+	acct.Set ( m_MemId[MEM_NEIGHBOR], (double) m_NeighborMax * ( sizeof(unsigned short) + m_NeighborWidth * ( sizeof(int) + sizeof(float) ) ) );
+	acct.Set ( m_MemId[MEM_GRID], grid );
+}
+
+//------------------------------------------------------ Checkpoint State
+
+#define STATE_MAGIC		0x46535432		// 'FST2' (particle blocks stored one after another)
+
+struct FluidStateHeader {
+	int		magic;
+	int		num;
+	int		stride;			// bytes per particle, all blocks
+	int		nparam;
+	int		frame;
+	int		pad;
+	double	time;
+	double	dt;
+};
+
+long FluidSystem::GetStateSize ()
+{
+	return sizeof(FluidStateHeader) + MAX_PARAM * ( sizeof(double) + sizeof(Vector3DF) + sizeof(bool) ) + (long) NumPoints() * GetRecordSize();
+}
+
+void FluidSystem::SaveState ( char* dest )
+{
+	FluidStateHeader hdr;
+	memset ( &hdr, 0, sizeof(hdr) );
+	hdr.magic = STATE_MAGIC;
+	hdr.num = NumPoints();
+	hdr.stride = GetRecordSize();
+	hdr.nparam = MAX_PARAM;
+	hdr.frame = m_Frame;
+	hdr.time = m_Time;
+	hdr.dt = m_DT;
+	memcpy ( dest, &hdr, sizeof(hdr) );			dest += sizeof(hdr);
+	memcpy ( dest, m_Param, sizeof(m_Param) );		dest += sizeof(m_Param);
+	memcpy ( dest, (char*) m_Vec, sizeof(m_Vec) );	dest += sizeof(m_Vec);		// plain x,y,z floats, no vtable
+	memcpy ( dest, m_Toggle, sizeof(m_Toggle) );	dest += sizeof(m_Toggle);
+	for (int b = 0; b < FLUID_BLOCKS; b++ ) {
+		memcpy ( dest, mBuf[b].data, (long) hdr.num * mBuf[b].stride );
+		dest += (long) hdr.num * mBuf[b].stride;
+	}
+}
+
+bool FluidSystem::LoadState ( char* src, long size )
+{
+	FluidStateHeader hdr;
+	if ( size < (long) sizeof(hdr) ) return false;
+	memcpy ( &hdr, src, sizeof(hdr) );
+	if ( hdr.magic != STATE_MAGIC || hdr.stride != GetRecordSize() || hdr.nparam != MAX_PARAM ) {
+		printf ( "ERROR: Checkpoint does not match this build (stride %d, expected %d).\n", hdr.stride, GetRecordSize() );
+		return false;
+	}
+	if ( size < (long) ( sizeof(hdr) + sizeof(m_Param) + sizeof(m_Vec) + sizeof(m_Toggle) + (long) hdr.num * hdr.stride ) ) return false;
+	src += sizeof(hdr);
+	memcpy ( m_Param, src, sizeof(m_Param) );		src += sizeof(m_Param);
+	memcpy ( (char*) m_Vec, src, sizeof(m_Vec) );	src += sizeof(m_Vec);		// plain x,y,z floats, no vtable
+	memcpy ( m_Toggle, src, sizeof(m_Toggle) );	src += sizeof(m_Toggle);
+
+	if ( hdr.num > mBuf[FLUID_HOT].max ) {
+		for (int b = 0; b < FLUID_BLOCKS; b++ )
+			ResetBuffer ( b, hdr.num );
+		SPH_SetupNeighbors ( hdr.num, m_NeighborWidth );
+	}
+	for (int b = 0; b < FLUID_BLOCKS; b++ ) {
+		memcpy ( mBuf[b].data, src, (long) hdr.num * mBuf[b].stride );
+		src += (long) hdr.num * mBuf[b].stride;
+	}
+	SetNumPoints ( hdr.num );
+	m_Frame = hdr.frame;
+	m_Time = hdr.time;
+	m_DT = hdr.dt;
+
+	SPH_ComputeKernels ();
+	SPH_SetupColliders ();						// walls and barriers of the restored volume and toggles
+	Grid_Setup ( m_Vec[SPH_VOLMIN], m_Vec[SPH_VOLMAX], m_Param[SPH_SIMSCALE], m_Param[SPH_SMOOTHRADIUS]*2.0, 1.0 );
+	Grid_InsertParticles ();
+	SPH_UpdateMemory ();
+	return true;
 }
 
 //------------------------------------------------------ SPH Setup 
@@ -874,6 +1726,9 @@ void FluidSystem::SPH_CreateExample ( int n, int nmax )
 		break;
 	}	
 
+	for (int i = 0; i < (int) m_Override.size(); i++ )
+		m_Param [ m_Override[i].first ] = m_Override[i].second;
+
 	SPH_ComputeKernels ();
 
 	m_Param [ SPH_SIMSIZE ] = m_Param [ SPH_SIMSCALE ] * (m_Vec[SPH_VOLMAX].z - m_Vec[SPH_VOLMIN].z);
@@ -883,9 +1738,81 @@ void FluidSystem::SPH_CreateExample ( int n, int nmax )
 	printf ( "Spacing: %f\n", ss);
 	AddVolume ( m_Vec[SPH_INITMIN], m_Vec[SPH_INITMAX], ss );	// Create the particles
 
+	SPH_SetupScene ();
+}
+
+// Synthetic particle distributions (SYNTH_), num particles at the fluid spacing. The volume
+// is a cube of k^3 lattice cells, k = ceil(cbrt(num)), with the examples' walls and gravity
+// (-y); SYNTH_POOL doubles it in y. Positions come from rand() after srand(seed), so a
+// scene repeats exactly for a seed.
+void FluidSystem::SPH_CreateSynthetic ( int dist, int num, unsigned int seed )
+{
+	Reset ( num );
+	for (int i = 0; i < (int) m_Override.size(); i++ )
+		m_Param [ m_Override[i].first ] = m_Override[i].second;
+
+	SPH_ComputeKernels ();
+	m_Param [ SPH_PDIST ] = pow ( m_Param[SPH_PMASS] / m_Param[SPH_RESTDENSITY], 1/3.0 );
+	float sp = m_Param [ SPH_PDIST ]*0.87 / m_Param[ SPH_SIMSCALE ];
+	int k = (int) ceil ( pow ( (double) num, 1/3.0 ) - 1e-4 );
+	float side = k * sp;
+	m_Vec [ SPH_VOLMIN ].Set ( -side/2, -side/2, 0 );
+	m_Vec [ SPH_VOLMAX ].Set ( side/2, ( dist == SYNTH_POOL ) ? side*1.5f : side/2, side );
+	m_Vec [ SPH_INITMIN ] = m_Vec [ SPH_VOLMIN ];
+	m_Vec [ SPH_INITMAX ].Set ( side/2, side/2, side );
+	m_Param [ SPH_SIMSIZE ] = m_Param [ SPH_SIMSCALE ] * side;
+
+	Vector3DF lo = m_Vec[SPH_INITMIN];
+	Vector3DF pos, center;
+	float sigma = sp * pow ( 1000.0 / ( 4.0 * pow ( 2*3.141592, 1.5 ) ), 1/3.0 );	// peak density N / ((2 pi)^1.5 sigma^3) = 4 / sp^3
+	float r, a, g[3];
+	srand ( seed );
+	for (int n = 0; n < num; n++ ) {
+		switch ( dist ) {
+		case SYNTH_RANDOM:
+			pos.Set ( lo.x + side * rand() / float(RAND_MAX), lo.y + side * rand() / float(RAND_MAX), lo.z + side * rand() / float(RAND_MAX) );
+			break;
+		case SYNTH_CLUSTER:
+			if ( n % 1000 == 0 )
+				center.Set ( lo.x + side * rand() / float(RAND_MAX), lo.y + side * rand() / float(RAND_MAX), lo.z + side * rand() / float(RAND_MAX) );
+			for (int i = 0; i < 3; i += 2 ) {		// Box-Muller, two normals per pair of uniforms
+				r = sigma * sqrt ( -2.0f * log ( ( rand() + 1.0f ) / ( RAND_MAX + 1.0f ) ) );
+				a = 2 * 3.141592f * rand() / float(RAND_MAX);
+				g[i] = r * cos ( a );
+				if ( i < 2 ) g[i+1] = r * sin ( a );
+			}
+			pos.Set ( center.x + g[0], center.y + g[1], center.z + g[2] );
+			pos.x = ( pos.x < lo.x ) ? lo.x : ( pos.x > lo.x + side ) ? lo.x + side : pos.x;
+			pos.y = ( pos.y < lo.y ) ? lo.y : ( pos.y > lo.y + side ) ? lo.y + side : pos.y;
+			pos.z = ( pos.z < lo.z ) ? lo.z : ( pos.z > lo.z + side ) ? lo.z + side : pos.z;
+			break;
+		default:		// lattice, pool
+			pos.Set ( lo.x + ( n % k + 0.5f ) * sp, lo.y + ( (n / k) % k + 0.5f ) * sp, lo.z + ( n / (k*k) + 0.5f ) * sp );
+			break;
+		}
+		int ndx = AddPointReuse ();
+		GetFluid ( ndx )->pos = pos;
+		GetThermal ( ndx )->temp = 1.0f;						// liquid, temp 0 is the solid phase
+		GetThermal ( ndx )->temp_eval = 1.0f;
+		GetCold ( ndx )->clr = COLORA ( (pos.x-lo.x)/side, (pos.y-lo.y)/side, (pos.z-lo.z)/side, 1 );
+	}
+	printf ( "Synthetic: %d particles, dist %d, %d^3 cells of %f\n", NumPoints(), dist, k, sp );
+
+	SPH_SetupScene ();
+}
+
+void FluidSystem::SPH_SetupScene ()
+{
+	SPH_SetupColliders ();
+
 	float cell_size = m_Param[SPH_SMOOTHRADIUS]*2.0;			// Grid cell size (2r)	
 	Grid_Setup ( m_Vec[SPH_VOLMIN], m_Vec[SPH_VOLMAX], m_Param[SPH_SIMSCALE], cell_size, 1.0 );												// Setup grid
+	if ( m_Pool != 0x0 && m_GridTotal > 0 ) {
+		m_Pool->Place ( (char*) &m_Grid[0], m_GridTotal * sizeof(int) );				// grid filled by main thread, migrate slices to owners
+		m_Pool->Place ( (char*) &m_GridCnt[0], m_GridTotal * sizeof(int) );
+	}
 	Grid_InsertParticles ();									// Insert particles
+	SPH_UpdateMemory ();
 
 	Vector3DF vmin, vmax;
 	vmin =  m_Vec[SPH_VOLMIN];
@@ -915,6 +1842,7 @@ void FluidSystem::SPH_ComputePressureSlow ()
 	int cnt = 0;
 	double dx, dy, dz, sum, dsq, c;
 	double d, d2, mR, mR2;
+	double stiff = ( m_Toggle[USE_PCISPH] || m_Toggle[USE_PBF] ) ? 0 : m_Param[SPH_INTSTIFF];		// the solvers find pressure later
 	d = m_Param[SPH_SIMSCALE];
 	d2 = d*d;
 	mR = m_Param[SPH_SMOOTHRADIUS];
@@ -944,67 +1872,276 @@ void FluidSystem::SPH_ComputePressureSlow ()
 			}
 		}	
 		p->density = sum * m_Param[SPH_PMASS] * m_Poly6Kern ;	
-		p->pressure = ( p->density - m_Param[SPH_RESTDENSITY] ) * m_Param[SPH_INTSTIFF];
-		p->density = 1.0f / p->density;
+		p->pressure = ( p->density - m_Param[SPH_RESTDENSITY] ) * stiff;
+		p->density = ( p->density > 0 ) ? 1.0f / p->density : 0;
 	}
 }
 
-// Compute Pressures - Using spatial grid, and also create neighbor table
+// Compute Pressures - Using spatial grid, and also create neighbor table. When a particle
+// has more neighbors than a table row holds, the rows are widened and the pass repeated,
+// so the table is never cut short below MAX_NEIGHBOR.
 void FluidSystem::SPH_ComputePressureGrid ()
 {
+	if ( NumPoints() > m_NeighborMax ) SPH_SetupNeighbors ( mBuf[FLUID_HOT].max, m_NeighborWidth );		// the buffer grew
+	long hits = m_BndHits;
+	for (;;) {
+		m_Pass[PASS_PRESS].visits = m_Pass[PASS_PRESS].entries = 0;
+		m_NumActive = 0;
+		m_NeighborFull = 0;
+		if ( m_Pool != 0x0 )
+			m_Pool->Run ( PressureJob, this );
+		else
+			SPH_ComputePressureRange ( 0, NumPoints() );
+		if ( m_NeighborFull == 0 || m_NeighborWidth >= MAX_NEIGHBOR ) break;
+		SPH_SetupNeighbors ( m_NeighborMax, m_NeighborWidth * 2 );
+		m_BndHits = hits;
+		SPH_UpdateMemory ();
+	}
+	CountPass ( PASS_PRESS, m_NumActive );
+}
+
+void FluidSystem::SPH_ComputePressureRange ( int start, int end )
+{
+	if ( m_Toggle[USE_QPOS] ) {
+		SPH_ComputePressureRangeQ ( start, end );
+		return;
+	}
 	char *dat1, *dat1_end;
 	Fluid* p;
 	Fluid* pcurr;
 	int pndx;
 	int i, cnt = 0;
+	long visits = 0, entries = 0, full = 0;
+	int width = m_NeighborWidth;
+	int* nbr;
+	float* ndist;
+	int gridcell[8] = { -1, -1, -1, -1, -1, -1, -1, -1 };		// per-thread copy of m_GridCell
 	float dx, dy, dz, sum, dsq, c;
 	float d, d2, mR, mR2;
 	float radius = m_Param[SPH_SMOOTHRADIUS] / m_Param[SPH_SIMSCALE];
+	double stiff = ( m_Toggle[USE_PCISPH] || m_Toggle[USE_PBF] ) ? 0 : m_Param[SPH_INTSTIFF];		// the solvers find pressure later
+	bool bSleep = m_bSleep;
+	DWORD skip = m_SkipMask;
+	long active = 0;
+	float drho = m_Param[SPH_SLEEP_DRHO];
+	float prev, bsum;
+	bool bBnd = m_bBoundary;
+	long hits = 0;
 	d = m_Param[SPH_SIMSCALE];
 	d2 = d*d;
 	mR = m_Param[SPH_SMOOTHRADIUS];
 	mR2 = mR*mR;	
 
-	dat1_end = mBuf[0].data + NumPoints()*mBuf[0].stride;
-	i = 0;
-	for ( dat1 = mBuf[0].data; dat1 < dat1_end; dat1 += mBuf[0].stride, i++ ) {
+	dat1_end = mBuf[0].data + end*mBuf[0].stride;
+	i = start;
+	for ( dat1 = mBuf[0].data + start*mBuf[0].stride; dat1 < dat1_end; dat1 += mBuf[0].stride, i++ ) {
+		p = (Fluid*) dat1;
+		if ( p->flags & skip ) { m_NC[i] = 0; continue; }		// dormant, or between its own steps: keeps its density and pressure
+		prev = p->density;
+		active++;
+
+		sum = 0.0;	
+		m_NC[i] = 0;
+		nbr = GetNeighbors ( i );
+		ndist = GetNDist ( i );
+
+		Grid_FindCells ( p->pos, radius, gridcell );
+		for (int cell=0; cell < 8; cell++) {
+			if ( gridcell[cell] != -1 ) {
+				pndx = m_Grid [ gridcell[cell] ];				
+				while ( pndx != -1 ) {					
+					pcurr = (Fluid*) (mBuf[0].data + pndx*mBuf[0].stride);					
+					if ( pcurr == p ) {pndx = pcurr->next; continue; }
+					visits++;
+					dx = ( p->pos.x - pcurr->pos.x)*d;		// dist in cm
+					dy = ( p->pos.y - pcurr->pos.y)*d;
+					dz = ( p->pos.z - pcurr->pos.z)*d;
+					dsq = (dx*dx + dy*dy + dz*dz);
+					if ( mR2 > dsq ) {
+						c =  m_R2 - dsq;
+						sum += c * c * c;
+						if ( m_NC[i] < width ) {
+							nbr[ m_NC[i] ] = pndx;
+							ndist[ m_NC[i] ] = sqrt(dsq);
+							m_NC[i]++;
+						} else {
+							full++;								// the row is widened and the pass repeated
+						}
+					}
+					pndx = pcurr->next;
+				}
+			}
+			gridcell[cell] = -1;
+		}
+		entries += m_NC[i];
+		bsum = bBnd ? SPH_BoundaryDensity ( p->pos ) : 0;
+		if ( bsum > 0 ) hits++;
+		p->density = ( sum * m_Param[SPH_PMASS] + bsum ) * m_Poly6Kern ;	
+		p->pressure = ( p->density - m_Param[SPH_RESTDENSITY] ) * stiff;		
+		p->density = ( p->density > 0 ) ? 1.0f / p->density : 0;		// no neighbors: no force, falls freely
+		if ( bSleep && !( fabs ( p->density - prev ) <= drho * prev ) ) p->flags |= FLUID_RESTLESS;		// inverse densities, same relative change
+	}
+	AddPassVisits ( PASS_PRESS, visits, entries );
+	if ( full > 0 ) ThreadPool::FetchAdd ( &m_NeighborFull, full );
+	ThreadPool::FetchAdd ( &m_NumActive, active );
+	if ( hits > 0 ) ThreadPool::FetchAdd ( &m_BndHits, hits );
+}
+
+// Counting sort of the grid chains into per-cell slots. Particles are visited in index
+// order and each cell is filled from the back, which reproduces the chain order (head =
+// highest index), so the neighbor table comes out in the same order as the exact search.
+// Offsets are truncated; the search adds half a quantum back, so each axis is off by at
+// most half a quantum (m_QStep/2) and a distance by at most sqrt(3)/2 quanta.
+void FluidSystem::Grid_Quantize ()
+{
+	int total = m_GridTotal;
+	m_QStart.resize ( total+1 );
+	m_QFill.resize ( total );
+	m_QStart[0] = 0;
+	for (int c = 0; c < total; c++ ) {
+		m_QStart[c+1] = m_QStart[c] + m_GridCnt[c];
+		m_QFill[c] = m_QStart[c+1];
+	}
+	m_QPos.resize ( m_QStart[total] );
+	m_QStep = 1.0f / ( m_GridDelta.x * QPOS_ONE );
+
+	char* dat1 = mBuf[FLUID_HOT].data;
+	int stride = mBuf[FLUID_HOT].stride;
+	float fx, fy, fz;
+	int gx, gy, gz, gs;
+	for (int n = 0; n < NumPoints(); n++, dat1 += stride ) {
+		Fluid* p = (Fluid*) dat1;
+		fx = (p->pos.x - m_GridMin.x) * m_GridDelta.x;		gx = (int) fx;
+		fy = (p->pos.y - m_GridMin.y) * m_GridDelta.y;		gy = (int) fy;
+		fz = (p->pos.z - m_GridMin.z) * m_GridDelta.z;		gz = (int) fz;
+		gs = (int)( (gz*m_GridRes.y + gy)*m_GridRes.x + gx);		// same cell as Grid_InsertParticles
+		if ( gs < 0 || gs >= total ) continue;
+		FluidQPos& q = m_QPos [ --m_QFill[gs] ];
+		q.x = (unsigned short) ( (fx - gx) * QPOS_ONE );
+		q.y = (unsigned short) ( (fy - gy) * QPOS_ONE );
+		q.z = (unsigned short) ( (fz - gz) * QPOS_ONE );
+		q.pad = 0;
+		q.idx = n;
+	}
+}
+
+// Same as SPH_ComputePressureRange, but candidates come from the quantized slots. The
+// particle's own position is exact, expressed in quanta relative to each visited cell.
+void FluidSystem::SPH_ComputePressureRangeQ ( int start, int end )
+{
+	char *dat1, *dat1_end;
+	Fluid* p;
+	FluidQPos *q, *qend;
+	int i, g, cx, cy, cz;
+	long visits = 0, entries = 0, full = 0;
+	int width = m_NeighborWidth;
+	int* nbr;
+	float* ndist;
+	int gridcell[8] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+	int resx = (int) m_GridRes.x, resy = (int) m_GridRes.y;
+	float fx, fy, fz, bx, by, bz;
+	float dx, dy, dz, sum, dsq, c;
+	float radius = m_Param[SPH_SMOOTHRADIUS] / m_Param[SPH_SIMSCALE];
+	float d = m_Param[SPH_SIMSCALE];
+	float sx = d / ( m_GridDelta.x * QPOS_ONE );		// quanta -> sim units
+	float sy = d / ( m_GridDelta.y * QPOS_ONE );
+	float sz = d / ( m_GridDelta.z * QPOS_ONE );
+	float mR = m_Param[SPH_SMOOTHRADIUS];
+	float mR2 = mR*mR;
+	double stiff = ( m_Toggle[USE_PCISPH] || m_Toggle[USE_PBF] ) ? 0 : m_Param[SPH_INTSTIFF];
+	bool bSleep = m_bSleep;
+	DWORD skip = m_SkipMask;
+	long active = 0;
+	float drho = m_Param[SPH_SLEEP_DRHO];
+	float prev, bsum;
+	bool bBnd = m_bBoundary;
+	long hits = 0;
+	FluidQPos* slots = m_QPos.empty() ? 0x0 : &m_QPos[0];
+
+	dat1_end = mBuf[0].data + end*mBuf[0].stride;
+	i = start;
+	for ( dat1 = mBuf[0].data + start*mBuf[0].stride; dat1 < dat1_end; dat1 += mBuf[0].stride, i++ ) {
 		p = (Fluid*) dat1;
+		if ( p->flags & skip ) { m_NC[i] = 0; continue; }
+		prev = p->density;
+		active++;
 
-		sum = 0.0;	
+		sum = 0.0;
 		m_NC[i] = 0;
+		nbr = GetNeighbors ( i );
+		ndist = GetNDist ( i );
+		fx = (p->pos.x - m_GridMin.x) * m_GridDelta.x;
+		fy = (p->pos.y - m_GridMin.y) * m_GridDelta.y;
+		fz = (p->pos.z - m_GridMin.z) * m_GridDelta.z;
 
-		Grid_FindCells ( p->pos, radius );
+		Grid_FindCells ( p->pos, radius, gridcell );
 		for (int cell=0; cell < 8; cell++) {
-			if ( m_GridCell[cell] != -1 ) {
-				pndx = m_Grid [ m_GridCell[cell] ];				
-				while ( pndx != -1 ) {					
-					pcurr = (Fluid*) (mBuf[0].data + pndx*mBuf[0].stride);					
-					if ( pcurr == p ) {pndx = pcurr->next; continue; }
-					dx = ( p->pos.x - pcurr->pos.x)*d;		// dist in cm
-					dy = ( p->pos.y - pcurr->pos.y)*d;
-					dz = ( p->pos.z - pcurr->pos.z)*d;
-					dsq = (dx*dx + dy*dy + dz*dz);
-					if ( mR2 > dsq ) {
-						Vector3DF vdif = pcurr->vel_eval;
-						vdif -= p->vel_eval;
-						vdif *= m_Param[SPH_PMASS]*pcurr->density;
-						c =  m_R2 - dsq;
-						sum += c * c * c;
-						if ( m_NC[i] < MAX_NEIGHBOR ) {
-							m_Neighbor[i][ m_NC[i] ] = pndx;
-							m_NDist[i][ m_NC[i] ] = sqrt(dsq);
-							m_NC[i]++;
-						}
+			g = gridcell[cell];
+			gridcell[cell] = -1;
+			if ( g == -1 ) continue;
+			cx = g % resx;	cy = (g / resx) % resy;		cz = g / (resx*resy);
+			bx = (fx - cx) * QPOS_ONE - 0.5f;
+			by = (fy - cy) * QPOS_ONE - 0.5f;
+			bz = (fz - cz) * QPOS_ONE - 0.5f;
+			qend = slots + m_QStart[g+1];
+			for ( q = slots + m_QStart[g]; q < qend; q++ ) {
+				if ( q->idx == i ) continue;
+				visits++;
+				dx = ( bx - q->x ) * sx;
+				dy = ( by - q->y ) * sy;
+				dz = ( bz - q->z ) * sz;
+				dsq = (dx*dx + dy*dy + dz*dz);
+				if ( mR2 > dsq ) {
+					c =  m_R2 - dsq;
+					sum += c * c * c;
+					if ( m_NC[i] < width ) {
+						nbr[ m_NC[i] ] = q->idx;
+						ndist[ m_NC[i] ] = sqrt(dsq);
+						m_NC[i]++;
+					} else {
+						full++;								// the row is widened and the pass repeated
 					}
-					pndx = pcurr->next;
 				}
 			}
-			m_GridCell[cell] = -1;
 		}
-		p->density = sum * m_Param[SPH_PMASS] * m_Poly6Kern ;	
-		p->pressure = ( p->density - m_Param[SPH_RESTDENSITY] ) * m_Param[SPH_INTSTIFF];		
-		p->density = 1.0f / p->density;		
+		entries += m_NC[i];
+		bsum = bBnd ? SPH_BoundaryDensity ( p->pos ) : 0;			// exact positions, the walls are not quantized
+		if ( bsum > 0 ) hits++;
+		p->density = ( sum * m_Param[SPH_PMASS] + bsum ) * m_Poly6Kern ;
+		p->pressure = ( p->density - m_Param[SPH_RESTDENSITY] ) * stiff;
+		p->density = ( p->density > 0 ) ? 1.0f / p->density : 0;
+		if ( bSleep && !( fabs ( p->density - prev ) <= drho * prev ) ) p->flags |= FLUID_RESTLESS;
+	}
+	AddPassVisits ( PASS_PRESS, visits, entries );
+	if ( full > 0 ) ThreadPool::FetchAdd ( &m_NeighborFull, full );
+	ThreadPool::FetchAdd ( &m_NumActive, active );
+	if ( hits > 0 ) ThreadPool::FetchAdd ( &m_BndHits, hits );
+}
+
+// Call between the pressure pass and Advance. The observed maximum can exceed the bound
+// by float rounding in the exact distances themselves.
+void FluidSystem::SPH_ReportQuantError ()
+{
+	double err, maxerr = 0, sumerr = 0;
+	long cnt = 0;
+	float d = m_Param[SPH_SIMSCALE];
+	for (int i = 0; i < NumPoints(); i++ ) {
+		Fluid* p = GetFluid ( i );
+		int* nbr = GetNeighbors ( i );
+		float* ndist = GetNDist ( i );
+		for (int j = 0; j < m_NC[i]; j++ ) {
+			Fluid* q = GetFluid ( nbr[j] );
+			Vector3DF dp = p->pos;
+			dp -= q->pos;
+			err = fabs ( ndist[j] - sqrt( (double) dp.x*dp.x + (double) dp.y*dp.y + (double) dp.z*dp.z ) * d );
+			if ( err > maxerr ) maxerr = err;
+			sumerr += err;
+			cnt++;
+		}
 	}
+	double bound = 0.5 * sqrt(3.0) * m_QStep * d;
+	printf ( "QPOS: quantum %g (sim), %ld pairs, dist error max %g avg %g, quantization bound %g (%.4f%% of h)\n",
+		m_QStep * d, cnt, maxerr, cnt > 0 ? sumerr / cnt : 0, bound, 100.0 * bound / m_Param[SPH_SMOOTHRADIUS] );
 }
 
 // Compute Forces - Very slow, but simple. O(n^2)
@@ -1159,13 +2296,15 @@ void FluidSystem::SPH_ComputeStressTensorGridNC ()
 	for ( dat1 = mBuf[0].data; dat1 < dat1_end; dat1 += mBuf[0].stride, i++ ) {
 		p = (Fluid*) dat1;
 		Matrix3 vgrad(0,0,0,0,0,0,0,0,0);
+		int* nbr = GetNeighbors ( i );
+		float* ndist = GetNDist ( i );
 		for (int j=0; j < m_NC[i]; j++ ) {
-			pcurr = (Fluid*) (mBuf[0].data + m_Neighbor[i][j]*mBuf[0].stride);				
-			c = ( mR - m_NDist[i][j] );
+			pcurr = (Fluid*) (mBuf[0].data + nbr[j]*mBuf[0].stride);				
+			c = ( mR - ndist[j] );
 			x_ij = p->pos;
 			x_ij -= pcurr->pos;
 			x_ij *= d;			//To scale;
-			x_ij *= m_SpikyKern * c * c / m_NDist[i][j];
+			x_ij *= m_SpikyKern * c * c / ndist[j];
 			v_ji = pcurr->vel_eval;
 			v_ji -= p->vel_eval;
 			v_ji *= d;
@@ -1198,6 +2337,17 @@ void FluidSystem::SPH_ComputeStressTensorGridNC ()
 
 // Compute Forces - Using spatial grid with saved neighbor table. Fastest.
 void FluidSystem::SPH_ComputeForceGridNC ()
+{
+	m_Pass[PASS_FORCE].visits = m_Pass[PASS_FORCE].entries = 0;
+	if ( m_bBlock ) m_BlockNbr.resize ( NumPoints() );
+	if ( m_Pool != 0x0 )
+		m_Pool->Run ( ForceJob, this );
+	else
+		SPH_ComputeForceRange ( 0, NumPoints() );
+	CountPass ( PASS_FORCE, m_NumActive );
+}
+
+void FluidSystem::SPH_ComputeForceRange ( int start, int end )
 {
 	char *dat1, *dat1_end;	
 	Fluid *p;
@@ -1210,35 +2360,49 @@ void FluidSystem::SPH_ComputeForceGridNC ()
 	float dx, dy, dz;
 	float mR, mR2, visc;
 	Matrix3 stensor_sum;
+	FluidThermal* t = 0x0;
+	bool bThermal = ( m_Pass[PASS_FORCE].own & (1 << FLUID_THERMAL) ) != 0;
+	DWORD skip = m_SkipMask;
+	char* nbrlev = m_bBlock ? &m_BlockNbr[0] : 0x0;		// block time-stepping: finest neighbor level
+	DWORD lnb;
+	float tdt = m_DT;
+	long visits = 0;
+	bool bBnd = m_bBoundary;
 
 	d = m_Param[SPH_SIMSCALE];
 	mR = m_Param[SPH_SMOOTHRADIUS];
 	mR2 = (mR*mR);
 	visc = m_Param[SPH_VISC];
 
-	dat1_end = mBuf[0].data + NumPoints()*mBuf[0].stride;
-	i = 0;
+	dat1_end = mBuf[0].data + end*mBuf[0].stride;
+	i = start;
 
-	for ( dat1 = mBuf[0].data; dat1 < dat1_end; dat1 += mBuf[0].stride, i++ ) {
+	for ( dat1 = mBuf[0].data + start*mBuf[0].stride; dat1 < dat1_end; dat1 += mBuf[0].stride, i++ ) {
 		p = (Fluid*) dat1;
+		if ( p->flags & skip ) continue;
+		if ( bThermal ) t = GetThermal ( i );
 
 		force.Set ( 0, 0, 0 );
 		dtemp = 0.0;
+		lnb = 0;
+		visits += m_NC[i];
+		int* nbr = GetNeighbors ( i );
+		float* ndist = GetNDist ( i );
 		for (int j=0; j < m_NC[i]; j++ ) {
-			pcurr = (Fluid*) (mBuf[0].data + m_Neighbor[i][j]*mBuf[0].stride);
+			pcurr = (Fluid*) (mBuf[0].data + nbr[j]*mBuf[0].stride);
 			dx = ( p->pos.x - pcurr->pos.x)*d;		// dist in cm
 			dy = ( p->pos.y - pcurr->pos.y)*d;
 			dz = ( p->pos.z - pcurr->pos.z)*d;				
-			c = ( mR - m_NDist[i][j] );
+			c = ( mR - ndist[j] );
 			
 			x_ij.Set(dx,dy,dz);
-			x_ij *= m_SpikyKern * c * c / m_NDist[i][j];
+			x_ij *= m_SpikyKern * c * c / ndist[j];
 			//stensor_sum = p->stress_tensor + pcurr->stress_tensor;
 			//fstress = TensorDotVec3(stensor_sum, x_ij);
 			//fstress *= m_Param[SPH_PMASS] * pcurr->density;
 
-			pterm = -0.5f * c * c * m_SpikyKern * pcurr->density * m_Param[SPH_PMASS] * ( p->pressure + pcurr->pressure) / m_NDist[i][j];
-			//pterm = - m_SpikyKern * c * c * m_Param[SPH_PMASS] * ( p->pressure*p->density + pcurr->pressure*pcurr->density*pcurr->density / p->density) / m_NDist[i][j];
+			pterm = -0.5f * c * c * m_SpikyKern * pcurr->density * m_Param[SPH_PMASS] * ( p->pressure + pcurr->pressure) / ndist[j];
+			//pterm = - m_SpikyKern * c * c * m_Param[SPH_PMASS] * ( p->pressure*p->density + pcurr->pressure*pcurr->density*pcurr->density / p->density) / ndist[j];
 			//dterm = c * p->density * pcurr->density;
 			
 			////Artificial Viscosity (MELTING)
@@ -1247,13 +2411,13 @@ void FluidSystem::SPH_ComputeForceGridNC ()
 			//v_ij *= d;
 			//x_ij.Set(dx,dy,dz);e
 			//float v_dot_x = v_ij.Dot(x_ij);
-			//float mu_ij =  m_Param[SPH_SMOOTHRADIUS]*v_dot_x / ( m_NDist[i][j]*m_NDist[i][j]+0.01f*m_Param[SPH_SMOOTHRADIUS]*m_Param[SPH_SMOOTHRADIUS]);
+			//float mu_ij =  m_Param[SPH_SMOOTHRADIUS]*v_dot_x / ( ndist[j]*ndist[j]+0.01f*m_Param[SPH_SMOOTHRADIUS]*m_Param[SPH_SMOOTHRADIUS]);
 			//float alpha = 0.1;
 			//if(v_dot_x < 0.0)
 			//	vterm = 2.0f*alpha*mu_ij*m_Param[SPH_INTSTIFF]/(1.0f/p->density+1.0f/pcurr->density);
 			//else
 			//	vterm = 0;
-			//vterm *= m_Param[SPH_PMASS] * m_SpikyKern * c * c / m_NDist[i][j];
+			//vterm *= m_Param[SPH_PMASS] * m_SpikyKern * c * c / ndist[j];
 			//force.x += ( pterm * dx + vterm * dx );// * dterm;
 			//force.y += ( pterm * dy + vterm * dy );// * dterm;
 			//force.z += ( pterm * dz + vterm * dz );// * dterm;
@@ -1265,17 +2429,1148 @@ void FluidSystem::SPH_ComputeForceGridNC ()
 			force.z += ( pterm * dz + vterm * (pcurr->vel_eval.z - p->vel_eval.z) );// * dterm;
 			
 			//Temperature
-			dtemp += pcurr->density * (pcurr->temp_eval - p->temp_eval)* m_LapKern * c;
+			if ( bThermal )
+				dtemp += pcurr->density * (GetThermal ( nbr[j] )->temp_eval - t->temp_eval)* m_LapKern * c;
+
+			if ( nbrlev != 0x0 && ( pcurr->flags & FLUID_LEVEL_MASK ) > lnb ) lnb = pcurr->flags & FLUID_LEVEL_MASK;
 
 			//force += fstress;
 		}
+		if ( bBnd ) SPH_BoundaryForce ( p, force );
 		//Forces
 		p->sph_force = force;
+		if ( nbrlev != 0x0 ) nbrlev[i] = (char) ( lnb >> FLUID_LEVEL_SHIFT );
 		
 		//Temperature
-		dtemp = m_Param[SPH_THERMAL_DIFF] * m_Param[SPH_PMASS] * dtemp;
-		p->temp = p->temp + m_DT * dtemp;	//Basic Euler Integration
+		if ( bThermal ) {
+			dtemp = m_Param[SPH_THERMAL_DIFF] * m_Param[SPH_PMASS] * dtemp;
+			if ( nbrlev != 0x0 ) tdt = m_Param[SPH_TIMESTEP] / ( 1 << ( ( p->flags & FLUID_LEVEL_MASK ) >> FLUID_LEVEL_SHIFT ) );		// the step that just ended
+			t->temp = t->temp + tdt * dtemp;	//Basic Euler Integration
+		}
+	}
+	AddPassVisits ( PASS_FORCE, visits, visits );
+}
+
+//------------------------------------------------------ Incompressible Pressure (PCISPH)
+
+// Pressure that undoes a unit density error within one step, for a particle with a full
+// neighborhood at rest spacing (SPH_PDIST, cubic lattice). Density is summed with Poly6
+// and the pressure acceleration uses the spiky gradient, so the two sums mix the kernels.
+// Divide by dt^2 for the step at hand.
+double FluidSystem::SPH_ComputePCIScale ()
+{
+	double h = m_Param[SPH_SMOOTHRADIUS];
+	double s = m_Param[SPH_PDIST];
+	double m = m_Param[SPH_PMASS];
+	double rho0 = m_Param[SPH_RESTDENSITY];
+	double gp[3] = { 0, 0, 0 }, gs[3] = { 0, 0, 0 };
+	double dot = 0, r, wp, ws;
+	int k = (int) ceil ( h / s );
+
+	for (int z = -k; z <= k; z++ )
+		for (int y = -k; y <= k; y++ )
+			for (int x = -k; x <= k; x++ ) {
+				double v[3] = { x*s, y*s, z*s };
+				r = sqrt ( v[0]*v[0] + v[1]*v[1] + v[2]*v[2] );
+				if ( r <= 0 || r >= h ) continue;
+				wp = -6.0 * m_Poly6Kern * (h*h - r*r) * (h*h - r*r);		// grad W_poly6 = wp * v
+				ws = m_SpikyKern * (h - r) * (h - r) / r;					// grad W_spiky = ws * v
+				for (int a = 0; a < 3; a++ ) { gp[a] += wp * v[a]; gs[a] += ws * v[a]; }
+				dot += wp * ws * r * r;
+			}
+	double denom = 2.0 * m * m / ( rho0 * rho0 ) * ( gp[0]*gs[0] + gp[1]*gs[1] + gp[2]*gs[2] + dot );
+	return ( denom > 0 ) ? 1.0 / denom : 0;
+}
+
+// Each iteration predicts positions under the current pressure, predicts density there
+// over this step's neighbor table, and raises the pressure of compressed particles by
+// delta * (density - rest). Pressure is clamped at zero so free surfaces do not stick.
+// The error is the average predicted compression (expansion counts as zero): a maximum
+// would stall on the few particles whose compression takes several steps to relax.
+void FluidSystem::SPH_ComputePressurePCI ()
+{
+	int n = NumPoints ();
+	int nt = ( m_Pool != 0x0 ) ? m_Pool->GetNumThreads() : 1;
+	int maxiter = (int) m_Param[SPH_PCI_ITER];
+	float tol = m_Param[SPH_PCI_TOL];
+	float rest = m_Param[SPH_RESTDENSITY];
+
+	m_PciPred.resize ( n );
+	m_PciPress.resize ( n );
+	m_ThreadErr.assign ( nt, 0 );
+	m_PciDT = GetStepDT ();
+	m_PciDelta = PCI_RELAX * SPH_ComputePCIScale () / ( (double) m_PciDT * m_PciDT );
+	m_Pass[PASS_SOLVE].visits = m_Pass[PASS_SOLVE].entries = 0;
+
+	m_SolveIters = 0;
+	do {
+		if ( m_Pool != 0x0 ) {
+			m_Pool->Run ( PredictJob, this );
+			m_Pool->Run ( PredictDensityJob, this );
+			m_Pool->Run ( PressureForceJob, this );
+		} else {
+			SPH_PredictRange ( 0, n );
+			SPH_PredictDensityRange ( 0, n, 0 );
+			SPH_PressureForceRange ( 0, n );
+		}
+		m_SolveIters++;
+		m_SolveErr = 0;
+		for (int t = 0; t < nt; t++ )
+			m_SolveErr += m_ThreadErr[t];
+		m_SolveErr /= ( n > 0 ) ? n * rest : 1;
+	} while ( m_SolveIters < maxiter && ( m_SolveIters < PCI_MIN_ITER || m_SolveErr > tol ) );
+
+	m_bPciValid = true;
+	CountPass ( PASS_SOLVE, (long) n * m_SolveIters );
+
+	m_SolveSteps++;
+	m_SolveIterSum += m_SolveIters;
+	if ( m_SolveIters > m_SolveIterMax ) m_SolveIterMax = m_SolveIters;
+	if ( m_SolveErr > tol ) m_SolveCapped++;
+	if ( m_SolveErr > m_SolveErrMax ) m_SolveErrMax = m_SolveErr;
+}
+
+// Predicted position after the leapfrog step Advance would take, v* = v + a dt, x* = x + v* dt,
+// with the same acceleration: sph_force (viscosity only in this mode), gravity and the
+// current pressure estimate, clamped to SPH_LIMIT, then the boundary response.
+void FluidSystem::SPH_PredictRange ( int start, int end )
+{
+	float dt = m_PciDT;
+	float dts = m_PciDT / m_Param[SPH_SIMSCALE];
+	float SL = m_Param[SPH_LIMIT];
+	float speed;
+	bool bFirst = ( m_SolveIters == 0 );
+	Vector3DF accel;
+	Fluid* p;
+
+	for (int i = start; i < end; i++ ) {
+		p = GetFluid ( i );
+		if ( bFirst ) m_PciPress[i].Set ( 0, 0, 0 );
+		accel = p->sph_force;
+		accel *= p->density;
+		accel += m_PciPress[i];
+		if ( m_Param[PLANE_GRAV] > 0 )
+			accel += m_Vec[PLANE_GRAV_DIR];
+		speed = accel.x*accel.x + accel.y*accel.y + accel.z*accel.z;
+		if ( speed > SL*SL )
+			accel *= SL / sqrt(speed);
+		SPH_ComputeBoundary ( p, i, accel );
+
+		m_PciPred[i].x = p->pos.x + ( p->vel.x + accel.x * dt ) * dts;
+		m_PciPred[i].y = p->pos.y + ( p->vel.y + accel.y * dt ) * dts;
+		m_PciPred[i].z = p->pos.z + ( p->vel.z + accel.z * dt ) * dts;
+	}
+}
+
+// Same sum as the pressure pass, at the predicted positions. New neighbors that come within
+// range during the step are not seen; the table is rebuilt next step.
+void FluidSystem::SPH_PredictDensityRange ( int start, int end, int t )
+{
+	float d2 = m_Param[SPH_SIMSCALE] * m_Param[SPH_SIMSCALE];
+	float mR2 = m_R2;
+	float kern = m_Param[SPH_PMASS] * m_Poly6Kern;
+	float rest = m_Param[SPH_RESTDENSITY];
+	float delta = m_PciDelta;
+	bool bBnd = m_bBoundary;
+	float dx, dy, dz, dsq, c, sum, err;
+	double errsum = 0;
+	long visits = 0;
+	Fluid* p;
+
+	for (int i = start; i < end; i++ ) {
+		Vector3DF& xi = m_PciPred[i];
+		sum = 0;
+		int* nbr = GetNeighbors ( i );
+		for (int j = 0; j < m_NC[i]; j++ ) {
+			Vector3DF& xj = m_PciPred[ nbr[j] ];
+			dx = xi.x - xj.x;
+			dy = xi.y - xj.y;
+			dz = xi.z - xj.z;
+			dsq = (dx*dx + dy*dy + dz*dz) * d2;
+			if ( mR2 > dsq ) {
+				c = mR2 - dsq;
+				sum += c * c * c;
+			}
+		}
+		visits += m_NC[i];
+		err = sum * kern - rest;
+		if ( bBnd ) err += SPH_BoundaryDensity ( xi ) * m_Poly6Kern;
+		p = GetFluid ( i );
+		p->pressure += delta * err;
+		if ( p->pressure < 0 ) p->pressure = 0;
+		if ( err > 0 ) errsum += err;
+	}
+	m_ThreadErr[t] = errsum;
+	AddPassVisits ( PASS_SOLVE, visits, visits );
+}
+
+// Symmetric pressure acceleration at the current positions:
+//   a_i = -m sum (p_i + p_j) / rest^2 * grad W_spiky
+void FluidSystem::SPH_PressureForceRange ( int start, int end )
+{
+	float d = m_Param[SPH_SIMSCALE];
+	float mR = m_Param[SPH_SMOOTHRADIUS];
+	float rest = m_Param[SPH_RESTDENSITY];
+	float scale = -m_Param[SPH_PMASS] * m_SpikyKern / ( rest * rest );
+	float c, r, pterm;
+	Vector3DF force;
+	Fluid *p, *pcurr;
+	long visits = 0;
+
+	for (int i = start; i < end; i++ ) {
+		p = GetFluid ( i );
+		force.Set ( 0, 0, 0 );
+		visits += m_NC[i];
+		int* nbr = GetNeighbors ( i );
+		float* ndist = GetNDist ( i );
+		for (int j = 0; j < m_NC[i]; j++ ) {
+			r = ndist[j];
+			if ( r <= 0 ) continue;
+			pcurr = GetFluid ( nbr[j] );
+			c = mR - r;
+			pterm = scale * c * c * ( p->pressure + pcurr->pressure ) / r;
+			force.x += pterm * ( p->pos.x - pcurr->pos.x ) * d;
+			force.y += pterm * ( p->pos.y - pcurr->pos.y ) * d;
+			force.z += pterm * ( p->pos.z - pcurr->pos.z ) * d;
+		}
+		if ( m_bBoundary ) SPH_BoundaryPressure ( p, force );
+		m_PciPress[i] = force;
+	}
+	AddPassVisits ( PASS_SOLVE, visits, visits );
+}
+
+void FluidSystem::SPH_ReportSolver ()
+{
+	if ( m_SolveSteps == 0 ) return;
+	if ( m_Toggle[USE_PBF] ) {
+		printf ( "Solver: PBF %d steps, %d iterations\n", m_SolveSteps, m_SolveIterMax );
+		printf ( "Solver: compression before the last iteration: last %.3f%%, max %.3f%%\n", m_SolveErr * 100.0, m_SolveErrMax * 100.0 );
+		return;
+	}
+	printf ( "Solver: PCISPH %d steps, %.1f iterations avg (%d max), %d stopped at the cap of %d\n", m_SolveSteps, double(m_SolveIterSum) / m_SolveSteps, m_SolveIterMax, m_SolveCapped, (int) m_Param[SPH_PCI_ITER] );
+	printf ( "Solver: compression last %.3f%%, max %.3f%%, tolerance %.3f%%\n", m_SolveErr * 100.0, m_SolveErrMax * 100.0, m_Param[SPH_PCI_TOL] * 100.0 );
+}
+
+//------------------------------------------------------ Position Based Fluids
+
+// Keeps a position out of the colliders SPH_ComputeBoundary pushes against, by 2 particle
+// radii. Moving the position is the whole response: the velocity derived from it loses
+// the normal component. A clamped position is set a little past the margin, by an amount
+// fixed per particle: particles clamped onto the same wall (or corner) would otherwise
+// coincide, and coincident particles have no kernel gradient to separate them. The domain
+// walls come in min / max pairs, which take the two amounts in turn.
+void FluidSystem::SPH_ProjectBounds ( Vector3DF& pos, int i )
+{
+	float margin = 2 * m_Param[SPH_PRADIUS] / m_Param[SPH_SIMSCALE];
+	unsigned int hash = (unsigned int) i * 2654435761u;
+	float lo = margin * ( 1.0f + PBF_WALL_JITTER * ( hash >> 24 ) / 255.0f );
+	float hi = margin * ( 1.0f + PBF_WALL_JITTER * ( ( hash >> 16 ) & 0xff ) / 255.0f );
+	int cell = m_Colliders.GetCell ( pos );
+	int nc = ( cell >= 0 ) ? m_Colliders.GetNumCandidates ( cell ) : m_Colliders.GetNum ();
+	const int* cand = ( cell >= 0 ) ? m_Colliders.GetCandidates ( cell ) : 0x0;
+	Vector3DF norm;
+	float d;
+	int c;
+
+	for (int n = 0; n < nc; n++ ) {
+		c = ( cand != 0x0 ) ? cand[n] : n;
+		if ( m_Colliders.Get ( c ).flags & COLLIDE_SINK ) continue;
+		d = m_Colliders.Distance ( c, pos, norm );
+		if ( d < margin ) {
+			norm *= ( ( c & 1 ) ? hi : lo ) - d;
+			pos += norm;
+		}
+	}
+}
+
+// Sum of |grad C|^2 over a full neighborhood at rest spacing (cubic lattice, see
+// SPH_ComputePCIScale). The particle's own gradient cancels there, so only the
+// neighbors count. SPH_PBF_RELAX and the artificial pressure are in units of this.
+double FluidSystem::SPH_ComputePBFScale ()
+{
+	double h = m_Param[SPH_SMOOTHRADIUS];
+	double s = m_Param[SPH_PDIST];
+	double mr = m_Param[SPH_PMASS] / m_Param[SPH_RESTDENSITY];
+	double sum = 0, r, ws;
+	int k = (int) ceil ( h / s );
+
+	for (int z = -k; z <= k; z++ )
+		for (int y = -k; y <= k; y++ )
+			for (int x = -k; x <= k; x++ ) {
+				r = s * sqrt ( double(x*x + y*y + z*z) );
+				if ( r <= 0 || r >= h ) continue;
+				ws = m_SpikyKern * (h - r) * (h - r);			// |grad W_spiky|
+				sum += ws * ws;
+			}
+	return mr * mr * sum;
+}
+
+// Step 1: x* = x + (v + a dt) dt under gravity alone, projected into the walls.
+// x is kept in m_PbfPrev, x* goes into pos so Grid_InsertParticles sees it.
+void FluidSystem::SPH_PredictPBF ()
+{
+	int n = NumPoints ();
+	m_PbfPrev.resize ( n );
+	m_PbfPos.resize ( n );
+	m_PbfNext.resize ( n );
+	m_PbfOmega.resize ( n );
+	m_PbfLambda.resize ( n );
+	m_PbfDT = GetStepDT ();
+	if ( m_Pool != 0x0 )
+		m_Pool->Run ( PBFPredictJob, this );
+	else
+		SPH_PredictPBFRange ( 0, n );
+}
+
+void FluidSystem::SPH_PredictPBFRange ( int start, int end )
+{
+	float dt = m_PbfDT;
+	float dts = m_PbfDT / m_Param[SPH_SIMSCALE];
+	Vector3DF accel, norm;
+	Fluid* p;
+
+	for (int i = start; i < end; i++ ) {
+		p = GetFluid ( i );
+		accel.Set ( 0, 0, 0 );
+		if ( m_Param[PLANE_GRAV] > 0 )
+			accel += m_Vec[PLANE_GRAV_DIR];
+		if ( m_Param[POINT_GRAV] > 0 ) {
+			norm = p->pos;
+			norm -= m_Vec[POINT_GRAV_POS];
+			norm.Normalize ();
+			norm *= m_Param[POINT_GRAV];
+			accel -= norm;
+		}
+		m_PbfPrev[i] = p->pos;
+		p->pos.x += ( p->vel.x + accel.x * dt ) * dts;
+		p->pos.y += ( p->vel.y + accel.y * dt ) * dts;
+		p->pos.z += ( p->vel.z + accel.z * dt ) * dts;
+		SPH_ProjectBounds ( p->pos, i );
+		m_PbfPos[i] = p->pos;
+	}
+}
+
+// Step 2: Jacobi iterations on C_i = rho_i / rest - 1 >= 0 over the neighbor table built
+// at x*. Only compression is corrected (as in the PCISPH solver, pressure >= 0), so a
+// thin surface does not pull itself into clumps; the artificial pressure term keeps
+// particles from pairing up. Then velocities, vorticity confinement and XSPH.
+void FluidSystem::SPH_SolvePBF ()
+{
+	int n = NumPoints ();
+	int nt = ( m_Pool != 0x0 ) ? m_Pool->GetNumThreads() : 1;
+	int iters = (int) m_Param[SPH_PBF_ITER];
+
+	m_ThreadErr.assign ( nt, 0 );
+	m_PbfScale = SPH_ComputePBFScale ();
+	m_Pass[PASS_SOLVE].visits = m_Pass[PASS_SOLVE].entries = 0;
+
+	m_SolveErr = 0;
+	for ( m_SolveIters = 0; m_SolveIters < iters; m_SolveIters++ ) {
+		if ( m_Pool != 0x0 ) {
+			m_Pool->Run ( PBFLambdaJob, this );
+			m_Pool->Run ( PBFDeltaJob, this );
+		} else {
+			SPH_PBFLambdaRange ( 0, n, 0 );
+			SPH_PBFDeltaRange ( 0, n );
+		}
+		m_PbfPos.swap ( m_PbfNext );
+		m_SolveErr = 0;
+		for (int t = 0; t < nt; t++ )
+			m_SolveErr += m_ThreadErr[t];
+		m_SolveErr /= ( n > 0 ) ? n : 1;
+	}
+
+	bool bVort = ( m_Param[SPH_PBF_VORT] > 0 || m_Param[SPH_PBF_XSPH] > 0 );
+	if ( m_Pool != 0x0 ) {
+		m_Pool->Run ( PBFVelocityJob, this );
+		if ( bVort ) {
+			m_Pool->Run ( PBFVorticityJob, this );
+			m_Pool->Run ( PBFConfineJob, this );
+		}
+	} else {
+		SPH_PBFVelocityRange ( 0, n );
+		if ( bVort ) {
+			SPH_PBFVorticityRange ( 0, n );
+			SPH_PBFConfineRange ( 0, n );
+		}
+	}
+	CountPass ( PASS_SOLVE, (long) n * ( bVort ? 3 : 1 ) );
+
+	m_SolveSteps++;
+	m_SolveIterSum += m_SolveIters;
+	if ( m_SolveIters > m_SolveIterMax ) m_SolveIterMax = m_SolveIters;
+	if ( m_SolveErr > m_SolveErrMax ) m_SolveErrMax = m_SolveErr;
+}
+
+//   lambda_i = -C_i / ( sum_k |grad_k C_i|^2 + eps ),   grad_j C_i = -m / rest * grad W_ij
+void FluidSystem::SPH_PBFLambdaRange ( int start, int end, int t )
+{
+	float ss = m_Param[SPH_SIMSCALE];
+	float mR = m_Param[SPH_SMOOTHRADIUS];
+	float mR2 = m_R2;
+	float mr = m_Param[SPH_PMASS] / m_Param[SPH_RESTDENSITY];
+	float eps = m_Param[SPH_PBF_RELAX] * m_PbfScale;
+	float dx, dy, dz, dsq, r, c, w, sum, grad2, C;
+	Vector3DF gi;
+	double errsum = 0;
+	long visits = 0;
+
+	for (int i = start; i < end; i++ ) {
+		Vector3DF& xi = m_PbfPos[i];
+		sum = 0;
+		grad2 = 0;
+		gi.Set ( 0, 0, 0 );
+		int* nbr = GetNeighbors ( i );
+		for (int j = 0; j < m_NC[i]; j++ ) {
+			Vector3DF& xj = m_PbfPos[ nbr[j] ];
+			dx = ( xi.x - xj.x ) * ss;
+			dy = ( xi.y - xj.y ) * ss;
+			dz = ( xi.z - xj.z ) * ss;
+			dsq = dx*dx + dy*dy + dz*dz;
+			if ( dsq >= mR2 ) continue;
+			c = mR2 - dsq;
+			sum += c * c * c;
+			if ( dsq <= 0 ) continue;
+			r = sqrt ( dsq );
+			w = mr * m_SpikyKern * (mR - r) * (mR - r) / r;		// grad_j C_i = -w * x_ij
+			gi.x += w * dx; gi.y += w * dy; gi.z += w * dz;
+			grad2 += w * w * dsq;
+		}
+		visits += m_NC[i];
+		C = sum * m_Poly6Kern * mr - 1.0f;
+		if ( C < 0 ) C = 0;
+		errsum += C;
+		m_PbfLambda[i] = -C / ( grad2 + gi.x*gi.x + gi.y*gi.y + gi.z*gi.z + eps );
+	}
+	m_ThreadErr[t] = errsum;
+	AddPassVisits ( PASS_SOLVE, visits, visits );
+}
+
+//   dx_i = m / rest * sum_j ( lambda_i + lambda_j + s_corr ) grad W_ij,   s_corr = -k (W_ij / W(dq h))^4
+// s_corr is the lambda of a compression k (W_ij / W(dq h))^4 at full neighborhood.
+void FluidSystem::SPH_PBFDeltaRange ( int start, int end )
+{
+	float ss = m_Param[SPH_SIMSCALE];
+	float mR = m_Param[SPH_SMOOTHRADIUS];
+	float mR2 = m_R2;
+	float mr = m_Param[SPH_PMASS] / m_Param[SPH_RESTDENSITY];
+	float dq2 = PBF_SCORR_DQ * PBF_SCORR_DQ * mR2;
+	float wq = 1.0f / ( ( mR2 - dq2 ) * ( mR2 - dq2 ) * ( mR2 - dq2 ) );		// 1 / W(dq h), kernel constant cancels
+	float kcorr = PBF_SCORR_K / m_PbfScale;
+	float dx, dy, dz, dsq, r, c, w, scorr, li;
+	Vector3DF dp;
+	long visits = 0;
+
+	for (int i = start; i < end; i++ ) {
+		Vector3DF& xi = m_PbfPos[i];
+		li = m_PbfLambda[i];
+		dp.Set ( 0, 0, 0 );
+		int* nbr = GetNeighbors ( i );
+		for (int j = 0; j < m_NC[i]; j++ ) {
+			int nj = nbr[j];
+			Vector3DF& xj = m_PbfPos[ nj ];
+			dx = ( xi.x - xj.x ) * ss;
+			dy = ( xi.y - xj.y ) * ss;
+			dz = ( xi.z - xj.z ) * ss;
+			dsq = dx*dx + dy*dy + dz*dz;
+			if ( dsq >= mR2 || dsq <= 0 ) continue;
+			c = mR2 - dsq;
+			scorr = c * c * c * wq;
+			scorr *= scorr;
+			scorr = -kcorr * scorr * scorr;
+			r = sqrt ( dsq );
+			w = ( li + m_PbfLambda[nj] + scorr ) * m_SpikyKern * (mR - r) * (mR - r) / r;
+			dp.x += w * dx; dp.y += w * dy; dp.z += w * dz;
+		}
+		visits += m_NC[i];
+		dp *= mr / ss;										// back to world units
+		dp += xi;
+		SPH_ProjectBounds ( dp, i );
+		m_PbfNext[i] = dp;
+	}
+	AddPassVisits ( PASS_SOLVE, visits, visits );
+}
+
+// Step 3: v = (x* - x) / dt, and the corrected x* becomes the position.
+void FluidSystem::SPH_PBFVelocityRange ( int start, int end )
+{
+	float sdt = m_Param[SPH_SIMSCALE] / m_PbfDT;
+	Fluid* p;
+
+	for (int i = start; i < end; i++ ) {
+		p = GetFluid ( i );
+		p->pos = m_PbfPos[i];
+		p->vel.x = ( p->pos.x - m_PbfPrev[i].x ) * sdt;
+		p->vel.y = ( p->pos.y - m_PbfPrev[i].y ) * sdt;
+		p->vel.z = ( p->pos.z - m_PbfPrev[i].z ) * sdt;
+		p->vel_eval = p->vel;
+	}
+}
+
+// Vorticity w_i = sum_j m / rho_j grad W_ij x (v_j - v_i), and the XSPH average
+// sum_j m / rho_j (v_j - v_i) W_ij into m_PbfNext. Density is the pressure pass's, at x*.
+void FluidSystem::SPH_PBFVorticityRange ( int start, int end )
+{
+	float ss = m_Param[SPH_SIMSCALE];
+	float mR = m_Param[SPH_SMOOTHRADIUS];
+	float m = m_Param[SPH_PMASS];
+	float r, c, g;
+	Vector3DF x_ij, v_ji, w, xsph;
+	Fluid *p, *pcurr;
+	long visits = 0;
+
+	for (int i = start; i < end; i++ ) {
+		p = GetFluid ( i );
+		w.Set ( 0, 0, 0 );
+		xsph.Set ( 0, 0, 0 );
+		int* nbr = GetNeighbors ( i );
+		for (int j = 0; j < m_NC[i]; j++ ) {
+			pcurr = GetFluid ( nbr[j] );
+			x_ij = p->pos;
+			x_ij -= pcurr->pos;
+			x_ij *= ss;
+			r = x_ij.Length ();
+			if ( r <= 0 || r >= mR ) continue;				// the table was built at x*, before the projection
+			v_ji = pcurr->vel;
+			v_ji -= p->vel;
+			c = mR - r;
+			g = m * pcurr->density * m_SpikyKern * c * c / r;		// density holds 1 / rho
+			w.x += g * ( x_ij.y * v_ji.z - x_ij.z * v_ji.y );
+			w.y += g * ( x_ij.z * v_ji.x - x_ij.x * v_ji.z );
+			w.z += g * ( x_ij.x * v_ji.y - x_ij.y * v_ji.x );
+			c = m_R2 - r*r;
+			v_ji *= m * pcurr->density * m_Poly6Kern * c * c * c;
+			xsph += v_ji;
+		}
+		visits += m_NC[i];
+		m_PbfOmega[i] = w;
+		m_PbfNext[i] = xsph;
+	}
+	AddPassVisits ( PASS_SOLVE, visits, visits );
+}
+
+// Confinement f_i = eps ( N x w_i ), N = grad |w| / |grad |w||, applied over the step
+// together with the XSPH correction.
+void FluidSystem::SPH_PBFConfineRange ( int start, int end )
+{
+	float ss = m_Param[SPH_SIMSCALE];
+	float mR = m_Param[SPH_SMOOTHRADIUS];
+	float m = m_Param[SPH_PMASS];
+	float vort = m_Param[SPH_PBF_VORT];
+	float xsph = m_Param[SPH_PBF_XSPH];
+	float r, c, g, wi, len;
+	Vector3DF x_ij, eta, f;
+	Fluid *p, *pcurr;
+	long visits = 0;
+
+	for (int i = start; i < end; i++ ) {
+		p = GetFluid ( i );
+		Vector3DF& w = m_PbfOmega[i];
+		wi = w.Length ();
+		eta.Set ( 0, 0, 0 );
+		if ( vort > 0 ) {
+			int* nbr = GetNeighbors ( i );
+			for (int j = 0; j < m_NC[i]; j++ ) {
+				pcurr = GetFluid ( nbr[j] );
+				x_ij = p->pos;
+				x_ij -= pcurr->pos;
+				x_ij *= ss;
+				r = x_ij.Length ();
+				if ( r <= 0 || r >= mR ) continue;
+				c = mR - r;
+				g = m * pcurr->density * m_SpikyKern * c * c / r * ( m_PbfOmega[ nbr[j] ].Length() - wi );
+				eta.x += g * x_ij.x;
+				eta.y += g * x_ij.y;
+				eta.z += g * x_ij.z;
+			}
+			visits += m_NC[i];
+		}
+		len = eta.Length ();
+		f.Set ( 0, 0, 0 );
+		if ( len > 0 ) {
+			eta *= vort / len;
+			f.x = ( eta.y * w.z - eta.z * w.y ) * m_PbfDT;
+			f.y = ( eta.z * w.x - eta.x * w.z ) * m_PbfDT;
+			f.z = ( eta.x * w.y - eta.y * w.x ) * m_PbfDT;
+		}
+		f.x += m_PbfNext[i].x * xsph;
+		f.y += m_PbfNext[i].y * xsph;
+		f.z += m_PbfNext[i].z * xsph;
+		p->vel += f;
+		p->vel_eval = p->vel;
+	}
+	AddPassVisits ( PASS_SOLVE, visits, visits );
+}
+
+//------------------------------------------------------ Dormant Cells
+
+// Two sweeps over the grid chains. The first marks restless cells: a particle flagged
+// FLUID_RESTLESS by the last step's passes, or an awake particle that moved into a dormant
+// cell. The second counts quiet steps per occupied cell (reset by a restless cell in its
+// 3x3x3 block), freezes cells that reach SPH_SLEEP_STEPS, wakes disturbed ones, and sets
+// the particle flags to match. Frozen particles are put at rest; a cell that wakes starts
+// from there, with the density and pressure it was frozen with until its pressure pass.
+void FluidSystem::SPH_UpdateDormancy ()
+{
+	m_bSleep = m_Param[SPH_SLEEP_STEPS] > 0 && m_Domain == 0x0 && !m_Toggle[USE_PCISPH] && !m_Toggle[USE_PBF];
+	m_NumAwake = NumPoints();
+	if ( !m_bSleep ) {
+		m_CellQuiet.clear ();						// all awake if it is switched on again
+		return;
+	}
+	int resx = (int) m_GridRes.x, resy = (int) m_GridRes.y, resz = (int) m_GridRes.z;
+	int cells = resx * resy * resz;
+	int steps = (int) m_Param[SPH_SLEEP_STEPS];
+	char* dat = mBuf[0].data;
+	int stride = mBuf[0].stride;
+	Fluid* p;
+	int pndx, c;
+	int used = 0, asleep = 0, frozen = 0;
+	bool restless, dormant;
+
+	if ( (int) m_CellQuiet.size() != cells ) m_CellQuiet.assign ( cells, 0 );
+	m_CellRestless.assign ( cells, 0 );
+
+	for ( c = 0; c < cells; c++ ) {
+		for ( pndx = m_Grid[c]; pndx != -1; pndx = p->next ) {
+			p = (Fluid*) (dat + pndx*stride);
+			if ( ( p->flags & FLUID_RESTLESS ) || ( m_CellQuiet[c] < 0 && !( p->flags & FLUID_SLEEP ) ) ) {
+				m_CellRestless[c] = 1;
+				break;
+			}
+		}
+	}
+
+	c = 0;
+	for (int cz = 0; cz < resz; cz++ )
+	for (int cy = 0; cy < resy; cy++ )
+	for (int cx = 0; cx < resx; cx++, c++ ) {
+		if ( m_Grid[c] == -1 ) { m_CellQuiet[c] = 0; continue; }
+		restless = false;
+		for (int z = cz-1; z <= cz+1 && !restless; z++ ) {
+			if ( z < 0 || z >= resz ) continue;
+			for (int y = cy-1; y <= cy+1 && !restless; y++ ) {
+				if ( y < 0 || y >= resy ) continue;
+				for (int x = cx-1; x <= cx+1 && !restless; x++ )
+					if ( x >= 0 && x < resx && m_CellRestless[ (z*resy + y)*resx + x ] ) restless = true;
+			}
+		}
+		if ( restless )
+			m_CellQuiet[c] = 0;
+		else if ( m_CellQuiet[c] >= 0 && ++m_CellQuiet[c] >= steps )
+			m_CellQuiet[c] = -1;
+		dormant = ( m_CellQuiet[c] < 0 );
+		used++;
+		if ( dormant ) asleep++;
+
+		for ( pndx = m_Grid[c]; pndx != -1; pndx = p->next ) {
+			p = (Fluid*) (dat + pndx*stride);
+			if ( dormant ) {
+				if ( !( p->flags & FLUID_SLEEP ) ) {
+					p->flags |= FLUID_SLEEP;
+					p->vel.Set ( 0, 0, 0 );
+					p->vel_eval.Set ( 0, 0, 0 );
+				}
+				frozen++;
+			} else
+				p->flags &= ~FLUID_SLEEP;
+			p->flags &= ~FLUID_RESTLESS;
+		}
+	}
+
+	m_NumAwake = NumPoints() - frozen;
+	m_CellsUsed = used;
+	m_CellsAsleep = asleep;
+	m_AwakeSum += ( NumPoints() > 0 ) ? double(m_NumAwake) / NumPoints() : 1.0;
+	m_SleepSteps++;
+}
+
+void FluidSystem::SPH_ReportDormancy ()
+{
+	if ( m_SleepSteps == 0 ) return;
+	printf ( "Dormancy: %d steps, %.1f%% of particles awake on average, last %d of %d\n", m_SleepSteps, m_AwakeSum * 100.0 / m_SleepSteps, m_NumAwake, NumPoints() );
+	printf ( "Dormancy: %d of %d occupied cells dormant, after %d quiet steps below %.4f m/s and %.3f%% density change\n", m_CellsAsleep, m_CellsUsed, (int) m_Param[SPH_SLEEP_STEPS], m_Param[SPH_SLEEP_VEL], m_Param[SPH_SLEEP_DRHO] * 100.0 );
+}
+
+//------------------------------------------------------ Block Time-Stepping
+
+// Each particle steps at SPH_TIMESTEP / 2^level; one Run() is one step of the finest
+// level, and a particle is only kicked (and its density and forces evaluated) when its
+// own step ends. A particle that started a step at least two levels finer than a
+// neighbor forces that neighbor to end its step at the next tick: the part of the kick
+// for the remaining time is taken back, so no particle keeps coasting past a fast one.
+void FluidSystem::SPH_FinishBlockStep ()
+{
+	int nlev = GetBlockLevels ();
+	int nt = (int) m_ThreadFine.size();
+	int lnext = 0;
+	while ( lnext < nlev-1 && ( m_BlockTick+1 ) % ( 1 << (nlev-1-lnext) ) != 0 ) lnext++;
+	double dtf = GetStepDT ();
+	
+	for (int l = 0; l < nlev; l++ ) {
+		m_BlockLevel[l] = 0;
+		for (int t = 0; t < nt; t++ ) m_BlockLevel[l] += m_ThreadLevel[t * BLOCK_LEVELS_MAX + l];
+	}
+	Fluid *p, *q;
+	FluidCold* cold;
+	Vector3DF kick;
+	int i, li, j, lj, lnew, period, left;
+	for (int t = 0; t < nt; t++ ) {
+		std::vector<int>& fine = m_ThreadFine[t];
+		for (int n = 0; n < (int) fine.size(); n++ ) {
+			i = fine[n];
+			p = GetFluid ( i );
+			li = ( p->flags & FLUID_LEVEL_MASK ) >> FLUID_LEVEL_SHIFT;
+			int* nbr = GetNeighbors ( i );
+			for (int k = 0; k < m_NC[i]; k++ ) {
+				j = nbr[k];
+				q = GetFluid ( j );
+				lj = ( q->flags & FLUID_LEVEL_MASK ) >> FLUID_LEVEL_SHIFT;
+				if ( lj >= li - 1 || ( q->flags & FLUID_SLEEP ) ) continue;
+				period = 1 << (nlev-1-lj);
+				left = ( m_BlockTick / period + 1 ) * period - ( m_BlockTick + 1 );	// finest steps it still had to go
+				if ( left > 0 ) {
+					cold = GetCold ( j );
+					kick = cold->accel;
+					kick *= float( 0.5 * left * dtf );
+					q->vel -= kick;
+					q->vel_eval = q->vel;
+					cold->step -= float( left * dtf );
+				}
+				lnew = ( li - 1 > lnext ) ? li - 1 : lnext;
+				q->flags = ( q->flags & ~(FLUID_LEVEL_MASK | FLUID_WAIT) ) | ( lnew << FLUID_LEVEL_SHIFT );
+				m_BlockLevel[lj]--;
+				m_BlockLevel[lnew]++;
+				m_BlockCuts++;
+			}
+		}
+	}
+	m_BlockEvals += m_NumActive;
+	m_BlockUpdates += NumPoints();
+	m_BlockTicks++;
+	m_BlockTick++;
+}
+
+void FluidSystem::SPH_ReportBlockSteps ()
+{
+	if ( m_BlockTicks == 0 ) return;
+	int nlev = GetBlockLevels ();
+	printf ( "Block steps: %ld steps of %.6f s over %d levels, %.1f%% of particles evaluated per step, %.2fx fewer force evaluations\n",
+		m_BlockTicks, GetStepDT (), nlev, m_BlockEvals * 100.0 / m_BlockUpdates, ( m_BlockEvals > 0 ) ? m_BlockUpdates / m_BlockEvals : 0.0 );
+	printf ( "Block steps: last step" );
+	for (int l = 0; l < nlev; l++ ) printf ( " L%d (%.6f s) %d", l, m_Param[SPH_TIMESTEP] / (1 << l), m_BlockLevel[l] );
+	printf ( "\n" );
+	printf ( "Block steps: %ld steps cut short by a faster neighbor, %ld kicks wanted a step below the finest level\n", m_BlockCuts, (long) m_BlockClamped );
+}
+
+//------------------------------------------------------ Colliders
+
+// The volume walls (a sloped floor with BOUND_ZMIN_SLOPE, no x walls with WRAP_X, x walls
+// FORCE_XMIN_SIN / FORCE_XMAX_SIN + 1 times as stiff) and the barrier toggles, as planes
+// and boxes in the order the hardcoded walls were tested. The barrier limits are where
+// particle centers are held back, so the boxes are inset from them by the contact distance.
+// Baked into one voxel field if SPH_COLLIDE_BAKE is set.
+void FluidSystem::SPH_SetupColliders ()
+{
+	Vector3DF min = m_Vec[SPH_VOLMIN];
+	Vector3DF max = m_Vec[SPH_VOLMAX];
+	float slope = m_Param[BOUND_ZMIN_SLOPE];
+	float reach = 2 * m_Param[SPH_PRADIUS] / m_Param[SPH_SIMSCALE];
+	float dp = BARRIER_DEPTH;
+
+	m_Colliders.Clear ( COLLIDE_DOMAIN );
+	m_Colliders.AddPlane ( min, Vector3DF(-slope, 0, 1), COLLIDE_DOMAIN );
+	m_Colliders.AddPlane ( max, Vector3DF(0, 0, -1), COLLIDE_DOMAIN );
+	if ( !m_Toggle[WRAP_X] ) {
+		m_Colliders.AddPlane ( min, Vector3DF(1, 0, 0), COLLIDE_DOMAIN, m_Param[FORCE_XMIN_SIN] + 1 );
+		m_Colliders.AddPlane ( max, Vector3DF(-1, 0, 0), COLLIDE_DOMAIN, m_Param[FORCE_XMAX_SIN] + 1 );
+	}
+	m_Colliders.AddPlane ( min, Vector3DF(0, 1, 0), COLLIDE_DOMAIN );
+	m_Colliders.AddPlane ( max, Vector3DF(0, -1, 0), COLLIDE_DOMAIN );
+
+	if ( m_Toggle[WALL_BARRIER] )			// x = 0 face, |y| < 3, below z = 10
+		m_Colliders.AddBox ( Vector3DF(-dp, -3+reach, min.z-dp), Vector3DF(0, 3-reach, 10-reach), COLLIDE_DOMAIN, 2 );
+	if ( m_Toggle[LEVY_BARRIER] ) {			// x = 0 face, |y| > 5, below z = 10
+		m_Colliders.AddBox ( Vector3DF(-dp, min.y-dp, min.z-dp), Vector3DF(0, -5-reach, 10-reach), COLLIDE_DOMAIN, 2 );
+		m_Colliders.AddBox ( Vector3DF(-dp, 5+reach, min.z-dp), Vector3DF(0, max.y+dp, 10-reach), COLLIDE_DOMAIN, 2 );
+	}
+	if ( m_Toggle[DRAIN_BARRIER] ) {		// floor at z = min.z + 15 with a hole at |x|, |y| < 3, sink below min.z + 10
+		float top = min.z + 15;
+		float hole = 3 + reach;
+		m_Colliders.AddBox ( Vector3DF(min.x-dp, min.y-dp, top-dp), Vector3DF(-hole, max.y+dp, top), COLLIDE_DOMAIN );
+		m_Colliders.AddBox ( Vector3DF(hole, min.y-dp, top-dp), Vector3DF(max.x+dp, max.y+dp, top), COLLIDE_DOMAIN );
+		m_Colliders.AddBox ( Vector3DF(-hole, min.y-dp, top-dp), Vector3DF(hole, -hole, top), COLLIDE_DOMAIN );
+		m_Colliders.AddBox ( Vector3DF(-hole, hole, top-dp), Vector3DF(hole, max.y+dp, top), COLLIDE_DOMAIN );
+		m_Colliders.AddBox ( Vector3DF(min.x-dp, min.y-dp, min.z-dp), Vector3DF(max.x+dp, max.y+dp, min.z+10), COLLIDE_DOMAIN | COLLIDE_SINK );
+	}
+
+	float cell = m_Param[SPH_COLLIDE_BAKE];
+	m_ColBake = cell;
+	if ( cell > 0 ) {
+		Vector3DF lo = min, hi = max;
+		lo -= Vector3DF(2*cell, 2*cell, 2*cell);
+		hi += Vector3DF(2*cell, 2*cell, 2*cell);
+		m_Colliders.Bake ( COLLIDE_DOMAIN, lo, hi, cell );
+	}
+}
+
+void FluidSystem::SPH_ComputeColliders ()
+{
+	float reach = 2 * m_Param[SPH_PRADIUS] / m_Param[SPH_SIMSCALE];		// contact distance, world units
+	if ( m_Param[SPH_COLLIDE_BAKE] != m_ColBake ) SPH_SetupColliders ();		// voxel spacing set after the example
+	m_Colliders.Cull ( m_GridMin, m_GridDelta, m_GridRes, reach );
+	m_ColAccel.resize ( NumPoints() );
+	m_ColRecords = 0;
+	m_ColContacts = 0;
+	if ( m_Pool != 0x0 )
+		m_Pool->Run ( CollideJob, this );
+	else
+		SPH_ComputeCollideRange ( 0, m_Colliders.GetNumCells() );
+	CountPass ( PASS_COLLIDE, m_ColRecords );
+	m_bContacts = true;
+}
+
+// The particles of a cell are gathered into batches of COLLIDE_BATCH and each candidate
+// is evaluated for the whole batch. Penalties are summed in candidate order, the order
+// the walls are listed in, as SPH_ComputeContact does.
+void FluidSystem::SPH_ComputeCollideRange ( int start, int end )
+{
+	float x[COLLIDE_BATCH], y[COLLIDE_BATCH], z[COLLIDE_BATCH];
+	float vx[COLLIDE_BATCH], vy[COLLIDE_BATCH], vz[COLLIDE_BATCH];
+	float d[COLLIDE_BATCH], nx[COLLIDE_BATCH], ny[COLLIDE_BATCH], nz[COLLIDE_BATCH];
+	float ax[COLLIDE_BATCH], ay[COLLIDE_BATCH], az[COLLIDE_BATCH];
+	int idx[COLLIDE_BATCH];
+	char hit[COLLIDE_BATCH];
+	float stiff = m_Param[SPH_EXTSTIFF];
+	float damp = m_Param[SPH_EXTDAMP];
+	float radius = m_Param[SPH_PRADIUS];
+	float ss = m_Param[SPH_SIMSCALE];
+	bool bPenalty = !m_Toggle[USE_PBF];				// PBF projects positions instead (SPH_ProjectBounds)
+	float contact = m_bBoundary ? 0 : 2 * radius;	// boundary particles hold the fluid off the walls
+	DWORD skip = m_SkipMask;
+	long records = 0, contacts = 0;
+	float diff, adj, k;
+	int cell, nc, cnt, pndx;
+	const int* cand;
+	Fluid* p;
+
+	for (int n = start; n < end; n++ ) {
+		cell = m_Colliders.GetCellIndex ( n );
+		nc = m_Colliders.GetNumCandidates ( cell );
+		cand = m_Colliders.GetCandidates ( cell );
+		pndx = m_Grid[cell];
+		while ( pndx != -1 ) {
+			cnt = 0;
+			while ( pndx != -1 && cnt < COLLIDE_BATCH ) {
+				p = (Fluid*) (mBuf[0].data + pndx*mBuf[0].stride);
+				if ( !( p->flags & skip ) ) {
+					idx[cnt] = pndx;
+					x[cnt] = p->pos.x; y[cnt] = p->pos.y; z[cnt] = p->pos.z;
+					vx[cnt] = p->vel_eval.x; vy[cnt] = p->vel_eval.y; vz[cnt] = p->vel_eval.z;
+					ax[cnt] = ay[cnt] = az[cnt] = 0;
+					hit[cnt] = 0;
+					cnt++;
+				}
+				pndx = p->next;
+			}
+			for (int c = 0; c < nc; c++ ) {
+				FluidCollider& col = m_Colliders.Get ( cand[c] );
+				if ( !bPenalty && !( col.flags & COLLIDE_SINK ) ) continue;
+				m_Colliders.Distance ( cand[c], cnt, x, y, z, d, nx, ny, nz );
+				if ( col.flags & COLLIDE_SINK ) {
+					for (int j = 0; j < cnt; j++ ) hit[j] |= ( d[j] < 0 ) ? 2 : 0;
+					continue;
+				}
+				k = stiff * col.stiff;
+				for (int j = 0; j < cnt; j++ ) {
+					diff = contact - d[j] * ss;
+					adj = ( diff > EPSILON ) ? k * diff - damp * ( nx[j]*vx[j] + ny[j]*vy[j] + nz[j]*vz[j] ) : 0;
+					ax[j] += adj * nx[j]; ay[j] += adj * ny[j]; az[j] += adj * nz[j];
+					hit[j] |= ( diff > EPSILON ) ? 1 : 0;
+				}
+			}
+			for (int j = 0; j < cnt; j++ ) {
+				if ( hit[j] == 0 ) continue;
+				p = (Fluid*) (mBuf[0].data + idx[j]*mBuf[0].stride);
+				if ( hit[j] & 1 ) {
+					m_ColAccel[ idx[j] ].Set ( ax[j], ay[j], az[j] );
+					p->flags |= FLUID_CONTACT;
+					contacts++;
+				}
+				if ( hit[j] & 2 ) p->flags |= FLUID_DEAD;
+			}
+			records += cnt;
+		}
+	}
+	ThreadPool::FetchAdd ( &m_ColRecords, records );
+	ThreadPool::FetchAdd ( &m_ColContacts, contacts );
+}
+
+// One particle against its cell's candidates, or against every collider outside the grid
+void FluidSystem::SPH_ComputeContact ( Fluid* p, Vector3DF& accel )
+{
+	float stiff = m_Param[SPH_EXTSTIFF];
+	float damp = m_Param[SPH_EXTDAMP];
+	float radius = m_Param[SPH_PRADIUS];
+	float ss = m_Param[SPH_SIMSCALE];
+	int cell = m_Colliders.GetCell ( p->pos );
+	int nc = ( cell >= 0 ) ? m_Colliders.GetNumCandidates ( cell ) : m_Colliders.GetNum ();
+	const int* cand = ( cell >= 0 ) ? m_Colliders.GetCandidates ( cell ) : 0x0;
+	float contact = m_bBoundary ? 0 : 2 * radius;
+	Vector3DF norm;
+	float diff, adj;
+	int c;
+
+	for (int n = 0; n < nc; n++ ) {
+		c = ( cand != 0x0 ) ? cand[n] : n;
+		FluidCollider& col = m_Colliders.Get ( c );
+		if ( col.flags & COLLIDE_SINK ) continue;
+		diff = contact - m_Colliders.Distance ( c, p->pos, norm ) * ss;
+		if ( diff > EPSILON ) {
+			adj = stiff * col.stiff * diff - damp * norm.Dot ( p->vel_eval );
+			accel.x += adj * norm.x; accel.y += adj * norm.y; accel.z += adj * norm.z;
+		}
+	}
+}
+
+// The field covers the band around the surface that contacts can reach, plus a
+// cell for the trilinear interpolation
+int FluidSystem::SPH_AddMeshCollider ( std::string fname, float scale, Vector3DF offset, float cell, int flags )
+{
+	FluidMeshSDF mesh;
+	FluidSDF sdf;
+	float reach = 2 * m_Param[SPH_PRADIUS] / m_Param[SPH_SIMSCALE];
+	if ( cell <= 0 ) cell = reach / 2;
+
+	if ( !mesh.LoadPly ( fname, scale ) ) return -1;
+	mesh.Translate ( offset );
+	std::string cache = fname;
+	if ( cache.size() > 4 && cache.compare ( cache.size()-4, 4, ".ply" ) == 0 ) cache.resize ( cache.size()-4 );
+	if ( !mesh.Bake ( sdf, cell, reach + 2 * cell, m_Pool, cache ) ) return -1;
+	mesh.Report ();
+	return m_Colliders.AddVoxel ( sdf, flags );
+}
+
+void FluidSystem::SPH_ReportColliders ()
+{
+	m_Colliders.Report ();
+	if ( m_bContacts )
+		printf ( "Colliders: last step %ld particles tested, %ld in contact\n", (long) m_ColRecords, (long) m_ColContacts );
+}
+
+//------------------------------------------------------ Boundary Particles
+
+// Samples a lattice at the fluid spacing, anchored at SPH_VOLMIN where SPH_CreateExample
+// starts the fluid, and keeps the points between one half spacing and one smoothing radius
+// behind the union of the non-sink colliders. The volume walls then continue the fluid
+// lattice one layer out, and the layer is a full kernel deep, so a particle at a wall sees
+// solid samples wherever it would see fluid ones. Each sample is frozen fluid with the
+// particle mass; the per-particle volumes of Akinci et al. are only needed for a single
+// sampled layer, which must stand in for the solid behind it.
+void FluidSystem::SPH_SetupBoundary ()
+{
+	mint::Time start, stop;
+	start.SetSystemTime ( ACC_NSEC );
+
+	float ss = m_Param[SPH_SIMSCALE];
+	float d2 = ss * ss;
+	float depth = m_Param[SPH_SMOOTHRADIUS] / ss;					// world units
+	float sp = m_Param[SPH_PDIST] * 0.87 / ss;						// as SPH_CreateExample
+	Vector3DF lo = m_Vec[SPH_VOLMIN];
+	Vector3DF hi = m_Vec[SPH_VOLMAX];
+	int k = (int) ceil ( depth / sp ) + 1;
+	int n[3];
+	n[0] = k + (int) floor ( ( hi.x + depth - lo.x ) / sp ) + 1;
+	n[1] = k + (int) floor ( ( hi.y + depth - lo.y ) / sp ) + 1;
+	n[2] = k + (int) floor ( ( hi.z + depth - lo.z ) / sp ) + 1;
+	Vector3DF first ( lo.x - k*sp, lo.y - k*sp, lo.z - k*sp );
+
+	std::vector<float> x ( n[0] ), y ( n[0] ), z ( n[0] ), d ( n[0] ), dmin ( n[0] ), nx ( n[0] ), ny ( n[0] ), nz ( n[0] );
+	std::vector<Vector3DF> pos, norm ( n[0] ), keep;
+	for (int i = 0; i < n[0]; i++ ) x[i] = first.x + i * sp;
+	for (int iz = 0; iz < n[2]; iz++ ) {
+		for (int iy = 0; iy < n[1]; iy++ ) {
+			for (int i = 0; i < n[0]; i++ ) {
+				y[i] = first.y + iy * sp;
+				z[i] = first.z + iz * sp;
+				dmin[i] = depth;
+			}
+			for (int c = 0; c < m_Colliders.GetNum(); c++ ) {
+				if ( m_Colliders.Get ( c ).flags & COLLIDE_SINK ) continue;
+				m_Colliders.Distance ( c, n[0], &x[0], &y[0], &z[0], &d[0], &nx[0], &ny[0], &nz[0] );
+				for (int i = 0; i < n[0]; i++ )
+					if ( d[i] < dmin[i] ) { dmin[i] = d[i]; norm[i].Set ( nx[i], ny[i], nz[i] ); }
+			}
+			for (int i = 0; i < n[0]; i++ )
+				if ( dmin[i] <= -0.5f*sp && dmin[i] > -0.5f*sp - depth ) { pos.push_back ( Vector3DF ( x[i], y[i], z[i] ) ); keep.push_back ( norm[i] ); }
+		}
+	}
+
+	// Static grid, one cell of padding around the lattice so the 3x3x3 blocks stay inside
+	int num = (int) pos.size();
+	m_BndCell = depth;
+	m_BndMin.Set ( first.x - depth, first.y - depth, first.z - depth );
+	m_BndRes[0] = (int) ( ( first.x + (n[0]-1)*sp - m_BndMin.x ) / depth ) + 2;
+	m_BndRes[1] = (int) ( ( first.y + (n[1]-1)*sp - m_BndMin.y ) / depth ) + 2;
+	m_BndRes[2] = (int) ( ( first.z + (n[2]-1)*sp - m_BndMin.z ) / depth ) + 2;
+	int rx = m_BndRes[0], rxy = m_BndRes[0] * m_BndRes[1];
+	int cells = rxy * m_BndRes[2];
+	std::vector<int> cell ( num );
+	m_BndStart.assign ( cells + 1, 0 );
+	for (int b = 0; b < num; b++ ) {
+		cell[b] = (int) ( ( pos[b].x - m_BndMin.x ) / depth ) + (int) ( ( pos[b].y - m_BndMin.y ) / depth ) * rx + (int) ( ( pos[b].z - m_BndMin.z ) / depth ) * rxy;
+		m_BndStart[ cell[b] + 1 ]++;
+	}
+	for (int g = 0; g < cells; g++ ) m_BndStart[g+1] += m_BndStart[g];
+	std::vector<int> fill ( m_BndStart.begin(), m_BndStart.end() - 1 );
+	m_BndPos.resize ( num );
+	m_BndNorm.resize ( num );
+	for (int b = 0; b < num; b++ ) {
+		m_BndPos[ fill[ cell[b] ] ] = pos[b];
+		m_BndNorm[ fill[ cell[b] ]++ ] = keep[b];
+	}
+
+	m_BndNear.assign ( cells, 0 );
+	for (int g = 0; g < cells; g++ ) {
+		if ( m_BndStart[g] == m_BndStart[g+1] ) continue;
+		for (int dz = -rxy; dz <= rxy; dz += rxy )
+			for (int dy = -rx; dy <= rx; dy += rx )
+				for (int dx = -1; dx <= 1; dx++ )
+					m_BndNear[ g + dz + dy + dx ] = 1;
 	}
+
+	// Mass: every sample stands for the same lattice cell of solid. Wall: the normal
+	// component of the damping weights for a particle on a flat wall (see SPH_BoundaryForce)
+	float sum = 0, wall = 0, dsq, c;
+	for (int iz = -k; iz <= k; iz++ )
+		for (int iy = -k; iy <= k; iy++ )
+			for (int ix = -k; ix <= k; ix++ ) {
+				dsq = ( ix*ix + iy*iy + iz*iz ) * sp * sp * d2;
+				if ( m_R2 > dsq ) {
+					c = m_R2 - dsq;
+					sum += c * c * c;
+					if ( iz < 0 ) wall += c * c * c * iz * iz / float( ix*ix + iy*iy + iz*iz );
+				}
+			}
+	m_BndPsi = m_Param[SPH_PMASS];
+	m_BndWall = wall / sum;
+
+	m_BndVersion = m_Colliders.GetVersion ();
+	m_BndHits = 0;
+	stop.SetSystemTime ( ACC_NSEC );
+	stop = stop - start;
+	m_BndSec = stop.GetSec ();
+}
+
+// The static cell of pos if any boundary particle is in its 3x3x3 block
+int FluidSystem::GetBoundaryCell ( Vector3DF& pos )
+{
+	if ( m_BndNear.empty() ) return -1;
+	float fx = ( pos.x - m_BndMin.x ) / m_BndCell;
+	float fy = ( pos.y - m_BndMin.y ) / m_BndCell;
+	float fz = ( pos.z - m_BndMin.z ) / m_BndCell;
+	if ( !( fx >= 1 && fx < m_BndRes[0]-1 && fy >= 1 && fy < m_BndRes[1]-1 && fz >= 1 && fz < m_BndRes[2]-1 ) ) return -1;		// also NaN
+	int g = (int) fx + ( (int) fy + (int) fz * m_BndRes[1] ) * m_BndRes[0];
+	return m_BndNear[g] ? g : -1;
+}
+
+float FluidSystem::SPH_BoundaryDensity ( Vector3DF& pos )
+{
+	int g = GetBoundaryCell ( pos );
+	if ( g < 0 ) return 0;
+	int rx = m_BndRes[0], rxy = m_BndRes[0] * m_BndRes[1];
+	float d2 = m_Param[SPH_SIMSCALE] * m_Param[SPH_SIMSCALE];
+	float sum = 0, dsq, c;
+	Vector3DF* bpos = &m_BndPos[0];
+	for (int dz = -rxy; dz <= rxy; dz += rxy )
+		for (int dy = -rx; dy <= rx; dy += rx )
+			for (int dx = -1; dx <= 1; dx++ )
+				for (int j = m_BndStart[g+dz+dy+dx]; j < m_BndStart[g+dz+dy+dx+1]; j++ ) {
+					dsq = ( (pos.x - bpos[j].x)*(pos.x - bpos[j].x) + (pos.y - bpos[j].y)*(pos.y - bpos[j].y) + (pos.z - bpos[j].z)*(pos.z - bpos[j].z) ) * d2;
+					if ( m_R2 > dsq ) {
+						c = m_R2 - dsq;
+						sum += c * c * c;
+					}
+				}
+	return sum * m_BndPsi;
+}
+
+// Pressure and viscosity from the boundary particles, in the force pass's units (the
+// fluid terms with the neighbor's mass, density and pressure taken as psi, rho_i and
+// max(p_i, 0)); the wall is at rest
+void FluidSystem::SPH_BoundaryForce ( Fluid* p, Vector3DF& force )
+{
+	int g = GetBoundaryCell ( p->pos );
+	if ( g < 0 ) return;
+	int rx = m_BndRes[0], rxy = m_BndRes[0] * m_BndRes[1];
+	float d = m_Param[SPH_SIMSCALE];
+	float mR = m_Param[SPH_SMOOTHRADIUS];
+	float press = ( p->pressure > 0 ) ? p->pressure : 0;
+	float pk = -m_SpikyKern * m_BndPsi * p->density * press;
+	float vk = m_LapKern * m_BndPsi * m_Param[SPH_VISC] * p->density;
+	float dk = ( p->density > 0 ) ? m_Param[SPH_EXTDAMP] * m_Poly6Kern * m_BndPsi / ( m_Param[SPH_RESTDENSITY] * m_BndWall * p->density ) : 0;
+	float dx, dy, dz, r, c, w, vn, pterm, dterm, vterm;
+	Vector3DF* bpos = &m_BndPos[0];
+	Vector3DF* bnrm = &m_BndNorm[0];
+	for (int oz = -rxy; oz <= rxy; oz += rxy )
+		for (int oy = -rx; oy <= rx; oy += rx )
+			for (int ox = -1; ox <= 1; ox++ )
+				for (int j = m_BndStart[g+oz+oy+ox]; j < m_BndStart[g+oz+oy+ox+1]; j++ ) {
+					dx = ( p->pos.x - bpos[j].x ) * d;
+					dy = ( p->pos.y - bpos[j].y ) * d;
+					dz = ( p->pos.z - bpos[j].z ) * d;
+					r = dx*dx + dy*dy + dz*dz;
+					if ( !( m_R2 > r ) || r <= 0 ) continue;
+					w = m_R2 - r;
+					r = sqrt ( r );
+					c = mR - r;
+					pterm = pk * c * c * fabs ( dx*bnrm[j].x + dy*bnrm[j].y + dz*bnrm[j].z ) / r;
+					vn = p->vel_eval.x*dx + p->vel_eval.y*dy + p->vel_eval.z*dz;
+					dterm = ( vn < 0 ) ? -dk * w * w * w * vn / ( r * r ) : 0;
+					vterm = vk * c;
+					force.x += pterm * bnrm[j].x + dterm * dx - vterm * p->vel_eval.x;
+					force.y += pterm * bnrm[j].y + dterm * dy - vterm * p->vel_eval.y;
+					force.z += pterm * bnrm[j].z + dterm * dz - vterm * p->vel_eval.z;
+				}
+}
+
+// As SPH_PressureForceRange with p_j = p_i and the mass psi
+void FluidSystem::SPH_BoundaryPressure ( Fluid* p, Vector3DF& force )
+{
+	int g = GetBoundaryCell ( p->pos );
+	if ( g < 0 ) return;
+	int rx = m_BndRes[0], rxy = m_BndRes[0] * m_BndRes[1];
+	float d = m_Param[SPH_SIMSCALE];
+	float mR = m_Param[SPH_SMOOTHRADIUS];
+	float rest = m_Param[SPH_RESTDENSITY];
+	float pk = -m_SpikyKern * m_BndPsi * p->pressure / ( rest * rest );
+	float dx, dy, dz, r, c, pterm;
+	Vector3DF* bpos = &m_BndPos[0];
+	Vector3DF* bnrm = &m_BndNorm[0];
+	for (int oz = -rxy; oz <= rxy; oz += rxy )
+		for (int oy = -rx; oy <= rx; oy += rx )
+			for (int ox = -1; ox <= 1; ox++ )
+				for (int j = m_BndStart[g+oz+oy+ox]; j < m_BndStart[g+oz+oy+ox+1]; j++ ) {
+					dx = ( p->pos.x - bpos[j].x ) * d;
+					dy = ( p->pos.y - bpos[j].y ) * d;
+					dz = ( p->pos.z - bpos[j].z ) * d;
+					r = dx*dx + dy*dy + dz*dz;
+					if ( !( m_R2 > r ) || r <= 0 ) continue;
+					r = sqrt ( r );
+					c = mR - r;
+					pterm = pk * c * c * fabs ( dx*bnrm[j].x + dy*bnrm[j].y + dz*bnrm[j].z ) / r;
+					force.x += pterm * bnrm[j].x;
+					force.y += pterm * bnrm[j].y;
+					force.z += pterm * bnrm[j].z;
+				}
+}
+
+void FluidSystem::SPH_ReportBoundary ()
+{
+	if ( m_BndVersion == -1 ) return;
+	double mb = ( ( m_BndPos.capacity() + m_BndNorm.capacity() ) * sizeof(Vector3DF) + m_BndStart.capacity() * sizeof(int) + m_BndNear.capacity() ) / (1024.0*1024.0);
+	printf ( "Boundary: %d particles in %d x %d x %d static cells, %.2f MB, sampled in %.3f s\n", (int) m_BndPos.size(), m_BndRes[0], m_BndRes[1], m_BndRes[2], mb, m_BndSec );
+	printf ( "Boundary: last step %ld of %d particles near a wall\n", (long) m_BndHits, NumPoints() );
 }
 
 void FluidSystem::SPH_ComputeXSPH(Fluid *p, int i)
@@ -1293,9 +3588,11 @@ void FluidSystem::SPH_ComputeXSPH(Fluid *p, int i)
 	mR2 = (mR*mR);
 	vel_correct.Set(0.0f,0.0f,0.0f);
 	
+	int* nbr = GetNeighbors ( i );
+	float* ndist = GetNDist ( i );
 	for (int j=0; j < m_NC[i]; j++ ) {
-		pcurr = (Fluid*) (mBuf[0].data + m_Neighbor[i][j]*mBuf[0].stride);				
-		c = ( mR2 - m_NDist[i][j]*m_NDist[i][j] );
+		pcurr = (Fluid*) (mBuf[0].data + nbr[j]*mBuf[0].stride);				
+		c = ( mR2 - ndist[j]*ndist[j] );
 		v_ji = pcurr->vel_eval;
 		v_ji -= p->vel_eval;
 		v_ji *= d;
@@ -1305,4 +3602,4 @@ void FluidSystem::SPH_ComputeXSPH(Fluid *p, int i)
 	}
 
 	p->vel += vel_correct;
-}
\ No newline at end of file
+}
@@ -44,13 +44,13 @@
 	
 	#define NULL_HASH		333333
 	
-	#define OFFSET_CLR		12
+	#define OFFSET_FLAGS	12
 	#define OFFSET_NEXT		16
 	#define OFFSET_VEL		20
 	#define OFFSET_VEVAL	32
-	#define OFFSET_PRESS	48
-	#define OFFSET_DENS		52
-	#define OFFSET_FORCE	56
+	#define OFFSET_PRESS	44
+	#define OFFSET_DENS		48
+	#define OFFSET_FORCE	52
 	
 
 	__global__ void hashParticles ( char* bufPnts, uint2* bufHash, int numPnt )
@@ -105,7 +105,7 @@
 			char* dest = bufPntSort + __mul24( ndx, simData.stride );
 			
 			*(float3*)(dest)				= *(float3*)(src);
-			*(uint*)  (dest + OFFSET_CLR)	= *(uint*)  (src + OFFSET_CLR);
+			*(uint*)  (dest + OFFSET_FLAGS)	= *(uint*)  (src + OFFSET_FLAGS);
 			*(float3*)(dest + OFFSET_VEL)	= *(float3*)(src + OFFSET_VEL);
 			*(float3*)(dest + OFFSET_VEVAL)	= *(float3*)(src + OFFSET_VEVAL);				
 			
@@ -32,6 +32,11 @@ CIS497 Physically Based Phase Changing Materials
 
 #include "render_particles.h"
 #include "fluid_system.h"
+#include "fluid_domain.h"
+#include "mthread.h"
+#include "fluid_ensemble.h"
+#include "fluid_checkpoint.h"
+#include "fluid_scheduler.h"
 
 #define DEBUG_MATRIX
 
@@ -68,6 +73,79 @@ ParticleRenderer *renderer = 0;
 
 FluidSystem fluidSystem;
 
+//Domain Decomposition (-ranks N -rank R [-axis 0|1|2] [-session name])
+FluidDomain *domain = 0;
+int domainRanks = 1;
+int domainRank = 0;
+int domainAxis = 0;
+std::string domainSession = "fluids";
+
+//Worker Threads (-threads N [-nopin])
+ThreadPool *pool = 0;
+int poolThreads = 0;
+bool poolPin = true;
+
+//Hardware Counters (-counters: cycles, instructions, cache and branch misses per phase and thread, 't' prints them)
+bool hwCounters = false;
+
+//Trace (-trace file: record phase and render spans from launch, 'T' starts/stops and writes Chrome trace JSON)
+std::string traceFile = "fluids_trace.json";
+bool traceStart = false;
+
+//Particle Buffers (-hugepages: 2 MB pages for the attribute blocks)
+bool geomHugePages = false;
+
+//Neighbor Search (-qpos: quantized cell-relative positions)
+bool qposSearch = false;
+
+//Adaptive Timestep (-cfl C: Courant number, the time step slider then shows the chosen dt)
+float cflNumber = 0;
+
+//Incompressible Pressure (-pcisph [-pcitol F: allowed compression, fraction of rest density])
+bool pciSolver = false;
+float pciTolerance = 0.01f;
+
+//Position Based Fluids (-pbf: one 1/60 s step per frame [-pbfiter N])
+bool pbfSolver = false;
+int pbfIterations = 4;
+
+//Dormant Cells (-sleep N: freeze grid cells that stayed at rest for N steps)
+int sleepSteps = 0;
+
+//Block Time-Stepping (-levels N: per-particle steps of SPH_TIMESTEP / 2^k, k < N)
+int blockLevels = 1;
+
+//Colliders (-bake X: sample the volume walls and barriers into one voxel field, X world units apart)
+float colliderBake = 0;
+//Boundary Particles (-boundary: walls and obstacles as static particles in the SPH sums)
+bool boundaryParticles = false;
+//Mesh Obstacle (-mesh file.ply [-meshscale S] [-meshcell X]: voxel spacing in world units)
+std::string meshFile = "";
+float meshScale = 1;
+float meshCell = 0;
+
+//Sub-steps (-simframe T: simulated seconds per frame [-budget ms] [-maxsub K] [-frameskip N])
+FluidScheduler scheduler;
+float simPerFrame = 0;
+float frameBudget = 12.0f;
+int maxSubSteps = 32;
+int maxFrameSkip = 2;
+
+//Headless Ensemble (-ensemble configs.txt [-steps N] [-every K] [-out prefix])
+std::string ensembleFile = "";
+std::string ensembleOut = "ensemble";
+int ensembleSteps = 1000;
+int ensembleEvery = 10;
+
+//Checkpoints (-checkpoint prefix [-chkevery N] [-chkmem MB] [-chkdrop]), restart with -restore file.chk
+FluidCheckpoint *checkpoint = 0;
+std::string checkpointPrefix = "";
+std::string restoreFile = "";
+int checkpointEvery = 100;
+int checkpointMB = 256;
+bool checkpointWait = true;
+int simStep = 0;
+
 //Display Info
 int mode = 0;
 bool bPause = true;
@@ -105,14 +183,47 @@ void initParticleSystem(int numParticles, uint3 gridSize, bool bUseOpenGL)
     if (bUseOpenGL) {
 		
 		//Initialize Particle System
+		fluidSystem.SetHugePages(geomHugePages);
 		fluidSystem.Initialize(BFLUID, numParticles);
+		if (qposSearch) fluidSystem.Toggle(USE_QPOS);
+		if (pciSolver) fluidSystem.Toggle(USE_PCISPH);
+		if (pbfSolver) fluidSystem.Toggle(USE_PBF);
+		if (boundaryParticles) fluidSystem.Toggle(USE_BOUNDARY);
+		if (poolThreads != 1) {
+			pool = new ThreadPool;
+			pool->Start(poolThreads, poolPin);
+			fluidSystem.SetThreadPool(pool);
+		}
+		if (hwCounters) Profiler::Global().StartCounters(pool);
+		if (traceStart) Profiler::Global().StartTrace();
 		fluidSystem.SPH_CreateExample( 0, numParticles);
+		fluidSystem.SetParam(SPH_CFL, cflNumber);
+		fluidSystem.SetParam(SPH_PCI_TOL, pciTolerance);
+		fluidSystem.SetParam(SPH_PBF_ITER, pbfIterations);
+		fluidSystem.SetParam(SPH_SLEEP_STEPS, sleepSteps);
+		fluidSystem.SetParam(SPH_BLOCK_LEVELS, blockLevels);
+		fluidSystem.SetParam(SPH_COLLIDE_BAKE, colliderBake);
+		if (!meshFile.empty()) fluidSystem.SPH_AddMeshCollider(meshFile, meshScale, Vector3DF(0,0,0), meshCell);
+		scheduler.Setup(simPerFrame, frameBudget, maxSubSteps, maxFrameSkip);
+
+		//Split Domain Across Processes
+		if (domainRanks > 1) {
+			domain = new FluidDomain;
+			if (!domain->Setup(&fluidSystem, domainSession, domainRank, domainRanks, domainAxis, 16 << 20)) {
+				fprintf(stderr, "Domain setup failed.\n");
+				exit(-1);
+			}
+			domain->ClipToSlab(&fluidSystem);
+			fluidSystem.SetDomain(domain);
+		}
 		
 		//Initialize Renderer
 		renderer = new ParticleRenderer(width,height);
 		renderer->setParticleRadius(1.0f);
-		renderer->setVertexBuffer(fluidSystem.getPositionVBO(), numParticles);
-        renderer->setColorBuffer(fluidSystem.getColorVBO());
+		FluidStage* stage = fluidSystem.GetStage();
+		renderer->setVertexBuffer(stage->GetVBO(), stage->GetNum(), stage->GetPosOffset(), stage->GetColorOffset());
+        renderer->setColorBuffer(stage->GetVBO());
+		renderer->setColorRamp((const unsigned int*) fluidSystem.GetColorRamp(), COLOR_RAMP);
 		renderer->loadSkyBoxTexture("../media/violentdays_large.jpg");
 		renderer->loadCubeMapTexture("../media/violentdays_large.jpg");
     }
@@ -120,7 +231,33 @@ void initParticleSystem(int numParticles, uint3 gridSize, bool bUseOpenGL)
 
 void cleanup()
 {
-
+	if (ensembleFile.empty()) {
+		MemAccount::Global().Report(fluidSystem.NumPoints());
+		fluidSystem.SPH_ReportTimestep();
+		fluidSystem.SPH_ReportSolver();
+		fluidSystem.SPH_ReportDormancy();
+		fluidSystem.SPH_ReportBlockSteps();
+		fluidSystem.SPH_ReportColliders();
+		fluidSystem.SPH_ReportBoundary();
+		fluidSystem.SPH_ReportProfile();
+		scheduler.Report();
+	}
+	if (Profiler::Global().IsTracing()) Profiler::Global().StopTrace(traceFile.c_str());
+	if (checkpoint) {
+		delete checkpoint;			//flushes pending writes
+		checkpoint = 0;
+	}
+	if (domain) {
+		fluidSystem.SetDomain(0);
+		delete domain;
+		domain = 0;
+	}
+	if (pool) {
+		fluidSystem.SetThreadPool(0);
+		pool->Stop();
+		delete pool;
+		pool = 0;
+	}
 }
 
 // initialize OpenGL
@@ -291,10 +428,30 @@ void display()
 	if (!bPause) {
 			//Update Fluid System Parameters 
 			fluidSystem.SetParam(SPH_VISC,viscocity);
-			fluidSystem.SetParam(SPH_TIMESTEP,timestep);
+			if (cflNumber > 0)
+				timestep = fluidSystem.GetParam(SPH_TIMESTEP);
+			else
+				fluidSystem.SetParam(SPH_TIMESTEP,timestep);
 			
-			//Update Fluid System
-			fluidSystem.Run();
+			//Particle colors are only computed when the display mode shows them
+			if (renderer) fluidSystem.GetStage()->SetColorFormat(renderer->needsParticleColor() ? STAGE_CLR_SCALAR : STAGE_CLR_NONE);
+
+			//Update Fluid System; only the last sub-step writes the render output
+			int steps = scheduler.Frame(&fluidSystem);
+			if (renderer) {
+				FluidStage* stage = fluidSystem.GetStage();		// newest published slot
+				renderer->setVertexBuffer(stage->GetVBO(), stage->GetNum(), stage->GetPosOffset(), stage->GetColorOffset());
+				renderer->setColorFormat(stage->GetColorFormat());
+			}
+
+			//Checkpoint (copy only, written in the background)
+			simStep += steps;
+			if (checkpoint && simStep / checkpointEvery != (simStep - steps) / checkpointEvery)
+				checkpoint->Snapshot(&fluidSystem, simStep);
+
+			//Behind schedule: this frame was simulation only
+			if (!scheduler.IsRenderFrame())
+				return;
 
 			//Record Image
 			if(bRecording){
@@ -495,9 +652,33 @@ void key(unsigned char key, int x, int y)
         displaySliders = !displaySliders;
         break;
 	case 'p':
+		//A reset on one rank would leave its neighbors exchanging with the old population
+		if (domain) {
+			cout << "Scene reset is disabled when the domain is split across processes." << endl;
+			break;
+		}
 		//fluidSystem.Reset(fluidSystem.NumPoints());
-		fluidSystem.SPH_CreateExample( 0, fluidSystem.NumPoints());
+		fluidSystem.SPH_CreateExample( 0, max_particles);
+		fluidSystem.SetParam(SPH_CFL, cflNumber);
+		fluidSystem.SetParam(SPH_PCI_TOL, pciTolerance);
+		fluidSystem.SetParam(SPH_PBF_ITER, pbfIterations);
+		fluidSystem.SetParam(SPH_SLEEP_STEPS, sleepSteps);
+		fluidSystem.SetParam(SPH_BLOCK_LEVELS, blockLevels);
+		fluidSystem.SetParam(SPH_COLLIDE_BAKE, colliderBake);
         break;
+	case 'n':
+		fluidSystem.SPH_ReportNUMA();
+		break;
+	case 'm':
+		MemAccount::Global().Report(fluidSystem.NumPoints());
+		break;
+	case 't':
+		fluidSystem.SPH_ReportProfile();
+		break;
+	case 'T':
+		if (Profiler::Global().IsTracing())	Profiler::Global().StopTrace(traceFile.c_str());
+		else								Profiler::Global().StartTrace();
+		break;
 	//Colors
 	case '1':
 		renderer->setDisplayMode(DISPLAY_DEPTH);
@@ -589,7 +770,7 @@ void initParams()
 {
     // create a new parameter list
     params = new ParamListGL("Misc.");
-    params->AddParam(new Param<float>("time step", timestep, 0, 0.01, 0.0001, &timestep));
+    params->AddParam(new Param<float>("time step", timestep, 0, pbfSolver ? 0.05 : 0.01, 0.0001, &timestep));
     params->AddParam(new Param<float>("art viscocity", viscocity, 0.0, 1.0, 0.01, &viscocity));
 	params->AddParam(new Param<float>("particle radius", pRadius, 0.0, 1.0, 0.01, &pRadius));
 	params->AddParam(new Param<float>("surface tension", surfTension, 0.0, 1.0, 0.01, &surfTension));
@@ -625,9 +806,65 @@ int
 main(int argc, char** argv) 
 {
 	cout << argv[0] << " Starting...\n\n" << endl;
+	Profiler::Global().SetThreadName("main");
 
 	cout << "particles: " << max_particles << endl;
 
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-nopin") == 0)			poolPin = false;
+		else if (strcmp(argv[i], "-chkdrop") == 0)	checkpointWait = false;
+		else if (strcmp(argv[i], "-hugepages") == 0)	geomHugePages = true;
+		else if (strcmp(argv[i], "-qpos") == 0)		qposSearch = true;
+		else if (strcmp(argv[i], "-pcisph") == 0)	pciSolver = true;
+		else if (strcmp(argv[i], "-pbf") == 0)		pbfSolver = true;
+		else if (strcmp(argv[i], "-boundary") == 0)	boundaryParticles = true;
+		else if (strcmp(argv[i], "-counters") == 0)	hwCounters = true;
+		else if (i+1 >= argc)						break;
+		else if (strcmp(argv[i], "-ranks") == 0)	domainRanks = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-rank") == 0)		domainRank = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-axis") == 0)		domainAxis = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-session") == 0)	domainSession = argv[++i];
+		else if (strcmp(argv[i], "-threads") == 0)	poolThreads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-trace") == 0)	{ traceFile = argv[++i]; traceStart = true; }
+		else if (strcmp(argv[i], "-ensemble") == 0)	ensembleFile = argv[++i];
+		else if (strcmp(argv[i], "-steps") == 0)	ensembleSteps = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-every") == 0)	ensembleEvery = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-out") == 0)		ensembleOut = argv[++i];
+		else if (strcmp(argv[i], "-checkpoint") == 0)	checkpointPrefix = argv[++i];
+		else if (strcmp(argv[i], "-chkevery") == 0)	checkpointEvery = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-chkmem") == 0)	checkpointMB = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-restore") == 0)	restoreFile = argv[++i];
+		else if (strcmp(argv[i], "-cfl") == 0)		cflNumber = atof(argv[++i]);
+		else if (strcmp(argv[i], "-pcitol") == 0)	pciTolerance = atof(argv[++i]);
+		else if (strcmp(argv[i], "-pbfiter") == 0)	pbfIterations = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-sleep") == 0)	sleepSteps = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-levels") == 0)	blockLevels = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-bake") == 0)		colliderBake = atof(argv[++i]);
+		else if (strcmp(argv[i], "-mesh") == 0)		meshFile = argv[++i];
+		else if (strcmp(argv[i], "-meshscale") == 0)	meshScale = atof(argv[++i]);
+		else if (strcmp(argv[i], "-meshcell") == 0)	meshCell = atof(argv[++i]);
+		else if (strcmp(argv[i], "-simframe") == 0)	simPerFrame = atof(argv[++i]);
+		else if (strcmp(argv[i], "-budget") == 0)	frameBudget = atof(argv[++i]);
+		else if (strcmp(argv[i], "-maxsub") == 0)	maxSubSteps = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-frameskip") == 0)	maxFrameSkip = atoi(argv[++i]);
+	}
+	if (pbfSolver) timestep = 1.0f / 60;		// one solver step per displayed frame
+
+	//Parameter Sweep: run every member on one shared pool, no window
+	if (!ensembleFile.empty()) {
+		FluidEnsemble ensemble;
+		if (!ensemble.Load(ensembleFile, max_particles)) return -1;
+		if (poolThreads != 1) {
+			pool = new ThreadPool;
+			pool->Start(poolThreads, poolPin);
+		}
+		if (traceStart) Profiler::Global().StartTrace();
+		ensemble.Setup(ensembleOut);
+		ensemble.Run(pool, ensembleSteps, ensembleEvery);
+		cleanup();
+		return 0;
+	}
+
 	//Image Library Init
 	initIL();
 
@@ -635,6 +872,14 @@ main(int argc, char** argv)
 	initGL(&argc, argv);
 
 	initParticleSystem(max_particles, gridSize, true);
+	if (!restoreFile.empty()) FluidCheckpoint::Load(&fluidSystem, restoreFile);
+	if (!checkpointPrefix.empty()) {
+		checkpoint = new FluidCheckpoint;
+		if (!checkpoint->Start(checkpointPrefix, long(checkpointMB) << 20, checkpointWait)) {
+			delete checkpoint;
+			checkpoint = 0;
+		}
+	}
     initParams();
 	initMenus();
 
@@ -20,6 +20,7 @@
 
 #include "Utility.h"
 #include "render_particles.h"
+#include "fluid_stage.h"
 
 #ifndef M_PI
 #define M_PI    3.1415926535897932384626433832795
@@ -88,6 +89,10 @@ ParticleRenderer::ParticleRenderer()
   m_normal_pass_program(0),
   m_vbo(0),
   m_colorVBO(0),
+  m_posOffset(0),
+  m_colorOffset(0),
+  m_colorFormat(STAGE_CLR_RGBA),
+  m_rampTexture(0),
   m_projection(0),
   m_modelView(0),
   m_NEARP(0),
@@ -115,6 +120,10 @@ ParticleRenderer::ParticleRenderer(int w, int h)
   m_normal_pass_program(0),
   m_vbo(0),
   m_colorVBO(0),
+  m_posOffset(0),
+  m_colorOffset(0),
+  m_colorFormat(STAGE_CLR_RGBA),
+  m_rampTexture(0),
   m_projection(0),
   m_NEARP(0),
   m_FARP(0),
@@ -132,6 +141,16 @@ ParticleRenderer::ParticleRenderer(int w, int h)
 ParticleRenderer::~ParticleRenderer()
 {
     m_pos = 0;
+	if (m_rampTexture) glDeleteTextures(1, &m_rampTexture);
+	MemAccount::Global().Unregister(m_memGPU);
+	MemAccount::Global().Unregister(m_memHost);
+}
+
+void ParticleRenderer::_updateMemory()
+{
+	//Textures on the GPU; the cube, sky and background pixels are also kept on the host
+	MemAccount::Global().Set(m_memGPU, m_fboBytes + m_cubeBytes + m_skyBytes);
+	MemAccount::Global().Set(m_memHost, m_cubeBytes + m_skyBytes + 4.0 * m_window_w * m_window_h);
 }
 
 void ParticleRenderer::setPositions(float *pos, int numParticles)
@@ -140,10 +159,23 @@ void ParticleRenderer::setPositions(float *pos, int numParticles)
     m_numParticles = numParticles;
 }
 
-void ParticleRenderer::setVertexBuffer(unsigned int vbo, int numParticles)
+void ParticleRenderer::setVertexBuffer(unsigned int vbo, int numParticles, long posOffset, long colorOffset)
 {
     m_vbo = vbo;
     m_numParticles = numParticles;
+    m_posOffset = posOffset;
+    m_colorOffset = colorOffset;
+}
+
+void ParticleRenderer::setColorRamp(const unsigned int *rgba, int n)
+{
+	if (!m_rampTexture) glGenTextures(1, &m_rampTexture);
+	glBindTexture(GL_TEXTURE_1D, m_rampTexture);
+	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA8, n, 0, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+	glBindTexture(GL_TEXTURE_1D, 0);
 }
 
 void 
@@ -160,13 +192,26 @@ ParticleRenderer::setProjectionMatrix(float * p)
 
 void ParticleRenderer::_drawPoints()
 {
+        // Positions are 3 floats and colors RGBA8, read straight from the staging slot
         glBindBufferARB(GL_ARRAY_BUFFER_ARB, m_vbo);
-        glVertexPointer(4, GL_FLOAT, 0, 0);
+        glVertexPointer(3, GL_FLOAT, 0, (char*) 0 + m_posOffset);
         glEnableClientState(GL_VERTEX_ARRAY);                
+        glVertexAttribPointer(particle_attributes::POSITION, 3, GL_FLOAT, GL_FALSE, 0, (char*) 0 + m_posOffset);
+        glEnableVertexAttribArray(particle_attributes::POSITION);
 
         glBindBufferARB(GL_ARRAY_BUFFER_ARB, m_colorVBO);
-        glColorPointer(4, GL_FLOAT, 0, 0);
-		glEnableClientState(GL_COLOR_ARRAY);
+        if (m_colorFormat == STAGE_CLR_RGBA) {
+            glColorPointer(4, GL_UNSIGNED_BYTE, 0, (char*) 0 + m_colorOffset);
+            glEnableClientState(GL_COLOR_ARRAY);
+            glVertexAttribPointer(particle_attributes::COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, (char*) 0 + m_colorOffset);
+            glEnableVertexAttribArray(particle_attributes::COLOR);
+        } else if (m_colorFormat == STAGE_CLR_SCALAR) {
+            glVertexAttribPointer(particle_attributes::COLOR, 1, GL_FLOAT, GL_FALSE, 0, (char*) 0 + m_colorOffset);
+            glEnableVertexAttribArray(particle_attributes::COLOR);
+        } else {
+            glDisableVertexAttribArray(particle_attributes::COLOR);
+            glVertexAttrib4f(particle_attributes::COLOR, 1, 1, 1, 1);
+        }
 
         glDrawArrays(GL_POINTS, 0, m_numParticles);
 
@@ -237,6 +282,8 @@ bool ParticleRenderer::loadCubeMapTexture(char *filename)
 		glTexGeni(GL_T, GL_TEXTURE_GEN_MODE, GL_REFLECTION_MAP);
 		glTexGeni(GL_R, GL_TEXTURE_GEN_MODE, GL_REFLECTION_MAP);
 
+		m_cubeBytes = 6.0 * m_faceDim * m_faceDim * 3;
+		_updateMemory();
 		return true;
 	}
 
@@ -321,6 +368,8 @@ void ParticleRenderer::loadSkyBoxTexture(char *filename)
 		}
 
 		ilDeleteImages(1, &nCurrTexImg);
+		m_skyBytes = 6.0 * m_faceDim * m_faceDim * 3;
+		_updateMemory();
 	}
 }
 
@@ -398,14 +447,17 @@ void ParticleRenderer::display()
 	mat4 inverse_transposed = inverse(m_modelView);
 
 	//Render Skybox To Color Texture
+	PROFILE_BEGIN(background);
 	_bindFBO(m_backgroundFBO);
 	glClearColor(1, 1, 1, 1);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	
 	glUseProgram(0);
 	renderSkyBox();
+	PROFILE_END(background, m_profId[RENDER_BACKGROUND]);
 	
 	//Render Attributes to Texture
+	PROFILE_BEGIN(depth);
 	_setTextures();
 	_bindFBO(m_FBO);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -425,12 +477,19 @@ void ParticleRenderer::display()
 	glUniformMatrix4fv(glGetUniformLocation(m_depth_pass_program,"u_ModelView"),1,GL_FALSE,&m_modelView[0][0]);
 	glUniformMatrix4fv(glGetUniformLocation(m_depth_pass_program,"u_Persp"),1,GL_FALSE,&m_projection[0][0]);
 	glUniformMatrix4fv(glGetUniformLocation(m_depth_pass_program,"u_InvTrans"),1,GL_FALSE,&inverse_transposed[0][0]);
+	glUniform1i(glGetUniformLocation(m_depth_pass_program, "u_ColorScalar"), m_colorFormat == STAGE_CLR_SCALAR);
+	glActiveTexture(GL_TEXTURE8);
+	glBindTexture(GL_TEXTURE_1D, m_rampTexture);
+	glUniform1i(glGetUniformLocation(m_depth_pass_program, "u_Ramp"), 8);
+	glActiveTexture(GL_TEXTURE0);
     
 	glColor3f(1, 1, 1);
     _drawPoints();
     glDisable(GL_POINT_SPRITE_ARB);
+	PROFILE_END(depth, m_profId[RENDER_DEPTH]);
 
 	//Create Fluid Thickness Map
+	PROFILE_BEGIN(thickness);
 	_setTextures();
 	_bindFBO(m_thickFBO);
 	glClearColor(0, 0, 0, 0);
@@ -461,8 +520,10 @@ void ParticleRenderer::display()
 	glDisable(GL_BLEND);
 	//glDepthMask(GL_TRUE);
     glEnable(GL_DEPTH_TEST);
+	PROFILE_END(thickness, m_profId[RENDER_THICKNESS]);
 
 	//Blur Depth Texture
+	PROFILE_BEGIN(blur);
 	_setTextures();
 	_bindFBO(m_blurDepthFBO);
 
@@ -481,8 +542,10 @@ void ParticleRenderer::display()
 	glDrawElements(GL_TRIANGLES, m_device_quad.num_indices, GL_UNSIGNED_SHORT,0);
 	
 	glBindVertexArray(0);
+	PROFILE_END(blur, m_profId[RENDER_BLUR]);
 
 	//Write Normals to Texture from Depth Texture
+	PROFILE_BEGIN(normal);
 	_setTextures();
 	_bindFBO(m_normalsFBO);
 	
@@ -508,8 +571,10 @@ void ParticleRenderer::display()
 	glDrawElements(GL_TRIANGLES, m_device_quad.num_indices, GL_UNSIGNED_SHORT,0);
 	
 	glBindVertexArray(0);
+	PROFILE_END(normal, m_profId[RENDER_NORMAL]);
 	
 	//Draw Full Screen Quad
+	PROFILE_BEGIN(composite);
 	_setTextures();
 	glUseProgram(m_program);
 	glBindVertexArray(m_device_quad.vertex_array);
@@ -552,6 +617,7 @@ void ParticleRenderer::display()
     
 
 	glBindVertexArray(0);
+	PROFILE_END(composite, m_profId[RENDER_COMPOSITE]);
 }
 
 void ParticleRenderer::_initNormalPassProgram() {
@@ -593,6 +659,12 @@ void ParticleRenderer::_initThickPassProgram() {
 
 void ParticleRenderer::_initGL()
 {
+	m_memGPU = MemAccount::Global().Register(MEM_GPU, "renderer");
+	m_memHost = MemAccount::Global().Register(MEM_STAGING, "renderer");
+	m_fboBytes = m_cubeBytes = m_skyBytes = 0;
+	const char* passes[RENDER_PASSES] = { "BACKGROUND", "DEPTH", "THICKNESS", "BLUR", "NORMAL", "COMPOSITE" };
+	for (int p = 0; p < RENDER_PASSES; p++)
+		m_profId[p] = Profiler::Global().Register(passes[p], "render");
 	_initDepthPassProgram();
 	_initNormalPassProgram();
 	_initBlurPassProgram();
@@ -697,6 +769,10 @@ void ParticleRenderer::_initFBO(int w, int h) {
 	glBindTexture(GL_TEXTURE_2D, 0);
 	
 	m_backgroundTexData = (unsigned char *)malloc(sizeof(unsigned char) * 4 * w * h);
+
+	//depth (4) + five RGB32F (12 each) + background RGB8 (3) bytes per pixel
+	m_fboBytes = (double) w * h * (4 + 5*12 + 3);
+	_updateMemory();
 	
 	glGenFramebuffers(1, &m_FBO);
 	glGenFramebuffers(1, &m_normalsFBO);
@@ -858,4 +934,4 @@ void ParticleRenderer::_setTextures() {
 	glColorMask(true,true,true,true);
     glDisable(GL_DEPTH_TEST);
 	glClear(GL_COLOR_BUFFER_BIT);
-}
\ No newline at end of file
+}